@@ -0,0 +1,911 @@
+/***************************************************************************
+ *   fixtures.hpp  --  This file is part of diskarbitratord.               *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef FIXTURES_HPP_
+#define FIXTURES_HPP_
+
+// Generators for small synthetic disk images, so the native image code can be
+// exercised anywhere without shipping binary fixtures.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <bzlib.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+inline void writeBE16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+inline void writeBE32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+inline void writeBE64(uint8_t* p, uint64_t v) {
+  writeBE32(p, v >> 32);
+  writeBE32(p + 4, v);
+}
+
+inline void writeLE16(uint8_t* p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+inline void writeLE32(uint8_t* p, uint32_t v) {
+  writeLE16(p, v);
+  writeLE16(p + 2, v >> 16);
+}
+
+inline void writeLE64(uint8_t* p, uint64_t v) {
+  writeLE32(p, v);
+  writeLE32(p + 4, v >> 32);
+}
+
+inline void removeTree(const std::string& path) {
+  nftw(path.c_str(), [](const char* p, const struct stat* st, int type, struct FTW* ftw) {
+    return remove(p);
+  }, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+inline void writeFile(const std::string& path, const std::vector<uint8_t>& data) {
+  std::ofstream f(path, std::ios::binary | std::ios::trunc);
+  f.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// A UDIF image with `data` as its data fork and the given XML plist, followed
+// by a koly trailer describing a disk of `sectors` sectors
+inline void writeUDIFFixture(const std::string& path, const std::vector<uint8_t>& data, const std::string& xml, uint64_t sectors) {
+  std::vector<uint8_t> image(data);
+  uint64_t xmlOffset = image.size();
+  image.insert(image.end(), xml.begin(), xml.end());
+
+  uint8_t koly[512];
+  memset(koly, 0, sizeof(koly));
+  memcpy(koly, "koly", 4);
+  writeBE32(koly + 4, 4);             // Version
+  writeBE32(koly + 8, 512);           // Header size
+  writeBE32(koly + 12, 1);            // Flags
+  writeBE64(koly + 24, 0);            // Data fork offset
+  writeBE64(koly + 32, data.size());  // Data fork length
+  writeBE32(koly + 56, 1);            // Segment number
+  writeBE32(koly + 60, 1);            // Segment count
+  writeBE64(koly + 216, xmlOffset);
+  writeBE64(koly + 224, xml.size());
+  writeBE32(koly + 488, 1);           // Image variant
+  writeBE64(koly + 492, sectors);
+  image.insert(image.end(), koly, koly + sizeof(koly));
+
+  writeFile(path, image);
+}
+
+// Minimal XML plist for a UDIF image, with or without a SLA resource
+inline std::string udifXML(bool withSLA, const std::string& blkxEntries = "") {
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n<dict>\n\t<key>resource-fork</key>\n\t<dict>\n";
+  if(withSLA) {
+    xml += "\t\t<key>LPic</key>\n\t\t<array>\n\t\t\t<dict><key>Data</key><data>AAAAAgAAAAAAAAAAAAQAAA==</data></dict>\n\t\t</array>\n";
+  }
+  xml += "\t\t<key>blkx</key>\n\t\t<array>\n" + blkxEntries + "\t\t</array>\n\t</dict>\n</dict>\n</plist>\n";
+  return xml;
+}
+
+inline std::string base64Encode(const std::vector<uint8_t>& data) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i = 0;
+  for(; i + 2 < data.size(); i += 3) {
+    uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 0x3F];
+    out += alphabet[(v >> 6) & 0x3F];
+    out += alphabet[v & 0x3F];
+  }
+  if(i + 1 == data.size()) {
+    uint32_t v = data[i] << 16;
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 0x3F];
+    out += "==";
+  } else if(i + 2 == data.size()) {
+    uint32_t v = (data[i] << 16) | (data[i + 1] << 8);
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 0x3F];
+    out += alphabet[(v >> 6) & 0x3F];
+    out += "=";
+  }
+  return out;
+}
+
+// Compressible but not trivially so: pseudo-random words from a small
+// vocabulary, with every fourth MB left as zeroes
+inline std::vector<uint8_t> makeDiskContents(uint64_t size, uint32_t seed = 0x9E3779B9) {
+  static const std::vector<std::string> words = {
+    "disk", "image", "sector", "chunk", "evidence", "partition", "volume", "block",
+    "arbitration", "mount", "attach", "forensic", "trailer", "table", "checksum", "\n"
+  };
+  std::vector<uint8_t> data(size, 0);
+  uint64_t i = 0;
+  while(i < size) {
+    if((i >> 20) % 4 == 3) {
+      i += 1 << 20;
+      continue;
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    const std::string& word = words[seed % words.size()];
+    for(size_t j = 0; j < word.size() && i < size; ++j, ++i) {
+      data[i] = word[j];
+    }
+    if(i < size) {
+      data[i++] = ' ';
+    }
+  }
+  return data;
+}
+
+enum FixtureCompression {
+  FIXTURE_RAW = 0x00000001,
+  FIXTURE_ZLIB = 0x80000005,
+  FIXTURE_BZIP2 = 0x80000006
+};
+
+// A real UDIF image of `disk`, split in chunks of `chunkSectors` sectors
+// compressed with `compression`. All-zero chunks become zero fill chunks the
+// way hdiutil does it, and the whole disk goes in a single blkx table. Carries
+// the same CRC32 checksums hdiutil writes: the table's over the uncompressed
+// data, the data fork's, and the master checksum over the table's.
+inline void writeCompressedUDIFFixture(const std::string& path, const std::vector<uint8_t>& disk, uint64_t chunkSectors, FixtureCompression compression) {
+  const uint64_t sectors = disk.size() / 512;
+  const uint64_t chunkCount = (sectors + chunkSectors - 1) / chunkSectors;
+  std::vector<uint8_t> dataFork;
+  // Header, chunk entries and the terminator
+  std::vector<uint8_t> mish(204 + (chunkCount + 1) * 40, 0);
+  memcpy(mish.data(), "mish", 4);
+  writeBE32(mish.data() + 4, 1);
+  writeBE64(mish.data() + 16, sectors);
+  writeBE32(mish.data() + 200, chunkCount + 1);
+
+  for(uint64_t c = 0; c < chunkCount; ++c) {
+    const uint64_t firstSector = c * chunkSectors;
+    const uint64_t chunkLength = std::min(chunkSectors, sectors - firstSector) * 512;
+    const uint8_t* chunk = disk.data() + firstSector * 512;
+    bool zero = true;
+    for(uint64_t i = 0; i < chunkLength && zero; ++i) {
+      zero = chunk[i] == 0;
+    }
+
+    std::vector<uint8_t> stored;
+    uint32_t type = compression;
+    if(zero) {
+      type = 0;
+    } else if(compression == FIXTURE_ZLIB) {
+      uLongf length = compressBound(chunkLength);
+      stored.resize(length);
+      compress(stored.data(), &length, chunk, chunkLength);
+      stored.resize(length);
+    } else if(compression == FIXTURE_BZIP2) {
+      unsigned int length = chunkLength + chunkLength / 100 + 600;
+      stored.resize(length);
+      BZ2_bzBuffToBuffCompress(reinterpret_cast<char*>(stored.data()), &length, const_cast<char*>(reinterpret_cast<const char*>(chunk)), chunkLength, 9, 0, 0);
+      stored.resize(length);
+    } else {
+      stored.assign(chunk, chunk + chunkLength);
+    }
+
+    uint8_t* entry = mish.data() + 204 + c * 40;
+    writeBE32(entry, type);
+    writeBE64(entry + 8, firstSector);
+    writeBE64(entry + 16, chunkLength / 512);
+    writeBE64(entry + 24, dataFork.size());
+    writeBE64(entry + 32, stored.size());
+    dataFork.insert(dataFork.end(), stored.begin(), stored.end());
+  }
+  uint8_t* terminator = mish.data() + 204 + chunkCount * 40;
+  writeBE32(terminator, 0xFFFFFFFF);
+  writeBE64(terminator + 8, sectors);
+
+  // CRC32 of the uncompressed table contents, and of the data fork
+  writeBE32(mish.data() + 64, 2);
+  writeBE32(mish.data() + 68, 32);
+  writeBE32(mish.data() + 72, crc32(0, disk.data(), disk.size()));
+
+  std::string entries = "\t\t\t<dict>\n\t\t\t\t<key>Data</key>\n\t\t\t\t<data>" + base64Encode(mish) +
+                        "</data>\n\t\t\t\t<key>Name</key>\n\t\t\t\t<string>Apple_HFS &amp; friends : 1</string>\n\t\t\t</dict>\n";
+  std::string xml = udifXML(false, entries);
+
+  std::vector<uint8_t> image(dataFork);
+  uint64_t xmlOffset = image.size();
+  image.insert(image.end(), xml.begin(), xml.end());
+  uint8_t koly[512];
+  memset(koly, 0, sizeof(koly));
+  memcpy(koly, "koly", 4);
+  writeBE32(koly + 4, 4);
+  writeBE32(koly + 8, 512);
+  writeBE32(koly + 12, 1);
+  writeBE64(koly + 32, dataFork.size());
+  writeBE32(koly + 56, 1);
+  writeBE32(koly + 60, 1);
+  writeBE32(koly + 80, 2);
+  writeBE32(koly + 84, 32);
+  writeBE32(koly + 88, crc32(0, dataFork.data(), dataFork.size()));
+  // Master checksum, the CRC32 of the table CRC32
+  writeBE32(koly + 352, 2);
+  writeBE32(koly + 356, 32);
+  writeBE32(koly + 360, crc32(0, mish.data() + 72, 4));
+  writeBE64(koly + 216, xmlOffset);
+  writeBE64(koly + 224, xml.size());
+  writeBE32(koly + 488, 1);
+  writeBE64(koly + 492, sectors);
+  image.insert(image.end(), koly, koly + sizeof(koly));
+
+  writeFile(path, image);
+}
+
+// Size of the volume section data EnCase writes, and where the first chunk of
+// the first segment lands: file header, volume section and sectors descriptor
+#define FIXTURE_EWF_VOLUME_SIZE 1052
+#define FIXTURE_EWF_FIRST_CHUNK_OFFSET (13 + 76 + FIXTURE_EWF_VOLUME_SIZE + 76)
+
+// Appends an EWF section descriptor for a section with `dataSize` bytes of
+// data following it. `last` sections point at themselves
+inline void appendEWFSection(std::vector<uint8_t>& segment, const std::string& type, uint64_t dataSize, bool last = false) {
+  uint8_t d[76];
+  memset(d, 0, sizeof(d));
+  memcpy(d, type.data(), type.size());
+  writeLE64(d + 16, last ? segment.size() : segment.size() + sizeof(d) + dataSize);
+  writeLE64(d + 24, sizeof(d) + dataSize);
+  writeLE32(d + 72, adler32(1, d, 72));
+  segment.insert(segment.end(), d, d + sizeof(d));
+}
+
+// An EWF image of `disk` as EnCase 6 writes it, in segments of at most
+// `chunksPerSegment` chunks named path.E01, path.E02... Chunks are zlib
+// compressed unless that doesn't make them smaller, or `compressed` is false,
+// in which case they're stored followed by their Adler-32. Only the sections
+// a reader needs are written, there's no header or hash section.
+inline void writeEWFFixture(const std::string& path, const std::vector<uint8_t>& disk, uint32_t chunkSectors, uint64_t chunksPerSegment, bool compressed = true) {
+  const uint64_t chunkSize = chunkSectors * 512;
+  const uint64_t chunkCount = (disk.size() + chunkSize - 1) / chunkSize;
+  const uint64_t segmentCount = (chunkCount + chunksPerSegment - 1) / chunksPerSegment;
+  for(uint64_t s = 0; s < segmentCount; ++s) {
+    std::vector<uint8_t> segment = {'E', 'V', 'F', 0x09, 0x0D, 0x0A, 0xFF, 0x00, 0x01, 0, 0, 0, 0};
+    writeLE16(segment.data() + 9, s + 1);
+
+    if(s == 0) {
+      appendEWFSection(segment, "volume", FIXTURE_EWF_VOLUME_SIZE);
+      std::vector<uint8_t> volume(FIXTURE_EWF_VOLUME_SIZE, 0);
+      writeLE32(volume.data(), 1); // Fixed disk
+      writeLE32(volume.data() + 4, chunkCount);
+      writeLE32(volume.data() + 8, chunkSectors);
+      writeLE32(volume.data() + 12, 512);
+      writeLE64(volume.data() + 16, disk.size() / 512);
+      writeLE32(volume.data() + FIXTURE_EWF_VOLUME_SIZE - 4, adler32(1, volume.data(), FIXTURE_EWF_VOLUME_SIZE - 4));
+      segment.insert(segment.end(), volume.begin(), volume.end());
+    }
+
+    const uint64_t firstChunk = s * chunksPerSegment;
+    const uint64_t lastChunk = std::min(chunkCount, firstChunk + chunksPerSegment);
+    std::vector<uint8_t> sectors;
+    std::vector<uint32_t> entries;
+    const uint64_t sectorsStart = segment.size() + 76;
+    for(uint64_t c = firstChunk; c < lastChunk; ++c) {
+      const uint8_t* chunk = disk.data() + c * chunkSize;
+      const uint64_t length = std::min<uint64_t>(chunkSize, disk.size() - c * chunkSize);
+      std::vector<uint8_t> stored(compressBound(length));
+      uLongf storedLength = stored.size();
+      uint32_t flag = 0x80000000;
+      if(!compressed || compress2(stored.data(), &storedLength, chunk, length, Z_DEFAULT_COMPRESSION) != Z_OK || storedLength >= length + 4) {
+        storedLength = length + 4;
+        memcpy(stored.data(), chunk, length);
+        writeLE32(stored.data() + length, adler32(1, chunk, length));
+        flag = 0;
+      }
+      entries.push_back((sectorsStart + sectors.size()) | flag);
+      sectors.insert(sectors.end(), stored.begin(), stored.begin() + storedLength);
+    }
+    appendEWFSection(segment, "sectors", sectors.size());
+    segment.insert(segment.end(), sectors.begin(), sectors.end());
+
+    std::vector<uint8_t> table(24 + entries.size() * 4 + 4, 0);
+    writeLE32(table.data(), entries.size());
+    writeLE32(table.data() + 20, adler32(1, table.data(), 20));
+    for(size_t i = 0; i < entries.size(); ++i) {
+      writeLE32(table.data() + 24 + i * 4, entries[i]);
+    }
+    writeLE32(table.data() + table.size() - 4, adler32(1, table.data() + 24, entries.size() * 4));
+    appendEWFSection(segment, "table", table.size());
+    segment.insert(segment.end(), table.begin(), table.end());
+    appendEWFSection(segment, "table2", table.size());
+    segment.insert(segment.end(), table.begin(), table.end());
+
+    appendEWFSection(segment, s + 1 == segmentCount ? "done" : "next", 0, true);
+    char extension[5];
+    snprintf(extension, sizeof(extension), ".E%02u", static_cast<unsigned int>(s + 1));
+    writeFile(path + extension, segment);
+  }
+}
+
+// `disk` split in segments of `segmentSize` bytes named path.001, path.002...
+inline void writeSplitRawFixture(const std::string& path, const std::vector<uint8_t>& disk, uint64_t segmentSize) {
+  for(uint64_t offset = 0, s = 1; offset < disk.size(); offset += segmentSize, ++s) {
+    char extension[5];
+    snprintf(extension, sizeof(extension), ".%03u", static_cast<unsigned int>(s));
+    writeFile(path + extension, std::vector<uint8_t>(disk.begin() + offset, disk.begin() + std::min<uint64_t>(disk.size(), offset + segmentSize)));
+  }
+}
+
+inline void writeEncryptedFixture(const std::string& path) {
+  std::vector<uint8_t> image(8192, 0xA5);
+  memcpy(image.data(), "encrcdsa", 8);
+  writeFile(path, image);
+}
+
+// `sectors` sectors of zeroes with a MBR holding a single partition
+inline void writeMBRFixture(const std::string& path, uint64_t sectors) {
+  std::vector<uint8_t> image(sectors * 512, 0);
+  uint8_t* entry = image.data() + 446;
+  entry[4] = 0x0C; // FAT32 LBA
+  writeLE32(entry + 8, 2048);
+  writeLE32(entry + 12, sectors - 2048);
+  image[510] = 0x55;
+  image[511] = 0xAA;
+  writeFile(path, image);
+}
+
+typedef struct FixturePartition {
+  // GPT type GUID bytes as stored, or the MBR type in the first byte
+  std::vector<uint8_t> type;
+  uint64_t firstLBA;
+  uint64_t lastLBA;
+  std::string name;
+} FixturePartition;
+
+// Apple APFS and EFI System type GUIDs, in on-disk byte order
+inline std::vector<uint8_t> apfsTypeGUID() {
+  return {0xEF, 0x57, 0x34, 0x7C, 0x00, 0x00, 0xAA, 0x11, 0xAA, 0x11, 0x00, 0x30, 0x65, 0x43, 0xEC, 0xAC};
+}
+
+inline std::vector<uint8_t> efiTypeGUID() {
+  return {0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11, 0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B};
+}
+
+// A GPT disk of `sectors` 512 byte sectors, with a protective MBR and both the
+// primary and backup tables, CRCs included
+inline std::vector<uint8_t> makeGPTDisk(uint64_t sectors, const std::vector<FixturePartition>& partitions) {
+  std::vector<uint8_t> disk(sectors * 512, 0);
+  uint8_t* pmbr = disk.data() + 446;
+  pmbr[4] = 0xEE;
+  writeLE32(pmbr + 8, 1);
+  writeLE32(pmbr + 12, std::min<uint64_t>(sectors - 1, 0xFFFFFFFF));
+  disk[510] = 0x55;
+  disk[511] = 0xAA;
+
+  std::vector<uint8_t> entries(128 * 128, 0);
+  for(size_t i = 0; i < partitions.size(); ++i) {
+    uint8_t* entry = entries.data() + i * 128;
+    memcpy(entry, partitions[i].type.data(), 16);
+    for(int b = 0; b < 16; ++b) {
+      entry[16 + b] = static_cast<uint8_t>(i * 16 + b + 1);
+    }
+    writeLE64(entry + 32, partitions[i].firstLBA);
+    writeLE64(entry + 40, partitions[i].lastLBA);
+    for(size_t c = 0; c < partitions[i].name.size() && c < 36; ++c) {
+      writeLE16(entry + 56 + c * 2, partitions[i].name[c]);
+    }
+  }
+  const uint32_t entriesCRC = crc32(0, entries.data(), entries.size());
+  const uint64_t entrySectors = entries.size() / 512;
+
+  auto writeHeader = [&](uint64_t lba, uint64_t backupLBA, uint64_t entriesLBA) {
+    uint8_t* header = disk.data() + lba * 512;
+    memcpy(header, "EFI PART", 8);
+    writeLE32(header + 8, 0x00010000);
+    writeLE32(header + 12, 92);
+    writeLE64(header + 24, lba);
+    writeLE64(header + 32, backupLBA);
+    writeLE64(header + 40, 2 + entrySectors);
+    writeLE64(header + 48, sectors - 2 - entrySectors);
+    for(int b = 0; b < 16; ++b) {
+      header[56 + b] = static_cast<uint8_t>(0xD0 + b);
+    }
+    writeLE64(header + 72, entriesLBA);
+    writeLE32(header + 80, 128);
+    writeLE32(header + 84, 128);
+    writeLE32(header + 88, entriesCRC);
+    writeLE32(header + 16, crc32(0, header, 92));
+    memcpy(disk.data() + entriesLBA * 512, entries.data(), entries.size());
+  };
+  writeHeader(1, sectors - 1, 2);
+  writeHeader(sectors - 1, 1, sectors - 1 - entrySectors);
+  return disk;
+}
+
+// A MBR disk with one primary partition and an extended one holding
+// `logicalCount` logical partitions of 2048 sectors
+inline std::vector<uint8_t> makeMBRDisk(uint64_t sectors, unsigned int logicalCount) {
+  std::vector<uint8_t> disk(sectors * 512, 0);
+  uint8_t* entry = disk.data() + 446;
+  entry[0] = 0x80;
+  entry[4] = 0x0C;
+  writeLE32(entry + 8, 2048);
+  writeLE32(entry + 12, 2048);
+  const uint64_t extendedLBA = 4096;
+  entry += 16;
+  entry[4] = 0x0F;
+  writeLE32(entry + 8, extendedLBA);
+  writeLE32(entry + 12, sectors - extendedLBA);
+  disk[510] = 0x55;
+  disk[511] = 0xAA;
+
+  for(unsigned int i = 0; i < logicalCount; ++i) {
+    uint64_t ebrLBA = extendedLBA + i * 4096;
+    uint8_t* ebr = disk.data() + ebrLBA * 512;
+    ebr[446 + 4] = 0x83;
+    writeLE32(ebr + 446 + 8, 2048);
+    writeLE32(ebr + 446 + 12, 2048);
+    if(i + 1 < logicalCount) {
+      ebr[462 + 4] = 0x05;
+      writeLE32(ebr + 462 + 8, (i + 1) * 4096);
+      writeLE32(ebr + 462 + 12, 4096);
+    }
+    ebr[510] = 0x55;
+    ebr[511] = 0xAA;
+  }
+  return disk;
+}
+
+inline std::vector<uint8_t> makeISOImage() {
+  std::vector<uint8_t> image(64 * 1024, 0);
+  uint8_t* pvd = image.data() + 32768;
+  pvd[0] = 1;
+  memcpy(pvd + 1, "CD001", 5);
+  memset(pvd + 40, ' ', 32);
+  memcpy(pvd + 40, "BENCH_ISO", 9);
+  writeLE16(pvd + 128, 2048);
+  writeBE16(pvd + 130, 2048);
+  memcpy(pvd + 813, "2023101812000000", 16);
+  return image;
+}
+
+inline void writeISOFixture(const std::string& path) {
+  writeFile(path, makeISOImage());
+}
+
+// Filesystem headers for the probe, written at `p` into a partition of `size`
+// bytes. Only what a probe looks at is filled in, nothing would mount these.
+
+// FAT16 with 2KB clusters, or FAT32 with 512 byte ones. The label goes in the
+// root directory only, the boot sector keeps "NO NAME" like after a rename
+inline void writeFATFixture(uint8_t* p, uint64_t size, bool fat32, const std::string& label, uint32_t serial) {
+  const uint32_t sectors = size / 512;
+  const uint32_t sectorsPerCluster = fat32 ? 1 : 4;
+  const uint32_t reserved = fat32 ? 32 : 4;
+  const uint32_t rootEntries = fat32 ? 0 : 512;
+  const uint32_t fatSize = (sectors / sectorsPerCluster * (fat32 ? 4 : 2) + 511) / 512;
+  p[0] = 0xEB;
+  p[1] = 0x3C;
+  p[2] = 0x90;
+  memcpy(p + 3, "MSDOS5.0", 8);
+  writeLE16(p + 11, 512);
+  p[13] = sectorsPerCluster;
+  writeLE16(p + 14, reserved);
+  p[16] = 2;
+  writeLE16(p + 17, rootEntries);
+  p[21] = 0xF8;
+  if(sectors < 65536) {
+    writeLE16(p + 19, sectors);
+  } else {
+    writeLE32(p + 32, sectors);
+  }
+  uint8_t* ebr = p + 36;
+  if(fat32) {
+    writeLE32(p + 36, fatSize);
+    writeLE32(p + 44, 2);
+    ebr = p + 64;
+  } else {
+    writeLE16(p + 22, fatSize);
+  }
+  ebr[2] = 0x29;
+  writeLE32(ebr + 3, serial);
+  memcpy(ebr + 7, "NO NAME    ", 11);
+  memcpy(ebr + 18, fat32 ? "FAT32   " : "FAT16   ", 8);
+  p[510] = 0x55;
+  p[511] = 0xAA;
+
+  // The root directory comes right after the FATs either way, as cluster 2
+  // in FAT32
+  uint8_t* root = p + (reserved + 2 * fatSize) * 512;
+  memset(root, ' ', 11);
+  memcpy(root, label.data(), std::min<size_t>(label.size(), 11));
+  root[11] = 0x08;
+}
+
+inline void writeExFATFixture(uint8_t* p, const std::string& label, uint32_t serial) {
+  p[0] = 0xEB;
+  p[1] = 0x76;
+  p[2] = 0x90;
+  memcpy(p + 3, "EXFAT   ", 8);
+  // Cluster heap at sector 2048, 4KB clusters, root directory in cluster 4
+  writeLE32(p + 88, 2048);
+  writeLE32(p + 96, 4);
+  writeLE32(p + 100, serial);
+  p[108] = 9;
+  p[109] = 3;
+  p[510] = 0x55;
+  p[511] = 0xAA;
+
+  // Allocation bitmap entry, then the label
+  uint8_t* root = p + 2048 * 512 + 2 * 4096;
+  root[0] = 0x81;
+  root[32] = 0x83;
+  root[33] = std::min<size_t>(label.size(), 11);
+  for(size_t c = 0; c < root[33]; ++c) {
+    writeLE16(root + 34 + c * 2, label[c]);
+  }
+}
+
+// 4KB clusters, 1KB MFT records and the MFT at cluster 4. The $Volume record
+// has its update sequence applied, so reading the label needs the fixups
+inline void writeNTFSFixture(uint8_t* p, const std::string& label, uint64_t serial) {
+  p[0] = 0xEB;
+  p[1] = 0x52;
+  p[2] = 0x90;
+  memcpy(p + 3, "NTFS    ", 8);
+  writeLE16(p + 11, 512);
+  p[13] = 8;
+  writeLE64(p + 48, 4);
+  p[64] = 0xF6;
+  writeLE64(p + 72, serial);
+  p[510] = 0x55;
+  p[511] = 0xAA;
+
+  uint8_t* record = p + 4 * 4096 + 3 * 1024;
+  memcpy(record, "FILE", 4);
+  writeLE16(record + 4, 48);
+  writeLE16(record + 6, 3);
+  writeLE16(record + 20, 56);
+  uint8_t* attribute = record + 56;
+  const uint32_t nameBytes = label.size() * 2;
+  const uint32_t length = (24 + nameBytes + 7) & ~7U;
+  writeLE32(attribute, 0x60);
+  writeLE32(attribute + 4, length);
+  writeLE32(attribute + 16, nameBytes);
+  writeLE16(attribute + 20, 24);
+  for(size_t c = 0; c < label.size(); ++c) {
+    writeLE16(attribute + 24 + c * 2, label[c]);
+  }
+  writeLE32(attribute + length, 0xFFFFFFFF);
+
+  // Save the real end of each sector in the update sequence array and stamp
+  // the sequence number over it
+  writeLE16(record + 48, 0x0001);
+  for(int sector = 1; sector <= 2; ++sector) {
+    memcpy(record + 48 + sector * 2, record + sector * 512 - 2, 2);
+    writeLE16(record + sector * 512 - 2, 0x0001);
+  }
+}
+
+inline void writeExtFixture(uint8_t* p, const std::string& label, const std::vector<uint8_t>& uuid) {
+  uint8_t* sb = p + 1024;
+  writeLE16(sb + 56, 0xEF53);
+  writeLE32(sb + 24, 2);
+  writeLE32(sb + 92, 0x4);
+  // Extents and flex_bg
+  writeLE32(sb + 96, 0x40 | 0x200);
+  memcpy(sb + 104, uuid.data(), 16);
+  memcpy(sb + 120, label.data(), std::min<size_t>(label.size(), 16));
+}
+
+// 4KB blocks, with a catalog file at block 2 whose first leaf node has the
+// root folder record, which is where the volume name comes from
+inline void writeHFSFixture(uint8_t* p, const std::string& label, uint64_t volumeID) {
+  uint8_t* vh = p + 1024;
+  memcpy(vh, "H+", 2);
+  writeBE16(vh + 2, 4);
+  writeBE32(vh + 40, 4096);
+  writeBE64(vh + 104, volumeID);
+  writeBE64(vh + 272, 2 * 4096);
+  writeBE32(vh + 284, 2);
+  writeBE32(vh + 288, 2);
+  writeBE32(vh + 292, 2);
+
+  uint8_t* headerNode = p + 2 * 4096;
+  headerNode[8] = 1;
+  writeBE16(headerNode + 10, 3);
+  writeBE16(headerNode + 14, 1);
+  writeBE32(headerNode + 16, 1);
+  writeBE32(headerNode + 24, 1);
+  writeBE16(headerNode + 32, 4096);
+
+  uint8_t* leaf = p + 3 * 4096;
+  leaf[8] = 0xFF;
+  leaf[9] = 1;
+  writeBE16(leaf + 10, 1);
+  uint8_t* key = leaf + 14;
+  writeBE16(key, 6 + label.size() * 2);
+  writeBE32(key + 2, 1);
+  writeBE16(key + 6, label.size());
+  for(size_t c = 0; c < label.size(); ++c) {
+    writeBE16(key + 8 + c * 2, label[c]);
+  }
+  writeBE16(leaf + 4094, 14);
+}
+
+inline void writeAPFSContainerFixture(uint8_t* p, const std::vector<uint8_t>& uuid) {
+  memcpy(p + 32, "NXSB", 4);
+  writeLE32(p + 36, 4096);
+  memcpy(p + 72, uuid.data(), 16);
+}
+
+inline void writeAPFSVolumeFixture(uint8_t* p, const std::string& label, const std::vector<uint8_t>& uuid) {
+  memcpy(p + 32, "APSB", 4);
+  memcpy(p + 240, uuid.data(), 16);
+  memcpy(p + 704, label.data(), std::min<size_t>(label.size(), 255));
+}
+
+inline void writeSparseBundleFixture(const std::string& path, uint64_t size, bool encrypted) {
+  mkdir(path.c_str(), 0755);
+  mkdir((path + "/bands").c_str(), 0755);
+  std::ofstream info(path + "/Info.plist");
+  info << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n<dict>\n";
+  info << "\t<key>CFBundleInfoDictionaryVersion</key>\n\t<string>6.0</string>\n";
+  info << "\t<key>band-size</key>\n\t<integer>8388608</integer>\n";
+  info << "\t<key>diskimage-bundle-type</key>\n\t<string>com.apple.diskimage.sparsebundle</string>\n";
+  info << "\t<key>size</key>\n\t<integer>" << size << "</integer>\n";
+  info << "</dict>\n</plist>\n";
+  if(encrypted) {
+    writeEncryptedFixture(path + "/token");
+  }
+}
+
+// Builds FAT32 (512 byte clusters) and exFAT (4KB clusters) volumes with real
+// files in them. Directories get 8 contiguous clusters each, and files can be
+// split into fragments with a free cluster between them. Every timestamp is
+// 2023-10-18 12:00:00
+#define FIXTURE_FAT_TIMESTAMP 1697630400
+#define FIXTURE_FAT_DIRECTORY_CLUSTERS 8
+
+class FATFixture {
+  public:
+    FATFixture(bool exfat, uint64_t size) : exfat(exfat), image(size, 0) {
+      const uint32_t sectors = size / 512;
+      uint8_t* boot = this->image.data();
+      boot[0] = 0xEB;
+      boot[1] = 0x76;
+      boot[2] = 0x90;
+      boot[510] = 0x55;
+      boot[511] = 0xAA;
+      if(exfat) {
+        this->clusterSize = 4096;
+        const uint32_t fatOffset = 128;
+        const uint32_t fatSectors = ((sectors / 8 + 2) * 4 + 511) / 512;
+        const uint32_t heapOffset = (fatOffset + fatSectors + 7) / 8 * 8;
+        this->clusterCount = (sectors - heapOffset) / 8;
+        this->fatOffset = fatOffset * 512ULL;
+        this->dataOffset = heapOffset * 512ULL;
+        memcpy(boot + 3, "EXFAT   ", 8);
+        writeLE64(boot + 72, sectors);
+        writeLE32(boot + 80, fatOffset);
+        writeLE32(boot + 84, fatSectors);
+        writeLE32(boot + 88, heapOffset);
+        writeLE32(boot + 92, this->clusterCount);
+        writeLE32(boot + 100, 0xCAFE00EF);
+        writeLE16(boot + 104, 0x0100);
+        boot[108] = 9;
+        boot[109] = 3;
+        boot[110] = 1;
+      } else {
+        this->clusterSize = 512;
+        const uint32_t reserved = 32;
+        const uint32_t fatSectors = ((sectors + 2) * 4 + 511) / 512;
+        this->fatOffset = reserved * 512ULL;
+        this->dataOffset = (reserved + 2 * fatSectors) * 512ULL;
+        this->clusterCount = sectors - reserved - 2 * fatSectors;
+        memcpy(boot + 3, "MSDOS5.0", 8);
+        writeLE16(boot + 11, 512);
+        boot[13] = 1;
+        writeLE16(boot + 14, reserved);
+        boot[16] = 2;
+        boot[21] = 0xF8;
+        writeLE32(boot + 32, sectors);
+        writeLE32(boot + 36, fatSectors);
+        writeLE32(boot + 44, 2);
+        boot[66] = 0x29;
+        writeLE32(boot + 67, 0x1234ABCD);
+        memcpy(boot + 71, "NO NAME    FAT32   ", 19);
+        this->setFAT(0, 0x0FFFFFF8);
+        this->setFAT(1, 0x0FFFFFFF);
+      }
+      this->root = this->allocate(FIXTURE_FAT_DIRECTORY_CLUSTERS * this->clusterSize, 0, false);
+      if(exfat) {
+        writeLE32(boot + 96, this->root);
+      }
+    }
+
+    uint32_t rootCluster() const {
+      return this->root;
+    }
+
+    uint32_t addDirectory(uint32_t parent, const std::string& name) {
+      uint32_t cluster = this->allocate(FIXTURE_FAT_DIRECTORY_CLUSTERS * this->clusterSize, 0, false);
+      this->addEntry(parent, name, true, cluster, FIXTURE_FAT_DIRECTORY_CLUSTERS * this->clusterSize, false);
+      return cluster;
+    }
+
+    // Files in one piece are flagged as contiguous in exFAT, so they skip the
+    // FAT. Fragmented ones always go through it
+    void addFile(uint32_t parent, const std::string& name, const std::vector<uint8_t>& data, uint32_t fragmentClusters = 0) {
+      uint32_t cluster = this->allocate(data.size(), fragmentClusters, this->exfat && !fragmentClusters);
+      this->addEntry(parent, name, false, cluster, data.size(), this->exfat && !fragmentClusters);
+      size_t written = 0;
+      for(uint32_t c = cluster; written < data.size(); ) {
+        size_t len = std::min<size_t>(this->clusterSize, data.size() - written);
+        memcpy(this->image.data() + this->clusterOffset(c), data.data() + written, len);
+        written += len;
+        c = this->contiguousFile ? c + 1 : this->chain[c];
+      }
+    }
+
+    const std::vector<uint8_t>& data() const {
+      return this->image;
+    }
+
+  private:
+    uint64_t clusterOffset(uint32_t cluster) const {
+      return this->dataOffset + static_cast<uint64_t>(cluster - 2) * this->clusterSize;
+    }
+
+    void setFAT(uint32_t cluster, uint32_t value) {
+      writeLE32(this->image.data() + this->fatOffset + cluster * 4ULL, value);
+      this->chain[cluster] = value;
+    }
+
+    uint32_t allocate(uint64_t bytes, uint32_t fragmentClusters, bool contiguous) {
+      uint32_t count = std::max<uint64_t>(1, (bytes + this->clusterSize - 1) / this->clusterSize);
+      if(this->nextFree + count * 2 > this->clusterCount + 2) {
+        throw std::runtime_error("FAT fixture is full");
+      }
+      uint32_t first = this->nextFree;
+      uint32_t previous = 0;
+      for(uint32_t i = 0; i < count; ++i) {
+        uint32_t cluster = this->nextFree++;
+        if(fragmentClusters && (i + 1) % fragmentClusters == 0) {
+          // Leave a hole
+          ++this->nextFree;
+        }
+        if(!contiguous) {
+          if(previous) {
+            this->setFAT(previous, cluster);
+          }
+          this->setFAT(cluster, this->exfat ? 0xFFFFFFFF : 0x0FFFFFFF);
+        }
+        previous = cluster;
+      }
+      this->contiguousFile = contiguous;
+      return first;
+    }
+
+    void addEntry(uint32_t directory, const std::string& name, bool isDirectory, uint32_t cluster, uint64_t size, bool contiguous) {
+      std::vector<std::vector<uint8_t>> entries = this->exfat ? exfatEntries(name, isDirectory, cluster, size, contiguous) : fatEntries(name, isDirectory, cluster, size);
+      size_t& used = this->directoryUsed[directory];
+      for(const auto& entry : entries) {
+        memcpy(this->image.data() + this->clusterOffset(directory) + used * 32, entry.data(), 32);
+        ++used;
+      }
+    }
+
+    std::vector<std::vector<uint8_t>> fatEntries(const std::string& name, bool isDirectory, uint32_t cluster, uint64_t size) {
+      std::vector<std::vector<uint8_t>> entries;
+      std::vector<uint8_t> shortEntry(32, 0);
+      memset(shortEntry.data(), ' ', 11);
+      std::string upper = name;
+      std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+      size_t dot = upper.rfind('.');
+      std::string base = upper.substr(0, dot);
+      std::string ext = dot == std::string::npos ? "" : upper.substr(dot + 1);
+      bool needsLongName = upper != name || base.size() > 8 || ext.size() > 3 || base.find(' ') != std::string::npos;
+      if(needsLongName) {
+        base.erase(std::remove(base.begin(), base.end(), ' '), base.end());
+        base = base.substr(0, 6) + "~" + std::to_string(++this->shortNameCounter % 10);
+      }
+      memcpy(shortEntry.data(), base.data(), std::min<size_t>(base.size(), 8));
+      memcpy(shortEntry.data() + 8, ext.data(), std::min<size_t>(ext.size(), 3));
+      shortEntry[11] = isDirectory ? 0x10 : 0x20;
+      writeLE16(shortEntry.data() + 20, cluster >> 16);
+      writeLE16(shortEntry.data() + 22, 12 << 11);
+      writeLE16(shortEntry.data() + 24, ((2023 - 1980) << 9) | (10 << 5) | 18);
+      writeLE16(shortEntry.data() + 26, cluster & 0xFFFF);
+      writeLE32(shortEntry.data() + 28, isDirectory ? 0 : size);
+
+      if(needsLongName) {
+        uint8_t checksum = 0;
+        for(int i = 0; i < 11; ++i) {
+          checksum = ((checksum & 1) << 7) + (checksum >> 1) + shortEntry[i];
+        }
+        std::vector<uint16_t> chars(name.begin(), name.end());
+        chars.push_back(0);
+        size_t count = (chars.size() + 12) / 13;
+        chars.resize(count * 13, 0xFFFF);
+        static const int positions[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        for(size_t n = count; n > 0; --n) {
+          std::vector<uint8_t> lfn(32, 0);
+          lfn[0] = n | (n == count ? 0x40 : 0);
+          lfn[11] = 0x0F;
+          lfn[13] = checksum;
+          for(int c = 0; c < 13; ++c) {
+            writeLE16(lfn.data() + positions[c], chars[(n - 1) * 13 + c]);
+          }
+          entries.push_back(lfn);
+        }
+      }
+      entries.push_back(shortEntry);
+      return entries;
+    }
+
+    static std::vector<std::vector<uint8_t>> exfatEntries(const std::string& name, bool isDirectory, uint32_t cluster, uint64_t size, bool contiguous) {
+      const size_t nameEntries = (name.size() + 14) / 15;
+      std::vector<std::vector<uint8_t>> entries(2 + nameEntries, std::vector<uint8_t>(32, 0));
+      entries[0][0] = 0x85;
+      entries[0][1] = 1 + nameEntries;
+      writeLE16(entries[0].data() + 4, isDirectory ? 0x10 : 0x20);
+      writeLE16(entries[0].data() + 12, 12 << 11);
+      writeLE16(entries[0].data() + 14, ((2023 - 1980) << 9) | (10 << 5) | 18);
+      entries[1][0] = 0xC0;
+      entries[1][1] = contiguous ? 0x03 : 0x01;
+      entries[1][3] = name.size();
+      writeLE64(entries[1].data() + 8, size);
+      writeLE32(entries[1].data() + 20, cluster);
+      writeLE64(entries[1].data() + 24, size);
+      for(size_t c = 0; c < name.size(); ++c) {
+        entries[2 + c / 15][0] = 0xC1;
+        writeLE16(entries[2 + c / 15].data() + 2 + (c % 15) * 2, name[c]);
+      }
+      return entries;
+    }
+
+    bool exfat;
+    std::vector<uint8_t> image;
+    uint64_t clusterSize;
+    uint32_t clusterCount;
+    uint64_t fatOffset;
+    uint64_t dataOffset;
+    uint32_t root;
+    uint32_t nextFree = 2;
+    bool contiguousFile = false;
+    unsigned int shortNameCounter = 0;
+    std::map<uint32_t, uint32_t> chain;
+    std::map<uint32_t, size_t> directoryUsed;
+};
+
+#endif
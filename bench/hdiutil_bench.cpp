@@ -0,0 +1,363 @@
+/***************************************************************************
+ *   hdiutil_bench.cpp  --  This file is part of diskarbitratord.          *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+// Benchmarks for the hdiutil execution path: spawning, collecting output,
+// parsing it, reporting progress and attaching many images at once. Everything runs against a fake
+// hdiutil script generated on the fly, so it works on any POSIX box. Plist
+// parsing and the real attach pipeline need CoreFoundation, so on other
+// platforms the attach pipeline is emulated with the same three hdiutil runs.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include <cxxopts.hpp>
+
+#include "command.hpp"
+
+#ifdef __APPLE__
+#include "hdiutil.hpp"
+#include "plist.hpp"
+#endif
+
+#define FAKE_TIMEOUT_SECS 30
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct FakeHdiutilConfig {
+  size_t outputBytes;
+  unsigned int latencyMs;
+  int exitCode;
+  // With -puppetstrings, the latency is split in this many steps, each one
+  // followed by a PERCENT line
+  unsigned int progressSteps;
+} FakeHdiutilConfig;
+
+static std::string msToSleepArg(unsigned int ms) {
+  std::ostringstream ss;
+  ss << ms / 1000 << "." << std::setw(3) << std::setfill('0') << ms % 1000;
+  return ss.str();
+}
+
+// Writes a fake hdiutil to `path` that answers isencrypted, imageinfo and
+// attach the same way the real one does with -plist. `outputBytes` of padding
+// are added to every plist, and it sleeps `latencyMs` before answering.
+static void writeFakeHdiutil(const std::string& path, const FakeHdiutilConfig& config) {
+  std::ofstream script(path);
+  script << "#!/bin/sh\n";
+  script << "# Fake hdiutil generated by hdiutil_bench\n";
+  if(config.progressSteps) {
+    script << "case \" $* \" in\n";
+    script << "  *\" -puppetstrings \"*)\n";
+    script << "    i=1\n";
+    script << "    while [ $i -le " << config.progressSteps << " ]; do\n";
+    script << "      sleep " << msToSleepArg(config.latencyMs / config.progressSteps) << "\n";
+    script << "      echo \"PERCENT:$((i * 100 / " << config.progressSteps << "))\"\n";
+    script << "      i=$((i + 1))\n";
+    script << "    done ;;\n";
+    script << "  *) sleep " << msToSleepArg(config.latencyMs) << " ;;\n";
+    script << "esac\n";
+  } else if(config.latencyMs) {
+    script << "sleep " << msToSleepArg(config.latencyMs) << "\n";
+  }
+  script << "case \"$1\" in\n";
+  script << "  isencrypted) body='<key>encrypted</key><false/>' ;;\n";
+  script << "  imageinfo) body='<key>Properties</key><dict><key>Software License Agreement</key><false/></dict>' ;;\n";
+  script << "  attach) body='<key>system-entities</key><array><dict><key>dev-entry</key><string>/dev/disk9</string></dict><dict><key>dev-entry</key><string>/dev/disk9s1</string></dict></array>' ;;\n";
+  script << "  *) echo \"fake hdiutil: unknown verb $1\" >&2; exit 1 ;;\n";
+  script << "esac\n";
+  script << "printf '<?xml version=\"1.0\" encoding=\"UTF-8\"?>\\n<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\\n<plist version=\"1.0\">\\n<dict>\\n'\n";
+  script << "printf '%s\\n' \"$body\"\n";
+  if(config.outputBytes) {
+    script << "printf '<key>padding</key><string>'\n";
+    script << "head -c " << config.outputBytes << " /dev/zero | tr '\\000' 'A'\n";
+    script << "printf '</string>\\n'\n";
+  }
+  script << "printf '</dict>\\n</plist>\\n'\n";
+  if(config.exitCode) {
+    script << "echo 'fake hdiutil: failing on purpose' >&2\n";
+  }
+  script << "exit " << config.exitCode << "\n";
+  script.close();
+
+  if(chmod(path.c_str(), 0755) != 0) {
+    throw std::runtime_error("Unable to make fake hdiutil executable: " + std::string(strerror(errno)));
+  }
+}
+
+typedef struct Stats {
+  double mean;
+  double p50;
+  double p99;
+} Stats;
+
+static Stats computeStats(std::vector<double> samples) {
+  Stats s = {0, 0, 0};
+  if(!samples.size()) {
+    return s;
+  }
+  std::sort(samples.begin(), samples.end());
+  for(const auto& sample : samples) {
+    s.mean += sample;
+  }
+  s.mean /= samples.size();
+  s.p50 = samples[samples.size() / 2];
+  s.p99 = samples[std::min(samples.size() - 1, (samples.size() * 99) / 100)];
+  return s;
+}
+
+static double elapsedMs(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static CommandOutput runFake(const std::string& fake, const std::string& verb, const std::string& image) {
+  return runCommand(fake, {verb, "-plist", image}, "", FAKE_TIMEOUT_SECS);
+}
+
+static void benchSpawnLatency(const std::string& fake, unsigned int iterations) {
+  writeFakeHdiutil(fake, {0, 0, 0, 0});
+  std::vector<double> samples;
+  for(unsigned int i = 0; i < iterations; ++i) {
+    Clock::time_point start = Clock::now();
+    CommandOutput output = runFake(fake, "isencrypted", "/dev/null");
+    samples.push_back(elapsedMs(start));
+    if(output.retCode) {
+      throw std::runtime_error("Fake hdiutil failed: " + output.stderr);
+    }
+  }
+  Stats s = computeStats(samples);
+  std::cout << "spawn latency (" << iterations << " runs): mean " << s.mean << " ms, p50 " << s.p50 << " ms, p99 " << s.p99 << " ms" << std::endl;
+}
+
+static void benchExitCode(const std::string& fake) {
+  writeFakeHdiutil(fake, {0, 0, 3, 0});
+  CommandOutput output = runFake(fake, "attach", "/dev/null");
+  if(output.retCode != 3 || !output.stderr.size()) {
+    throw std::runtime_error("Exit code 3 was reported as " + std::to_string(output.retCode));
+  }
+  std::cout << "exit code propagation: ok" << std::endl;
+}
+
+static void benchOutputThroughput(const std::string& fake, const std::vector<size_t>& sizes, unsigned int iterations) {
+  for(const auto& size : sizes) {
+    writeFakeHdiutil(fake, {size, 0, 0, 0});
+    std::vector<double> samples;
+    size_t outputSize = 0;
+    for(unsigned int i = 0; i < iterations; ++i) {
+      Clock::time_point start = Clock::now();
+      CommandOutput output = runFake(fake, "attach", "/dev/null");
+      samples.push_back(elapsedMs(start));
+      outputSize = output.stdout.size();
+      if(outputSize < size) {
+        throw std::runtime_error("Short output from fake hdiutil: " + std::to_string(outputSize) + " bytes");
+      }
+    }
+    Stats s = computeStats(samples);
+    std::cout << "output " << outputSize << " bytes: mean " << s.mean << " ms, " << (outputSize / 1e6) / (s.mean / 1e3) << " MB/s" << std::endl;
+
+#ifdef __APPLE__
+    CommandOutput output = runFake(fake, "attach", "/dev/null");
+    const PlistPath devEntriesPath = PlistPath().key("system-entities").each().key("dev-entry");
+    samples.clear();
+    for(unsigned int i = 0; i < iterations; ++i) {
+      Clock::time_point start = Clock::now();
+      Plist pl(output.stdout);
+      PlistQueryResult result = pl.query(devEntriesPath);
+      samples.push_back(elapsedMs(start));
+      if(!result.ok) {
+        throw std::runtime_error("Unable to query fake attach output: " + result.error);
+      }
+    }
+    s = computeStats(samples);
+    std::cout << "plist parse " << outputSize << " bytes: mean " << s.mean << " ms, p99 " << s.p99 << " ms" << std::endl;
+#endif
+  }
+}
+
+// A child that keeps reporting progress must outlive the inactivity timeout,
+// and one that goes quiet must be killed once it expires.
+static void benchProgress(const std::string& fake) {
+  CommandOptions options;
+  options.timeoutSecs = 1;
+  options.inactivityTimeout = true;
+
+  writeFakeHdiutil(fake, {0, 2000, 0, 5});
+  unsigned int progressLines = 0;
+  double firstProgressMs = 0;
+  Clock::time_point start = Clock::now();
+  options.onStdoutLine = [&](const std::string& line) {
+    if(line.compare(0, 8, "PERCENT:") == 0) {
+      if(!progressLines++) {
+        firstProgressMs = elapsedMs(start);
+      }
+    }
+  };
+  CommandOutput output = runCommand(fake, {"attach", "-plist", "-puppetstrings", "/dev/null"}, "", options);
+  double ms = elapsedMs(start);
+  if(output.retCode || progressLines != 5) {
+    throw std::runtime_error("Progress run failed with code " + std::to_string(output.retCode) + " after " + std::to_string(progressLines) + " progress lines");
+  }
+  std::cout << "progress: " << progressLines << " lines in " << ms << " ms with a 1 s inactivity timeout, first after " << firstProgressMs << " ms" << std::endl;
+
+  writeFakeHdiutil(fake, {0, 3000, 0, 0});
+  options.onStdoutLine = nullptr;
+  start = Clock::now();
+  output = runCommand(fake, {"attach", "-plist", "/dev/null"}, "", options);
+  ms = elapsedMs(start);
+  if(output.retCode != SIGKILL) {
+    throw std::runtime_error("Stalled child was not killed, exit code " + std::to_string(output.retCode));
+  }
+  std::cout << "progress: stalled child killed after " << ms << " ms" << std::endl;
+
+#ifdef __APPLE__
+  writeFakeHdiutil(fake, {0, 500, 0, 5});
+  setHdiutilPath(fake);
+  unsigned int updates = 0;
+  attachDisk("/dev/null", diskarbitrator::MountMode::MOUNT_NONE, "", [&updates](const AttachProgress& progress) {
+    ++updates;
+  });
+  std::cout << "progress: attachDisk reported " << updates << " updates" << std::endl;
+#endif
+}
+
+// Attaches `images` fake images with every parallelism level and reports how
+// the batch time scales compared to attaching them one by one.
+static void benchConcurrentAttach(const std::string& fake, const std::string& dir, unsigned int images, unsigned int latencyMs, const std::vector<unsigned int>& levels) {
+  writeFakeHdiutil(fake, {0, latencyMs, 0, 0});
+
+  std::vector<std::string> paths;
+  for(unsigned int i = 0; i < images; ++i) {
+    // attachDisk identifies images by inode, so every one needs its own file
+    paths.push_back(dir + "/image" + std::to_string(i) + ".dmg");
+    std::ofstream(paths.back()) << i;
+  }
+
+  double baseline = 0;
+  for(const auto& level : levels) {
+    Clock::time_point start = Clock::now();
+    std::atomic<unsigned int> failures(0);
+#ifdef __APPLE__
+    setHdiutilPath(fake);
+    attachDisks(paths, diskarbitrator::MountMode::MOUNT_NONE, level, [&failures](const AttachResult& result) {
+      if(result.error.size()) {
+        ++failures;
+      }
+    });
+#else
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for(unsigned int t = 0; t < std::min(level, images); ++t) {
+      workers.emplace_back([&]() {
+        size_t i;
+        while((i = next++) < paths.size()) {
+          for(const auto& verb : {"isencrypted", "imageinfo", "attach"}) {
+            if(runFake(fake, verb, paths[i]).retCode) {
+              ++failures;
+            }
+          }
+        }
+      });
+    }
+    for(auto& t : workers) {
+      t.join();
+    }
+#endif
+    double ms = elapsedMs(start);
+    if(!baseline) {
+      baseline = ms;
+    }
+    std::cout << "attach " << images << " images, parallelism " << level << ": " << ms << " ms, " << images / (ms / 1e3) << " images/s, speedup " << baseline / ms << "x";
+    if(failures) {
+      std::cout << " (" << failures << " failures)";
+    }
+    std::cout << std::endl;
+  }
+
+  for(const auto& p : paths) {
+    unlink(p.c_str());
+  }
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_logtostderr = true;
+
+  cxxopts::Options options("hdiutil_bench", "hdiutil execution benchmarks against a fake hdiutil");
+  options.add_options()
+      ("i,iterations", "Runs per measurement", cxxopts::value<unsigned int>()->default_value("50"))
+      ("sizes", "Plist padding sizes for the throughput runs, in bytes", cxxopts::value<std::vector<size_t>>()->default_value("0,65536,1048576,16777216"))
+      ("images", "Images per concurrent attach batch", cxxopts::value<unsigned int>()->default_value("32"))
+      ("latency", "Fake hdiutil latency for the concurrent attach runs, in ms", cxxopts::value<unsigned int>()->default_value("50"))
+      ("levels", "Parallelism levels for the concurrent attach runs", cxxopts::value<std::vector<unsigned int>>()->default_value("1,2,4,8,16"))
+      ("h,help", "Print usage")
+  ;
+  cxxopts::ParseResult result = options.parse(argc, argv);
+  if (result.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  // The fake doesn't read its stdin, don't die if it exits before we write it
+  signal(SIGPIPE, SIG_IGN);
+
+  char dirTemplate[] = "/tmp/hdiutil_bench.XXXXXX";
+  if(mkdtemp(dirTemplate) == NULL) {
+    std::cerr << "Unable to create temporary directory: " << strerror(errno) << std::endl;
+    return 1;
+  }
+  const std::string dir = dirTemplate;
+  const std::string fake = dir + "/hdiutil";
+
+  int ret = 0;
+  try {
+    unsigned int iterations = result["iterations"].as<unsigned int>();
+    benchSpawnLatency(fake, iterations);
+    benchExitCode(fake);
+    benchOutputThroughput(fake, result["sizes"].as<std::vector<size_t>>(), iterations);
+    benchProgress(fake);
+    benchConcurrentAttach(fake, dir, result["images"].as<unsigned int>(), result["latency"].as<unsigned int>(), result["levels"].as<std::vector<unsigned int>>());
+  } catch(const std::exception& e) {
+    std::cerr << "Benchmark FAILED: " << e.what() << std::endl;
+    ret = 1;
+  }
+
+  unlink(fake.c_str());
+  rmdir(dir.c_str());
+  return ret;
+}
@@ -0,0 +1,2381 @@
+/***************************************************************************
+ *   image_bench.cpp  --  This file is part of diskarbitratord.            *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+// Benchmarks for the native image code. Every image is generated by
+// fixtures.hpp, and answers are checked against what the fixture contains
+// before timing anything.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <random>
+#include <thread>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include <cxxopts.hpp>
+
+#include "acquisition.hpp"
+#include "allocation_map.hpp"
+#include "baseline.hpp"
+#include "block_cache.hpp"
+#include "block_reader.hpp"
+#include "block_scan.hpp"
+#include "byteorder.hpp"
+#include "checkpoint.hpp"
+#include "container.hpp"
+#include "crc32.hpp"
+#include "ewf.hpp"
+#include "fat_volume.hpp"
+#include "fixtures.hpp"
+#include "fs_probe.hpp"
+#include "hash.hpp"
+#include "image_reader.hpp"
+#include "image_sniffer.hpp"
+#include "io_scheduler.hpp"
+#include "nbd_server.hpp"
+#include "partition_table.hpp"
+#include "pipeline.hpp"
+#include "rescue.hpp"
+#include "scope_guard.hpp"
+#include "thread_pool.hpp"
+#include "udif.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedUs(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+typedef struct SnifferCase {
+  std::string name;
+  std::string path;
+  ImageFormat format;
+  bool encrypted;
+  bool hasSLA;
+  bool slaKnown;
+  uint64_t size;
+} SnifferCase;
+
+// Containers are our own format, so there's no independent fixture writer:
+// they're written with ContainerWriter and checked by reading them back
+static void writeContainer(const std::string& path, const std::vector<uint8_t>& disk, ContainerCompression compression, unsigned int threads, const std::string& sha256) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    throw std::runtime_error("Unable to create " + path);
+  }
+  ContainerWriter writer(fd, compression, CONTAINER_DEFAULT_CHUNK_SIZE, threads);
+  // In pieces that don't line up with the chunks
+  for(size_t offset = 0; offset < disk.size(); offset += 1000003) {
+    writer.write(disk.data() + offset, std::min<size_t>(1000003, disk.size() - offset));
+  }
+  writer.finish(sha256);
+  close(fd);
+}
+
+static void benchSniffer(const std::string& dir, unsigned int iterations) {
+  std::vector<SnifferCase> cases = {
+    {"udif", dir + "/plain.dmg", IMAGE_FORMAT_UDIF, false, false, true, 2048 * 512},
+    {"udif-sla", dir + "/sla.dmg", IMAGE_FORMAT_UDIF, false, true, true, 2048 * 512},
+    {"encrypted", dir + "/encrypted.dmg", IMAGE_FORMAT_ENCRYPTED, true, false, false, 0},
+    {"mbr", dir + "/disk.img", IMAGE_FORMAT_RAW_MBR, false, false, true, 4096 * 512},
+    {"iso", dir + "/disk.iso", IMAGE_FORMAT_ISO9660, false, false, true, 64 * 1024},
+    {"ewf", dir + "/sniff", IMAGE_FORMAT_EWF, false, false, true, 4096 * 512},
+    {"split-raw", dir + "/sniff", IMAGE_FORMAT_SPLIT_RAW, false, false, true, 4096 * 512},
+    {"container", dir + "/sniff.dac", IMAGE_FORMAT_CONTAINER, false, false, true, 4096 * 512},
+    {"sparsebundle", dir + "/plain.sparsebundle", IMAGE_FORMAT_SPARSEBUNDLE, false, false, true, 1ULL << 30},
+    {"sparsebundle-encrypted", dir + "/encrypted.sparsebundle", IMAGE_FORMAT_SPARSEBUNDLE, true, false, true, 1ULL << 30},
+  };
+
+  writeUDIFFixture(cases[0].path, std::vector<uint8_t>(4096, 0), udifXML(false), 2048);
+  writeUDIFFixture(cases[1].path, std::vector<uint8_t>(4096, 0), udifXML(true), 2048);
+  writeEncryptedFixture(cases[2].path);
+  writeMBRFixture(cases[3].path, 4096);
+  writeISOFixture(cases[4].path);
+  writeEWFFixture(cases[5].path, std::vector<uint8_t>(4096 * 512, 0), 64, 16);
+  cases[5].path += ".E01";
+  writeSplitRawFixture(cases[6].path, std::vector<uint8_t>(4096 * 512, 0), 1 << 20);
+  cases[6].path += ".001";
+  writeContainer(cases[7].path, std::vector<uint8_t>(4096 * 512, 0), CONTAINER_COMPRESSION_ZLIB, 1, "");
+  writeSparseBundleFixture(cases[8].path, 1ULL << 30, false);
+  writeSparseBundleFixture(cases[9].path, 1ULL << 30, true);
+
+  for(const auto& c : cases) {
+    ImageInfo info = sniffImage(c.path);
+    if(info.format != c.format || !info.encryptionKnown || info.encrypted != c.encrypted ||
+       info.slaKnown != c.slaKnown || (c.slaKnown && info.hasSLA != c.hasSLA) ||
+       (info.sizeKnown && info.size != c.size)) {
+      throw std::runtime_error("Wrong answer sniffing " + c.name + ": got " + imageFormatName(info.format));
+    }
+
+    Clock::time_point start = Clock::now();
+    for(unsigned int i = 0; i < iterations; ++i) {
+      sniffImage(c.path);
+    }
+    std::cout << "sniff " << c.name << " (" << imageFormatName(info.format) << "): " << elapsedUs(start) / iterations << " us" << std::endl;
+  }
+}
+
+// Streams the whole disk through a UDIFReader or EWFReader with `threads`
+// decompression workers, checking it reads back exactly what went in
+template <typename Reader>
+static void benchChunkedRead(const std::string& name, const std::string& path, const std::vector<uint8_t>& disk, unsigned int threads, size_t readSize) {
+  Reader reader(path, threads);
+  if(reader.size() != disk.size()) {
+    throw std::runtime_error("Wrong size reading " + name + ": got " + std::to_string(reader.size()));
+  }
+  std::vector<uint8_t> buffer(readSize);
+  Clock::time_point start = Clock::now();
+  for(uint64_t offset = 0; offset < disk.size(); offset += readSize) {
+    size_t bytesRead = reader.read(offset, buffer.data(), readSize);
+    if(memcmp(buffer.data(), disk.data() + offset, bytesRead)) {
+      throw std::runtime_error("Wrong data reading " + name + " at offset " + std::to_string(offset));
+    }
+  }
+  double us = elapsedUs(start);
+  std::cout << "read " << name << " sequential, " << threads << " threads: " << disk.size() / us << " MB/s" << std::endl;
+}
+
+// Random reads, as a filesystem walk would do them. Mostly tells how much the
+// chunk cache saves
+template <typename Reader>
+static void benchChunkedRandomRead(const std::string& name, const std::string& path, const std::vector<uint8_t>& disk, unsigned int iterations) {
+  Reader reader(path);
+  std::mt19937_64 rng(42);
+  // Skewed towards the start of the disk, where filesystem metadata lives
+  std::geometric_distribution<uint64_t> block(0.01);
+  std::vector<uint8_t> buffer(4096);
+  const uint64_t blocks = disk.size() / buffer.size();
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < iterations; ++i) {
+    uint64_t offset = (block(rng) * 97 % blocks) * buffer.size();
+    reader.read(offset, buffer.data(), buffer.size());
+    if(memcmp(buffer.data(), disk.data() + offset, buffer.size())) {
+      throw std::runtime_error("Wrong data reading " + name + " at offset " + std::to_string(offset));
+    }
+  }
+  double hitRate = 100.0 * reader.cacheHits() / std::max<size_t>(1, reader.cacheHits() + reader.cacheMisses());
+  std::cout << "read " << name << " random 4K: " << elapsedUs(start) / iterations << " us, " << hitRate << "% cache hits" << std::endl;
+}
+
+static void benchUDIF(const std::string& dir, uint64_t diskMB, unsigned int iterations) {
+  const std::vector<uint8_t> disk = makeDiskContents(diskMB << 20);
+  const std::vector<std::pair<std::string, FixtureCompression>> compressions = {
+    {"raw", FIXTURE_RAW},
+    {"zlib", FIXTURE_ZLIB},
+    {"bzip2", FIXTURE_BZIP2},
+  };
+  std::vector<unsigned int> threadCounts = {1, 2, 4};
+  if(std::thread::hardware_concurrency() > 4) {
+    threadCounts.push_back(std::thread::hardware_concurrency());
+  }
+
+  for(const auto& compression : compressions) {
+    const std::string path = dir + "/" + compression.first + ".dmg";
+    // 1MB chunks, what hdiutil uses by default
+    writeCompressedUDIFFixture(path, disk, 2048, compression.second);
+    for(const auto& threads : threadCounts) {
+      benchChunkedRead<UDIFReader>(compression.first, path, disk, threads, 256 * 1024);
+    }
+    benchChunkedRandomRead<UDIFReader>(compression.first, path, disk, iterations);
+  }
+
+  // Chunks claiming to be huge, or to be stored way past the end of the
+  // file, have to be refused when opening rather than allocated
+  const std::vector<std::pair<uint64_t, uint64_t>> corruptChunks = {
+    {1ULL << 40, 16},   // Sectors
+    {1, UINT64_MAX},    // Stored bytes, wraps around past the offset
+  };
+  for(const auto& corruptChunk : corruptChunks) {
+    std::vector<uint8_t> mish(204 + 40, 0);
+    memcpy(mish.data(), "mish", 4);
+    writeBE32(mish.data() + 4, 1);
+    writeBE64(mish.data() + 16, corruptChunk.first);
+    writeBE32(mish.data() + 200, 1);
+    writeBE32(mish.data() + 204, FIXTURE_ZLIB);
+    writeBE64(mish.data() + 204 + 16, corruptChunk.first);
+    writeBE64(mish.data() + 204 + 24, 16);
+    writeBE64(mish.data() + 204 + 32, corruptChunk.second);
+    const std::string entries = "\t\t\t<dict>\n\t\t\t\t<key>Data</key>\n\t\t\t\t<data>" + base64Encode(mish) + "</data>\n\t\t\t</dict>\n";
+    writeUDIFFixture(dir + "/corrupt.dmg", std::vector<uint8_t>(4096, 0), udifXML(false, entries), corruptChunk.first);
+    bool caught = false;
+    try {
+      UDIFReader reader(dir + "/corrupt.dmg");
+    } catch(const std::runtime_error& e) {
+      caught = true;
+    }
+    if(!caught) {
+      throw std::runtime_error("Corrupt UDIF chunk opened without errors");
+    }
+  }
+}
+
+// EnCase's default of 32KB chunks, in segments of a quarter of the disk so
+// reads have to cross them
+static void benchEWF(const std::string& dir, uint64_t diskMB, unsigned int iterations) {
+  const std::vector<uint8_t> disk = makeDiskContents(diskMB << 20);
+  const uint64_t chunkCount = disk.size() / (64 * 512);
+  writeEWFFixture(dir + "/disk", disk, 64, chunkCount / 4 + 1);
+  const std::string path = dir + "/disk.E01";
+  ImageInfo info = sniffImage(path);
+  if(info.format != IMAGE_FORMAT_EWF || !info.sizeKnown || info.size != disk.size()) {
+    throw std::runtime_error("Wrong answer sniffing the EWF image: got " + imageFormatName(info.format));
+  }
+  {
+    EWFReader reader(path, 1, 0);
+    if(reader.segmentCount() != 4 || reader.chunkCount() != chunkCount) {
+      throw std::runtime_error("Wrong layout for the EWF image: " + std::to_string(reader.segmentCount()) + " segments, " + std::to_string(reader.chunkCount()) + " chunks");
+    }
+  }
+
+  std::vector<unsigned int> threadCounts = {1, 2, 4};
+  if(std::thread::hardware_concurrency() > 4) {
+    threadCounts.push_back(std::thread::hardware_concurrency());
+  }
+  for(const auto& threads : threadCounts) {
+    benchChunkedRead<EWFReader>("ewf", path, disk, threads, 256 * 1024);
+  }
+  benchChunkedRandomRead<EWFReader>("ewf", path, disk, iterations);
+
+  // A stored chunk with a flipped byte has to be caught by its Adler-32, and
+  // only that chunk should fail
+  std::vector<uint8_t> small(disk.begin(), disk.begin() + (1 << 20));
+  writeEWFFixture(dir + "/corrupt", small, 64, 1024, false);
+  {
+    std::fstream file(dir + "/corrupt.E01", std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(FIXTURE_EWF_FIRST_CHUNK_OFFSET + 100);
+    file.put(small[100] ^ 0xFF);
+  }
+  EWFReader corrupt(dir + "/corrupt.E01");
+  std::vector<uint8_t> buffer(64 * 512);
+  if(corrupt.read(buffer.size(), buffer.data(), buffer.size()) != buffer.size() || memcmp(buffer.data(), small.data() + buffer.size(), buffer.size())) {
+    throw std::runtime_error("Wrong data reading past the corrupt EWF chunk");
+  }
+  bool caught = false;
+  try {
+    corrupt.read(0, buffer.data(), buffer.size());
+  } catch(const std::runtime_error& e) {
+    caught = true;
+  }
+  if(!caught) {
+    throw std::runtime_error("Corrupt EWF chunk read without errors");
+  }
+
+  // Odd sized segments, so that reads straddle them
+  writeSplitRawFixture(dir + "/split", disk, (7 << 20) + 512);
+  info = sniffImage(dir + "/split.001");
+  if(info.format != IMAGE_FORMAT_SPLIT_RAW || info.size != disk.size()) {
+    throw std::runtime_error("Wrong answer sniffing the split raw image: got " + imageFormatName(info.format));
+  }
+  std::unique_ptr<ImageReader> split = openImageReader(dir + "/split.001");
+  buffer.resize(256 * 1024);
+  Clock::time_point start = Clock::now();
+  for(uint64_t offset = 0; offset < disk.size(); offset += buffer.size()) {
+    size_t bytesRead = split->read(offset, buffer.data(), buffer.size());
+    if(bytesRead != std::min<uint64_t>(buffer.size(), disk.size() - offset) || memcmp(buffer.data(), disk.data() + offset, bytesRead)) {
+      throw std::runtime_error("Wrong data reading the split raw image at offset " + std::to_string(offset));
+    }
+  }
+  std::cout << "read split raw sequential: " << disk.size() / elapsedUs(start) << " MB/s" << std::endl;
+}
+
+// `consumers` threads each reading the whole disk sequentially through their
+// own reader, the way probing, hashing and extraction would at once
+static double readConcurrently(std::function<std::unique_ptr<ImageReader>()> open, const std::vector<uint8_t>& disk, unsigned int consumers) {
+  std::vector<std::future<void>> running;
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < consumers; ++i) {
+    running.push_back(std::async(std::launch::async, [&open, &disk]() {
+      std::unique_ptr<ImageReader> reader = open();
+      std::vector<uint8_t> buffer(64 * 1024);
+      for(uint64_t offset = 0; offset < disk.size(); offset += buffer.size()) {
+        size_t bytesRead = reader->read(offset, buffer.data(), buffer.size());
+        if(memcmp(buffer.data(), disk.data() + offset, bytesRead)) {
+          throw std::runtime_error("Wrong data reading through the block cache at offset " + std::to_string(offset));
+        }
+      }
+    }));
+  }
+  for(auto& f : running) {
+    f.get();
+  }
+  return consumers * disk.size() / elapsedUs(start);
+}
+
+static void benchBlockCache(const std::string& dir, uint64_t diskMB, unsigned int iterations) {
+  const std::vector<uint8_t> disk = makeDiskContents(diskMB << 20);
+  const std::string path = dir + "/cached.img";
+  writeFile(path, disk);
+  const unsigned int consumers = 4;
+
+  double speed = readConcurrently([&path]() {
+    return std::unique_ptr<ImageReader>(new FileImageReader(path));
+  }, disk, consumers);
+  std::cout << "block cache off, " << consumers << " readers: " << speed << " MB/s" << std::endl;
+
+  for(bool directIO : {false, true}) {
+    std::shared_ptr<BlockCache> cache = std::make_shared<BlockCache>(disk.size() * 2, directIO);
+    speed = readConcurrently([&cache, &path]() {
+      return cache->open(path);
+    }, disk, consumers);
+    BlockCacheStats stats = cache->stats();
+    // Every block should come off the device exactly once
+    if(stats.deviceBytesRead != disk.size()) {
+      throw std::runtime_error("Block cache read " + std::to_string(stats.deviceBytesRead) + " bytes off the device for a " + std::to_string(disk.size()) + " byte disk");
+    }
+    std::cout << "block cache" << (directIO ? " direct" : "") << ", " << consumers << " readers: " << speed << " MB/s, "
+              << 100.0 * stats.hits / std::max<uint64_t>(1, stats.hits + stats.misses) << "% hits, "
+              << 100.0 * stats.readaheadHits / std::max<uint64_t>(1, stats.readaheadBlocks) << "% of " << stats.readaheadBlocks << " readahead blocks used" << std::endl;
+  }
+
+  // Random reads over a cache a quarter the size of the disk
+  std::shared_ptr<BlockCache> cache = std::make_shared<BlockCache>(disk.size() / 4);
+  std::unique_ptr<ImageReader> reader = cache->open(path);
+  std::mt19937_64 rng(42);
+  std::geometric_distribution<uint64_t> block(0.01);
+  std::vector<uint8_t> buffer(4096);
+  const uint64_t blocks = disk.size() / buffer.size();
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < iterations; ++i) {
+    uint64_t offset = (block(rng) * 97 % blocks) * buffer.size();
+    reader->read(offset, buffer.data(), buffer.size());
+    if(memcmp(buffer.data(), disk.data() + offset, buffer.size())) {
+      throw std::runtime_error("Wrong data reading through the block cache at offset " + std::to_string(offset));
+    }
+  }
+  BlockCacheStats stats = cache->stats();
+  std::cout << "block cache random 4K: " << elapsedUs(start) / iterations << " us, " << 100.0 * stats.hits / std::max<uint64_t>(1, stats.hits + stats.misses)
+            << "% hits, " << stats.readaheadBlocks << " readahead blocks" << std::endl;
+}
+
+// Bare bones NBD client, just enough to check the server against. Read
+// cookies are the read offset, which is how simple replies (that don't say
+// how much data follows) get matched to their length
+class NBDClient {
+  public:
+    // Connects and goes through the handshake up to NBD_OPT_GO for `name`
+    NBDClient(const std::string& socketPath, const std::string& name, bool structured) : NBDClient(socketPath) {
+      this->structured = structured;
+      if(structured && this->option(NBD_OPT_STRUCTURED_REPLY, "").first != NBD_REP_ACK) {
+        throw std::runtime_error("Structured replies refused");
+      }
+      // Export name, then one info request for the block sizes
+      std::string go(4, '\0');
+      writeBE32(reinterpret_cast<uint8_t*>(&go[0]), name.size());
+      go += name + std::string("\0\1\0\3", 4);
+      this->sendOption(NBD_OPT_GO, go);
+      while(true) {
+        std::pair<uint32_t, std::string> reply = this->optionReply();
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(reply.second.data());
+        if(reply.first == NBD_REP_ACK) {
+          break;
+        }
+        if(reply.first != NBD_REP_INFO) {
+          throw std::runtime_error("NBD_OPT_GO failed for " + name + ": " + reply.second);
+        }
+        if(readBE16(p) == NBD_INFO_EXPORT) {
+          this->exportSize = readBE64(p + 2);
+          this->transmissionFlags = readBE16(p + 10);
+        } else if(readBE16(p) == NBD_INFO_BLOCK_SIZE) {
+          this->maxRequest = readBE32(p + 10);
+        }
+      }
+    }
+
+    ~NBDClient() {
+      if(this->exportSize) {
+        uint8_t request[28];
+        this->putRequest(request, NBD_CMD_DISC, 0, 0, 0);
+        send(this->fd, request, sizeof(request), MSG_NOSIGNAL);
+      }
+      close(this->fd);
+    }
+
+    static std::vector<std::string> list(const std::string& socketPath) {
+      NBDClient client(socketPath);
+      client.sendOption(NBD_OPT_LIST, "");
+      std::vector<std::string> names;
+      for(std::pair<uint32_t, std::string> reply = client.optionReply(); reply.first == NBD_REP_SERVER; reply = client.optionReply()) {
+        names.push_back(reply.second.substr(4));
+      }
+      client.option(NBD_OPT_ABORT, "");
+      return names;
+    }
+
+    void sendRequest(uint16_t type, uint64_t cookie, uint64_t offset, uint32_t length) {
+      uint8_t request[28];
+      this->putRequest(request, type, cookie, offset, length);
+      this->sendAll(request, sizeof(request));
+    }
+
+    void sendAll(const void* data, size_t len) {
+      if(len && send(this->fd, data, len, MSG_NOSIGNAL) != static_cast<ssize_t>(len)) {
+        throw std::runtime_error("NBD send failed");
+      }
+    }
+
+    // Returns the cookie and error of the next reply. Read data goes into
+    // `buffer`, which is as big as a read. Our server always sends structured
+    // reads in a single chunk
+    std::pair<uint64_t, uint32_t> receiveReply(std::vector<uint8_t>& buffer, uint64_t diskSize) {
+      uint8_t header[20];
+      if(!this->structured) {
+        this->receive(header, 16);
+        if(readBE32(header) != NBD_SIMPLE_REPLY_MAGIC) {
+          throw std::runtime_error("Bad NBD simple reply");
+        }
+        const uint64_t cookie = readBE64(header + 8);
+        if(!readBE32(header + 4) && cookie < diskSize) {
+          this->receive(buffer.data(), std::min<uint64_t>(buffer.size(), diskSize - cookie));
+        }
+        return std::make_pair(cookie, readBE32(header + 4));
+      }
+      this->receive(header, sizeof(header));
+      if(readBE32(header) != NBD_STRUCTURED_REPLY_MAGIC || !(readBE16(header + 4) & NBD_REPLY_FLAG_DONE)) {
+        throw std::runtime_error("Bad NBD structured reply");
+      }
+      std::vector<uint8_t> payload(readBE32(header + 16));
+      if(readBE16(header + 6) == NBD_REPLY_TYPE_OFFSET_DATA) {
+        this->receive(payload.data(), 8);
+        this->receive(buffer.data(), payload.size() - 8);
+        return std::make_pair(readBE64(header + 8), 0u);
+      }
+      this->receive(payload.data(), payload.size());
+      return std::make_pair(readBE64(header + 8), payload.size() >= 4 ? readBE32(payload.data()) : 0u);
+    }
+
+    uint64_t exportSize = 0;
+    uint16_t transmissionFlags = 0;
+    uint32_t maxRequest = 0;
+
+  private:
+    // Connects and gets through the greeting, ready for options
+    NBDClient(const std::string& socketPath) {
+      this->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      struct sockaddr_un address;
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+      if(this->fd == -1 || connect(this->fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1) {
+        throw std::runtime_error("Unable to connect to " + socketPath + ": " + strerror(errno));
+      }
+      uint8_t hello[18];
+      this->receive(hello, sizeof(hello));
+      if(readBE64(hello) != NBD_MAGIC || readBE64(hello + 8) != NBD_OPTION_MAGIC || !(readBE16(hello + 16) & NBD_FLAG_FIXED_NEWSTYLE)) {
+        throw std::runtime_error("Bad NBD greeting");
+      }
+      uint8_t flags[4];
+      writeBE32(flags, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+      this->sendAll(flags, sizeof(flags));
+    }
+
+    void putRequest(uint8_t* request, uint16_t type, uint64_t cookie, uint64_t offset, uint32_t length) {
+      writeBE32(request, NBD_REQUEST_MAGIC);
+      writeBE16(request + 4, 0);
+      writeBE16(request + 6, type);
+      writeBE64(request + 8, cookie);
+      writeBE64(request + 16, offset);
+      writeBE32(request + 24, length);
+    }
+
+    void sendOption(uint32_t option, const std::string& data) {
+      uint8_t header[16];
+      writeBE64(header, NBD_OPTION_MAGIC);
+      writeBE32(header + 8, option);
+      writeBE32(header + 12, data.size());
+      this->sendAll(header, sizeof(header));
+      this->sendAll(data.data(), data.size());
+    }
+
+    std::pair<uint32_t, std::string> optionReply() {
+      uint8_t header[20];
+      this->receive(header, sizeof(header));
+      if(readBE64(header) != NBD_REPLY_MAGIC) {
+        throw std::runtime_error("Bad NBD option reply");
+      }
+      std::string data(readBE32(header + 16), '\0');
+      this->receive(&data[0], data.size());
+      return std::make_pair(readBE32(header + 12), data);
+    }
+
+    std::pair<uint32_t, std::string> option(uint32_t option, const std::string& data) {
+      this->sendOption(option, data);
+      return this->optionReply();
+    }
+
+    void receive(void* data, size_t len) {
+      size_t total = 0;
+      while(total < len) {
+        ssize_t received = recv(this->fd, static_cast<uint8_t*>(data) + total, len - total, 0);
+        if(received <= 0) {
+          throw std::runtime_error("NBD connection closed");
+        }
+        total += received;
+      }
+    }
+
+    int fd;
+    bool structured = false;
+};
+
+// Reads the whole export with `depth` requests in flight, checking every
+// reply against the disk. Replies can come back in any order
+static double readNBDExport(NBDClient& client, const std::vector<uint8_t>& disk, size_t readSize, unsigned int depth) {
+  std::vector<uint8_t> buffer(readSize);
+  uint64_t nextOffset = 0;
+  unsigned int pending = 0;
+  Clock::time_point start = Clock::now();
+  while(nextOffset < disk.size() || pending) {
+    for(; pending < depth && nextOffset < disk.size(); ++pending) {
+      uint32_t length = std::min<uint64_t>(readSize, disk.size() - nextOffset);
+      client.sendRequest(NBD_CMD_READ, nextOffset, nextOffset, length);
+      nextOffset += length;
+    }
+    std::pair<uint64_t, uint32_t> reply = client.receiveReply(buffer, disk.size());
+    const uint64_t offset = reply.first;
+    if(reply.second || offset >= disk.size() || memcmp(buffer.data(), disk.data() + offset, std::min<uint64_t>(readSize, disk.size() - offset))) {
+      throw std::runtime_error("Wrong NBD reply for offset " + std::to_string(offset) + " (error " + std::to_string(reply.second) + ")");
+    }
+    --pending;
+  }
+  return disk.size() / elapsedUs(start);
+}
+
+static void benchNBD(const std::string& dir, uint64_t diskMB) {
+  const std::vector<uint8_t> disk = makeDiskContents(diskMB << 20);
+  writeFile(dir + "/nbd.img", disk);
+  writeEWFFixture(dir + "/nbd", disk, 64, 1 << 20);
+
+  NBDServer server(dir + "/nbd.sock");
+  if(server.addExport("raw", dir + "/nbd.img") != disk.size() || server.addExport("ewf", dir + "/nbd.E01") != disk.size()) {
+    throw std::runtime_error("Wrong NBD export size");
+  }
+  std::vector<std::string> names = NBDClient::list(server.path());
+  std::sort(names.begin(), names.end());
+  if(names != std::vector<std::string>({"ewf", "raw"})) {
+    throw std::runtime_error("Wrong NBD export list");
+  }
+
+  for(const auto& name : names) {
+    for(bool structured : {false, true}) {
+      NBDClient client(server.path(), name, structured);
+      if(client.exportSize != disk.size() || !(client.transmissionFlags & NBD_FLAG_READ_ONLY) || client.maxRequest != NBD_MAX_REQUEST_SIZE) {
+        throw std::runtime_error("Wrong NBD export info for " + name);
+      }
+      // Writes have to be refused, and the data after them still understood
+      std::vector<uint8_t> buffer(4096);
+      client.sendRequest(NBD_CMD_WRITE, disk.size(), 0, buffer.size());
+      client.sendAll(buffer.data(), buffer.size());
+      if(client.receiveReply(buffer, disk.size()).second != NBD_EPERM) {
+        throw std::runtime_error("NBD write to " + name + " was not refused");
+      }
+      client.sendRequest(NBD_CMD_READ, disk.size(), disk.size() - 512, 1024);
+      if(client.receiveReply(buffer, disk.size()).second != NBD_EINVAL) {
+        throw std::runtime_error("NBD read past the end of " + name + " was not refused");
+      }
+      for(unsigned int depth : {1, 16}) {
+        double speed = readNBDExport(client, disk, 256 * 1024, depth);
+        std::cout << "nbd " << name << (structured ? " structured" : " simple") << ", " << depth << " in flight: " << speed << " MB/s" << std::endl;
+      }
+    }
+  }
+}
+
+// Zero and constant runs are merged back whether they were read or were holes,
+// so a sparse copy of a disk can be compared with the original
+static std::vector<AllocationRun> mapRuns(ImageReader& reader, int fd, uint32_t blockSize, AllocationSummary& summary) {
+  std::vector<AllocationRun> runs;
+  summary = mapAllocation(reader, fd, blockSize, [&runs](const AllocationRun& run) {
+    if(runs.size() && runs.back().kind == run.kind && runs.back().fill == run.fill && run.kind != BLOCK_DATA) {
+      runs.back().length += run.length;
+    } else {
+      runs.push_back(run);
+    }
+    return true;
+  });
+  return runs;
+}
+
+static void checkRuns(const std::string& name, const std::vector<AllocationRun>& runs, const std::vector<AllocationRun>& expected) {
+  bool same = runs.size() == expected.size();
+  for(size_t i = 0; same && i < runs.size(); ++i) {
+    same = runs[i].offset == expected[i].offset && runs[i].length == expected[i].length && runs[i].kind == expected[i].kind && runs[i].fill == expected[i].fill;
+  }
+  if(!same) {
+    for(const auto& run : runs) {
+      std::cerr << run.offset << "+" << run.length << " " << blockKindName(run.kind) << " " << static_cast<int>(run.fill) << std::endl;
+    }
+    throw std::runtime_error("Wrong allocation map of " + name);
+  }
+}
+
+static void benchAllocation(const std::string& dir, uint64_t diskMB, unsigned int iterations) {
+  const uint32_t blockSize = ALLOCATION_DEFAULT_BLOCK_SIZE;
+  // The SIMD kernels have to notice one odd byte anywhere, with any length
+  // and alignment
+  std::vector<uint8_t> buffer(4096 + 64, 0);
+  for(size_t start = 0; start < 64; start += 7) {
+    for(size_t len = 1; len < 1024; len += 13) {
+      if(!blockIsFilled(buffer.data() + start, len, 0)) {
+        throw std::runtime_error(std::string("Zero block not recognised by ") + blockScanImplementation());
+      }
+      for(size_t odd = 0; odd < len; odd += std::max<size_t>(1, len / 5)) {
+        buffer[start + odd] = 1;
+        if(blockIsFilled(buffer.data() + start, len, 0)) {
+          throw std::runtime_error(std::string("Byte missed by ") + blockScanImplementation() + " at " + std::to_string(odd) + " of " + std::to_string(len));
+        }
+        buffer[start + odd] = 0;
+      }
+      buffer[start + len - 1] = 1;
+      if(blockIsFilled(buffer.data() + start, len, 0)) {
+        throw std::runtime_error(std::string("Last byte missed by ") + blockScanImplementation());
+      }
+      buffer[start + len - 1] = 0;
+    }
+  }
+
+  // Data, zeroes, erased flash, a block with a single byte set, more zeroes,
+  // and a short data block at the end
+  const uint64_t MB = 1 << 20;
+  const uint64_t size = std::max<uint64_t>(diskMB, 8) * MB + 1000;
+  const std::vector<uint8_t> data = makeDiskContents(MB);
+  std::vector<uint8_t> disk(size, 0);
+  std::copy(data.begin(), data.end(), disk.begin());
+  std::fill(disk.begin() + 3 * MB, disk.begin() + 4 * MB, 0xFF);
+  disk[4 * MB + blockSize - 1] = 1;
+  std::copy(data.begin(), data.begin() + 1000, disk.end() - 1000);
+  const std::vector<AllocationRun> expected = {
+    {0, MB, BLOCK_DATA, 0, false},
+    {MB, 2 * MB, BLOCK_ZERO, 0, false},
+    {3 * MB, MB, BLOCK_CONSTANT, 0xFF, false},
+    {4 * MB, blockSize, BLOCK_DATA, 0, false},
+    {4 * MB + blockSize, size - 1000 - 4 * MB - blockSize, BLOCK_ZERO, 0, false},
+    {size - 1000, 1000, BLOCK_DATA, 0, false},
+  };
+
+  const std::string path = dir + "/allocation.img";
+  {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  FileImageReader reader(path);
+  AllocationSummary summary;
+  checkRuns("a raw image", mapRuns(reader, -1, blockSize, summary), expected);
+  if(summary.dataBytes != MB + blockSize + 1000 || summary.constantBytes != MB || summary.holeBytes != 0) {
+    throw std::runtime_error("Wrong allocation summary of a raw image");
+  }
+
+  // Same disk, but with holes where it's empty
+  const std::string sparsePath = dir + "/allocation-sparse.img";
+  int fd = open(sparsePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || ftruncate(fd, size) != 0) {
+    throw std::runtime_error("Unable to create " + sparsePath);
+  }
+  for(const auto& run : expected) {
+    if(run.kind != BLOCK_ZERO &&
+       pwrite(fd, disk.data() + run.offset, run.length, run.offset) != static_cast<ssize_t>(run.length)) {
+      throw std::runtime_error("Unable to write " + sparsePath);
+    }
+  }
+  FileImageReader sparseReader(sparsePath);
+  checkRuns("a sparse raw image", mapRuns(sparseReader, fd, blockSize, summary), expected);
+  if(summary.holeBytes == 0) {
+    std::cout << "allocation map: no holes found, the filesystem doesn't support SEEK_HOLE" << std::endl;
+  } else if(summary.holeBytes > size - summary.dataBytes - summary.constantBytes) {
+    throw std::runtime_error("Data reported as a hole");
+  }
+  close(fd);
+  AllocationSummary pathSummary = mapAllocation(sparsePath, blockSize, [](const AllocationRun& run) {
+    return true;
+  });
+  if(pathSummary.holeBytes != summary.holeBytes || pathSummary.dataBytes != summary.dataBytes) {
+    throw std::runtime_error("Holes not used when mapping by path");
+  }
+
+  // Kernel throughput on zeroes, which is the worst case since everything
+  // has to be looked at
+  std::vector<uint8_t> zeroes(8 << 20, 0);
+  unsigned int runs = std::max(1U, iterations / 20);
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < runs; ++i) {
+    for(size_t offset = 0; offset < zeroes.size(); offset += blockSize) {
+      uint8_t fill;
+      if(classifyBlock(zeroes.data() + offset, blockSize, fill) != BLOCK_ZERO) {
+        throw std::runtime_error("Zero block classified as something else");
+      }
+    }
+  }
+  std::cout << "block scan " << blockScanImplementation() << ": " << zeroes.size() * runs / elapsedUs(start) << " MB/s" << std::endl;
+
+  start = Clock::now();
+  for(unsigned int i = 0; i < runs; ++i) {
+    for(size_t offset = 0; offset < zeroes.size(); offset += blockSize) {
+      if(!std::all_of(zeroes.begin() + offset, zeroes.begin() + offset + blockSize, [](uint8_t byte) { return byte == 0; })) {
+        throw std::runtime_error("Zero block classified as something else");
+      }
+    }
+  }
+  std::cout << "block scan naive: " << zeroes.size() * runs / elapsedUs(start) << " MB/s" << std::endl;
+
+  start = Clock::now();
+  mapRuns(reader, -1, blockSize, summary);
+  std::cout << "allocation map (" << (size >> 20) << " MB raw): " << size / elapsedUs(start) << " MB/s" << std::endl;
+  start = Clock::now();
+  mapRuns(sparseReader, -1, blockSize, summary);
+  double withoutHoles = elapsedUs(start);
+  fd = open(sparsePath.c_str(), O_RDONLY);
+  start = Clock::now();
+  mapRuns(sparseReader, fd, blockSize, summary);
+  std::cout << "allocation map sparse: " << withoutHoles / 1000 << " ms reading everything, " << elapsedUs(start) / 1000 << " ms skipping holes" << std::endl;
+  close(fd);
+}
+
+static std::string sha256Of(const void* data, size_t len) {
+  SHA256 hash;
+  hash.update(data, len);
+  return hash.finish();
+}
+
+static std::vector<uint8_t> readFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void benchSHA256(unsigned int iterations) {
+  const std::string million(1000000, 'a');
+  if(sha256Of("", 0) != "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" ||
+     sha256Of("abc", 3) != "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" ||
+     sha256Of(million.data(), million.size()) != "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0") {
+    throw std::runtime_error(std::string("Wrong SHA-256 from ") + sha256Implementation());
+  }
+  // Fed in awkward pieces, so every path through the block buffering is hit
+  SHA256 pieces;
+  for(size_t offset = 0, len = 1; offset < million.size(); offset += len, len = len * 3 + 1) {
+    pieces.update(million.data() + offset, std::min(len, million.size() - offset));
+  }
+  if(pieces.finish() != "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0") {
+    throw std::runtime_error("Wrong SHA-256 when fed in pieces");
+  }
+
+  std::vector<uint8_t> buffer = makeDiskContents(8 << 20);
+  unsigned int runs = std::max(1U, iterations / 100);
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < runs; ++i) {
+    sha256Of(buffer.data(), buffer.size());
+  }
+  std::cout << "sha256 " << sha256Implementation() << ": " << buffer.size() * runs / elapsedUs(start) << " MB/s" << std::endl;
+}
+
+static std::string digestOf(const std::string& algorithm, const void* data, size_t len) {
+  std::unique_ptr<Hasher> hash = makeHasher(algorithm);
+  hash->update(data, len);
+  return hash->finish();
+}
+
+static HashResult hashWith(const std::string& path, const std::vector<std::string>& algorithms, uint64_t segmentSize, double& us) {
+  HashOptions options;
+  options.algorithms = algorithms;
+  options.segmentSize = segmentSize;
+  Clock::time_point start = Clock::now();
+  HashResult result = hashDisk(path, options, [](const HashProgress& progress) {
+    return true;
+  });
+  us = elapsedUs(start);
+  if(!result.complete) {
+    throw std::runtime_error("Incomplete hashing of " + path);
+  }
+  return result;
+}
+
+static void benchHash(const std::string& dir, uint64_t diskMB, unsigned int iterations) {
+  const std::string million(1000000, 'a');
+  const std::vector<std::pair<std::string, std::vector<std::string>>> vectors = {
+    {"md5", {"d41d8cd98f00b204e9800998ecf8427e", "900150983cd24fb0d6963f7d28e17f72", "7707d6ae4e027c70eea2a935c2296f21"}},
+    {"sha1", {"da39a3ee5e6b4b0d3255bfef95601890afd80709", "a9993e364706816aba3e25717850c26c9cd0d89d", "34aa973cd4c4daa4f61eeb2bdbad27316534016f"}},
+  };
+  for(const auto& v : vectors) {
+    if(digestOf(v.first, "", 0) != v.second[0] || digestOf(v.first, "abc", 3) != v.second[1] || digestOf(v.first, million.data(), million.size()) != v.second[2]) {
+      throw std::runtime_error("Wrong " + v.first);
+    }
+    std::unique_ptr<Hasher> pieces = makeHasher(v.first);
+    for(size_t offset = 0, len = 1; offset < million.size(); offset += len, len = len * 3 + 1) {
+      pieces->update(million.data() + offset, std::min(len, million.size() - offset));
+    }
+    if(pieces->finish() != v.second[2]) {
+      throw std::runtime_error("Wrong " + v.first + " when fed in pieces");
+    }
+  }
+
+  std::vector<uint8_t> buffer = makeDiskContents(8 << 20);
+  unsigned int runs = std::max(1U, iterations / 100);
+  for(const char* algorithm : {"md5", "sha1"}) {
+    Clock::time_point start = Clock::now();
+    for(unsigned int i = 0; i < runs; ++i) {
+      digestOf(algorithm, buffer.data(), buffer.size());
+    }
+    std::cout << algorithm << " " << (std::string(algorithm) == "sha1" ? sha1Implementation() : "scalar") << ": "
+              << buffer.size() * runs / elapsedUs(start) << " MB/s" << std::endl;
+  }
+
+  // Not a multiple of anything, so the last buffer and segment are short
+  const std::vector<uint8_t> disk = makeDiskContents((diskMB << 20) + 12345);
+  const std::string path = dir + "/hash.img";
+  {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  const std::vector<std::string> algorithms = {"md5", "sha1", "sha256"};
+  std::map<std::string, std::string> expected;
+  for(const auto& algorithm : algorithms) {
+    expected[algorithm] = digestOf(algorithm, disk.data(), disk.size());
+  }
+
+  // Every algorithm from one read, against one read each
+  double together;
+  HashResult result = hashWith(path, algorithms, 0, together);
+  if(result.digests != expected || result.bytes != disk.size() || result.segments.size()) {
+    throw std::runtime_error("Wrong digests from hashDisk");
+  }
+  double separately = 0;
+  for(const auto& algorithm : algorithms) {
+    double us;
+    HashResult single = hashWith(path, {algorithm}, 0, us);
+    if(single.digests.size() != 1 || single.digests[algorithm] != expected[algorithm]) {
+      throw std::runtime_error("Wrong " + algorithm + " from hashDisk");
+    }
+    std::cout << "hash disk " << algorithm << " alone: " << disk.size() / us << " MB/s" << std::endl;
+    separately += us;
+  }
+  std::cout << "hash disk md5+sha1+sha256 in one pass: " << disk.size() / together << " MB/s, "
+            << disk.size() / separately << " MB/s one after the other, on " << std::thread::hardware_concurrency() << " cores" << std::endl;
+
+  // Segments that don't line up with the buffers
+  const uint64_t segmentSize = 3 * 1000 * 1000;
+  double us;
+  result = hashWith(path, algorithms, segmentSize, us);
+  if(result.digests != expected || result.segments.size() != (disk.size() + segmentSize - 1) / segmentSize) {
+    throw std::runtime_error("Wrong segments from hashDisk");
+  }
+  for(const auto& segment : result.segments) {
+    for(const auto& algorithm : algorithms) {
+      if(segment.offset + segment.length > disk.size() || segment.digests.at(algorithm) != digestOf(algorithm, disk.data() + segment.offset, segment.length)) {
+        throw std::runtime_error("Wrong " + algorithm + " of the segment at " + std::to_string(segment.offset));
+      }
+    }
+  }
+  std::cout << "hash disk with " << result.segments.size() << " segments: " << disk.size() / us << " MB/s" << std::endl;
+
+  // Containers are hashed as the disk inside, unless asked otherwise
+  const std::string container = dir + "/hash.dac";
+  writeContainer(container, disk, CONTAINER_COMPRESSION_ZLIB, 4, expected["sha256"]);
+  result = hashWith(container, algorithms, 0, us);
+  if(result.digests != expected) {
+    throw std::runtime_error("Wrong digests of a container");
+  }
+  std::cout << "hash disk container: " << disk.size() / us << " MB/s" << std::endl;
+  HashOptions options;
+  options.algorithms = {"sha256"};
+  options.imageFiles = true;
+  const std::vector<uint8_t> file = readFile(container);
+  result = hashDisk(container, options, [](const HashProgress& progress) {
+    return true;
+  });
+  if(result.digests["sha256"] != sha256Of(file.data(), file.size())) {
+    throw std::runtime_error("Wrong digest of a container file");
+  }
+
+  bool threw = false;
+  try {
+    options.algorithms = {"crc64"};
+    hashDisk(path, options, [](const HashProgress& progress) {
+      return true;
+    });
+  } catch(const std::runtime_error& e) {
+    threw = true;
+  }
+  if(!threw) {
+    throw std::runtime_error("hashDisk took an unknown algorithm");
+  }
+}
+
+static void benchAcquire(const std::string& dir, uint64_t diskMB) {
+  // Not a multiple of the buffer size, so the last read is a short one
+  const std::vector<uint8_t> disk = makeDiskContents((diskMB << 20) + 12345);
+  const std::string source = dir + "/acquire-source.img";
+  {
+    std::ofstream file(source, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  const std::string expected = sha256Of(disk.data(), disk.size());
+
+  const std::string destination = dir + "/acquire.img";
+  AcquireOptions dense;
+  dense.sparse = false;
+  uint64_t lastWritten = 0;
+  Clock::time_point start = Clock::now();
+  AcquireResult result = acquireDisk(source, destination, dense, [&lastWritten](const AcquireProgress& progress) {
+    if(progress.bytesWritten < lastWritten || progress.bytesWritten > progress.bytesRead) {
+      throw std::runtime_error("Acquisition progress going backwards");
+    }
+    lastWritten = progress.bytesWritten;
+    return true;
+  });
+  double pipelined = elapsedUs(start);
+  if(!result.complete || result.bytes != disk.size() || result.sha256 != expected || lastWritten != disk.size() || result.sparseBytes) {
+    throw std::runtime_error("Wrong acquisition result");
+  }
+  if(readFile(destination) != disk) {
+    throw std::runtime_error("Acquired image differs from the disk");
+  }
+  bool refused = false;
+  try {
+    acquireDisk(source, destination, AcquireOptions(), [](const AcquireProgress& progress) {
+      return true;
+    });
+  } catch(const std::runtime_error& e) {
+    refused = true;
+  }
+  if(!refused) {
+    throw std::runtime_error("Acquisition overwrote an existing image");
+  }
+
+  // Every fourth MB of the fixture is zeroes, plus a few more at the end so
+  // the image has to end in a hole
+  std::vector<uint8_t> sparseDisk = disk;
+  sparseDisk.resize(disk.size() + (3 << 20), 0);
+  const std::string sparseSource = dir + "/acquire-sparse-source.img";
+  {
+    std::ofstream file(sparseSource, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(sparseDisk.data()), sparseDisk.size());
+  }
+  const std::string sparsePath = dir + "/acquire-sparse.img";
+  start = Clock::now();
+  result = acquireDisk(sparseSource, sparsePath, AcquireOptions(), [](const AcquireProgress& progress) {
+    return true;
+  });
+  double sparseTime = elapsedUs(start);
+  if(!result.complete || result.sha256 != sha256Of(sparseDisk.data(), sparseDisk.size()) || readFile(sparsePath) != sparseDisk) {
+    throw std::runtime_error("Sparse image differs from the disk");
+  }
+  struct stat st;
+  if(stat(sparsePath.c_str(), &st) != 0) {
+    throw std::runtime_error("Unable to stat " + sparsePath);
+  }
+  const uint64_t allocated = st.st_blocks * 512;
+  uint64_t zeroBytes = 0;
+  for(size_t offset = 0; offset < sparseDisk.size(); offset += ACQUIRE_SPARSE_BLOCK_SIZE) {
+    size_t len = std::min<size_t>(ACQUIRE_SPARSE_BLOCK_SIZE, sparseDisk.size() - offset);
+    zeroBytes += blockIsFilled(sparseDisk.data() + offset, len, 0) ? len : 0;
+  }
+  // Filesystems with bigger blocks get fewer, bigger holes
+  if(result.sparseBytes > zeroBytes || (st.st_blksize == ACQUIRE_SPARSE_BLOCK_SIZE && result.sparseBytes != zeroBytes)) {
+    throw std::runtime_error("Wrong amount of zeroes left as holes in a sparse image");
+  }
+  std::cout << "acquire sparse: " << sparseDisk.size() / sparseTime << " MB/s, " << (sparseDisk.size() >> 20) << " MB disk in "
+            << (allocated >> 20) << " MB, " << (result.sparseBytes >> 20) << " MB left as holes" << std::endl;
+
+  // The same work one step at a time, like dd piped into a hash would
+  const std::string sequentialPath = dir + "/acquire-sequential.img";
+  start = Clock::now();
+  {
+    int in = open(source.c_str(), O_RDONLY);
+    int out = open(sequentialPath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    std::vector<uint8_t> buffer(ACQUIRE_BUFFER_SIZE);
+    SHA256 hash;
+    ssize_t bytesRead;
+    while((bytesRead = read(in, buffer.data(), buffer.size())) > 0) {
+      hash.update(buffer.data(), bytesRead);
+      if(write(out, buffer.data(), bytesRead) != bytesRead) {
+        throw std::runtime_error("Unable to write " + sequentialPath);
+      }
+    }
+    fsync(out);
+    close(in);
+    close(out);
+    if(hash.finish() != expected) {
+      throw std::runtime_error("Wrong sequential hash");
+    }
+  }
+  double sequential = elapsedUs(start);
+  std::cout << "acquire pipelined: " << disk.size() / pipelined << " MB/s, sequential: " << disk.size() / sequential << " MB/s" << std::endl;
+}
+
+static void benchContainerCompression(const std::string& dir, const std::vector<uint8_t>& disk, ContainerCompression compression) {
+  const std::string name = containerCompressionName(compression);
+  const std::string path = dir + "/container-" + name + ".dac";
+  const std::string sha256 = sha256Of(disk.data(), disk.size());
+  for(unsigned int threads : {1, 2, 4}) {
+    Clock::time_point start = Clock::now();
+    writeContainer(path, disk, compression, threads, sha256);
+    std::cout << "container " << name << " write, " << threads << " threads: " << disk.size() / elapsedUs(start) << " MB/s" << std::endl;
+  }
+
+  ContainerReader reader(path);
+  if(reader.size() != disk.size() || reader.sha256() != sha256 || reader.compression() != compression ||
+     reader.chunkCount() != (disk.size() + CONTAINER_DEFAULT_CHUNK_SIZE - 1) / CONTAINER_DEFAULT_CHUNK_SIZE) {
+    throw std::runtime_error("Wrong " + name + " container trailer");
+  }
+  std::vector<uint8_t> contents(disk.size());
+  Clock::time_point start = Clock::now();
+  if(!readExact(reader, 0, contents.data(), contents.size()) || contents != disk) {
+    throw std::runtime_error("Wrong contents read from a " + name + " container");
+  }
+  struct stat st;
+  stat(path.c_str(), &st);
+  std::cout << "container " << name << " read: " << disk.size() / elapsedUs(start) << " MB/s, "
+            << 100 * st.st_size / disk.size() << "% of the disk" << std::endl;
+
+  // Random reads spanning chunk boundaries, through the cache
+  std::mt19937_64 random(42);
+  start = Clock::now();
+  for(int i = 0; i < 1000; ++i) {
+    const uint64_t offset = random() % disk.size();
+    const size_t len = std::min<uint64_t>(random() % (CONTAINER_DEFAULT_CHUNK_SIZE * 2), disk.size() - offset);
+    std::vector<uint8_t> buffer(len);
+    if(reader.read(offset, buffer.data(), len) != len || !std::equal(buffer.begin(), buffer.end(), disk.begin() + offset)) {
+      throw std::runtime_error("Wrong random read from a " + name + " container");
+    }
+  }
+  std::cout << "container " << name << " random reads: " << elapsedUs(start) / 1000 << " us, " << reader.cacheHits() << " cache hits" << std::endl;
+}
+
+static void benchContainer(const std::string& dir, uint64_t diskMB) {
+  // Not a multiple of the chunk size, so the last one is short
+  const std::vector<uint8_t> disk = makeDiskContents((diskMB << 20) + 12345);
+  benchContainerCompression(dir, disk, CONTAINER_COMPRESSION_NONE);
+  benchContainerCompression(dir, disk, CONTAINER_COMPRESSION_ZLIB);
+#ifdef DISKIMAGE_HAVE_ZSTD
+  benchContainerCompression(dir, disk, CONTAINER_COMPRESSION_ZSTD);
+#endif
+
+  // Flip a byte in the first chunk's data, right after the header
+  const std::string path = dir + "/container-zlib.dac";
+  std::vector<uint8_t> file = readFile(path);
+  file[CONTAINER_HEADER_SIZE + 10] ^= 0xFF;
+  const std::string corruptPath = dir + "/container-corrupt.dac";
+  {
+    std::ofstream out(corruptPath, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(file.data()), file.size());
+  }
+  ContainerReader corrupt(corruptPath);
+  bool caught = false;
+  try {
+    corrupt.readChunk(0);
+  } catch(const std::runtime_error& e) {
+    caught = true;
+  }
+  if(!caught) {
+    throw std::runtime_error("Corrupt container chunk not noticed");
+  }
+
+  // A container whose acquisition never finished has no trailer
+  const std::string truncatedPath = dir + "/container-truncated.dac";
+  {
+    std::ofstream out(truncatedPath, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(file.data()), file.size() / 2);
+  }
+  ImageInfo info = sniffImage(truncatedPath);
+  if(info.format != IMAGE_FORMAT_CONTAINER || info.sizeKnown) {
+    throw std::runtime_error("Unfinished container sniffed wrong");
+  }
+
+  // Straight from an acquisition, and back through openImageReader
+  const std::string source = dir + "/container-source.img";
+  {
+    std::ofstream out(source, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  AcquireOptions options;
+  options.container = true;
+  const std::string acquired = dir + "/container-acquired.dac";
+  AcquireResult result = acquireDisk(source, acquired, options, [](const AcquireProgress& progress) {
+    return true;
+  });
+  std::unique_ptr<ImageReader> reader = openImageReader(acquired);
+  std::vector<uint8_t> contents(disk.size());
+  if(!result.complete || result.storedBytes >= disk.size() || !readExact(*reader, 0, contents.data(), contents.size()) || contents != disk ||
+     static_cast<ContainerReader*>(reader.get())->sha256() != result.sha256) {
+    throw std::runtime_error("Wrong container acquisition");
+  }
+}
+
+// Fails every read once it's been read from `limit` times, like a daemon
+// getting killed halfway through a rescue
+class InterruptedRescueSource : public RescueSource {
+  public:
+    InterruptedRescueSource(RescueSource& parent, uint64_t limit) : parent(parent), limit(limit) {}
+    uint64_t size() const override {
+      return this->parent.size();
+    }
+    uint32_t sectorSize() const override {
+      return this->parent.sectorSize();
+    }
+    bool read(void* buffer, size_t len, uint64_t offset) override {
+      if(!this->limit--) {
+        throw std::runtime_error("Interrupted");
+      }
+      return this->parent.read(buffer, len, offset);
+    }
+
+  private:
+    RescueSource& parent;
+    uint64_t limit;
+};
+
+static void addRescueFaults(FaultyRescueSource& source) {
+  // A cluster not aligned to anything, a lone sector, a weak one that reads
+  // on the retry pass and the very end of the disk
+  source.addBadRange((10 << 20) + 3 * 4096, 256 * 1024);
+  source.addBadRange((20 << 20) + 3 * 512, 512);
+  source.addBadRange(30 << 20, 1024, 4);
+  source.addBadRange(source.size() - 1024, 1024);
+}
+
+static void benchRescue(const std::string& dir, uint64_t diskMB) {
+  const uint64_t size = diskMB << 20;
+  const std::vector<uint8_t> disk = makeDiskContents(size);
+  const std::string source = dir + "/rescue-source.img";
+  {
+    std::ofstream out(source, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  std::vector<uint8_t> expected = disk;
+  RescueMap expectedMap(size);
+  expectedMap.set(0, size, RESCUE_GOOD);
+  for(const auto& bad : std::vector<std::pair<uint64_t, uint64_t>>{{(10 << 20) + 3 * 4096, 256 * 1024}, {(20 << 20) + 3 * 512, 512}, {size - 1024, 1024}}) {
+    std::fill(expected.begin() + bad.first, expected.begin() + bad.first + bad.second, 0);
+    expectedMap.set(bad.first, bad.second, RESCUE_BAD);
+  }
+  auto noProgress = [](const AcquireProgress& progress) {
+    return true;
+  };
+
+  // In one go, with failed reads taking a millisecond each
+  DeviceRescueSource device(source);
+  FaultyRescueSource faulty(device, 1000);
+  addRescueFaults(faulty);
+  AcquireOptions options;
+  options.rescueMap = dir + "/rescue.map";
+  Clock::time_point start = Clock::now();
+  AcquireResult result = rescueDisk(faulty, dir + "/rescue.img", options, noProgress);
+  std::cout << "rescue: " << elapsedUs(start) / 1000 << " ms, " << faulty.reads << " reads, " << faulty.failedReads << " failed" << std::endl;
+  if(!result.complete || result.badBytes != 256 * 1024 + 512 + 1024 || result.bytes != size - result.badBytes ||
+     result.readErrors != faulty.failedReads || readFile(dir + "/rescue.img") != expected || result.sha256 != sha256Of(expected.data(), expected.size())) {
+    throw std::runtime_error("Wrong rescue");
+  }
+  RescueMap map(size);
+  map.load(options.rescueMap);
+  if(!map.finished || map.regions().size() != expectedMap.regions().size() ||
+     !std::equal(map.regions().begin(), map.regions().end(), expectedMap.regions().begin(), [](const std::pair<const uint64_t, RescueRegion>& a, const std::pair<const uint64_t, RescueRegion>& b) {
+       return a.first == b.first && a.second.length == b.second.length && a.second.status == b.second.status;
+     })) {
+    throw std::runtime_error("Wrong rescue map");
+  }
+
+  // Killed halfway through a few times, every resume picking up where the
+  // last one stopped without reading anything twice. The first pass starts
+  // skipping small again, so it may fail a read more after each
+  FaultyRescueSource resumed(device, 1000);
+  addRescueFaults(resumed);
+  options.rescueMap = dir + "/rescue-resumed.map";
+  unsigned int interruptions = 0;
+  for(uint64_t limit = 40; ; limit += 150, ++interruptions) {
+    InterruptedRescueSource interrupted(resumed, limit);
+    try {
+      result = rescueDisk(interrupted, dir + "/rescue-resumed.img", options, noProgress);
+      break;
+    } catch(const std::runtime_error& e) {
+      if(std::string(e.what()) != "Interrupted") {
+        throw;
+      }
+    }
+  }
+  if(!result.complete || resumed.reads > faulty.reads + interruptions || resumed.bytesRead != faulty.bytesRead ||
+     readFile(dir + "/rescue-resumed.img") != expected || result.sha256 != sha256Of(expected.data(), expected.size())) {
+    throw std::runtime_error("Wrong resumed rescue");
+  }
+
+  // Without the map an existing image is never touched
+  bool caught = false;
+  try {
+    options.rescueMap = dir + "/rescue-missing.map";
+    rescueDisk(faulty, dir + "/rescue.img", options, noProgress);
+  } catch(const std::runtime_error& e) {
+    caught = true;
+  }
+  if(!caught) {
+    throw std::runtime_error("Rescue overwrote an image without a map");
+  }
+}
+
+// Keeps `reader` full with reads of `len` at `offsets`, checking each one
+// against the disk. Returns how long it took
+static double runBlockReader(BlockReader& reader, uint8_t* buffers, size_t len, const std::vector<uint64_t>& offsets, const std::vector<uint8_t>& disk) {
+  std::vector<unsigned int> freeSlots;
+  for(unsigned int slot = 0; slot < reader.depth(); ++slot) {
+    freeSlots.push_back(slot);
+  }
+  std::vector<BlockCompletion> completions;
+  size_t next = 0;
+  Clock::time_point start = Clock::now();
+  while(next < offsets.size() || reader.inFlight()) {
+    while(next < offsets.size() && freeSlots.size()) {
+      const unsigned int slot = freeSlots.back();
+      freeSlots.pop_back();
+      reader.submit(buffers + slot * len, len, offsets[next], next * reader.depth() + slot);
+      ++next;
+    }
+    completions.clear();
+    reader.wait(completions);
+    for(const auto& completion : completions) {
+      const unsigned int slot = completion.tag % reader.depth();
+      const uint64_t offset = offsets[completion.tag / reader.depth()];
+      const size_t expected = std::min<uint64_t>(len, disk.size() - offset);
+      if(completion.result != static_cast<ssize_t>(expected) || memcmp(buffers + slot * len, disk.data() + offset, expected)) {
+        throw std::runtime_error(std::string("Wrong read from the ") + reader.name() + " block reader");
+      }
+      freeSlots.push_back(slot);
+    }
+  }
+  return elapsedUs(start);
+}
+
+static void benchBlockReader(const std::string& dir, uint64_t diskMB) {
+  // The end isn't aligned, so the last read comes back short
+  const std::vector<uint8_t> disk = makeDiskContents((diskMB << 20) + 512);
+  const std::string path = dir + "/block-reader.img";
+  {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  std::vector<BlockReaderBackend> backends = {BLOCK_READER_PREAD};
+  if(ioUringAvailable()) {
+    backends.push_back(BLOCK_READER_IO_URING);
+  } else {
+    std::cout << "block reader: no io_uring on this system" << std::endl;
+  }
+
+  std::mt19937_64 random(42);
+  std::vector<uint64_t> randomOffsets(20000);
+  for(auto& offset : randomOffsets) {
+    offset = random() % (disk.size() / 4096) * 4096;
+  }
+  std::vector<uint64_t> sequentialOffsets;
+  for(uint64_t offset = 0; offset < disk.size(); offset += 1 << 20) {
+    sequentialOffsets.push_back(offset);
+  }
+
+  // Through the page cache is all system call overhead, O_DIRECT is down to
+  // how well the device gets kept busy
+  for(bool direct : {false, true}) {
+    int flags = O_RDONLY;
+#ifdef O_DIRECT
+    flags |= direct ? O_DIRECT : 0;
+#endif
+    int fd = open(path.c_str(), flags);
+    if(fd == -1) {
+      std::cout << "block reader: no O_DIRECT here" << std::endl;
+      continue;
+    }
+    ScopeGuard fdGuard([fd]() {
+      close(fd);
+    });
+    const std::string mode = direct ? "direct" : "cached";
+    for(unsigned int depth : {1, 8, 32, 128}) {
+      for(BlockReaderBackend backend : backends) {
+        std::shared_ptr<uint8_t> buffers = allocateAligned(depth << 20);
+        std::unique_ptr<BlockReader> reader = openBlockReader(fd, backend, depth, {{buffers.get(), depth << 20}});
+        double randomTime = runBlockReader(*reader, buffers.get(), 4096, randomOffsets, disk);
+        double sequentialTime = runBlockReader(*reader, buffers.get(), 1 << 20, sequentialOffsets, disk);
+        std::cout << "block reader " << reader->name() << " " << mode << ", depth " << depth << ": "
+                  << static_cast<uint64_t>(randomOffsets.size() / randomTime * 1000000) << " random 4K IOPS, "
+                  << disk.size() / sequentialTime << " MB/s sequential" << std::endl;
+      }
+    }
+  }
+
+  // And what it means for acquisitions
+  for(BlockReaderBackend backend : backends) {
+    AcquireOptions options;
+    options.ioBackend = backend;
+    const std::string destination = dir + "/block-reader-acquired-" + std::to_string(backend) + ".img";
+    Clock::time_point start = Clock::now();
+    AcquireResult result = acquireDisk(path, destination, options, [](const AcquireProgress& progress) {
+      return true;
+    });
+    double us = elapsedUs(start);
+    if(!result.complete || result.sha256 != sha256Of(disk.data(), disk.size()) || readFile(destination) != disk) {
+      throw std::runtime_error("Wrong acquisition through a block reader");
+    }
+    std::cout << "acquire " << (backend == BLOCK_READER_PREAD ? "pread" : "io_uring") << ": " << disk.size() / us << " MB/s" << std::endl;
+  }
+}
+
+// Keeps acquiring 1MB for `job` until `stop`, like a reader going as fast as
+// it's let
+static void acquireUntil(IOScheduler::Job& job, const std::atomic<bool>& stop) {
+  while(!stop) {
+    job.acquire(1 << 20);
+  }
+}
+
+static double megabytesPerSecond(uint64_t bytes, double us) {
+  return bytes / us * 1000000 / (1 << 20);
+}
+
+static void benchIOScheduler(const std::string& dir, uint64_t diskMB) {
+  const uint64_t limit = 64 << 20;
+  const double burst = limit * IO_SCHEDULER_BURST_MS / 1000.0;
+
+  // A device limit on its own, the first burst goes by for free
+  {
+    IOScheduler scheduler;
+    scheduler.setDeviceLimit("a", limit);
+    std::unique_ptr<IOScheduler::Job> job = scheduler.join("a", "", IO_CLASS_BULK);
+    Clock::time_point start = Clock::now();
+    while(job->bytes() < 2 * limit) {
+      job->acquire(1 << 20);
+    }
+    double rate = megabytesPerSecond(job->bytes() - burst, elapsedUs(start));
+    std::cout << "io scheduler device limit of " << (limit >> 20) << " MB/s: " << rate << " MB/s" << std::endl;
+    if(rate < 0.9 * (limit >> 20) || rate > 1.1 * (limit >> 20)) {
+      throw std::runtime_error("Wrong rate from the I/O scheduler");
+    }
+  }
+
+  // Two jobs on a limited device, one weighing twice as much
+  {
+    IOScheduler scheduler;
+    scheduler.setDeviceLimit("a", limit);
+    std::unique_ptr<IOScheduler::Job> heavy = scheduler.join("a", "", IO_CLASS_BULK, 2 * IO_DEFAULT_WEIGHT);
+    std::unique_ptr<IOScheduler::Job> light = scheduler.join("a", "", IO_CLASS_BULK);
+    std::atomic<bool> stop(false);
+    std::thread heavyThread(acquireUntil, std::ref(*heavy), std::cref(stop));
+    std::thread lightThread(acquireUntil, std::ref(*light), std::cref(stop));
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop = true;
+    heavyThread.join();
+    lightThread.join();
+    double ratio = static_cast<double>(heavy->bytes()) / light->bytes();
+    std::cout << "io scheduler weights 2:1: " << (heavy->bytes() >> 20) << " MB and " << (light->bytes() >> 20) << " MB, " << ratio << ":1" << std::endl;
+    if(ratio < 1.6 || ratio > 2.4) {
+      throw std::runtime_error("Wrong shares from the I/O scheduler");
+    }
+  }
+
+  // Two devices on a limited bus share it, but not with a third one elsewhere
+  {
+    IOScheduler scheduler;
+    scheduler.setBusLimit("bus", limit);
+    std::unique_ptr<IOScheduler::Job> first = scheduler.join("a", "bus", IO_CLASS_BULK);
+    std::unique_ptr<IOScheduler::Job> second = scheduler.join("b", "bus", IO_CLASS_BULK);
+    std::unique_ptr<IOScheduler::Job> elsewhere = scheduler.join("c", "other", IO_CLASS_BULK);
+    std::atomic<bool> stop(false);
+    Clock::time_point start = Clock::now();
+    std::thread firstThread(acquireUntil, std::ref(*first), std::cref(stop));
+    std::thread secondThread(acquireUntil, std::ref(*second), std::cref(stop));
+    std::thread elsewhereThread([&]() {
+      while(!stop && elsewhere->bytes() < 4 * limit) {
+        elsewhere->acquire(1 << 20);
+      }
+    });
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop = true;
+    firstThread.join();
+    secondThread.join();
+    elsewhereThread.join();
+    double us = elapsedUs(start);
+    double rate = megabytesPerSecond(first->bytes() + second->bytes() - burst, us);
+    std::cout << "io scheduler bus limit of " << (limit >> 20) << " MB/s: " << rate << " MB/s between two devices ("
+              << (first->bytes() >> 20) << " MB and " << (second->bytes() >> 20) << " MB), "
+              << megabytesPerSecond(elsewhere->bytes(), us) << " MB/s on another bus" << std::endl;
+    if(rate < 0.9 * (limit >> 20) || rate > 1.1 * (limit >> 20) || elsewhere->bytes() < 2 * limit) {
+      throw std::runtime_error("Wrong bus limit from the I/O scheduler");
+    }
+  }
+
+  // Idle jobs get nothing while a bulk job is reading, and go once it stops
+  {
+    IOScheduler scheduler;
+    scheduler.setDeviceLimit("a", limit);
+    std::unique_ptr<IOScheduler::Job> bulk = scheduler.join("a", "", IO_CLASS_BULK);
+    std::unique_ptr<IOScheduler::Job> idle = scheduler.join("a", "", IO_CLASS_IDLE);
+    std::atomic<bool> stopBulk(false);
+    std::atomic<bool> stopIdle(false);
+    std::thread bulkThread(acquireUntil, std::ref(*bulk), std::cref(stopBulk));
+    std::thread idleThread(acquireUntil, std::ref(*idle), std::cref(stopIdle));
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    stopBulk = true;
+    bulkThread.join();
+    const uint64_t idleWhileBulk = idle->bytes();
+    Clock::time_point stopped = Clock::now();
+    while(!idle->bytes() && elapsedUs(stopped) < 2000000) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double waitedMs = elapsedUs(stopped) / 1000;
+    stopIdle = true;
+    idleThread.join();
+    std::cout << "io scheduler idle class: " << (idleWhileBulk >> 20) << " MB while bulk read " << (bulk->bytes() >> 20)
+              << " MB, started " << waitedMs << " ms after it stopped" << std::endl;
+    if(idleWhileBulk || waitedMs >= 2000) {
+      throw std::runtime_error("Wrong idle class from the I/O scheduler");
+    }
+  }
+
+  // An interactive job doesn't wait behind a bulk one, which holds off while
+  // it's there
+  {
+    IOScheduler scheduler;
+    scheduler.setDeviceLimit("a", limit);
+    std::unique_ptr<IOScheduler::Job> bulk = scheduler.join("a", "", IO_CLASS_BULK);
+    std::atomic<bool> stop(false);
+    std::thread bulkThread(acquireUntil, std::ref(*bulk), std::cref(stop));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    uint64_t bulkBefore;
+    uint64_t bulkDuring;
+    double interactiveUs;
+    {
+      std::unique_ptr<IOScheduler::Job> interactive = scheduler.join("a", "", IO_CLASS_INTERACTIVE);
+      // Whatever bulk had already been let through still goes
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      bulkBefore = bulk->bytes();
+      Clock::time_point start = Clock::now();
+      for(unsigned int i = 0; i < 16; ++i) {
+        interactive->acquire(64 * 1024);
+      }
+      interactiveUs = elapsedUs(start);
+      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+      bulkDuring = bulk->bytes() - bulkBefore;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    stop = true;
+    bulkThread.join();
+    std::cout << "io scheduler interactive class: 16 reads in " << interactiveUs << " us, bulk read " << (bulkDuring >> 20)
+              << " MB meanwhile and " << ((bulk->bytes() - bulkBefore - bulkDuring) >> 20) << " MB in the 200 ms after" << std::endl;
+    if(interactiveUs > 10000 || bulkDuring || bulk->bytes() == bulkBefore + bulkDuring) {
+      throw std::runtime_error("Wrong interactive class from the I/O scheduler");
+    }
+  }
+
+  // And an acquisition going through the shared one
+  const std::vector<uint8_t> disk = makeDiskContents(diskMB << 20);
+  const std::string path = dir + "/io-scheduler.img";
+  {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  std::shared_ptr<IOScheduler> scheduler = std::make_shared<IOScheduler>();
+  const uint64_t acquireLimit = std::max<uint64_t>(diskMB / 2, 1) << 20;
+  scheduler->setDeviceLimit(ioDeviceKey(path), acquireLimit);
+  setSharedIOScheduler(scheduler);
+  ScopeGuard schedulerGuard([]() {
+    setSharedIOScheduler(nullptr);
+  });
+  Clock::time_point start = Clock::now();
+  AcquireResult result = acquireDisk(path, dir + "/io-scheduler-acquired.img", AcquireOptions(), [](const AcquireProgress& progress) {
+    return true;
+  });
+  double rate = megabytesPerSecond(disk.size() - acquireLimit * IO_SCHEDULER_BURST_MS / 1000.0, elapsedUs(start));
+  std::cout << "io scheduler acquisition limited to " << (acquireLimit >> 20) << " MB/s: " << rate << " MB/s" << std::endl;
+  // The last buffers go through on credit, and there are a few of them
+  if(!result.complete || result.sha256 != sha256Of(disk.data(), disk.size()) || rate > 1.25 * (acquireLimit >> 20)) {
+    throw std::runtime_error("Wrong acquisition through the I/O scheduler");
+  }
+}
+
+static void copyFile(const std::string& from, const std::string& to) {
+  std::ifstream in(from, std::ios::binary);
+  std::ofstream out(to, std::ios::binary | std::ios::trunc);
+  out << in.rdbuf();
+}
+
+static void benchCheckpoint(const std::string& dir, uint64_t diskMB) {
+  // Not a multiple of the buffer size, and with every fourth MB zeroes so the
+  // image is sparse
+  const std::vector<uint8_t> disk = makeDiskContents((diskMB << 20) + 12345);
+  const std::string source = dir + "/checkpoint-source.img";
+  {
+    std::ofstream file(source, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  const std::string expected = sha256Of(disk.data(), disk.size());
+  // Slow enough for the first progress report to come halfway through
+  std::shared_ptr<IOScheduler> scheduler = std::make_shared<IOScheduler>();
+  scheduler->setDeviceLimit(ioDeviceKey(source), std::max<uint64_t>(diskMB / 2, 1) << 20);
+  ScopeGuard schedulerGuard([]() {
+    setSharedIOScheduler(nullptr);
+  });
+  auto cancelled = [](const AcquireProgress& progress) {
+    return false;
+  };
+  auto interruptAcquisition = [&](const std::string& destination, const std::string& checkpoint) {
+    AcquireOptions options;
+    options.checkpoint = checkpoint;
+    setSharedIOScheduler(scheduler);
+    AcquireResult result = acquireDisk(source, destination, options, cancelled);
+    setSharedIOScheduler(nullptr);
+    Checkpoint saved;
+    if(result.complete || !loadCheckpoint(checkpoint, saved) || saved.offset != result.bytes || !saved.offset || saved.size != disk.size()) {
+      throw std::runtime_error("No checkpoint from an interrupted acquisition");
+    }
+    return saved;
+  };
+  auto resumeAcquisition = [&](const std::string& destination, const std::string& checkpoint) {
+    AcquireOptions options;
+    options.checkpoint = checkpoint;
+    return acquireDisk(source, destination, options, [](const AcquireProgress& progress) {
+      return true;
+    });
+  };
+
+  const std::string image = dir + "/checkpoint.img";
+  const std::string checkpoint = dir + "/checkpoint.txt";
+  Checkpoint saved = interruptAcquisition(image, checkpoint);
+  Clock::time_point start = Clock::now();
+  AcquireResult result = resumeAcquisition(image, checkpoint);
+  double us = elapsedUs(start);
+  if(!result.complete || result.resumedFrom != saved.offset || result.sha256 != expected || readFile(image) != disk || access(checkpoint.c_str(), F_OK) == 0) {
+    throw std::runtime_error("Wrong acquisition resumed from a checkpoint");
+  }
+  std::cout << "checkpoint acquisition interrupted at " << (saved.offset >> 20) << " MB, resumed in " << us / 1000 << " ms" << std::endl;
+
+  // A crash some time after the last checkpoint, with more of the image
+  // written past it
+  const std::string stale = dir + "/checkpoint-stale.txt";
+  const std::string staleImage = dir + "/checkpoint-stale.img";
+  {
+    AcquireOptions options;
+    options.checkpoint = checkpoint;
+    options.checkpointInterval = 1;
+    setSharedIOScheduler(scheduler);
+    result = acquireDisk(source, staleImage, options, [&](const AcquireProgress& progress) {
+      if(access(stale.c_str(), F_OK) != 0 && access(checkpoint.c_str(), F_OK) == 0) {
+        copyFile(checkpoint, stale);
+      }
+      return true;
+    });
+    setSharedIOScheduler(nullptr);
+  }
+  if(!result.complete || !loadCheckpoint(stale, saved) || saved.offset >= disk.size()) {
+    throw std::runtime_error("No checkpoint kept during an acquisition");
+  }
+  result = resumeAcquisition(staleImage, stale);
+  if(!result.complete || result.resumedFrom != saved.offset || result.sha256 != expected || readFile(staleImage) != disk) {
+    throw std::runtime_error("Wrong acquisition resumed from a stale checkpoint");
+  }
+
+  // Neither another disk nor an image that lost data get resumed
+  const std::string refusedImage = dir + "/checkpoint-refused.img";
+  saved = interruptAcquisition(refusedImage, checkpoint);
+  auto refused = [&]() {
+    try {
+      resumeAcquisition(refusedImage, checkpoint);
+    } catch(const std::runtime_error& e) {
+      return true;
+    }
+    return false;
+  };
+  {
+    std::fstream file(source, std::ios::binary | std::ios::in | std::ios::out);
+    file.put(disk[0] ^ 1);
+  }
+  if(!refused()) {
+    throw std::runtime_error("Acquisition resumed on another disk");
+  }
+  {
+    std::fstream file(source, std::ios::binary | std::ios::in | std::ios::out);
+    file.put(disk[0]);
+  }
+  if(truncate(refusedImage.c_str(), saved.outputSize - 1) != 0 || !saved.outputSize) {
+    throw std::runtime_error("Unable to truncate " + refusedImage);
+  }
+  if(!refused()) {
+    throw std::runtime_error("Acquisition resumed on a truncated image");
+  }
+  unlink(checkpoint.c_str());
+
+  // Hashing, segments and all
+  const std::vector<std::string> algorithms = {"md5", "sha1", "sha256"};
+  const uint64_t segmentSize = 3 * 1000 * 1000;
+  HashOptions options;
+  options.algorithms = algorithms;
+  options.segmentSize = segmentSize;
+  options.checkpoint = checkpoint;
+  setSharedIOScheduler(scheduler);
+  HashResult hashed = hashDisk(source, options, [](const HashProgress& progress) {
+    return false;
+  });
+  setSharedIOScheduler(nullptr);
+  if(hashed.complete || !loadCheckpoint(checkpoint, saved) || saved.offset != hashed.bytes || !saved.offset) {
+    throw std::runtime_error("No checkpoint from interrupted hashing");
+  }
+  HashOptions otherSegments = options;
+  otherSegments.segmentSize = segmentSize / 2;
+  bool mismatched = false;
+  try {
+    hashDisk(source, otherSegments, [](const HashProgress& progress) {
+      return true;
+    });
+  } catch(const std::runtime_error& e) {
+    mismatched = true;
+  }
+  if(!mismatched) {
+    throw std::runtime_error("Hashing resumed with other segments");
+  }
+  hashed = hashDisk(source, options, [](const HashProgress& progress) {
+    return true;
+  });
+  if(!hashed.complete || hashed.resumedFrom != saved.offset || hashed.segments.size() != (disk.size() + segmentSize - 1) / segmentSize || access(checkpoint.c_str(), F_OK) == 0) {
+    throw std::runtime_error("Wrong hashing resumed from a checkpoint");
+  }
+  for(const auto& algorithm : algorithms) {
+    if(hashed.digests.at(algorithm) != digestOf(algorithm, disk.data(), disk.size())) {
+      throw std::runtime_error("Wrong " + algorithm + " resumed from a checkpoint");
+    }
+    for(const auto& segment : hashed.segments) {
+      if(segment.digests.at(algorithm) != digestOf(algorithm, disk.data() + segment.offset, segment.length)) {
+        throw std::runtime_error("Wrong " + algorithm + " of the segment at " + std::to_string(segment.offset) + " resumed from a checkpoint");
+      }
+    }
+  }
+  std::cout << "checkpoint hashing interrupted at " << (saved.offset >> 20) << " MB, " << saved.segments.at("sha256/segments").size()
+            << " segments in, resumed with the same digests" << std::endl;
+}
+
+static DiffResult diffWith(const std::string& first, const std::string& second, std::vector<DiffExtent>& extents, double& us) {
+  extents.clear();
+  Clock::time_point start = Clock::now();
+  DiffResult result = diffDisks(first, second, DiffOptions(), [](const DiffProgress& progress) {
+    return true;
+  }, [&extents](const DiffExtent& extent) {
+    extents.push_back(extent);
+    return true;
+  });
+  us = elapsedUs(start);
+  if(!result.complete || result.extentCount != extents.size()) {
+    throw std::runtime_error("Incomplete comparison of " + first + " and " + second);
+  }
+  return result;
+}
+
+static void benchDiff(const std::string& dir, uint64_t diskMB, unsigned int iterations) {
+  // One different byte has to be noticed anywhere, with any length and
+  // alignment
+  std::vector<uint8_t> a = makeDiskContents(4096 + 64);
+  std::vector<uint8_t> b = a;
+  for(size_t start = 0; start < 64; start += 7) {
+    for(size_t len = 1; len < 1024; len += 13) {
+      if(!blocksEqual(a.data() + start, b.data() + start, len)) {
+        throw std::runtime_error("Equal blocks told apart");
+      }
+      for(size_t odd = 0; odd < len; odd += std::max<size_t>(1, len / 5)) {
+        b[start + odd] ^= 0x80;
+        if(blocksEqual(a.data() + start, b.data() + start, len)) {
+          throw std::runtime_error("Different byte missed at " + std::to_string(odd) + " of " + std::to_string(len));
+        }
+        b[start + odd] ^= 0x80;
+      }
+    }
+  }
+  const std::vector<uint8_t> kernelData = makeDiskContents(8 << 20);
+  const std::vector<uint8_t> kernelCopy = kernelData;
+  unsigned int runs = std::max(1U, iterations / 20);
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < runs; ++i) {
+    for(size_t offset = 0; offset < kernelData.size(); offset += DIFF_DEFAULT_BLOCK_SIZE) {
+      if(!blocksEqual(kernelData.data() + offset, kernelCopy.data() + offset, DIFF_DEFAULT_BLOCK_SIZE)) {
+        throw std::runtime_error("Equal blocks told apart");
+      }
+    }
+  }
+  std::cout << "block compare: " << kernelData.size() * runs / elapsedUs(start) << " MB/s" << std::endl;
+
+  // A byte here and there, two blocks either side of a buffer boundary that
+  // have to come out as one extent, and a second disk that's a bit longer
+  const uint64_t MB = 1 << 20;
+  const std::vector<uint8_t> disk = makeDiskContents(std::max<uint64_t>(diskMB, 32) * MB + 12345);
+  std::vector<uint8_t> changed = disk;
+  changed.resize(disk.size() + 5000, 0x5A);
+  for(uint64_t offset : std::vector<uint64_t>{5000, ACQUIRE_BUFFER_SIZE - 1, ACQUIRE_BUFFER_SIZE, 30 * MB + 100, disk.size() - 1}) {
+    changed[offset] ^= 0xFF;
+  }
+  const uint64_t lastBlock = disk.size() / DIFF_DEFAULT_BLOCK_SIZE * DIFF_DEFAULT_BLOCK_SIZE;
+  const std::vector<std::pair<uint64_t, uint64_t>> expected = {
+    {4096, 4096},
+    {ACQUIRE_BUFFER_SIZE - 4096, 8192},
+    {30 * MB, 4096},
+    {lastBlock, changed.size() - lastBlock},
+  };
+  const std::string first = dir + "/diff-first.img";
+  const std::string second = dir + "/diff-second.img";
+  const std::string copy = dir + "/diff-copy.img";
+  for(const auto& file : std::vector<std::pair<std::string, const std::vector<uint8_t>*>>{{first, &disk}, {second, &changed}, {copy, &disk}}) {
+    std::ofstream out(file.first, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(file.second->data()), file.second->size());
+  }
+
+  std::vector<DiffExtent> extents;
+  double us;
+  DiffResult result = diffWith(first, second, extents, us);
+  bool same = extents.size() == expected.size();
+  for(size_t i = 0; same && i < extents.size(); ++i) {
+    same = extents[i].offset == expected[i].first && extents[i].length == expected[i].second;
+  }
+  if(!same || result.bytesCompared != disk.size() || result.firstSize != disk.size() || result.secondSize != changed.size() ||
+     result.differentBytes != 4096 + 8192 + 4096 + changed.size() - lastBlock) {
+    for(const auto& extent : extents) {
+      std::cerr << extent.offset << "+" << extent.length << std::endl;
+    }
+    throw std::runtime_error("Wrong extents from diffDisks");
+  }
+  std::cout << "diff disks with " << result.extentCount << " extents: " << megabytesPerSecond(disk.size(), us) << " MB/s" << std::endl;
+
+  result = diffWith(first, copy, extents, us);
+  if(result.differentBytes || extents.size()) {
+    throw std::runtime_error("Differences found between copies");
+  }
+  std::cout << "diff identical disks: " << megabytesPerSecond(disk.size(), us) << " MB/s" << std::endl;
+
+  // An evidence container is compared as the disk inside it
+  const std::string container = dir + "/diff.dac";
+  writeContainer(container, disk, CONTAINER_COMPRESSION_ZLIB, 4, sha256Of(disk.data(), disk.size()));
+  result = diffWith(container, first, extents, us);
+  if(result.differentBytes || result.firstSize != disk.size()) {
+    throw std::runtime_error("Container not compared as the disk inside it");
+  }
+  std::cout << "diff container against raw: " << megabytesPerSecond(disk.size(), us) << " MB/s" << std::endl;
+
+  // Stopping at the first extent
+  result = diffDisks(first, second, DiffOptions(), [](const DiffProgress& progress) {
+    return true;
+  }, [](const DiffExtent& extent) {
+    return false;
+  });
+  if(result.complete || result.extentCount != 1) {
+    throw std::runtime_error("Comparison not stopped");
+  }
+}
+
+// The Merkle Tree Hash as RFC 6962 defines it, splitting at the biggest power
+// of two, for checking the bottom-up one in baseline.cpp
+static std::vector<uint8_t> rfc6962Root(const uint8_t* leaves, size_t count) {
+  std::vector<uint8_t> digest(SHA256_DIGEST_SIZE);
+  if(count == 1) {
+    digest.assign(leaves, leaves + SHA256_DIGEST_SIZE);
+    return digest;
+  }
+  size_t split = 1;
+  while(split * 2 < count) {
+    split *= 2;
+  }
+  const std::vector<uint8_t> left = rfc6962Root(leaves, split);
+  const std::vector<uint8_t> right = rfc6962Root(leaves + split * SHA256_DIGEST_SIZE, count - split);
+  const uint8_t prefix = 0x01;
+  SHA256 hash;
+  hash.update(&prefix, sizeof(prefix));
+  hash.update(left.data(), left.size());
+  hash.update(right.data(), right.size());
+  hash.finish(digest.data());
+  return digest;
+}
+
+static std::vector<uint64_t> changedLeaves(const BaselineVerification& verification) {
+  if(!verification.complete) {
+    throw std::runtime_error("Incomplete baseline verification");
+  }
+  std::vector<uint64_t> leaves;
+  for(const auto& leaf : verification.changed) {
+    leaves.push_back(leaf.index);
+  }
+  return leaves;
+}
+
+static void benchBaseline(const std::string& dir, uint64_t diskMB) {
+  auto keepGoing = [](const BaselineProgress& progress) {
+    return true;
+  };
+  for(size_t count = 1; count <= 33; ++count) {
+    Baseline baseline;
+    baseline.leafSize = 4096;
+    baseline.diskSize = count * 4096 - 1;
+    baseline.leaves = makeDiskContents(count * SHA256_DIGEST_SIZE);
+    const std::vector<uint8_t> expected = rfc6962Root(baseline.leaves.data(), count);
+    if(merkleRoot(baseline) != hexString(expected.data(), expected.size())) {
+      throw std::runtime_error("Wrong Merkle root for " + std::to_string(count) + " leaves");
+    }
+  }
+
+  // Leaves of 1 MB, and a last one that's only partly there
+  const uint64_t MB = 1 << 20;
+  const std::vector<uint8_t> disk = makeDiskContents(std::max<uint64_t>(diskMB, 32) * MB + 12345);
+  const std::string path = dir + "/baseline.img";
+  {
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(disk.data()), disk.size());
+  }
+  ThreadPool pool;
+  BaselineOptions options;
+  options.leafSize = MB;
+  Clock::time_point start = Clock::now();
+  BaselineResult built = buildBaseline(path, options, pool, keepGoing);
+  double us = elapsedUs(start);
+  const Baseline& baseline = built.baseline;
+  const uint64_t leafCount = disk.size() / MB + 1;
+  if(!built.complete || baseline.diskSize != disk.size() || baselineLeafCount(baseline) != leafCount || built.root != merkleRoot(baseline)) {
+    throw std::runtime_error("Incomplete baseline");
+  }
+  for(uint64_t index = 0; index < leafCount; ++index) {
+    const BaselineLeaf leaf = baselineLeaf(baseline, index);
+    const uint8_t prefix = 0x00;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    SHA256 hash;
+    hash.update(&prefix, sizeof(prefix));
+    hash.update(disk.data() + leaf.offset, leaf.length);
+    hash.finish(digest);
+    if(memcmp(digest, baseline.leaves.data() + index * SHA256_DIGEST_SIZE, sizeof(digest))) {
+      throw std::runtime_error("Wrong digest for leaf " + std::to_string(index));
+    }
+  }
+  std::cout << "baseline of " << leafCount << " leaves: " << megabytesPerSecond(disk.size(), us) << " MB/s" << std::endl;
+
+  // Saved and loaded as it was, and anything off in the file is noticed
+  const std::string saved = baselinePath(dir, "6A2F0C1E-0000-4000-8000-00000000BA5E");
+  Baseline loaded;
+  if(loadBaseline(saved, loaded)) {
+    throw std::runtime_error("Baseline loaded from nowhere");
+  }
+  saveBaseline(saved, baseline);
+  if(!loadBaseline(saved, loaded) || loaded.leaves != baseline.leaves || loaded.diskSize != baseline.diskSize ||
+     loaded.leafSize != baseline.leafSize || loaded.created != baseline.created) {
+    throw std::runtime_error("Baseline not loaded as saved");
+  }
+  const std::vector<uint8_t> file = readFile(saved);
+  const std::string broken = dir + "/broken.merkle";
+  for(size_t offset : std::vector<size_t>{0, 20, 40, file.size() - 1}) {
+    std::vector<uint8_t> corrupt = file;
+    corrupt[offset] ^= 0x01;
+    std::ofstream(broken, std::ios::binary).write(reinterpret_cast<const char*>(corrupt.data()), corrupt.size());
+    bool thrown = false;
+    try {
+      loadBaseline(broken, loaded);
+    } catch(const std::runtime_error& e) {
+      thrown = true;
+    }
+    if(!thrown) {
+      throw std::runtime_error("Corrupt baseline loaded, byte " + std::to_string(offset));
+    }
+  }
+  std::ofstream(broken, std::ios::binary).write(reinterpret_cast<const char*>(file.data()), file.size() - SHA256_DIGEST_SIZE);
+  bool thrown = false;
+  try {
+    loadBaseline(broken, loaded);
+  } catch(const std::runtime_error& e) {
+    thrown = true;
+  }
+  if(!thrown) {
+    throw std::runtime_error("Truncated baseline loaded");
+  }
+
+  // A byte changed here and there, two of them in the same leaf
+  std::vector<uint8_t> changed = disk;
+  for(uint64_t offset : std::vector<uint64_t>{100, 5 * MB, 5 * MB + 7, 20 * MB - 1, disk.size() - 1}) {
+    changed[offset] ^= 0xFF;
+  }
+  const std::vector<uint64_t> expected = {0, 5, 19, leafCount - 1};
+  const std::string changedPath = dir + "/baseline-changed.img";
+  {
+    std::ofstream out(changedPath, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(changed.data()), changed.size());
+  }
+  start = Clock::now();
+  BaselineVerification verification = verifyBaseline(changedPath, baseline, BaselineOptions(), pool, keepGoing);
+  us = elapsedUs(start);
+  if(changedLeaves(verification) != expected || verification.leavesChecked != leafCount || verification.bytesChecked != disk.size()) {
+    throw std::runtime_error("Wrong leaves from a full verification");
+  }
+  std::cout << "verify whole baseline: " << megabytesPerSecond(disk.size(), us) << " MB/s" << std::endl;
+  if(verifyBaseline(path, baseline, BaselineOptions(), pool, keepGoing).changed.size()) {
+    throw std::runtime_error("Unchanged disk failed verification");
+  }
+
+  // Only the leaves holding the extents are read
+  BaselineOptions extents;
+  extents.extents = {{5 * MB + 3, 10}, {8 * MB, 2 * MB + 1}, {disk.size() - 2, 100}};
+  verification = verifyBaseline(changedPath, baseline, extents, pool, keepGoing);
+  if(changedLeaves(verification) != std::vector<uint64_t>{5, leafCount - 1} || verification.leavesChecked != 5) {
+    throw std::runtime_error("Wrong leaves from verifying extents");
+  }
+
+  // Samples are distinct, sorted, the size asked for and spread over the disk
+  BaselineOptions sample;
+  sample.sample = 8;
+  std::vector<uint64_t> seen(leafCount);
+  for(uint64_t seed = 1; seed <= 200; ++seed) {
+    const std::vector<uint64_t> picked = baselineSelection(baseline, sample, seed);
+    if(picked.size() != sample.sample || std::adjacent_find(picked.begin(), picked.end(), std::greater_equal<uint64_t>()) != picked.end()) {
+      throw std::runtime_error("Bad sample of leaves");
+    }
+    for(uint64_t leaf : picked) {
+      seen[leaf]++;
+    }
+  }
+  if(std::count(seen.begin(), seen.end(), 0)) {
+    throw std::runtime_error("Sampling never picks some leaves");
+  }
+  start = Clock::now();
+  verification = verifyBaseline(changedPath, baseline, sample, pool, keepGoing);
+  us = elapsedUs(start);
+  for(uint64_t leaf : changedLeaves(verification)) {
+    if(std::find(expected.begin(), expected.end(), leaf) == expected.end()) {
+      throw std::runtime_error("Unchanged leaf " + std::to_string(leaf) + " reported changed");
+    }
+  }
+  if(verification.leavesChecked != sample.sample) {
+    throw std::runtime_error("Wrong sample size verified");
+  }
+  std::cout << "verify sample of " << sample.sample << " leaves: " << us / 1000 << " ms" << std::endl;
+
+  // Whatever a shrunk disk doesn't have anymore has changed
+  const std::string shrunk = dir + "/baseline-shrunk.img";
+  {
+    std::ofstream out(shrunk, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(disk.data()), 30 * MB + 10);
+  }
+  verification = verifyBaseline(shrunk, baseline, BaselineOptions(), pool, keepGoing);
+  std::vector<uint64_t> gone;
+  for(uint64_t leaf = 30; leaf < leafCount; ++leaf) {
+    gone.push_back(leaf);
+  }
+  if(changedLeaves(verification) != gone || verification.diskSize != 30 * MB + 10) {
+    throw std::runtime_error("Wrong leaves from a shrunk disk");
+  }
+}
+
+static void benchCRC32(unsigned int iterations) {
+  std::vector<uint8_t> buffer = makeDiskContents(8 << 20);
+  uint32_t expected = crc32(0, buffer.data(), buffer.size());
+  if(crc32Update(0, buffer.data(), buffer.size()) != expected) {
+    throw std::runtime_error(std::string("Wrong CRC32 from ") + crc32Implementation());
+  }
+  unsigned int runs = std::max(1U, iterations / 50);
+
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < runs; ++i) {
+    crc32Update(0, buffer.data(), buffer.size());
+  }
+  std::cout << "crc32 " << crc32Implementation() << ": " << buffer.size() * runs / elapsedUs(start) << " MB/s" << std::endl;
+
+  start = Clock::now();
+  for(unsigned int i = 0; i < runs; ++i) {
+    crc32(0, buffer.data(), buffer.size());
+  }
+  std::cout << "crc32 zlib: " << buffer.size() * runs / elapsedUs(start) << " MB/s" << std::endl;
+}
+
+static bool allChecksumsMatch(const std::vector<UDIFChecksumResult>& results) {
+  for(const auto& result : results) {
+    if(!result.checked || result.expected != result.actual) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void benchVerify(const std::string& dir, uint64_t diskMB) {
+  const std::vector<uint8_t> disk = makeDiskContents(diskMB << 20);
+  const std::string path = dir + "/verify.dmg";
+  writeCompressedUDIFFixture(path, disk, 2048, FIXTURE_ZLIB);
+
+  std::vector<unsigned int> threadCounts = {1, 2, 4};
+  if(std::thread::hardware_concurrency() > 4) {
+    threadCounts.push_back(std::thread::hardware_concurrency());
+  }
+  for(const auto& threads : threadCounts) {
+    UDIFReader reader(path, threads);
+    Clock::time_point start = Clock::now();
+    if(!allChecksumsMatch(reader.verify())) {
+      throw std::runtime_error("Checksum mismatch verifying an intact image");
+    }
+    std::cout << "verify zlib, " << threads << " threads: " << disk.size() / elapsedUs(start) << " MB/s" << std::endl;
+  }
+
+  // Flip a byte in the middle of the data fork. Depending on where it lands
+  // decompression may fail outright, which is as good as a mismatch
+  std::vector<uint8_t> image;
+  {
+    std::ifstream f(path, std::ios::binary);
+    image.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  }
+  UDIFReader intact(path);
+  image[intact.trailer().dataForkLength / 2] ^= 0xFF;
+  writeFile(path, image);
+  bool detected;
+  try {
+    UDIFReader corrupted(path);
+    detected = !allChecksumsMatch(corrupted.verify());
+  } catch(const std::runtime_error& e) {
+    detected = true;
+  }
+  if(!detected) {
+    throw std::runtime_error("Corruption went unnoticed verifying a damaged image");
+  }
+}
+
+static void timePartitionTable(const std::string& name, const std::string& path, unsigned int iterations) {
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < iterations; ++i) {
+    std::unique_ptr<ImageReader> reader = openImageReader(path);
+    readPartitionTable(*reader);
+  }
+  std::cout << "partitions " << name << ": " << elapsedUs(start) / iterations << " us" << std::endl;
+}
+
+static void benchPartitions(const std::string& dir, unsigned int iterations) {
+  const uint64_t sectors = 65536;
+  const std::vector<FixturePartition> partitions = {
+    {efiTypeGUID(), 40, 2047, "EFI System Partition"},
+    {apfsTypeGUID(), 2048, sectors - 64, "Macintosh HD"},
+  };
+  std::vector<uint8_t> gpt = makeGPTDisk(sectors, partitions);
+  const std::string gptPath = dir + "/gpt.img";
+  writeFile(gptPath, gpt);
+
+  FileImageReader gptReader(gptPath);
+  PartitionTable table = readPartitionTable(gptReader);
+  if(table.scheme != PARTITION_SCHEME_GPT || table.partitions.size() != 2 || !table.warnings.empty() ||
+     table.partitions[1].typeName != "Apple APFS" || table.partitions[1].name != "Macintosh HD" ||
+     table.partitions[1].offset != 2048 * 512) {
+    throw std::runtime_error("Wrong answer parsing a GPT disk");
+  }
+  timePartitionTable("gpt", gptPath, iterations);
+
+  // Wreck the primary header, the backup has to take over
+  gpt[512 + 24] ^= 0xFF;
+  const std::string damagedPath = dir + "/gpt-damaged.img";
+  writeFile(damagedPath, gpt);
+  FileImageReader damagedReader(damagedPath);
+  table = readPartitionTable(damagedReader);
+  if(table.scheme != PARTITION_SCHEME_GPT || table.primaryValid || !table.backupValid || table.partitions.size() != 2 || table.warnings.empty()) {
+    throw std::runtime_error("Backup GPT not used when the primary is damaged");
+  }
+  timePartitionTable("gpt-backup", damagedPath, iterations);
+
+  const std::string mbrPath = dir + "/mbr.img";
+  writeFile(mbrPath, makeMBRDisk(sectors, 4));
+  FileImageReader mbrReader(mbrPath);
+  table = readPartitionTable(mbrReader);
+  if(table.scheme != PARTITION_SCHEME_MBR || table.partitions.size() != 6 || table.partitions.back().index != 8 ||
+     table.partitions.back().offset != (4096 + 3 * 4096 + 2048) * 512ULL || !table.partitions[0].bootable) {
+    throw std::runtime_error("Wrong answer parsing a MBR disk");
+  }
+  timePartitionTable("mbr-logical", mbrPath, iterations);
+
+  // Same GPT disk, through the UDIF reader
+  const std::string udifPath = dir + "/gpt.dmg";
+  writeCompressedUDIFFixture(udifPath, makeGPTDisk(sectors, partitions), 2048, FIXTURE_ZLIB);
+  std::unique_ptr<ImageReader> udifReader = openImageReader(udifPath);
+  if(readPartitionTable(*udifReader).partitions.size() != 2) {
+    throw std::runtime_error("Wrong answer parsing a GPT disk inside a UDIF image");
+  }
+  timePartitionTable("gpt-udif", udifPath, std::max(1U, iterations / 10));
+}
+
+typedef struct ProbeCase {
+  std::string name;
+  FilesystemKind kind;
+  std::string label;
+  std::string uuid;
+  uint32_t blockSize;
+} ProbeCase;
+
+static void checkProbe(const ProbeCase& c, const FilesystemInfo& info) {
+  if(info.kind != c.kind || info.label != c.label || info.uuid != c.uuid || info.blockSize != c.blockSize) {
+    throw std::runtime_error("Wrong answer probing " + c.name + ": got " + filesystemKindName(info.kind) +
+                             " \"" + info.label + "\" " + info.uuid + " " + std::to_string(info.blockSize));
+  }
+}
+
+static void timeProbeDisk(const std::string& name, const std::string& path, unsigned int threads, unsigned int iterations) {
+  ThreadPool pool(threads);
+  std::unique_ptr<ImageReader> reader = openImageReader(path);
+  Clock::time_point start = Clock::now();
+  for(unsigned int i = 0; i < iterations; ++i) {
+    probeDisk(*reader, pool);
+  }
+  std::cout << "probe " << name << ", " << threads << " threads: " << elapsedUs(start) / iterations << " us" << std::endl;
+}
+
+// One GPT disk with a partition of each filesystem, probed as a whole, plus
+// the ones that show up without a partition table
+static void benchProbe(const std::string& dir, unsigned int iterations) {
+  const std::vector<uint8_t> uuid = {0x5A, 0x1B, 0x2C, 0x3D, 0x4E, 0x5F, 0x60, 0x71, 0x82, 0x93, 0xA4, 0xB5, 0xC6, 0xD7, 0xE8, 0xF9};
+  const std::string uuidString = "5A1B2C3D-4E5F-6071-8293-A4B5C6D7E8F9";
+  const uint64_t mb = 2048;
+  std::vector<FixturePartition> partitions = {
+    {efiTypeGUID(), 2048, 2048 + 16 * mb - 1, "FAT16"},
+    {efiTypeGUID(), 2048 + 16 * mb, 2048 + 52 * mb - 1, "FAT32"},
+    {efiTypeGUID(), 2048 + 52 * mb, 2048 + 56 * mb - 1, "exFAT"},
+    {efiTypeGUID(), 2048 + 56 * mb, 2048 + 60 * mb - 1, "NTFS"},
+    {efiTypeGUID(), 2048 + 60 * mb, 2048 + 64 * mb - 1, "ext4"},
+    {efiTypeGUID(), 2048 + 64 * mb, 2048 + 68 * mb - 1, "HFS+"},
+    {apfsTypeGUID(), 2048 + 68 * mb, 2048 + 72 * mb - 1, "APFS"},
+    {efiTypeGUID(), 2048 + 72 * mb, 2048 + 76 * mb - 1, "Empty"},
+  };
+  std::vector<uint8_t> disk = makeGPTDisk(2048 + 77 * mb, partitions);
+  auto at = [&disk](const FixturePartition& partition) {
+    return disk.data() + partition.firstLBA * 512;
+  };
+  writeFATFixture(at(partitions[0]), 16 << 20, false, "BENCH FAT16", 0x1234ABCD);
+  writeFATFixture(at(partitions[1]), 36 << 20, true, "BENCH FAT32", 0xCAFE0032);
+  writeExFATFixture(at(partitions[2]), "Bench exFAT", 0xCAFE00EF);
+  writeNTFSFixture(at(partitions[3]), "Bench NTFS", 0x0123456789ABCDEFULL);
+  writeExtFixture(at(partitions[4]), "bench-ext4", uuid);
+  writeHFSFixture(at(partitions[5]), "Bench HFS+", 0xFEEDFACECAFEBEEFULL);
+  writeAPFSContainerFixture(at(partitions[6]), uuid);
+
+  const std::vector<ProbeCase> cases = {
+    {"fat16", FS_FAT16, "BENCH FAT16", "1234-ABCD", 2048},
+    {"fat32", FS_FAT32, "BENCH FAT32", "CAFE-0032", 512},
+    {"exfat", FS_EXFAT, "Bench exFAT", "CAFE-00EF", 4096},
+    {"ntfs", FS_NTFS, "Bench NTFS", "0123456789ABCDEF", 4096},
+    {"ext4", FS_EXT4, "bench-ext4", uuidString, 4096},
+    {"hfs+", FS_HFSPLUS, "Bench HFS+", "FEEDFACECAFEBEEF", 4096},
+    {"apfs-container", FS_APFS, "", uuidString, 4096},
+    {"empty", FS_UNKNOWN, "", "", 0},
+  };
+
+  const std::string gptPath = dir + "/filesystems.img";
+  writeFile(gptPath, disk);
+  ThreadPool pool(4);
+  std::unique_ptr<ImageReader> reader = openImageReader(gptPath);
+  DiskProbe probe = probeDisk(*reader, pool);
+  if(probe.filesystems.size() != cases.size()) {
+    throw std::runtime_error("Wrong number of partitions probed: " + std::to_string(probe.filesystems.size()));
+  }
+  for(size_t i = 0; i < cases.size(); ++i) {
+    checkProbe(cases[i], probe.filesystems[i]);
+  }
+  timeProbeDisk("gpt-8-partitions", gptPath, 1, std::max(1U, iterations / 10));
+  timeProbeDisk("gpt-8-partitions", gptPath, 4, std::max(1U, iterations / 10));
+
+  // Without a partition table, as APFS volumes and optical media show up
+  std::vector<uint8_t> volume(1 << 20, 0);
+  writeAPFSVolumeFixture(volume.data(), "Bench APFS", uuid);
+  const std::string volumePath = dir + "/apfs-volume.img";
+  writeFile(volumePath, volume);
+  const std::string isoPath = dir + "/probe.iso";
+  writeISOFixture(isoPath);
+
+  const std::vector<std::pair<std::string, ProbeCase>> wholeDisks = {
+    {volumePath, {"apfs-volume", FS_APFS, "Bench APFS", uuidString, 0}},
+    {isoPath, {"iso9660", FS_ISO9660, "BENCH_ISO", "2023-10-18-12-00-00-00", 2048}},
+  };
+  for(const auto& wholeDisk : wholeDisks) {
+    std::unique_ptr<ImageReader> wholeReader = openImageReader(wholeDisk.first);
+    checkProbe(wholeDisk.second, probeDisk(*wholeReader, pool).wholeDisk);
+    Clock::time_point start = Clock::now();
+    for(unsigned int i = 0; i < iterations; ++i) {
+      probeFilesystem(*wholeReader);
+    }
+    std::cout << "probe " << wholeDisk.second.name << ": " << elapsedUs(start) / iterations << " us" << std::endl;
+  }
+}
+
+// Reads a file one cluster at a time, which is what following the chain
+// without coalescing would do
+static uint64_t readPerCluster(ImageReader& reader, FATVolume& volume, const FATFile& file, uint64_t clusterSize) {
+  std::vector<uint8_t> buffer(clusterSize);
+  uint64_t total = 0;
+  for(const auto& extent : volume.extents(file)) {
+    for(uint64_t done = 0; done < extent.length; done += clusterSize) {
+      total += reader.read(extent.offset + done, buffer.data(), std::min<uint64_t>(clusterSize, extent.length - done));
+    }
+  }
+  return total;
+}
+
+static void benchFATVolume(const std::string& name, const std::string& dir, bool exfat) {
+  const uint64_t clusterSize = exfat ? 4096 : 512;
+  FATFixture fixture(exfat, exfat ? 64 << 20 : 40 << 20);
+  const std::vector<uint8_t> big = makeDiskContents(16 << 20, 1);
+  const std::vector<uint8_t> fragmented = makeDiskContents(2 << 20, 2);
+  fixture.addFile(fixture.rootCluster(), "BIG.BIN", big);
+  fixture.addFile(fixture.rootCluster(), "Fragmented file.bin", fragmented, 64 * 1024 / clusterSize);
+  uint32_t photos = fixture.addDirectory(fixture.rootCluster(), "Photos");
+  std::vector<std::vector<uint8_t>> photoData;
+  for(int i = 0; i < 100; ++i) {
+    photoData.push_back(makeDiskContents(10 * 1024 + i, 100 + i));
+    char photoName[16];
+    snprintf(photoName, sizeof(photoName), "IMG_%04d.JPG", i);
+    fixture.addFile(photos, photoName, photoData.back());
+  }
+  const std::string path = dir + "/" + name + ".img";
+  writeFile(path, fixture.data());
+
+  std::unique_ptr<ImageReader> reader = openImageReader(path);
+  ThreadPool pool(1);
+  FATVolume volume(*reader, pool);
+  if(volume.kind() != (exfat ? FS_EXFAT : FS_FAT32)) {
+    throw std::runtime_error("Wrong filesystem kind for " + name + ": " + filesystemKindName(volume.kind()));
+  }
+  auto readAll = [&volume](const FATFile& file) {
+    std::vector<uint8_t> contents;
+    volume.readFile(file, [&contents](const uint8_t* data, size_t len) {
+      contents.insert(contents.end(), data, data + len);
+      return true;
+    });
+    return contents;
+  };
+
+  std::vector<FATFile> rootFiles = volume.listDirectory(volume.root());
+  FATFile bigFile = volume.lookup("/big.bin");
+  FATFile fragmentedFile = volume.lookup("Fragmented file.bin");
+  if(rootFiles.size() != 3 || rootFiles[1].name != "Fragmented file.bin" || !rootFiles[2].directory || rootFiles[2].name != "Photos" ||
+     bigFile.modified != FIXTURE_FAT_TIMESTAMP || volume.extents(bigFile).size() != 1 || volume.extents(fragmentedFile).size() != 32 ||
+     readAll(bigFile) != big || readAll(fragmentedFile) != fragmented) {
+    throw std::runtime_error("Wrong answer reading the root directory of " + name);
+  }
+  std::vector<FATFile> photoFiles = volume.listDirectory(volume.lookup("/PHOTOS"));
+  if(photoFiles.size() != photoData.size()) {
+    throw std::runtime_error("Wrong number of files in " + name + "/Photos: " + std::to_string(photoFiles.size()));
+  }
+  for(size_t i = 0; i < photoFiles.size(); ++i) {
+    if(readAll(photoFiles[i]) != photoData[i]) {
+      throw std::runtime_error("Wrong data reading " + name + "/Photos/" + photoFiles[i].name);
+    }
+  }
+
+  Clock::time_point start = Clock::now();
+  uint64_t total = 0;
+  volume.readFile(bigFile, [&total](const uint8_t* data, size_t len) {
+    total += len;
+    return true;
+  });
+  std::cout << "extract " << name << " 16MB file: " << total / elapsedUs(start) << " MB/s" << std::endl;
+  start = Clock::now();
+  total = readPerCluster(*reader, volume, bigFile, clusterSize);
+  std::cout << "extract " << name << " 16MB file, cluster by cluster: " << total / elapsedUs(start) << " MB/s" << std::endl;
+
+  start = Clock::now();
+  total = 0;
+  for(const auto& photo : volume.listDirectory(volume.lookup("Photos"))) {
+    total += readAll(photo).size();
+  }
+  std::cout << "extract " << name << " 100 small files: " << elapsedUs(start) / 1000 << " ms" << std::endl;
+}
+
+static void benchFAT(const std::string& dir) {
+  benchFATVolume("fat32", dir, false);
+  benchFATVolume("exfat", dir, true);
+
+  // A boot sector claiming far more clusters than the volume holds has to be
+  // refused, rather than get a FAT allocated for all of them
+  FATFixture fixture(true, 4 << 20);
+  std::vector<uint8_t> data = fixture.data();
+  writeLE32(data.data() + 92, 0xFFFFFFF0);
+  writeFile(dir + "/corrupt-exfat.img", data);
+  std::unique_ptr<ImageReader> reader = openImageReader(dir + "/corrupt-exfat.img");
+  ThreadPool pool(1);
+  bool caught = false;
+  try {
+    FATVolume volume(*reader, pool);
+  } catch(const std::runtime_error& e) {
+    caught = true;
+  }
+  if(!caught) {
+    throw std::runtime_error("Corrupt exFAT geometry opened without errors");
+  }
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_logtostderr = true;
+
+  cxxopts::Options options("image_bench", "Native disk image code benchmarks");
+  options.add_options()
+      ("i,iterations", "Runs per measurement", cxxopts::value<unsigned int>()->default_value("1000"))
+      ("disk-size", "Size in MB of the disks used for read benchmarks", cxxopts::value<uint64_t>()->default_value("64"))
+      ("h,help", "Print usage")
+  ;
+  cxxopts::ParseResult result = options.parse(argc, argv);
+  if (result.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  char dirTemplate[] = "/tmp/image_bench.XXXXXX";
+  if(mkdtemp(dirTemplate) == NULL) {
+    std::cerr << "Unable to create temporary directory: " << strerror(errno) << std::endl;
+    return 1;
+  }
+  const std::string dir = dirTemplate;
+
+  int ret = 0;
+  try {
+    unsigned int iterations = result["iterations"].as<unsigned int>();
+    benchSniffer(dir, iterations);
+    benchPartitions(dir, iterations);
+    benchProbe(dir, iterations);
+    benchFAT(dir);
+    benchUDIF(dir, result["disk-size"].as<uint64_t>(), iterations);
+    benchEWF(dir, result["disk-size"].as<uint64_t>(), iterations);
+    benchNBD(dir, result["disk-size"].as<uint64_t>());
+    benchBlockCache(dir, result["disk-size"].as<uint64_t>(), iterations);
+    benchAllocation(dir, result["disk-size"].as<uint64_t>(), iterations);
+    benchCRC32(iterations);
+    benchSHA256(iterations);
+    benchHash(dir, result["disk-size"].as<uint64_t>(), iterations);
+    benchAcquire(dir, result["disk-size"].as<uint64_t>());
+    benchContainer(dir, result["disk-size"].as<uint64_t>());
+    benchRescue(dir, result["disk-size"].as<uint64_t>());
+    benchBlockReader(dir, result["disk-size"].as<uint64_t>());
+    benchIOScheduler(dir, result["disk-size"].as<uint64_t>());
+    benchCheckpoint(dir, result["disk-size"].as<uint64_t>());
+    benchDiff(dir, result["disk-size"].as<uint64_t>(), iterations);
+    benchBaseline(dir, result["disk-size"].as<uint64_t>());
+    benchVerify(dir, result["disk-size"].as<uint64_t>());
+  } catch(const std::exception& e) {
+    std::cerr << "Benchmark FAILED: " << e.what() << std::endl;
+    ret = 1;
+  }
+
+  removeTree(dir);
+  return ret;
+}
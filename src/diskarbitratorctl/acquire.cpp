@@ -0,0 +1,132 @@
+/***************************************************************************
+ *   acquire.cpp  --  This file is part of diskarbitratorctl.              *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+bool doAcquire(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl acquire", "acquire: Images a disk into a raw image, hashing it on the way");
+  options.add_options()
+      ("disk", "Disk to image", cxxopts::value<std::string>())
+      ("output", "Raw image to create", cxxopts::value<std::string>())
+      ("dense", "Write zeroes out instead of leaving holes in the image")
+      ("c,compress", "Write a compressed evidence container instead, with zlib or zstd", cxxopts::value<std::string>()->default_value(""))
+      ("r,rescue", "Rescue mode for failing disks, keeping track of what's been read in this map. Run it again with the same map to resume", cxxopts::value<std::string>()->default_value(""))
+      ("retries", "Rescue mode, extra attempts at unreadable sectors", cxxopts::value<uint32_t>()->default_value("1"))
+      ("k,checkpoint", "Keep a checkpoint of a raw image in this file. Run it again with the same checkpoint to resume", cxxopts::value<std::string>()->default_value(""))
+      ("w,weight", "Share of the disk next to other jobs reading it, from 1 to 1000", cxxopts::value<uint32_t>()->default_value("100"))
+      ("idle", "Only read while nothing else is using the disk")
+      ("p,progress", "Show acquisition progress")
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+
+  std::string socketPath;
+  std::string disk;
+  std::string output;
+  bool dense;
+  std::string compression;
+  std::string rescueMap;
+  uint32_t retries;
+  std::string checkpoint;
+  uint32_t weight;
+  bool idle;
+  bool showProgress;
+
+  try {
+    options.parse_positional({"disk", "output"});
+    options.positional_help("disk output");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("disk") || !result.count("output")) {
+      std::cout << "disk and output arguments were not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    disk = result["disk"].as<std::string>();
+    output = result["output"].as<std::string>();
+    dense = result.count("dense");
+    compression = result["compress"].as<std::string>();
+    rescueMap = result["rescue"].as<std::string>();
+    retries = result["retries"].as<uint32_t>();
+    checkpoint = result["checkpoint"].as<std::string>();
+    weight = result["weight"].as<uint32_t>();
+    idle = result.count("idle");
+    showProgress = result.count("progress");
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+  std::unique_ptr<diskarbitrator::AcquireResult> result = client.AcquireDisk(disk, output, dense, compression, rescueMap, retries, checkpoint, weight, idle, [showProgress](const diskarbitrator::AcquireProgress& progress) {
+    if(showProgress && progress.bytes_total()) {
+      std::cout << "[" << 100 * progress.bytes_written() / progress.bytes_total() << "%] ";
+      if(progress.pass()) {
+        std::cout << "pass " << progress.pass() << ", " << sizeToHuman(progress.bytes_bad()) << " unreadable, ";
+      }
+      std::cout << sizeToHuman(progress.bytes_written()) << " of " << sizeToHuman(progress.bytes_total())
+                << ", " << sizeToHuman(progress.bytes_per_second()) << "/s" << std::endl;
+    }
+  });
+  if(result == nullptr) {
+    return false;
+  }
+  std::cout << "Acquired " << sizeToHuman(result->bytes()) << " into " << output << " in " << result->duration_ms() << " ms" << std::endl;
+  if(result->resumed_from()) {
+    std::cout << "Resumed from the checkpoint at " << sizeToHuman(result->resumed_from()) << std::endl;
+  }
+  if(compression.size() && result->bytes()) {
+    std::cout << "Stored in " << sizeToHuman(result->stored_bytes()) << " (" << 100 * result->stored_bytes() / result->bytes() << "%)" << std::endl;
+  }
+  if(result->sparse_bytes()) {
+    std::cout << sizeToHuman(result->sparse_bytes()) << " of zeroes left as holes" << std::endl;
+  }
+  if(result->bad_bytes()) {
+    std::cout << sizeToHuman(result->bad_bytes()) << " couldn't be read after " << result->read_errors() << " read errors, left as zeroes" << std::endl;
+  }
+  std::cout << "SHA-256: " << result->sha256() << std::endl;
+  return true;
+}
@@ -30,28 +30,34 @@
 #include "socket.hpp"
 
 bool doAttach(int argc, char** argv) {
-  cxxopts::Options options("diskarbitratorctl attach", "attach: Attaches a disk image (and optionally mounts it) to the system");
+  cxxopts::Options options("diskarbitratorctl attach", "attach: Attaches disk images (and optionally mounts them) to the system");
   options.add_options()
-      ("image", "Image to mount", cxxopts::value<std::string>())
+      ("images", "Images to mount", cxxopts::value<std::vector<std::string>>())
       ("m,mode", "Mode to mount the disk. Either nomount, ro or rw.", cxxopts::value<std::string>()->default_value("nomount"))
+      ("p,progress", "Show attach progress. Only for a single image.")
+      ("V,verify", "Verify image checksums first, and only attach the ones that pass")
+      ("j,jobs", "Maximum images attached at the same time. 0 uses the daemon default.", cxxopts::value<unsigned int>()->default_value("0"))
       ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
       ("h,help", "Print usage")
   ;
   
   std::string socketPath;
-  std::string image;
+  std::vector<std::string> images;
   std::string modeStr;
+  unsigned int jobs;
+  bool showProgress;
+  bool verify;
 
   try {
-    options.parse_positional({"image"});
-    options.positional_help("image");
+    options.parse_positional({"images"});
+    options.positional_help("image [image...]");
     cxxopts::ParseResult result = options.parse(argc, argv);
     if (result.count("help")) {
       std::cout << options.help() << std::endl;
       return true;
     }
 
-    if(!result.count("image")) {
+    if(!result.count("images")) {
       std::cout << "image argument was not provided" << std::endl;
       std::cout << options.help() << std::endl;
       return false;
@@ -65,8 +71,11 @@ bool doAttach(int argc, char** argv) {
     }
 
     socketPath = result["socket"].as<std::string>();
-    image = result["image"].as<std::string>();
+    images = result["images"].as<std::vector<std::string>>();
     modeStr = result["mode"].as<std::string>();
+    jobs = result["jobs"].as<unsigned int>();
+    showProgress = result.count("progress");
+    verify = result.count("verify");
   } catch(const cxxopts::exceptions::exception& ex) {
     std::cout << ex.what() << std::endl;
     std::cout << options.help() << std::endl;
@@ -87,14 +96,60 @@ bool doAttach(int argc, char** argv) {
   }
 
   DiskArbitratorClient client = getClient(socketPath);
-  std::vector<std::string> disks = client.AttachDisk(image, mode);
-  if(!disks.size()) {
-    return false;
+
+  bool allVerified = true;
+  if(verify) {
+    std::vector<std::string> verified;
+    for(const auto& image : images) {
+      std::unique_ptr<diskarbitrator::VerifyImageResult> result = client.VerifyImage(image, [](const diskarbitrator::VerifyProgress& progress) {});
+      if(result == nullptr || !result->valid()) {
+        std::cout << image << ": verification FAILED, not attaching" << std::endl;
+        allVerified = false;
+        continue;
+      }
+      verified.push_back(image);
+    }
+    if(!verified.size()) {
+      return false;
+    }
+    images = verified;
   }
-  std::cout << "Disks attached:" << std::endl;
-  for(const auto& d : disks) {
-    std::cout << d << std::endl;
+
+  if(images.size() == 1) {
+    std::vector<std::string> disks;
+    if(showProgress) {
+      disks = client.AttachDiskWithProgress(images[0], mode, [](const diskarbitrator::AttachProgress& progress) {
+        if(progress.percent() >= 0) {
+          std::cout << "[" << static_cast<int>(progress.percent()) << "%] ";
+        }
+        std::cout << progress.message() << std::endl;
+      });
+    } else {
+      disks = client.AttachDisk(images[0], mode);
+    }
+    if(!disks.size()) {
+      return false;
+    }
+    std::cout << "Disks attached:" << std::endl;
+    for(const auto& d : disks) {
+      std::cout << d << std::endl;
+    }
+    return allVerified;
   }
 
-  return true;
+  // Several images, let the daemon attach them concurrently
+  bool allAttached = true;
+  bool ok = client.AttachDisks(images, mode, jobs, [&allAttached](const diskarbitrator::AttachDisksOutput& result) {
+    if(result.has_error()) {
+      allAttached = false;
+      std::cout << result.image() << ": FAILED (" << result.duration_ms() << " ms): " << result.error() << std::endl;
+      return;
+    }
+    std::cout << result.image() << ": attached (" << result.duration_ms() << " ms)" << std::endl;
+    for(const auto& d : result.disks()) {
+      std::cout << "  " << d << std::endl;
+    }
+  });
+
+  return ok && allAttached && allVerified;
 }
\ No newline at end of file
@@ -0,0 +1,161 @@
+/***************************************************************************
+ *   baseline.cpp  --  This file is part of diskarbitratorctl.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#include <iomanip>
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+static void printProgress(const diskarbitrator::BaselineProgress& progress) {
+  if(progress.bytes_total()) {
+    std::cout << "[" << 100 * progress.bytes_hashed() / progress.bytes_total() << "%] "
+              << sizeToHuman(progress.bytes_hashed()) << " of " << sizeToHuman(progress.bytes_total())
+              << ", " << sizeToHuman(progress.bytes_per_second()) << "/s" << std::endl;
+  }
+}
+
+bool doBaseline(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl baseline", "baseline: Takes a Merkle tree baseline of a disk, or checks the disk against the one it has");
+  options.add_options()
+      ("disk", "Disk to take or check the baseline of", cxxopts::value<std::string>())
+      ("c,check", "Check the disk against its baseline instead of taking one. Every leaf unless --sample or --extent say otherwise")
+      ("n,sample", "Check this many leaves picked at random", cxxopts::value<uint64_t>()->default_value("0"))
+      ("e,extent", "Check the leaves holding OFFSET:LENGTH, can be given more than once", cxxopts::value<std::vector<std::string>>())
+      ("r,root", "Refuse to check against a baseline without this root", cxxopts::value<std::string>()->default_value(""))
+      ("l,leaf-size", "Bytes of the disk under each leaf of a new baseline", cxxopts::value<uint32_t>()->default_value("4194304"))
+      ("replace", "Take a new baseline even if the disk has one")
+      ("w,weight", "Share of the disk next to other jobs reading it, from 1 to 1000", cxxopts::value<uint32_t>()->default_value("100"))
+      ("idle", "Only read while nothing else is using the disk")
+      ("p,progress", "Show progress")
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+
+  std::string socketPath;
+  std::string disk;
+  bool check;
+  uint64_t sample;
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+  std::string root;
+  uint32_t leafSize;
+  bool replace;
+  uint32_t weight;
+  bool idle;
+  bool showProgress;
+
+  try {
+    options.parse_positional({"disk"});
+    options.positional_help("disk");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("disk")) {
+      std::cout << "disk argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    disk = result["disk"].as<std::string>();
+    check = result.count("check");
+    sample = result["sample"].as<uint64_t>();
+    if(result.count("extent")) {
+      for(const auto& extent : result["extent"].as<std::vector<std::string>>()) {
+        size_t colon = extent.find(':');
+        try {
+          if(colon == std::string::npos) {
+            throw std::invalid_argument(extent);
+          }
+          extents.push_back(std::make_pair(std::stoull(extent.substr(0, colon)), std::stoull(extent.substr(colon + 1))));
+        } catch(const std::logic_error& e) {
+          std::cout << "Invalid extent " << extent << ", expected OFFSET:LENGTH" << std::endl;
+          return false;
+        }
+      }
+    }
+    root = result["root"].as<std::string>();
+    leafSize = result["leaf-size"].as<uint32_t>();
+    replace = result.count("replace");
+    weight = result["weight"].as<uint32_t>();
+    idle = result.count("idle");
+    showProgress = result.count("progress");
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+  if(!check) {
+    std::unique_ptr<diskarbitrator::BaselineSummary> summary = client.BuildBaseline(disk, leafSize, replace, weight, idle, [showProgress](const diskarbitrator::BaselineProgress& progress) {
+      if(showProgress) {
+        printProgress(progress);
+      }
+    });
+    if(summary == nullptr) {
+      return false;
+    }
+    std::cout << "Baseline of " << sizeToHuman(summary->disk_size()) << " in " << summary->leaf_count() << " leaves, took " << summary->duration_ms() << " ms" << std::endl;
+    std::cout << "Root: " << summary->root() << std::endl;
+    return true;
+  }
+
+  std::unique_ptr<diskarbitrator::VerifyBaselineSummary> summary = client.VerifyBaseline(disk, extents, sample, root, weight, idle, [showProgress](const diskarbitrator::BaselineProgress& progress) {
+    if(showProgress) {
+      printProgress(progress);
+    }
+  }, [](const google::protobuf::RepeatedPtrField<diskarbitrator::ChangedLeaf>& changed) {
+    for(const auto& leaf : changed) {
+      std::cout << "Changed leaf " << std::setw(10) << leaf.index() << " " << std::setw(16) << leaf.offset() << " " << std::setw(10) << leaf.length() << std::endl;
+    }
+  });
+  if(summary == nullptr) {
+    return false;
+  }
+  std::cout << "Checked " << summary->leaves_checked() << " of " << summary->baseline().leaf_count() << " leaves (" << sizeToHuman(summary->bytes_checked()) << ") in " << summary->duration_ms() << " ms" << std::endl;
+  std::cout << "Root: " << summary->baseline().root() << std::endl;
+  if(summary->disk_size() != summary->baseline().disk_size()) {
+    std::cout << "The disk is " << sizeToHuman(summary->disk_size()) << " now, it was " << sizeToHuman(summary->baseline().disk_size()) << std::endl;
+  }
+  if(summary->intact()) {
+    std::cout << "Intact" << std::endl;
+    return true;
+  }
+  std::cout << summary->changed_count() << " leaves changed" << std::endl;
+  // As with diff, a changed disk is a failure for scripts checking evidence
+  return false;
+}
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   cache.cpp  --  This file is part of diskarbitratorctl.                *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <iomanip>
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+static double percent(uint64_t part, uint64_t total) {
+  return total ? 100.0 * part / total : 0.0;
+}
+
+bool doCache(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl cache", "cache: Shows how the shared block cache is doing, and how many attaches were coalesced");
+  options.add_options()
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+
+  std::string socketPath;
+
+  try {
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+  std::unique_ptr<diskarbitrator::CacheStatsOutput> stats = client.CacheStats();
+  if(stats == nullptr) {
+    return false;
+  }
+  if(!stats->enabled()) {
+    std::cout << "Block cache disabled" << std::endl;
+    std::cout << "Coalesced attaches: " << stats->coalesced_attaches() << std::endl;
+    return true;
+  }
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "Size:        " << sizeToHuman(stats->capacity()) << (stats->direct_io() ? ", direct I/O" : "") << std::endl;
+  std::cout << "Hits:        " << stats->hits() << " (" << percent(stats->hits(), stats->hits() + stats->misses()) << "%)" << std::endl;
+  std::cout << "Misses:      " << stats->misses() << std::endl;
+  std::cout << "Readahead:   " << stats->readahead_blocks() << " blocks, " << percent(stats->readahead_hits(), stats->readahead_blocks()) << "% used" << std::endl;
+  std::cout << "Device read: " << sizeToHuman(stats->device_bytes_read()) << std::endl;
+  std::cout << "Coalesced attaches: " << stats->coalesced_attaches() << std::endl;
+  return true;
+}
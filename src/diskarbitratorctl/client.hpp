@@ -176,6 +176,455 @@ class DiskArbitratorClient {
     return disks;
   }
 
+  // Progress updates are handed to the callback as they arrive
+  std::vector<std::string> AttachDiskWithProgress(const std::string& disk, diskarbitrator::MountMode mode, std::function<void(const diskarbitrator::AttachProgress&)> onProgress) {
+    grpc::ClientContext context;
+
+    diskarbitrator::AttachDiskInput request;
+    diskarbitrator::AttachDiskProgressOutput reply;
+    request.set_disk(disk);
+    request.set_mode(mode);
+
+    std::vector<std::string> disks;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::AttachDiskProgressOutput>> reader(stub->AttachDiskWithProgress(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.has_progress()) {
+        onProgress(reply.progress());
+      } else if(reply.has_result()) {
+        for(const auto& d : reply.result().disks()) {
+          disks.push_back(d);
+        }
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return {};
+    }
+
+    return disks;
+  }
+
+  // Results are handed to the callback as the daemon streams them back
+  bool AttachDisks(const std::vector<std::string>& images, diskarbitrator::MountMode mode, unsigned int parallelism, std::function<void(const diskarbitrator::AttachDisksOutput&)> onResult) {
+    grpc::ClientContext context;
+
+    diskarbitrator::AttachDisksInput request;
+    diskarbitrator::AttachDisksOutput reply;
+    for(const auto& image : images) {
+      std::string* newImage = request.add_disks();
+      *newImage = image;
+    }
+    request.set_mode(mode);
+    request.set_parallelism(parallelism);
+
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::AttachDisksOutput>> reader(stub->AttachDisks(&context, request));
+    while(reader->Read(&reply)) {
+      onResult(reply);
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  std::unique_ptr<diskarbitrator::ImageDescription> InspectImage(const std::string& image) {
+    grpc::ClientContext context;
+
+    diskarbitrator::InspectImageInput request;
+    diskarbitrator::ImageDescription* reply = new diskarbitrator::ImageDescription;
+    request.set_image(image);
+
+    grpc::Status status = stub->InspectImage(&context, request, reply);
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      delete reply;
+      return nullptr;
+    }
+
+    return std::unique_ptr<diskarbitrator::ImageDescription>(reply);
+  }
+
+  // Data is handed to the callback as the daemon streams it back
+  bool ReadImage(const std::string& image, uint64_t offset, uint64_t length, std::function<void(const diskarbitrator::ReadImageOutput&)> onData) {
+    grpc::ClientContext context;
+
+    diskarbitrator::ReadImageInput request;
+    diskarbitrator::ReadImageOutput reply;
+    request.set_image(image);
+    request.set_offset(offset);
+    request.set_length(length);
+
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::ReadImageOutput>> reader(stub->ReadImage(&context, request));
+    while(reader->Read(&reply)) {
+      onData(reply);
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  std::unique_ptr<diskarbitrator::VerifyImageResult> VerifyImage(const std::string& image, std::function<void(const diskarbitrator::VerifyProgress&)> onProgress) {
+    grpc::ClientContext context;
+
+    diskarbitrator::VerifyImageInput request;
+    diskarbitrator::VerifyImageOutput reply;
+    request.set_image(image);
+
+    std::unique_ptr<diskarbitrator::VerifyImageResult> result;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::VerifyImageOutput>> reader(stub->VerifyImage(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.has_progress()) {
+        onProgress(reply.progress());
+      } else if(reply.has_result()) {
+        result.reset(new diskarbitrator::VerifyImageResult(reply.result()));
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return nullptr;
+    }
+
+    return result;
+  }
+
+  std::unique_ptr<diskarbitrator::PartitionTableDescription> InspectPartitions(const std::string& disk) {
+    grpc::ClientContext context;
+
+    diskarbitrator::InspectPartitionsInput request;
+    diskarbitrator::PartitionTableDescription* reply = new diskarbitrator::PartitionTableDescription;
+    request.set_disk(disk);
+
+    grpc::Status status = stub->InspectPartitions(&context, request, reply);
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      delete reply;
+      return nullptr;
+    }
+
+    return std::unique_ptr<diskarbitrator::PartitionTableDescription>(reply);
+  }
+
+  // `partition` of -1 reads the whole disk
+  bool ExtractFiles(const std::string& disk, int64_t partition, const std::vector<std::string>& paths, std::function<bool(const diskarbitrator::ExtractFilesOutput&)> onEntry) {
+    grpc::ClientContext context;
+
+    diskarbitrator::ExtractFilesInput request;
+    diskarbitrator::ExtractFilesOutput reply;
+    request.set_disk(disk);
+    if(partition >= 0) {
+      request.set_partition(partition);
+    }
+    for(const auto& path : paths) {
+      std::string* newPath = request.add_paths();
+      *newPath = path;
+    }
+
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::ExtractFilesOutput>> reader(stub->ExtractFiles(&context, request));
+    bool ok = true;
+    while(reader->Read(&reply)) {
+      if(!onEntry(reply)) {
+        ok = false;
+        context.TryCancel();
+        break;
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok() && ok) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return false;
+    }
+
+    return ok;
+  }
+
+  std::unique_ptr<diskarbitrator::ExportDiskOutput> ExportDisk(const std::string& disk, const std::string& name) {
+    grpc::ClientContext context;
+
+    diskarbitrator::ExportDiskInput request;
+    diskarbitrator::ExportDiskOutput* reply = new diskarbitrator::ExportDiskOutput;
+    request.set_disk(disk);
+    request.set_name(name);
+
+    grpc::Status status = stub->ExportDisk(&context, request, reply);
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      delete reply;
+      return nullptr;
+    }
+
+    return std::unique_ptr<diskarbitrator::ExportDiskOutput>(reply);
+  }
+
+  bool UnexportDisk(const std::string& name) {
+    grpc::ClientContext context;
+
+    diskarbitrator::UnexportDiskInput request;
+    ::google::protobuf::Empty reply;
+    request.set_name(name);
+
+    grpc::Status status = stub->UnexportDisk(&context, request, &reply);
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  std::unique_ptr<diskarbitrator::CacheStatsOutput> CacheStats() {
+    grpc::ClientContext context;
+
+    ::google::protobuf::Empty request;
+    diskarbitrator::CacheStatsOutput* reply = new diskarbitrator::CacheStatsOutput;
+
+    grpc::Status status = stub->CacheStats(&context, request, reply);
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      delete reply;
+      return nullptr;
+    }
+
+    return std::unique_ptr<diskarbitrator::CacheStatsOutput>(reply);
+  }
+
+  // Every batch of runs goes to `onRuns` as it arrives
+  std::unique_ptr<diskarbitrator::AllocationSummary> MapAllocation(const std::string& disk, uint32_t blockSize, bool idle, std::function<void(const google::protobuf::RepeatedPtrField<diskarbitrator::AllocationRun>&)> onRuns) {
+    grpc::ClientContext context;
+
+    diskarbitrator::MapAllocationInput request;
+    diskarbitrator::MapAllocationOutput reply;
+    request.set_disk(disk);
+    request.set_block_size(blockSize);
+    request.set_idle(idle);
+
+    std::unique_ptr<diskarbitrator::AllocationSummary> summary;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::MapAllocationOutput>> reader(stub->MapAllocation(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.runs_size()) {
+        onRuns(reply.runs());
+      }
+      if(reply.has_summary()) {
+        summary.reset(new diskarbitrator::AllocationSummary(reply.summary()));
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return nullptr;
+    }
+
+    return summary;
+  }
+
+  std::unique_ptr<diskarbitrator::AcquireResult> AcquireDisk(const std::string& disk, const std::string& output, bool dense, const std::string& compression, const std::string& rescueMap, uint32_t retries, const std::string& checkpoint, uint32_t weight, bool idle, std::function<void(const diskarbitrator::AcquireProgress&)> onProgress) {
+    grpc::ClientContext context;
+
+    diskarbitrator::AcquireDiskInput request;
+    diskarbitrator::AcquireDiskOutput reply;
+    request.set_disk(disk);
+    request.set_output(output);
+    request.set_dense(dense);
+    request.set_compression(compression);
+    request.set_rescue_map(rescueMap);
+    request.set_checkpoint(checkpoint);
+    request.set_retries(retries);
+    request.set_io_weight(weight);
+    request.set_idle(idle);
+
+    std::unique_ptr<diskarbitrator::AcquireResult> result;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::AcquireDiskOutput>> reader(stub->AcquireDisk(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.has_progress()) {
+        onProgress(reply.progress());
+      } else if(reply.has_result()) {
+        result.reset(new diskarbitrator::AcquireResult(reply.result()));
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return nullptr;
+    }
+
+    return result;
+  }
+
+  std::unique_ptr<diskarbitrator::HashResult> HashDisk(const std::string& disk, const std::vector<std::string>& algorithms, uint64_t segmentSize, bool imageFiles, const std::string& checkpoint, uint32_t weight, bool idle, std::function<void(const diskarbitrator::HashProgress&)> onProgress, std::function<void(const google::protobuf::RepeatedPtrField<diskarbitrator::HashSegment>&)> onSegments) {
+    grpc::ClientContext context;
+
+    diskarbitrator::HashDiskInput request;
+    diskarbitrator::HashDiskOutput reply;
+    request.set_disk(disk);
+    for(const auto& algorithm : algorithms) {
+      request.add_algorithms(algorithm);
+    }
+    request.set_segment_size(segmentSize);
+    request.set_image_files(imageFiles);
+    request.set_checkpoint(checkpoint);
+    request.set_io_weight(weight);
+    request.set_idle(idle);
+
+    std::unique_ptr<diskarbitrator::HashResult> result;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::HashDiskOutput>> reader(stub->HashDisk(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.segments_size()) {
+        onSegments(reply.segments());
+      }
+      if(reply.has_progress()) {
+        onProgress(reply.progress());
+      } else if(reply.has_result()) {
+        result.reset(new diskarbitrator::HashResult(reply.result()));
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return nullptr;
+    }
+
+    return result;
+  }
+
+  std::unique_ptr<diskarbitrator::DiffSummary> DiffDisks(const std::string& first, const std::string& second, uint32_t blockSize, bool imageFiles, uint32_t weight, bool idle, std::function<void(const diskarbitrator::DiffProgress&)> onProgress, std::function<void(const google::protobuf::RepeatedPtrField<diskarbitrator::DiffExtent>&)> onExtents) {
+    grpc::ClientContext context;
+
+    diskarbitrator::DiffDisksInput request;
+    diskarbitrator::DiffDisksOutput reply;
+    request.set_first(first);
+    request.set_second(second);
+    request.set_block_size(blockSize);
+    request.set_image_files(imageFiles);
+    request.set_io_weight(weight);
+    request.set_idle(idle);
+
+    std::unique_ptr<diskarbitrator::DiffSummary> summary;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::DiffDisksOutput>> reader(stub->DiffDisks(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.extents_size()) {
+        onExtents(reply.extents());
+      }
+      if(reply.has_progress()) {
+        onProgress(reply.progress());
+      } else if(reply.has_summary()) {
+        summary.reset(new diskarbitrator::DiffSummary(reply.summary()));
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return nullptr;
+    }
+
+    return summary;
+  }
+
+  std::unique_ptr<diskarbitrator::BaselineSummary> BuildBaseline(const std::string& disk, uint32_t leafSize, bool replace, uint32_t weight, bool idle, std::function<void(const diskarbitrator::BaselineProgress&)> onProgress) {
+    grpc::ClientContext context;
+
+    diskarbitrator::BuildBaselineInput request;
+    diskarbitrator::BuildBaselineOutput reply;
+    request.set_disk(disk);
+    request.set_leaf_size(leafSize);
+    request.set_replace(replace);
+    request.set_io_weight(weight);
+    request.set_idle(idle);
+
+    std::unique_ptr<diskarbitrator::BaselineSummary> summary;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::BuildBaselineOutput>> reader(stub->BuildBaseline(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.has_progress()) {
+        onProgress(reply.progress());
+      } else if(reply.has_summary()) {
+        summary.reset(new diskarbitrator::BaselineSummary(reply.summary()));
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return nullptr;
+    }
+
+    return summary;
+  }
+
+  std::unique_ptr<diskarbitrator::VerifyBaselineSummary> VerifyBaseline(const std::string& disk, const std::vector<std::pair<uint64_t, uint64_t>>& extents, uint64_t sample, const std::string& root, uint32_t weight, bool idle, std::function<void(const diskarbitrator::BaselineProgress&)> onProgress, std::function<void(const google::protobuf::RepeatedPtrField<diskarbitrator::ChangedLeaf>&)> onChanged) {
+    grpc::ClientContext context;
+
+    diskarbitrator::VerifyBaselineInput request;
+    diskarbitrator::VerifyBaselineOutput reply;
+    request.set_disk(disk);
+    for(const auto& extent : extents) {
+      diskarbitrator::BaselineExtent* entry = request.add_extents();
+      entry->set_offset(extent.first);
+      entry->set_length(extent.second);
+    }
+    request.set_sample(sample);
+    request.set_root(root);
+    request.set_io_weight(weight);
+    request.set_idle(idle);
+
+    std::unique_ptr<diskarbitrator::VerifyBaselineSummary> summary;
+    std::unique_ptr<grpc::ClientReader<diskarbitrator::VerifyBaselineOutput>> reader(stub->VerifyBaseline(&context, request));
+    while(reader->Read(&reply)) {
+      if(reply.changed_size()) {
+        onChanged(reply.changed());
+      }
+      if(reply.has_progress()) {
+        onProgress(reply.progress());
+      } else if(reply.has_summary()) {
+        summary.reset(new diskarbitrator::VerifyBaselineSummary(reply.summary()));
+      }
+    }
+    grpc::Status status = reader->Finish();
+
+    if(!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return nullptr;
+    }
+
+    return summary;
+  }
+
  private:
   std::unique_ptr<diskarbitrator::DiskArbitrator::Stub> stub;
 };
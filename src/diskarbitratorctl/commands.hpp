@@ -29,6 +29,17 @@ bool doAttach(int argc, char** argv);
 bool doInfo(int argc, char** argv);
 bool doList(int argc, char** argv);
 bool doArbitrate(int argc, char** argv);
+bool doInspect(int argc, char** argv);
+bool doVerify(int argc, char** argv);
+bool doPartitions(int argc, char** argv);
+bool doExtract(int argc, char** argv);
+bool doExport(int argc, char** argv);
+bool doCache(int argc, char** argv);
+bool doMap(int argc, char** argv);
+bool doAcquire(int argc, char** argv);
+bool doHash(int argc, char** argv);
+bool doDiff(int argc, char** argv);
+bool doBaseline(int argc, char** argv);
 
 const std::string parseCommand(const char* arg) {
   const std::vector<const std::string> validCommands = {
@@ -39,6 +50,17 @@ const std::string parseCommand(const char* arg) {
     "arbitrate",
     "list",
     "info",
+    "inspect",
+    "verify",
+    "partitions",
+    "extract",
+    "export",
+    "cache",
+    "map",
+    "acquire",
+    "hash",
+    "diff",
+    "baseline",
   };
 
   for(const auto& cmd : validCommands) {
@@ -0,0 +1,125 @@
+/***************************************************************************
+ *   diff.cpp  --  This file is part of diskarbitratorctl.                 *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+#include <iomanip>
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+bool doDiff(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl diff", "diff: Compares two disks or images block by block, reading both at once");
+  options.add_options()
+      ("first", "Disk or image to compare", cxxopts::value<std::string>())
+      ("second", "Disk or image to compare it with", cxxopts::value<std::string>())
+      ("b,block-size", "Size of the blocks compared, in bytes", cxxopts::value<uint32_t>()->default_value("4096"))
+      ("image-files", "Compare images as the files they are, not the disks inside them")
+      ("q,quiet", "Only print the summary, not every extent that differs")
+      ("w,weight", "Share of the disks next to other jobs reading them, from 1 to 1000", cxxopts::value<uint32_t>()->default_value("100"))
+      ("idle", "Only read while nothing else is using the disks")
+      ("p,progress", "Show comparison progress")
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+
+  std::string socketPath;
+  std::string first;
+  std::string second;
+  uint32_t blockSize;
+  bool imageFiles;
+  bool quiet;
+  uint32_t weight;
+  bool idle;
+  bool showProgress;
+
+  try {
+    options.parse_positional({"first", "second"});
+    options.positional_help("first second");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("first") || !result.count("second")) {
+      std::cout << "first and second arguments were not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    first = result["first"].as<std::string>();
+    second = result["second"].as<std::string>();
+    blockSize = result["block-size"].as<uint32_t>();
+    imageFiles = result.count("image-files");
+    quiet = result.count("quiet");
+    weight = result["weight"].as<uint32_t>();
+    idle = result.count("idle");
+    showProgress = result.count("progress");
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+  std::unique_ptr<diskarbitrator::DiffSummary> summary = client.DiffDisks(first, second, blockSize, imageFiles, weight, idle, [showProgress](const diskarbitrator::DiffProgress& progress) {
+    if(showProgress && progress.bytes_total()) {
+      std::cout << "[" << 100 * progress.bytes_compared() / progress.bytes_total() << "%] "
+                << sizeToHuman(progress.bytes_compared()) << " of " << sizeToHuman(progress.bytes_total())
+                << ", " << sizeToHuman(progress.bytes_per_second()) << "/s" << std::endl;
+    }
+  }, [quiet](const google::protobuf::RepeatedPtrField<diskarbitrator::DiffExtent>& extents) {
+    for(const auto& extent : extents) {
+      if(!quiet) {
+        std::cout << std::setw(16) << extent.offset() << " " << std::setw(16) << extent.length() << std::endl;
+      }
+    }
+  });
+  if(summary == nullptr) {
+    return false;
+  }
+  std::cout << "Compared " << sizeToHuman(summary->bytes_compared()) << " in " << summary->duration_ms() << " ms" << std::endl;
+  if(summary->first_size() != summary->second_size()) {
+    std::cout << first << " is " << sizeToHuman(summary->first_size()) << " and " << second << " is " << sizeToHuman(summary->second_size()) << std::endl;
+  }
+  if(summary->identical()) {
+    std::cout << "Identical" << std::endl;
+    return true;
+  }
+  std::cout << sizeToHuman(summary->different_bytes()) << " differ in " << summary->extent_count() << " extents" << std::endl;
+  // Like cmp(1), differences are a failure for scripts checking evidence
+  return false;
+}
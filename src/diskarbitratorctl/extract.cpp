@@ -0,0 +1,203 @@
+/***************************************************************************
+ *   extract.cpp  --  This file is part of diskarbitratorctl.              *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <chrono>
+#include <iostream>
+#include <fstream>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+// Paths come from whatever is on the volume, so nothing gets to climb out of
+// the output directory
+static bool isSafePath(const std::string& path) {
+  if(path.empty() || path[0] == '/') {
+    return false;
+  }
+  size_t start = 0;
+  while(start <= path.size()) {
+    size_t end = path.find('/', start);
+    if(end == std::string::npos) {
+      end = path.size();
+    }
+    if(path.compare(start, end - start, "..") == 0 && end - start == 2) {
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+static bool makeDirectories(const std::string& path) {
+  for(size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+    const std::string dir = path.substr(0, slash);
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      std::cout << "Unable to create " << dir << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    if(slash == std::string::npos) {
+      return true;
+    }
+  }
+}
+
+static void setModified(const std::string& path, int64_t modified) {
+  struct timeval times[2];
+  times[0].tv_sec = modified;
+  times[0].tv_usec = 0;
+  times[1] = times[0];
+  utimes(path.c_str(), times);
+}
+
+bool doExtract(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl extract", "extract: Copies files off a FAT/exFAT disk or image without mounting it");
+  options.add_options()
+      ("disk", "Disk (BSD name or device path) or image to read", cxxopts::value<std::string>())
+      ("paths", "Files or directories to extract. Everything if none given", cxxopts::value<std::vector<std::string>>())
+      ("o,output", "Directory to extract to", cxxopts::value<std::string>())
+      ("p,partition", "Partition number, for disks and images with a partition table", cxxopts::value<unsigned int>())
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+
+  std::string socketPath;
+  std::string disk;
+  std::vector<std::string> paths;
+  std::string outputPath;
+  int64_t partition = -1;
+
+  try {
+    options.parse_positional({"disk", "paths"});
+    options.positional_help("disk [paths...]");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("disk")) {
+      std::cout << "disk argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    if(!result.count("output")) {
+      std::cout << "output argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    disk = result["disk"].as<std::string>();
+    outputPath = result["output"].as<std::string>();
+    if(result.count("paths")) {
+      paths = result["paths"].as<std::vector<std::string>>();
+    }
+    if(result.count("partition")) {
+      partition = result["partition"].as<unsigned int>();
+    }
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  if(!makeDirectories(outputPath)) {
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+
+  std::ofstream output;
+  std::string currentPath;
+  int64_t currentModified = 0;
+  uint64_t files = 0;
+  uint64_t total = 0;
+  // Timestamps are set once the file is complete, writing would change them
+  auto finishFile = [&output, &currentPath, &currentModified]() {
+    if(output.is_open()) {
+      output.close();
+      setModified(currentPath, currentModified);
+    }
+  };
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  bool ok = client.ExtractFiles(disk, partition, paths, [&](const diskarbitrator::ExtractFilesOutput& entry) {
+    if(entry.has_file()) {
+      finishFile();
+      const diskarbitrator::ExtractedFile& file = entry.file();
+      if(!isSafePath(file.path())) {
+        std::cout << "Refusing to extract " << file.path() << std::endl;
+        return false;
+      }
+      currentPath = outputPath + "/" + file.path();
+      currentModified = file.modified();
+      if(file.directory()) {
+        return makeDirectories(currentPath);
+      }
+      // Single files asked for by path come without their parents
+      if(!makeDirectories(currentPath.substr(0, currentPath.rfind('/')))) {
+        return false;
+      }
+      output.open(currentPath, std::ios::binary | std::ios::trunc);
+      if(!output) {
+        std::cout << "Unable to open " << currentPath << std::endl;
+        return false;
+      }
+      ++files;
+      return true;
+    }
+    if(!output.is_open()) {
+      std::cout << "Got data without a file to write it to" << std::endl;
+      return false;
+    }
+    output.write(entry.data().data(), entry.data().size());
+    total += entry.data().size();
+    return output.good();
+  });
+  finishFile();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "Extracted " << files << " files (" << sizeToHuman(total) << ") from " << disk << " in " << seconds << "s";
+  if(seconds > 0) {
+    std::cout << ", " << sizeToHuman(total / seconds) << "/s";
+  }
+  std::cout << std::endl;
+  return ok;
+}
@@ -0,0 +1,124 @@
+/***************************************************************************
+ *   hash.cpp  --  This file is part of diskarbitratorctl.                 *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+#include <iomanip>
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+bool doHash(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl hash", "hash: Hashes a disk or image with several algorithms, reading it only once");
+  options.add_options()
+      ("disk", "Disk or image to hash", cxxopts::value<std::string>())
+      ("a,algorithms", "Comma separated md5, sha1 and sha256", cxxopts::value<std::vector<std::string>>()->default_value("md5,sha1,sha256"))
+      ("segment", "Also hash every piece of this many MB on its own", cxxopts::value<uint64_t>()->default_value("0"))
+      ("image-files", "Hash images as the files they are, not the disk inside them")
+      ("k,checkpoint", "Keep a checkpoint in this file. Run it again with the same checkpoint to resume", cxxopts::value<std::string>()->default_value(""))
+      ("w,weight", "Share of the disk next to other jobs reading it, from 1 to 1000", cxxopts::value<uint32_t>()->default_value("100"))
+      ("idle", "Only read while nothing else is using the disk")
+      ("p,progress", "Show hashing progress")
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+
+  std::string socketPath;
+  std::string disk;
+  std::vector<std::string> algorithms;
+  uint64_t segmentSize;
+  bool imageFiles;
+  std::string checkpoint;
+  uint32_t weight;
+  bool idle;
+  bool showProgress;
+
+  try {
+    options.parse_positional({"disk"});
+    options.positional_help("disk");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("disk")) {
+      std::cout << "disk argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    disk = result["disk"].as<std::string>();
+    algorithms = result["algorithms"].as<std::vector<std::string>>();
+    segmentSize = result["segment"].as<uint64_t>() << 20;
+    imageFiles = result.count("image-files");
+    checkpoint = result["checkpoint"].as<std::string>();
+    weight = result["weight"].as<uint32_t>();
+    idle = result.count("idle");
+    showProgress = result.count("progress");
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+  std::unique_ptr<diskarbitrator::HashResult> result = client.HashDisk(disk, algorithms, segmentSize, imageFiles, checkpoint, weight, idle, [showProgress](const diskarbitrator::HashProgress& progress) {
+    if(showProgress && progress.bytes_total()) {
+      std::cout << "[" << 100 * progress.bytes_hashed() / progress.bytes_total() << "%] "
+                << sizeToHuman(progress.bytes_hashed()) << " of " << sizeToHuman(progress.bytes_total())
+                << ", " << sizeToHuman(progress.bytes_per_second()) << "/s" << std::endl;
+    }
+  }, [](const google::protobuf::RepeatedPtrField<diskarbitrator::HashSegment>& segments) {
+    for(const auto& segment : segments) {
+      std::cout << std::setw(16) << segment.offset() << " " << std::setw(16) << segment.length();
+      for(const auto& digest : segment.digests()) {
+        std::cout << " " << digest.algorithm() << ":" << digest.digest();
+      }
+      std::cout << std::endl;
+    }
+  });
+  if(result == nullptr) {
+    return false;
+  }
+  std::cout << "Hashed " << sizeToHuman(result->bytes()) << " in " << result->duration_ms() << " ms" << std::endl;
+  if(result->resumed_from()) {
+    std::cout << "Resumed from the checkpoint at " << sizeToHuman(result->resumed_from()) << std::endl;
+  }
+  for(const auto& digest : result->digests()) {
+    std::cout << digest.algorithm() << ": " << digest.digest() << std::endl;
+  }
+  return true;
+}
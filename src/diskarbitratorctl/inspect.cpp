@@ -0,0 +1,131 @@
+/***************************************************************************
+ *   inspect.cpp  --  This file is part of diskarbitratorctl.              *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <fstream>
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+static void printImageDescription(const diskarbitrator::ImageDescription& desc) {
+  std::cout << "Format: " << desc.format() << std::endl;
+  if(desc.has_encrypted()) {
+    std::cout << "Is Encrypted: " << (desc.encrypted() ? "true" : "false") << std::endl;
+  }
+  if(desc.has_has_sla()) {
+    std::cout << "Has License Agreement: " << (desc.has_sla() ? "true" : "false") << std::endl;
+  }
+  if(desc.has_size()) {
+    std::cout << "Disk Size: " << sizeToHuman(desc.size()) << std::endl;
+  }
+  if(desc.partitions_size()) {
+    std::cout << "Chunks: " << desc.chunk_count() << std::endl;
+    std::cout << "Partitions:" << std::endl;
+    for(const auto& partition : desc.partitions()) {
+      std::cout << "\t" << partition.name() << ": sectors " << partition.first_sector()
+                << " - " << partition.first_sector() + partition.sector_count() << std::endl;
+    }
+  }
+}
+
+bool doInspect(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl inspect", "inspect: Inspects or reads a disk image without attaching it");
+  options.add_options()
+      ("image", "Image to inspect", cxxopts::value<std::string>())
+      ("o,output", "Instead of inspecting, read the disk inside the image to this file", cxxopts::value<std::string>())
+      ("offset", "Offset in bytes to read from", cxxopts::value<uint64_t>()->default_value("0"))
+      ("length", "Bytes to read. 0 reads up to the end of the disk", cxxopts::value<uint64_t>()->default_value("0"))
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+  
+  std::string socketPath;
+  std::string image;
+  std::string outputPath;
+  uint64_t offset;
+  uint64_t length;
+
+  try {
+    options.parse_positional({"image"});
+    options.positional_help("image");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("image")) {
+      std::cout << "image argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    image = result["image"].as<std::string>();
+    if(result.count("output")) {
+      outputPath = result["output"].as<std::string>();
+    }
+    offset = result["offset"].as<uint64_t>();
+    length = result["length"].as<uint64_t>();
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+
+  if(!outputPath.size()) {
+    std::unique_ptr<diskarbitrator::ImageDescription> desc = client.InspectImage(image);
+    if(desc == nullptr) {
+      return false;
+    }
+    std::cout << "Printing image description for " << image << ":" << std::endl;
+    printImageDescription(*desc);
+    return true;
+  }
+
+  std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+  if(!output) {
+    std::cout << "Unable to open " << outputPath << std::endl;
+    return false;
+  }
+  uint64_t total = 0;
+  bool ok = client.ReadImage(image, offset, length, [&output, &total](const diskarbitrator::ReadImageOutput& chunk) {
+    output.write(chunk.data().data(), chunk.data().size());
+    total += chunk.data().size();
+  });
+  std::cout << "Read " << sizeToHuman(total) << " from " << image << std::endl;
+  return ok && output.good();
+}
@@ -40,6 +40,17 @@ static void printHelp() {
   std::cout << "  umount     Unmounts the specified disk" << std::endl;
   std::cout << "  attach     Attaches a disk image (and optionally mounts it) to the system" << std::endl;
   std::cout << "  eject      Ejects a disk from the system" << std::endl;
+  std::cout << "  inspect    Inspects or reads a disk image without attaching it" << std::endl;
+  std::cout << "  verify     Verifies the checksums of UDIF images" << std::endl;
+  std::cout << "  partitions Shows the partition table and filesystems of a disk or image" << std::endl;
+  std::cout << "  extract    Copies files off a FAT/exFAT disk or image without mounting it" << std::endl;
+  std::cout << "  export     Serves a disk or image read-only over NBD" << std::endl;
+  std::cout << "  cache      Shows how the shared block cache and attach coalescing are doing" << std::endl;
+  std::cout << "  map        Maps which parts of a disk or image hold data" << std::endl;
+  std::cout << "  acquire    Images a disk into a raw image, hashing it on the way" << std::endl;
+  std::cout << "  hash       Hashes a disk or image with MD5, SHA-1 and SHA-256 in one read" << std::endl;
+  std::cout << "  diff       Compares two disks or images block by block" << std::endl;
+  std::cout << "  baseline   Takes a Merkle tree baseline of a disk, or checks it against one" << std::endl;
   std::cout << std::endl;  
 }
 
@@ -82,6 +93,50 @@ int main(int argc, char** argv) {
     if(!doList(argc - 1, argv + 1)) {
       return 1;
     }
+  } else if(command == "inspect") {
+    if(!doInspect(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "verify") {
+    if(!doVerify(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "partitions") {
+    if(!doPartitions(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "extract") {
+    if(!doExtract(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "export") {
+    if(!doExport(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "cache") {
+    if(!doCache(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "map") {
+    if(!doMap(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "acquire") {
+    if(!doAcquire(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "hash") {
+    if(!doHash(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "diff") {
+    if(!doDiff(argc - 1, argv + 1)) {
+      return 1;
+    }
+  } else if(command == "baseline") {
+    if(!doBaseline(argc - 1, argv + 1)) {
+      return 1;
+    }
   } else if(command == "arbitrate") {
     if(!doArbitrate(argc - 1, argv + 1)) {
       return 1;
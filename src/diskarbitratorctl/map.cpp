@@ -0,0 +1,120 @@
+/***************************************************************************
+ *   map.cpp  --  This file is part of diskarbitratorctl.                  *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#include <iomanip>
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+static const char* blockKindName(diskarbitrator::BlockKind kind, bool hole) {
+  if(hole) {
+    return "hole";
+  }
+  switch(kind) {
+    case diskarbitrator::BLOCK_ZERO:
+      return "zero";
+    case diskarbitrator::BLOCK_CONSTANT:
+      return "constant";
+    default:
+      return "data";
+  }
+}
+
+bool doMap(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl map", "map: Maps which parts of a disk or image hold data");
+  options.add_options()
+      ("disk", "Disk or image to map", cxxopts::value<std::string>())
+      ("b,block-size", "Granularity of the map in bytes", cxxopts::value<uint32_t>()->default_value("4096"))
+      ("summary", "Only print the totals")
+      ("idle", "Only read while nothing else is using the disk")
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+
+  std::string socketPath;
+  std::string disk;
+  uint32_t blockSize;
+  bool summaryOnly;
+  bool idle;
+
+  try {
+    options.parse_positional({"disk"});
+    options.positional_help("disk");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("disk")) {
+      std::cout << "disk argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    disk = result["disk"].as<std::string>();
+    blockSize = result["block-size"].as<uint32_t>();
+    summaryOnly = result.count("summary");
+    idle = result.count("idle");
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+  std::unique_ptr<diskarbitrator::AllocationSummary> summary = client.MapAllocation(disk, blockSize, idle, [summaryOnly](const google::protobuf::RepeatedPtrField<diskarbitrator::AllocationRun>& runs) {
+    if(summaryOnly) {
+      return;
+    }
+    for(const auto& run : runs) {
+      std::cout << std::setw(16) << run.offset() << " " << std::setw(16) << run.length() << " " << blockKindName(run.kind(), run.hole());
+      if(run.kind() == diskarbitrator::BLOCK_CONSTANT) {
+        std::cout << " 0x" << std::hex << std::setfill('0') << std::setw(2) << run.fill() << std::dec << std::setfill(' ');
+      }
+      std::cout << std::endl;
+    }
+  });
+  if(summary == nullptr) {
+    return false;
+  }
+  std::cout << "Data: " << sizeToHuman(summary->data_bytes()) << ", zero: " << sizeToHuman(summary->zero_bytes())
+            << " (" << sizeToHuman(summary->hole_bytes()) << " in holes), constant: " << sizeToHuman(summary->constant_bytes()) << std::endl;
+  std::cout << summary->run_count() << " runs in " << summary->duration_ms() << " ms" << std::endl;
+  return true;
+}
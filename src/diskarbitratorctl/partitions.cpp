@@ -0,0 +1,132 @@
+/***************************************************************************
+ *   partitions.cpp  --  This file is part of diskarbitratorctl.           *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+static void printVolume(const diskarbitrator::VolumeInfo& volume, const std::string& indent) {
+  std::cout << indent << "Filesystem: " << volume.kind() << std::endl;
+  if(volume.has_label() && volume.label().size()) {
+    std::cout << indent << "Volume Name: " << volume.label() << std::endl;
+  }
+  if(volume.has_uuid() && volume.uuid().size()) {
+    std::cout << indent << "Volume UUID: " << volume.uuid() << std::endl;
+  }
+  if(volume.block_size()) {
+    std::cout << indent << "Block Size: " << volume.block_size() << std::endl;
+  }
+}
+
+static void printPartitionTable(const diskarbitrator::PartitionTableDescription& desc) {
+  std::cout << "Scheme: " << desc.scheme() << std::endl;
+  std::cout << "Sector Size: " << desc.sector_size() << std::endl;
+  if(desc.has_disk_guid()) {
+    std::cout << "Disk GUID: " << desc.disk_guid() << std::endl;
+  }
+  if(desc.has_volume()) {
+    printVolume(desc.volume(), "");
+  }
+  for(const auto& warning : desc.warnings()) {
+    std::cout << "WARNING: " << warning << std::endl;
+  }
+  for(const auto& partition : desc.partitions()) {
+    std::cout << std::endl;
+    std::cout << "Partition " << partition.index() << ":" << std::endl;
+    std::cout << "\tOffset: " << partition.offset() << std::endl;
+    std::cout << "\tSize: " << sizeToHuman(partition.size()) << std::endl;
+    std::cout << "\tType: " << partition.type();
+    if(partition.has_type_name()) {
+      std::cout << " (" << partition.type_name() << ")";
+    }
+    std::cout << std::endl;
+    if(partition.has_name() && partition.name().size()) {
+      std::cout << "\tName: " << partition.name() << std::endl;
+    }
+    if(partition.has_uuid()) {
+      std::cout << "\tUUID: " << partition.uuid() << std::endl;
+    }
+    if(partition.has_bootable()) {
+      std::cout << "\tIs Bootable: " << (partition.bootable() ? "true" : "false") << std::endl;
+    }
+    if(partition.has_volume()) {
+      printVolume(partition.volume(), "\t");
+    }
+  }
+}
+
+bool doPartitions(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl partitions", "partitions: Shows the partition table and filesystems of a disk or image");
+  options.add_options()
+      ("disk", "Disk (BSD name or device path) or image to read", cxxopts::value<std::string>())
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+  
+  std::string socketPath;
+  std::string disk;
+
+  try {
+    options.parse_positional({"disk"});
+    options.positional_help("disk");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("disk")) {
+      std::cout << "disk argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    disk = result["disk"].as<std::string>();
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+  std::unique_ptr<diskarbitrator::PartitionTableDescription> desc = client.InspectPartitions(disk);
+  if(desc == nullptr) {
+    return false;
+  }
+  std::cout << "Printing partition table for " << disk << ":" << std::endl;
+  printPartitionTable(*desc);
+  return true;
+}
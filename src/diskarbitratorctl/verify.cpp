@@ -0,0 +1,109 @@
+/***************************************************************************
+ *   verify.cpp  --  This file is part of diskarbitratorctl.               *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratorctl is free software: you can redistribute it and/or    *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratorctl is distributed in the hope that it will be useful,  *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <iomanip>
+#include <iostream>
+
+#include <cxxopts.hpp>
+
+#include "diskarbitrator.grpc.pb.h"
+
+#include "common.hpp"
+#include "client.hpp"
+#include "socket.hpp"
+
+bool doVerify(int argc, char** argv) {
+  cxxopts::Options options("diskarbitratorctl verify", "verify: Verifies the checksums of UDIF images");
+  options.add_options()
+      ("images", "Images to verify", cxxopts::value<std::vector<std::string>>())
+      ("p,progress", "Show verification progress")
+      ("s,socket", "diskarbitratord socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("h,help", "Print usage")
+  ;
+  
+  std::string socketPath;
+  std::vector<std::string> images;
+  bool showProgress;
+
+  try {
+    options.parse_positional({"images"});
+    options.positional_help("image [image...]");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::cout << options.help() << std::endl;
+      return true;
+    }
+
+    if(!result.count("images")) {
+      std::cout << "image argument was not provided" << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> unmatched = result.unmatched();
+    if(unmatched.size()) {
+      std::cout << "Unrecognized argument: " << unmatched[0] << std::endl;
+      std::cout << options.help() << std::endl;
+      return false;
+    }
+
+    socketPath = result["socket"].as<std::string>();
+    images = result["images"].as<std::vector<std::string>>();
+    showProgress = result.count("progress");
+  } catch(const cxxopts::exceptions::exception& ex) {
+    std::cout << ex.what() << std::endl;
+    std::cout << options.help() << std::endl;
+    return false;
+  }
+
+  DiskArbitratorClient client = getClient(socketPath);
+
+  bool allValid = true;
+  for(const auto& image : images) {
+    std::unique_ptr<diskarbitrator::VerifyImageResult> result = client.VerifyImage(image, [showProgress](const diskarbitrator::VerifyProgress& progress) {
+      if(showProgress && progress.bytes_total()) {
+        std::cout << "[" << 100 * progress.bytes_done() / progress.bytes_total() << "%] "
+                  << sizeToHuman(progress.bytes_done()) << " of " << sizeToHuman(progress.bytes_total()) << std::endl;
+      }
+    });
+    if(result == nullptr) {
+      allValid = false;
+      continue;
+    }
+    std::cout << image << ": " << (result->valid() ? "VALID" : "INVALID") << " (" << result->duration_ms() << " ms)" << std::endl;
+    for(const auto& checksum : result->checksums()) {
+      std::cout << "\t" << checksum.name() << ": ";
+      if(!checksum.checked()) {
+        std::cout << "not a CRC32 checksum, skipped" << std::endl;
+        continue;
+      }
+      std::cout << std::hex << std::setfill('0') << std::setw(8) << checksum.actual();
+      if(checksum.actual() != checksum.expected()) {
+        std::cout << " MISMATCH, expected " << std::setw(8) << checksum.expected();
+      }
+      std::cout << std::dec << std::endl;
+    }
+    allValid = allValid && result->valid();
+  }
+
+  return allValid;
+}
@@ -0,0 +1,928 @@
+/***************************************************************************
+ *   acquisition.cpp  --  This file is part of diskarbitratord.            *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "acquisition.hpp"
+#include "block_reader.hpp"
+#include "block_scan.hpp"
+#include "checkpoint.hpp"
+#include "container.hpp"
+#include "hash.hpp"
+#include "image_reader.hpp"
+#include "image_sniffer.hpp"
+#include "pipeline.hpp"
+#include "rescue.hpp"
+#include "scope_guard.hpp"
+
+// What the image hash is saved as in acquisition checkpoints
+#define ACQUIRE_CHECKPOINT_HASH "sha256"
+// How long hashing waits for its stages to catch up before a checkpoint,
+// before checking whether one of them failed
+#define HASH_DRAIN_POLL_MS 100
+
+typedef struct AcquireBuffer {
+  std::shared_ptr<uint8_t> data;
+  uint64_t offset;
+  size_t length;
+  // The image hash right after this buffer, only when checkpointing
+  std::string hashState;
+} AcquireBuffer;
+
+// Everything the stages share. The first error stops the whole pipeline
+class Acquisition {
+  public:
+    Channel<AcquireBuffer> free;
+    Channel<AcquireBuffer> toHash;
+    Channel<AcquireBuffer> toWrite;
+    std::atomic<uint64_t> bytesRead{0};
+
+    void fail(std::exception_ptr error) {
+      {
+        const std::lock_guard<std::mutex> lock(this->errorMutex);
+        if(!this->error) {
+          this->error = error;
+        }
+      }
+      this->stop();
+    }
+
+    bool failed() {
+      const std::lock_guard<std::mutex> lock(this->errorMutex);
+      return this->error != nullptr;
+    }
+
+    void stop() {
+      this->free.close();
+      this->toHash.close();
+      this->toWrite.close();
+    }
+
+    void rethrow() {
+      const std::lock_guard<std::mutex> lock(this->errorMutex);
+      if(this->error) {
+        std::rethrow_exception(this->error);
+      }
+    }
+
+  private:
+    std::mutex errorMutex;
+    std::exception_ptr error;
+};
+
+int openAcquisitionSource(const std::string& path) {
+  int flags = O_RDONLY;
+#ifdef O_DIRECT
+  flags |= O_DIRECT;
+#endif
+  int fd = open(path.c_str(), flags);
+  // Some filesystems (tmpfs, for one) don't do O_DIRECT
+  if(fd == -1 && errno == EINVAL && flags != O_RDONLY) {
+    fd = open(path.c_str(), O_RDONLY);
+  }
+  if(fd == -1) {
+    throw std::runtime_error("Unable to open " + path + ": " + std::string(strerror(errno)));
+  }
+#ifdef F_NOCACHE
+  // Each block is read once, caching it would only push out something useful
+  fcntl(fd, F_NOCACHE, 1);
+#endif
+  return fd;
+}
+
+// Writes the image, skipping zeroes when it's sparse. Anything skipped that
+// the file already has data for gets a hole punched instead
+class ImageWriter {
+  public:
+    ImageWriter(int fd, bool sparse) : fd(fd), sparse(sparse) {
+      struct stat st;
+      if(fstat(fd, &st) != 0) {
+        throw std::runtime_error("Unable to stat image: " + std::string(strerror(errno)));
+      }
+      this->fileSize = st.st_size;
+      this->blockSize = ACQUIRE_SPARSE_BLOCK_SIZE;
+      if(st.st_blksize > ACQUIRE_SPARSE_BLOCK_SIZE && st.st_blksize <= ACQUIRE_BUFFER_SIZE && ACQUIRE_BUFFER_SIZE % st.st_blksize == 0) {
+        this->blockSize = st.st_blksize;
+      }
+    }
+
+    // `offset` has to be a multiple of ACQUIRE_BUFFER_SIZE
+    void write(const uint8_t* data, size_t len, uint64_t offset) {
+      if(!this->sparse) {
+        this->writeData(data, len, offset);
+        return;
+      }
+      size_t position = 0;
+      while(position < len) {
+        const bool zero = blockIsFilled(data + position, std::min<size_t>(this->blockSize, len - position), 0);
+        size_t end = position + this->blockSize;
+        while(end < len && blockIsFilled(data + end, std::min<size_t>(this->blockSize, len - end), 0) == zero) {
+          end += this->blockSize;
+        }
+        end = std::min(end, len);
+        if(zero) {
+          this->skip(offset + position, end - position);
+        } else {
+          this->writeData(data + position, end - position, offset + position);
+        }
+        position = end;
+      }
+    }
+
+    // Trailing zeroes only become a hole once the file has its full size
+    void finish(uint64_t size) {
+      if(ftruncate(this->fd, size) != 0) {
+        throw std::runtime_error("Unable to set the image size: " + std::string(strerror(errno)));
+      }
+    }
+
+    // Past the last byte written, holes at the end don't count
+    uint64_t size() const {
+      return this->fileSize;
+    }
+
+    uint64_t sparseBytes = 0;
+
+  private:
+    void writeData(const uint8_t* data, size_t len, uint64_t offset) {
+      pwriteFully(this->fd, data, len, offset);
+      this->fileSize = std::max<uint64_t>(this->fileSize, offset + len);
+    }
+
+    void skip(uint64_t offset, uint64_t len) {
+      this->sparseBytes += len;
+      if(offset >= this->fileSize) {
+        return;
+      }
+      len = std::min(len, this->fileSize - offset);
+#if defined(FALLOC_FL_PUNCH_HOLE)
+      if(fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return;
+      }
+#elif defined(F_PUNCHHOLE)
+      fpunchhole_t hole = {0, 0, static_cast<off_t>(offset), static_cast<off_t>(len)};
+      if(fcntl(this->fd, F_PUNCHHOLE, &hole) == 0) {
+        return;
+      }
+#endif
+      // No holes on this filesystem, the zeroes have to be written out
+      static const uint8_t zeroes[ACQUIRE_SPARSE_BLOCK_SIZE] = {0};
+      for(uint64_t position = 0; position < len; position += sizeof(zeroes)) {
+        pwriteFully(this->fd, zeroes, std::min<uint64_t>(sizeof(zeroes), len - position), offset + position);
+      }
+      this->sparseBytes -= len;
+    }
+
+    int fd;
+    bool sparse;
+    uint32_t blockSize;
+    uint64_t fileSize;
+};
+
+// Keeps as many reads in flight as the queue and the free buffers allow.
+// They finish in any order, but buffers are handed on in order, since that's
+// the only way they can be hashed. `start` has to be a multiple of
+// ACQUIRE_BUFFER_SIZE
+static void readStage(Acquisition& acquisition, BlockReader& reader, uint64_t start, uint64_t size, IOScheduler::Job* ioJob) {
+  // Buffers being read by offset, with how many of their reads are still out
+  std::map<uint64_t, std::pair<AcquireBuffer, unsigned int>> reading;
+  std::vector<BlockCompletion> completions;
+  // Nothing can go away while the kernel may still be reading into it
+  ScopeGuard drain([&]() {
+    try {
+      while(reader.inFlight()) {
+        reader.wait(completions);
+      }
+    } catch(...) {
+    }
+  });
+  try {
+    std::unique_ptr<ScopedIOPriority> priority;
+    if(ioJob) {
+      priority.reset(new ScopedIOPriority(ioJob->ioClass(), ioJob->weight()));
+    }
+    const unsigned int readsPerBuffer = ACQUIRE_BUFFER_SIZE / ACQUIRE_READ_SIZE;
+    uint64_t nextRead = start;
+    uint64_t nextHash = start;
+    while(nextHash < size) {
+      AcquireBuffer buffer;
+      while(nextRead < size && reader.inFlight() + readsPerBuffer <= reader.depth() &&
+            (reading.empty() ? acquisition.free.pop(buffer) : acquisition.free.tryPop(buffer))) {
+        buffer.offset = nextRead;
+        buffer.length = std::min<uint64_t>(ACQUIRE_BUFFER_SIZE, size - nextRead);
+        if(ioJob) {
+          ioJob->acquire(buffer.length);
+        }
+        unsigned int reads = 0;
+        // Always whole reads, O_DIRECT wants aligned lengths. The device just
+        // ends early for the last one
+        for(uint64_t piece = 0; piece < buffer.length; piece += ACQUIRE_READ_SIZE, ++reads) {
+          reader.submit(buffer.data.get() + piece, ACQUIRE_READ_SIZE, nextRead + piece, nextRead + piece);
+        }
+        reading[nextRead] = std::make_pair(buffer, reads);
+        nextRead += buffer.length;
+      }
+      if(reading.empty()) {
+        // Stopped
+        return;
+      }
+
+      completions.clear();
+      reader.wait(completions);
+      for(const auto& completion : completions) {
+        if(completion.result < 0) {
+          throw std::runtime_error("Unable to read at offset " + std::to_string(completion.tag) + ": " + std::string(strerror(-completion.result)));
+        }
+        const uint64_t expected = std::min<uint64_t>(ACQUIRE_READ_SIZE, size - completion.tag);
+        if(static_cast<uint64_t>(completion.result) < expected) {
+          throw std::runtime_error("Short read at offset " + std::to_string(completion.tag));
+        }
+        --reading[completion.tag - completion.tag % ACQUIRE_BUFFER_SIZE].second;
+        acquisition.bytesRead += expected;
+      }
+      while(reading.size() && reading.begin()->first == nextHash && !reading.begin()->second.second) {
+        AcquireBuffer done = reading.begin()->second.first;
+        reading.erase(reading.begin());
+        nextHash += done.length;
+        if(!acquisition.toHash.push(done)) {
+          return;
+        }
+      }
+    }
+    acquisition.toHash.close();
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+}
+
+// Images get read one buffer at a time, their readers decompress on several
+// threads already
+static void imageReadStage(Acquisition& acquisition, ImageReader& reader, uint64_t start, uint64_t size, IOScheduler::Job* ioJob) {
+  try {
+    std::unique_ptr<ScopedIOPriority> priority;
+    if(ioJob) {
+      priority.reset(new ScopedIOPriority(ioJob->ioClass(), ioJob->weight()));
+    }
+    uint64_t offset = start;
+    AcquireBuffer buffer;
+    while(offset < size && acquisition.free.pop(buffer)) {
+      buffer.offset = offset;
+      buffer.length = std::min<uint64_t>(ACQUIRE_BUFFER_SIZE, size - offset);
+      if(ioJob) {
+        ioJob->acquire(buffer.length);
+      }
+      if(!readExact(reader, offset, buffer.data.get(), buffer.length)) {
+        throw std::runtime_error("Short read at offset " + std::to_string(offset));
+      }
+      acquisition.bytesRead += buffer.length;
+      offset += buffer.length;
+      if(!acquisition.toHash.push(buffer)) {
+        return;
+      }
+    }
+    acquisition.toHash.close();
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+}
+
+static void hashStage(Acquisition& acquisition, SHA256& hash, bool saveStates) {
+  try {
+    AcquireBuffer buffer;
+    while(acquisition.toHash.pop(buffer)) {
+      hash.update(buffer.data.get(), buffer.length);
+      if(saveStates) {
+        buffer.hashState = hash.saveState();
+      }
+      if(!acquisition.toWrite.push(buffer)) {
+        return;
+      }
+    }
+    acquisition.toWrite.close();
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+}
+
+// Hands every buffer an acquisition gets to go round to its free channel
+static std::vector<std::pair<void*, size_t>> allocateBuffers(Acquisition& acquisition) {
+  std::vector<std::pair<void*, size_t>> buffers;
+  for(int i = 0; i < ACQUIRE_BUFFER_COUNT; ++i) {
+    AcquireBuffer buffer = {allocateAligned(ACQUIRE_BUFFER_SIZE), 0, 0, ""};
+    buffers.push_back(std::make_pair(buffer.data.get(), ACQUIRE_BUFFER_SIZE));
+    acquisition.free.push(buffer);
+  }
+  return buffers;
+}
+
+static std::unique_ptr<BlockReader> openPipelineReader(int fd, BlockReaderBackend backend, unsigned int depth, const std::vector<std::pair<void*, size_t>>& buffers) {
+  std::unique_ptr<BlockReader> blockReader = openBlockReader(fd, backend, depth, buffers);
+  // Enough of a queue for at least a whole buffer at a time
+  if(blockReader->depth() < ACQUIRE_BUFFER_SIZE / ACQUIRE_READ_SIZE) {
+    blockReader = openBlockReader(fd, backend, ACQUIRE_BUFFER_SIZE / ACQUIRE_READ_SIZE, buffers);
+  }
+  return blockReader;
+}
+
+// Throws unless `checkpoint` was taken from this very disk, at a point the
+// pipeline can start from
+static void checkResumable(const Checkpoint& checkpoint, const std::string& identity, uint64_t size, const std::string& source) {
+  if(checkpoint.identity != identity || checkpoint.size != size) {
+    throw std::runtime_error(source + " isn't the disk the checkpoint was taken from");
+  }
+  if(checkpoint.offset % ACQUIRE_BUFFER_SIZE && checkpoint.offset != size) {
+    throw std::runtime_error("Invalid checkpoint offset " + std::to_string(checkpoint.offset));
+  }
+}
+
+AcquireResult acquireDisk(const std::string& source, const std::string& destination, const AcquireOptions& options, std::function<bool(const AcquireProgress&)> onProgress) {
+  std::unique_ptr<IOScheduler::Job> ioJob;
+  std::shared_ptr<IOScheduler> scheduler = sharedIOScheduler();
+  if(scheduler) {
+    ioJob = scheduler->join(ioDeviceKey(source), options.bus, options.ioClass, options.ioWeight);
+  }
+  // Rescues have their map, and a container's index would have to go in the
+  // checkpoint too
+  if(options.checkpoint.size() && (options.rescueMap.size() || options.container)) {
+    throw std::runtime_error("Only raw images can be checkpointed");
+  }
+  if(options.rescueMap.size()) {
+    DeviceRescueSource rescueSource(source);
+    return rescueDisk(rescueSource, destination, options, onProgress, ioJob.get());
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int sourceFd = openAcquisitionSource(source);
+  ScopeGuard sourceGuard([sourceFd]() {
+    close(sourceFd);
+  });
+  const uint64_t size = fileOrDeviceSize(sourceFd);
+
+  Checkpoint checkpoint;
+  bool resuming = false;
+  if(options.checkpoint.size()) {
+    const std::string identity = diskIdentity(sourceFd, size, options.identity);
+    resuming = loadCheckpoint(options.checkpoint, checkpoint);
+    if(resuming) {
+      checkResumable(checkpoint, identity, size, source);
+    }
+    checkpoint.identity = identity;
+    checkpoint.size = size;
+  }
+
+  // Never overwrite anything, it could be evidence too. Resuming carries on
+  // with the image the checkpoint was taken for, which has to be there
+  int destinationFd = resuming ? open(destination.c_str(), O_WRONLY) : open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if(destinationFd == -1) {
+    throw std::runtime_error("Unable to " + std::string(resuming ? "open " : "create ") + destination + ": " + std::string(strerror(errno)));
+  }
+  ScopeGuard destinationGuard([destinationFd]() {
+    close(destinationFd);
+  });
+  if(resuming) {
+    // If the image lost anything the checkpoint says was written, none of it
+    // can be trusted. Anything past it gets written again
+    struct stat st;
+    if(fstat(destinationFd, &st) != 0) {
+      throw std::runtime_error("Unable to stat " + destination + ": " + std::string(strerror(errno)));
+    }
+    if(static_cast<uint64_t>(st.st_size) < checkpoint.outputSize) {
+      throw std::runtime_error(destination + " is shorter than when the checkpoint was taken");
+    }
+    if(ftruncate(destinationFd, checkpoint.offset) != 0) {
+      throw std::runtime_error("Unable to truncate " + destination + ": " + std::string(strerror(errno)));
+    }
+  }
+
+  ImageWriter writer(destinationFd, options.sparse && !options.container);
+  writer.sparseBytes = checkpoint.sparseBytes;
+  std::unique_ptr<ContainerWriter> container;
+  if(options.container) {
+    container.reset(new ContainerWriter(destinationFd, options.compression));
+  }
+  Acquisition acquisition;
+  std::unique_ptr<BlockReader> blockReader = openPipelineReader(sourceFd, options.ioBackend, options.queueDepth, allocateBuffers(acquisition));
+  SHA256 hash;
+  if(resuming) {
+    auto state = checkpoint.states.find(ACQUIRE_CHECKPOINT_HASH);
+    if(state == checkpoint.states.end()) {
+      throw std::runtime_error("Checkpoint " + options.checkpoint + " has no image hash");
+    }
+    hash.restoreState(state->second);
+  }
+  const uint64_t resumedFrom = checkpoint.offset;
+  acquisition.bytesRead = resumedFrom;
+  std::thread reader(readStage, std::ref(acquisition), std::ref(*blockReader), resumedFrom, size, ioJob.get());
+  std::thread hasher(hashStage, std::ref(acquisition), std::ref(hash), options.checkpoint.size() > 0);
+
+  // Writing happens right here, so progress is reported from this thread
+  AcquireProgress progress = {};
+  progress.bytesRead = resumedFrom;
+  progress.bytesWritten = resumedFrom;
+  progress.bytesTotal = size;
+  auto lastProgress = start;
+  auto reportProgress = [&]() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - start).count();
+    progress.bytesRead = acquisition.bytesRead;
+    progress.bytesPerSecond = seconds > 0 ? (progress.bytesWritten - resumedFrom) / seconds : 0;
+    lastProgress = now;
+    return onProgress(progress);
+  };
+  // Hash state after the last buffer written
+  std::string hashState;
+  auto lastCheckpoint = start;
+  auto saveProgress = [&]() {
+    // The checkpoint can't get ahead of what's really on the disk
+    if(fdatasync(destinationFd) != 0) {
+      throw std::runtime_error("Unable to flush " + destination + ": " + std::string(strerror(errno)));
+    }
+    checkpoint.offset = progress.bytesWritten;
+    checkpoint.outputSize = writer.size();
+    checkpoint.sparseBytes = writer.sparseBytes;
+    checkpoint.states[ACQUIRE_CHECKPOINT_HASH] = hashState;
+    saveCheckpoint(options.checkpoint, checkpoint);
+    lastCheckpoint = std::chrono::steady_clock::now();
+  };
+  try {
+    AcquireBuffer buffer;
+    while(acquisition.toWrite.pop(buffer)) {
+      if(container) {
+        container->write(buffer.data.get(), buffer.length);
+      } else {
+        writer.write(buffer.data.get(), buffer.length, buffer.offset);
+      }
+      progress.bytesWritten += buffer.length;
+      hashState.swap(buffer.hashState);
+      acquisition.free.push(buffer);
+      auto now = std::chrono::steady_clock::now();
+      if(options.checkpoint.size() && progress.bytesWritten < size && now - lastCheckpoint >= std::chrono::milliseconds(options.checkpointInterval)) {
+        saveProgress();
+      }
+      if(now - lastProgress >= std::chrono::milliseconds(ACQUIRE_PROGRESS_INTERVAL_MS) && !reportProgress()) {
+        acquisition.stop();
+        break;
+      }
+    }
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+  acquisition.stop();
+  reader.join();
+  hasher.join();
+  // Cancelled or failed, the next run can pick up from whatever got written.
+  // The first error is the one that gets thrown
+  try {
+    if(options.checkpoint.size() && progress.bytesWritten < size && progress.bytesWritten > checkpoint.offset) {
+      saveProgress();
+    }
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+  acquisition.rethrow();
+
+  AcquireResult result;
+  result.bytes = progress.bytesWritten;
+  result.complete = progress.bytesWritten == size;
+  result.sparseBytes = writer.sparseBytes;
+  result.storedBytes = 0;
+  result.badBytes = 0;
+  result.readErrors = 0;
+  result.resumedFrom = resumedFrom;
+  result.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  if(!result.complete) {
+    // Cancelled, the hash would be of half a disk
+    return result;
+  }
+  result.sha256 = hash.finish();
+  if(container) {
+    container->finish(result.sha256);
+    result.storedBytes = container->storedBytes();
+  } else {
+    writer.finish(size);
+    result.storedBytes = size - writer.sparseBytes;
+  }
+  if(fsync(destinationFd) != 0) {
+    throw std::runtime_error("Unable to flush " + destination + ": " + std::string(strerror(errno)));
+  }
+  if(options.checkpoint.size()) {
+    // A stale one would only get the image truncated and finished again
+    unlink(options.checkpoint.c_str());
+  }
+  reportProgress();
+  return result;
+}
+
+// One algorithm, over the whole disk or segment by segment
+typedef struct DigestStage {
+  std::string algorithm;
+  // 0 for the whole disk
+  uint64_t segmentSize;
+  Channel<AcquireBuffer> input;
+  std::vector<std::string> digests;
+  std::unique_ptr<Hasher> hasher;
+  // Of the segment it's on
+  uint64_t hashed;
+
+  // What it's saved as in checkpoints
+  std::string name() const {
+    return this->segmentSize ? this->algorithm + "/segments" : this->algorithm;
+  }
+} DigestStage;
+
+static void digestStage(Acquisition& acquisition, DigestStage& stage, std::function<void(const AcquireBuffer&)> release) {
+  try {
+    AcquireBuffer buffer;
+    while(stage.input.pop(buffer)) {
+      if(!stage.segmentSize) {
+        stage.hasher->update(buffer.data.get(), buffer.length);
+      }
+      for(size_t position = 0; stage.segmentSize && position < buffer.length;) {
+        const size_t len = std::min<uint64_t>(buffer.length - position, stage.segmentSize - stage.hashed);
+        stage.hasher->update(buffer.data.get() + position, len);
+        position += len;
+        stage.hashed += len;
+        if(stage.hashed == stage.segmentSize) {
+          stage.digests.push_back(stage.hasher->finish());
+          stage.hasher = makeHasher(stage.algorithm);
+          stage.hashed = 0;
+        }
+      }
+      release(buffer);
+    }
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+}
+
+// The image formats hashed and compared as the disk inside them
+static bool readAsImage(const std::string& path) {
+  switch(sniffImage(path).format) {
+    case IMAGE_FORMAT_UDIF:
+    case IMAGE_FORMAT_EWF:
+    case IMAGE_FORMAT_SPLIT_RAW:
+    case IMAGE_FORMAT_CONTAINER:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// A disk, or the disk inside an image, feeding a pipeline's toHash channel
+class PipelineSource {
+  public:
+    PipelineSource(const std::string& path, bool imageFiles, BlockReaderBackend backend, unsigned int depth, Acquisition& acquisition, const std::vector<std::pair<void*, size_t>>& buffers) : acquisition(acquisition) {
+      if(!imageFiles && readAsImage(path)) {
+        this->imageReader = openImageReader(path);
+        this->size = this->imageReader->size();
+      } else {
+        this->fd = openAcquisitionSource(path);
+        this->size = fileOrDeviceSize(this->fd);
+        this->blockReader = openPipelineReader(this->fd, backend, depth, buffers);
+      }
+    }
+
+    ~PipelineSource() {
+      // The descriptor goes only once the block reader is done with it
+      this->blockReader.reset();
+      if(this->fd != -1) {
+        close(this->fd);
+      }
+    }
+
+    // Everything from `start` to `end`, in order. `start` has to be a
+    // multiple of ACQUIRE_BUFFER_SIZE
+    std::thread read(uint64_t start, uint64_t end, IOScheduler::Job* ioJob) {
+      if(this->imageReader) {
+        return std::thread(imageReadStage, std::ref(this->acquisition), std::ref(*this->imageReader), start, end, ioJob);
+      }
+      return std::thread(readStage, std::ref(this->acquisition), std::ref(*this->blockReader), start, end, ioJob);
+    }
+
+    std::string identity(const std::string& extra) {
+      return this->imageReader ? diskIdentity(*this->imageReader, extra) : diskIdentity(this->fd, this->size, extra);
+    }
+
+    uint64_t size;
+
+  private:
+    Acquisition& acquisition;
+    int fd = -1;
+    std::unique_ptr<BlockReader> blockReader;
+    std::unique_ptr<ImageReader> imageReader;
+};
+
+HashResult hashDisk(const std::string& source, const HashOptions& options, std::function<bool(const HashProgress&)> onProgress) {
+  std::vector<std::string> algorithms;
+  for(const auto& algorithm : options.algorithms) {
+    // Finds out about unknown ones before reading anything
+    makeHasher(algorithm);
+    if(std::find(algorithms.begin(), algorithms.end(), algorithm) == algorithms.end()) {
+      algorithms.push_back(algorithm);
+    }
+  }
+  if(algorithms.empty()) {
+    throw std::runtime_error("No hash algorithms requested");
+  }
+  std::unique_ptr<IOScheduler::Job> ioJob;
+  std::shared_ptr<IOScheduler> scheduler = sharedIOScheduler();
+  if(scheduler) {
+    ioJob = scheduler->join(ioDeviceKey(source), options.bus, options.ioClass, options.ioWeight);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  Acquisition acquisition;
+  PipelineSource disk(source, options.imageFiles, options.ioBackend, options.queueDepth, acquisition, allocateBuffers(acquisition));
+  const uint64_t size = disk.size;
+
+  std::vector<std::unique_ptr<DigestStage>> stages;
+  for(const auto& algorithm : algorithms) {
+    stages.emplace_back(new DigestStage{algorithm, 0, {}, {}, makeHasher(algorithm), 0});
+    if(options.segmentSize) {
+      stages.emplace_back(new DigestStage{algorithm, options.segmentSize, {}, {}, makeHasher(algorithm), 0});
+    }
+  }
+
+  Checkpoint checkpoint;
+  if(options.checkpoint.size()) {
+    const std::string identity = disk.identity(options.identity);
+    if(loadCheckpoint(options.checkpoint, checkpoint)) {
+      checkResumable(checkpoint, identity, size, source);
+      // Every stage has to pick up exactly where the checkpoint left it, or
+      // it was taken with other algorithms or segments
+      for(auto& stage : stages) {
+        auto state = checkpoint.states.find(stage->name());
+        if(state == checkpoint.states.end() || checkpoint.states.size() != stages.size()) {
+          throw std::runtime_error("Checkpoint " + options.checkpoint + " was taken with other algorithms");
+        }
+        stage->hasher->restoreState(state->second);
+        if(stage->segmentSize) {
+          stage->digests = checkpoint.segments[stage->name()];
+          stage->hashed = checkpoint.offset % stage->segmentSize;
+          if(stage->digests.size() != checkpoint.offset / stage->segmentSize) {
+            throw std::runtime_error("Checkpoint " + options.checkpoint + " was taken with another segment size");
+          }
+        }
+      }
+    }
+    checkpoint.identity = identity;
+    checkpoint.size = size;
+  }
+  const uint64_t resumedFrom = checkpoint.offset;
+
+  // Buffers go back once every stage is done with them
+  std::mutex releaseMutex;
+  std::condition_variable released;
+  std::map<uint8_t*, size_t> releases;
+  std::atomic<uint64_t> bytesHashed{resumedFrom};
+  auto release = [&](const AcquireBuffer& buffer) {
+    {
+      const std::lock_guard<std::mutex> lock(releaseMutex);
+      if(++releases[buffer.data.get()] < stages.size()) {
+        return;
+      }
+      releases.erase(buffer.data.get());
+      bytesHashed += buffer.length;
+    }
+    released.notify_all();
+    acquisition.free.push(buffer);
+  };
+  std::vector<std::thread> hashers;
+  for(auto& stage : stages) {
+    hashers.emplace_back(digestStage, std::ref(acquisition), std::ref(*stage), std::function<void(const AcquireBuffer&)>(release));
+  }
+  std::thread reader = disk.read(resumedFrom, size, ioJob.get());
+
+  // Every buffer read goes to every stage from here, so progress is reported
+  // from this thread
+  HashProgress progress = {resumedFrom, size, 0};
+  auto lastProgress = start;
+  auto reportProgress = [&]() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - start).count();
+    progress.bytesHashed = bytesHashed;
+    progress.bytesPerSecond = seconds > 0 ? (progress.bytesHashed - resumedFrom) / seconds : 0;
+    lastProgress = now;
+    return onProgress(progress);
+  };
+  // Only valid once every stage has hashed everything handed out
+  uint64_t dispatched = resumedFrom;
+  auto lastCheckpoint = start;
+  auto saveProgress = [&]() {
+    checkpoint.offset = dispatched;
+    for(const auto& stage : stages) {
+      checkpoint.states[stage->name()] = stage->hasher->saveState();
+      if(stage->segmentSize) {
+        checkpoint.segments[stage->name()] = stage->digests;
+      }
+    }
+    saveCheckpoint(options.checkpoint, checkpoint);
+    lastCheckpoint = std::chrono::steady_clock::now();
+  };
+  try {
+    AcquireBuffer buffer;
+    while(acquisition.toHash.pop(buffer)) {
+      for(auto& stage : stages) {
+        stage->input.push(buffer);
+      }
+      dispatched += buffer.length;
+      auto now = std::chrono::steady_clock::now();
+      if(options.checkpoint.size() && dispatched < size && now - lastCheckpoint >= std::chrono::milliseconds(options.checkpointInterval)) {
+        // The stages have to catch up for their states to line up. A failed
+        // one never will, but then there's nothing to save anyway
+        std::unique_lock<std::mutex> lock(releaseMutex);
+        while(bytesHashed < dispatched && !acquisition.failed()) {
+          released.wait_for(lock, std::chrono::milliseconds(HASH_DRAIN_POLL_MS));
+        }
+        if(bytesHashed == dispatched) {
+          saveProgress();
+        }
+      }
+      if(now - lastProgress >= std::chrono::milliseconds(ACQUIRE_PROGRESS_INTERVAL_MS) && !reportProgress()) {
+        acquisition.stop();
+        break;
+      }
+    }
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+  for(auto& stage : stages) {
+    stage->input.close();
+  }
+  for(auto& hasher : hashers) {
+    hasher.join();
+  }
+  acquisition.stop();
+  reader.join();
+  // Every stage drains its input, so unless one of them failed they're all
+  // at the same point, which the next run can pick up from
+  try {
+    if(options.checkpoint.size() && dispatched < size && dispatched > checkpoint.offset && bytesHashed == dispatched) {
+      saveProgress();
+    }
+  } catch(...) {
+    acquisition.fail(std::current_exception());
+  }
+  acquisition.rethrow();
+
+  HashResult result;
+  result.bytes = bytesHashed;
+  result.complete = result.bytes == size;
+  result.resumedFrom = resumedFrom;
+  result.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  if(!result.complete) {
+    return result;
+  }
+  // Only finished here, a cancelled job's states go in its checkpoint
+  for(const auto& stage : stages) {
+    if(!stage->segmentSize) {
+      result.digests[stage->algorithm] = stage->hasher->finish();
+      continue;
+    }
+    if(stage->hashed) {
+      stage->digests.push_back(stage->hasher->finish());
+    }
+    for(size_t i = 0; i < stage->digests.size(); ++i) {
+      if(result.segments.size() <= i) {
+        const uint64_t offset = i * stage->segmentSize;
+        result.segments.push_back({offset, std::min(stage->segmentSize, size - offset), {}});
+      }
+      result.segments[i].digests[stage->algorithm] = stage->digests[i];
+    }
+  }
+  if(options.checkpoint.size()) {
+    unlink(options.checkpoint.c_str());
+  }
+  reportProgress();
+  return result;
+}
+
+DiffResult diffDisks(const std::string& first, const std::string& second, const DiffOptions& options, std::function<bool(const DiffProgress&)> onProgress, std::function<bool(const DiffExtent&)> onExtent) {
+  if(!options.blockSize || ACQUIRE_BUFFER_SIZE % options.blockSize) {
+    throw std::runtime_error("Invalid block size " + std::to_string(options.blockSize));
+  }
+  std::unique_ptr<IOScheduler::Job> firstJob;
+  std::unique_ptr<IOScheduler::Job> secondJob;
+  std::shared_ptr<IOScheduler> scheduler = sharedIOScheduler();
+  if(scheduler) {
+    firstJob = scheduler->join(ioDeviceKey(first), options.firstBus, options.ioClass, options.ioWeight);
+    secondJob = scheduler->join(ioDeviceKey(second), options.secondBus, options.ioClass, options.ioWeight);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  // A pipeline each, so neither disk waits for the other's reads
+  Acquisition firstPipeline;
+  Acquisition secondPipeline;
+  PipelineSource firstDisk(first, options.imageFiles, options.ioBackend, options.queueDepth, firstPipeline, allocateBuffers(firstPipeline));
+  PipelineSource secondDisk(second, options.imageFiles, options.ioBackend, options.queueDepth, secondPipeline, allocateBuffers(secondPipeline));
+  const uint64_t size = std::min(firstDisk.size, secondDisk.size);
+  std::thread firstReader = firstDisk.read(0, size, firstJob.get());
+  std::thread secondReader = secondDisk.read(0, size, secondJob.get());
+
+  DiffResult result = {};
+  result.firstSize = firstDisk.size;
+  result.secondSize = secondDisk.size;
+  // Only handed out once the next different block isn't right after it
+  DiffExtent pending = {0, 0};
+  bool stopped = false;
+  auto flush = [&]() {
+    if(!pending.length) {
+      return;
+    }
+    result.differentBytes += pending.length;
+    ++result.extentCount;
+    stopped = stopped || !onExtent(pending);
+    pending.length = 0;
+  };
+  auto differs = [&](uint64_t offset, uint64_t length) {
+    if(pending.length && pending.offset + pending.length == offset) {
+      pending.length += length;
+      return;
+    }
+    flush();
+    pending = {offset, length};
+  };
+
+  DiffProgress progress = {0, size, 0};
+  auto lastProgress = start;
+  auto reportProgress = [&]() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - start).count();
+    progress.bytesPerSecond = seconds > 0 ? progress.bytesCompared / seconds : 0;
+    lastProgress = now;
+    return onProgress(progress);
+  };
+  try {
+    // Both pipelines hand out the same offsets in the same order
+    AcquireBuffer a;
+    AcquireBuffer b;
+    while(!stopped && firstPipeline.toHash.pop(a) && secondPipeline.toHash.pop(b)) {
+      for(size_t position = 0; position < a.length; position += options.blockSize) {
+        const size_t len = std::min<size_t>(options.blockSize, a.length - position);
+        if(!blocksEqual(a.data.get() + position, b.data.get() + position, len)) {
+          differs(a.offset + position, len);
+        }
+      }
+      progress.bytesCompared += a.length;
+      firstPipeline.free.push(a);
+      secondPipeline.free.push(b);
+      if(std::chrono::steady_clock::now() - lastProgress >= std::chrono::milliseconds(ACQUIRE_PROGRESS_INTERVAL_MS) && !reportProgress()) {
+        stopped = true;
+      }
+    }
+    if(!stopped && progress.bytesCompared == size) {
+      if(firstDisk.size != secondDisk.size) {
+        differs(size, std::max(firstDisk.size, secondDisk.size) - size);
+      }
+      flush();
+    }
+  } catch(...) {
+    firstPipeline.fail(std::current_exception());
+  }
+  firstPipeline.stop();
+  secondPipeline.stop();
+  firstReader.join();
+  secondReader.join();
+  firstPipeline.rethrow();
+  secondPipeline.rethrow();
+
+  result.bytesCompared = progress.bytesCompared;
+  result.complete = !stopped && result.bytesCompared == size;
+  result.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  if(result.complete) {
+    reportProgress();
+  }
+  return result;
+}
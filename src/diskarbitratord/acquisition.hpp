@@ -0,0 +1,228 @@
+/***************************************************************************
+ *   acquisition.hpp  --  This file is part of diskarbitratord.            *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef ACQUISITION_HPP_
+#define ACQUISITION_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "block_reader.hpp"
+#include "checkpoint.hpp"
+#include "container.hpp"
+#include "io_scheduler.hpp"
+
+// Disks are read in pieces of this size
+#define ACQUIRE_BUFFER_SIZE (8 * 1024 * 1024)
+// Buffers going round the pipeline, which is all the memory an acquisition
+// takes no matter how big the disk is
+#define ACQUIRE_BUFFER_COUNT 8
+// Each buffer is filled with several reads of this size, all of them in
+// flight together
+#define ACQUIRE_READ_SIZE (1024 * 1024)
+// How often progress is reported
+#define ACQUIRE_PROGRESS_INTERVAL_MS 500
+// Smallest hole left in sparse images, unless the destination filesystem has
+// bigger blocks. Anything smaller wouldn't save any space
+#define ACQUIRE_SPARSE_BLOCK_SIZE 4096
+// Extra attempts at unreadable sectors in rescue mode
+#define ACQUIRE_RESCUE_RETRIES 1
+// Disks are compared in blocks of this size by default, which is what most
+// filesystems allocate in
+#define DIFF_DEFAULT_BLOCK_SIZE 4096
+
+typedef struct AcquireOptions {
+  // Leave holes where the disk is all zeroes instead of writing them
+  bool sparse = true;
+  // Write a compressed evidence container instead of a raw image, its chunks
+  // compressed on every core
+  bool container = false;
+  ContainerCompression compression = CONTAINER_COMPRESSION_ZLIB;
+  // How the disk is read, the daemon's defaults unless set
+  BlockReaderBackend ioBackend = BLOCK_READER_AUTO;
+  unsigned int queueDepth = 0;
+  // Its share of the disk (and bus) when other jobs are reading from it too,
+  // through the shared I/O scheduler
+  IOClass ioClass = IO_CLASS_BULK;
+  unsigned int ioWeight = IO_DEFAULT_WEIGHT;
+  std::string bus;
+  // Rescue mode for failing disks, when set. A ddrescue style map of what's
+  // been read, what couldn't be and what's left is kept at this path, and an
+  // interrupted rescue picks up from it
+  std::string rescueMap;
+  unsigned int retries = ACQUIRE_RESCUE_RETRIES;
+  // Keep a checkpoint at this path every `checkpointInterval` ms, and resume
+  // from the one there if there's one already. Raw images only, rescues have
+  // their map for that
+  std::string checkpoint;
+  unsigned int checkpointInterval = CHECKPOINT_INTERVAL_MS;
+  // Whatever tells the disk apart that its contents don't, such as its model,
+  // for the checkpoint to check before resuming
+  std::string identity;
+} AcquireOptions;
+
+typedef struct AcquireProgress {
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  uint64_t bytesTotal;
+  // Written, on average since the start
+  double bytesPerSecond;
+  // Rescue mode only, what couldn't be read so far and the pass it's on
+  uint64_t bytesBad;
+  unsigned int pass;
+} AcquireProgress;
+
+typedef struct AcquireResult {
+  // False if cancelled, and then there's no hash
+  bool complete;
+  uint64_t bytes;
+  // Zeroes left as holes in the image
+  uint64_t sparseBytes;
+  // What the image takes on disk
+  uint64_t storedBytes;
+  std::string sha256;
+  uint64_t durationMs;
+  // Rescue mode only. Unreadable sectors are left as zeroes in the image, and
+  // the hash is of the image as it is
+  uint64_t badBytes;
+  uint64_t readErrors;
+  // Where it picked up from a checkpoint, 0 if it started from scratch
+  uint64_t resumedFrom;
+} AcquireResult;
+
+// Images the device or raw image at `source`, opened read-only, into a new
+// file at `destination`. Reading, hashing and writing each run on their own
+// thread, handing a fixed set of buffers to each other, so the disk is never
+// waiting for the hash or the destination. `onProgress` is called from the
+// calling thread, and returning false from it stops the acquisition, leaving
+// whatever was written. The hash is always of the whole disk, holes or not.
+// Throws on errors, or if `destination` exists (unless resuming a rescue or
+// from a checkpoint). Resuming throws if the disk or image changed since.
+AcquireResult acquireDisk(const std::string& source, const std::string& destination, const AcquireOptions& options, std::function<bool(const AcquireProgress&)> onProgress);
+
+typedef struct HashOptions {
+  // Any of what makeHasher() knows, all computed from the same reads
+  std::vector<std::string> algorithms = {"md5", "sha1", "sha256"};
+  // Also hash every piece of this many bytes on its own, 0 for none. Each
+  // piece costs as much hashing as the whole disk again
+  uint64_t segmentSize = 0;
+  // Images the daemon can read natively (EWF, UDIF, evidence containers and
+  // split raw sets) are hashed as the disk inside them, so the hashes match
+  // the ones of the acquisition they came from. This hashes the files as they
+  // are instead
+  bool imageFiles = false;
+  // As for acquisitions
+  std::string checkpoint;
+  unsigned int checkpointInterval = CHECKPOINT_INTERVAL_MS;
+  std::string identity;
+  BlockReaderBackend ioBackend = BLOCK_READER_AUTO;
+  unsigned int queueDepth = 0;
+  IOClass ioClass = IO_CLASS_BULK;
+  unsigned int ioWeight = IO_DEFAULT_WEIGHT;
+  std::string bus;
+} HashOptions;
+
+typedef struct HashProgress {
+  // Through every algorithm
+  uint64_t bytesHashed;
+  uint64_t bytesTotal;
+  double bytesPerSecond;
+} HashProgress;
+
+typedef struct HashSegment {
+  uint64_t offset;
+  uint64_t length;
+  // By algorithm name
+  std::map<std::string, std::string> digests;
+} HashSegment;
+
+typedef struct HashResult {
+  // False if cancelled, and then there are no digests
+  bool complete;
+  uint64_t bytes;
+  std::map<std::string, std::string> digests;
+  std::vector<HashSegment> segments;
+  uint64_t durationMs;
+  uint64_t resumedFrom;
+} HashResult;
+
+// Hashes the device or image at `source` with every algorithm in `options`,
+// reading it only once. Reads go through the same pipeline as acquisitions,
+// and each algorithm (and its segments) gets a thread of its own fed the same
+// buffers, so it's only as slow as the slower of the disk and the slowest
+// algorithm. `onProgress` works as it does for acquireDisk(). Throws on
+// errors or unknown algorithms.
+HashResult hashDisk(const std::string& source, const HashOptions& options, std::function<bool(const HashProgress&)> onProgress);
+
+typedef struct DiffOptions {
+  // Differences are found in blocks of this many bytes, which has to divide
+  // ACQUIRE_BUFFER_SIZE
+  uint32_t blockSize = DIFF_DEFAULT_BLOCK_SIZE;
+  // As for hashing, images are compared as the disk inside them unless set
+  bool imageFiles = false;
+  BlockReaderBackend ioBackend = BLOCK_READER_AUTO;
+  unsigned int queueDepth = 0;
+  IOClass ioClass = IO_CLASS_BULK;
+  unsigned int ioWeight = IO_DEFAULT_WEIGHT;
+  std::string firstBus;
+  std::string secondBus;
+} DiffOptions;
+
+typedef struct DiffProgress {
+  uint64_t bytesCompared;
+  uint64_t bytesTotal;
+  double bytesPerSecond;
+} DiffProgress;
+
+// Blocks that differ, adjacent ones coalesced
+typedef struct DiffExtent {
+  uint64_t offset;
+  uint64_t length;
+} DiffExtent;
+
+typedef struct DiffResult {
+  // False if cancelled
+  bool complete;
+  uint64_t firstSize;
+  uint64_t secondSize;
+  uint64_t bytesCompared;
+  // Including whatever the bigger one has past the end of the other
+  uint64_t differentBytes;
+  uint64_t extentCount;
+  uint64_t durationMs;
+} DiffResult;
+
+// Compares the devices or images at `first` and `second` block by block.
+// Both are read at once through pipelines like acquisitions', each on its
+// own thread, so it's only as slow as the slower of them. Every extent goes
+// to `onExtent` in disk order once it can't grow any further, and returning
+// false from it (or from `onProgress`) stops the comparison. If the sizes
+// differ, what only the bigger one has is the last extent. Throws on errors.
+DiffResult diffDisks(const std::string& first, const std::string& second, const DiffOptions& options, std::function<bool(const DiffProgress&)> onProgress, std::function<bool(const DiffExtent&)> onExtent);
+
+// Opens a disk for imaging, skipping the buffer cache where possible
+int openAcquisitionSource(const std::string& path);
+
+#endif
@@ -0,0 +1,193 @@
+/***************************************************************************
+ *   allocation_map.cpp  --  This file is part of diskarbitratord.         *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "allocation_map.hpp"
+#include "image_sniffer.hpp"
+#include "pipeline.hpp"
+#include "scope_guard.hpp"
+
+// Grows the current run while blocks keep matching it, and hands it over
+// when one doesn't
+class RunBuilder {
+  public:
+    RunBuilder(std::function<bool(const AllocationRun&)> onRun) : onRun(onRun) {
+      memset(&this->summary, 0, sizeof(this->summary));
+    }
+
+    bool add(uint64_t offset, uint64_t length, BlockKind kind, uint8_t fill, bool hole) {
+      if(this->started && this->current.kind == kind && this->current.fill == fill && this->current.hole == hole &&
+         this->current.offset + this->current.length == offset) {
+        this->current.length += length;
+        return true;
+      }
+      bool keepGoing = this->finish();
+      this->started = true;
+      this->current.offset = offset;
+      this->current.length = length;
+      this->current.kind = kind;
+      this->current.fill = fill;
+      this->current.hole = hole;
+      return keepGoing;
+    }
+
+    // Hands over the run in progress, if any
+    bool finish() {
+      if(!this->started) {
+        return true;
+      }
+      this->started = false;
+      ++this->summary.runCount;
+      if(this->current.hole) {
+        this->summary.holeBytes += this->current.length;
+      }
+      if(this->current.kind == BLOCK_ZERO) {
+        this->summary.zeroBytes += this->current.length;
+      } else if(this->current.kind == BLOCK_CONSTANT) {
+        this->summary.constantBytes += this->current.length;
+      } else {
+        this->summary.dataBytes += this->current.length;
+      }
+      return this->onRun(this->current);
+    }
+
+    AllocationSummary summary;
+
+  private:
+    std::function<bool(const AllocationRun&)> onRun;
+    AllocationRun current;
+    bool started = false;
+};
+
+// Reads and classifies [start, end). Returns false if told to stop
+static bool scanRange(ImageReader& reader, uint64_t start, uint64_t end, uint32_t blockSize, RunBuilder& runs, IOScheduler::Job* ioJob) {
+  const size_t readSize = std::max<size_t>(blockSize, ALLOCATION_READ_SIZE / blockSize * blockSize);
+  std::shared_ptr<uint8_t> buffers[2] = {allocateAligned(readSize), allocateAligned(readSize)};
+  auto readAt = [&reader, end, readSize, ioJob](uint64_t offset, uint8_t* buffer) {
+    const size_t len = std::min<uint64_t>(readSize, end - offset);
+    if(!ioJob) {
+      return reader.read(offset, buffer, len);
+    }
+    ioJob->acquire(len);
+    ScopedIOPriority priority(ioJob->ioClass(), ioJob->weight());
+    return reader.read(offset, buffer, len);
+  };
+
+  std::future<size_t> next = std::async(std::launch::async, readAt, start, buffers[0].get());
+  for(uint64_t offset = start, i = 0; offset < end; ++i) {
+    const size_t length = next.get();
+    if(length == 0) {
+      throw std::runtime_error("Short read at offset " + std::to_string(offset));
+    }
+    const uint8_t* data = buffers[i % 2].get();
+    if(offset + length < end) {
+      next = std::async(std::launch::async, readAt, offset + length, buffers[(i + 1) % 2].get());
+    }
+    for(size_t position = 0; position < length; position += blockSize) {
+      const size_t blockLength = std::min<size_t>(blockSize, length - position);
+      uint8_t fill;
+      BlockKind kind = classifyBlock(data + position, blockLength, fill);
+      if(!runs.add(offset + position, blockLength, kind, fill, false)) {
+        return false;
+      }
+    }
+    offset += length;
+  }
+  return true;
+}
+
+AllocationSummary mapAllocation(ImageReader& reader, int fd, uint32_t blockSize, std::function<bool(const AllocationRun&)> onRun, IOScheduler::Job* ioJob) {
+  if(blockSize == 0 || blockSize > ALLOCATION_MAX_BLOCK_SIZE) {
+    throw std::runtime_error("Invalid block size " + std::to_string(blockSize));
+  }
+  RunBuilder runs(onRun);
+  const uint64_t size = reader.size();
+  uint64_t position = 0;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  while(fd != -1 && position < size) {
+    off_t data = lseek(fd, position, SEEK_DATA);
+    if(data == -1 && errno == ENXIO) {
+      // Nothing but hole until the end
+      data = size;
+    } else if(data == -1) {
+      // The filesystem doesn't know, read everything from here on
+      break;
+    }
+    // Blocks are classified whole, so data starts at a block boundary
+    uint64_t dataStart = std::max<uint64_t>(position, std::min<uint64_t>(data, size) / blockSize * blockSize);
+    if(dataStart > position && !runs.add(position, dataStart - position, BLOCK_ZERO, 0, true)) {
+      return runs.summary;
+    }
+    if(dataStart >= size) {
+      position = size;
+      break;
+    }
+    off_t hole = lseek(fd, dataStart, SEEK_HOLE);
+    uint64_t dataEnd = hole == -1 ? size : std::min<uint64_t>(size, (static_cast<uint64_t>(hole) + blockSize - 1) / blockSize * blockSize);
+    if(!scanRange(reader, dataStart, dataEnd, blockSize, runs, ioJob)) {
+      return runs.summary;
+    }
+    position = dataEnd;
+  }
+#endif
+
+  if(position < size && !scanRange(reader, position, size, blockSize, runs, ioJob)) {
+    return runs.summary;
+  }
+  runs.finish();
+  return runs.summary;
+}
+
+AllocationSummary mapAllocation(const std::string& path, uint32_t blockSize, std::function<bool(const AllocationRun&)> onRun, IOClass ioClass, const std::string& bus) {
+  std::unique_ptr<ImageReader> reader = openImageReader(path);
+  std::unique_ptr<IOScheduler::Job> ioJob;
+  std::shared_ptr<IOScheduler> scheduler = sharedIOScheduler();
+  if(scheduler) {
+    ioJob = scheduler->join(ioDeviceKey(path), bus, ioClass);
+  }
+  int fd = -1;
+  ImageFormat format = sniffImage(path).format;
+  if(format == IMAGE_FORMAT_RAW_MBR || format == IMAGE_FORMAT_RAW_GPT || format == IMAGE_FORMAT_ISO9660 || format == IMAGE_FORMAT_UNKNOWN) {
+    // Only regular files have holes worth asking about
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      fd = open(path.c_str(), O_RDONLY);
+    }
+  }
+  ScopeGuard fdGuard([fd]() {
+    if(fd != -1) {
+      close(fd);
+    }
+  });
+  return mapAllocation(*reader, fd, blockSize, onRun, ioJob.get());
+}
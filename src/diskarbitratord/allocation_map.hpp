@@ -0,0 +1,76 @@
+/***************************************************************************
+ *   allocation_map.hpp  --  This file is part of diskarbitratord.         *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef ALLOCATION_MAP_HPP_
+#define ALLOCATION_MAP_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "block_scan.hpp"
+#include "image_reader.hpp"
+#include "io_scheduler.hpp"
+
+// Which parts of a disk hold anything at all. Big evidence drives are often
+// mostly empty, and hashing, imaging or carving can skip what's known to be
+// zeroes (or erased flash).
+
+#define ALLOCATION_DEFAULT_BLOCK_SIZE 4096
+// Disks are read in pieces of this size, two at a time so that the next one
+// is being read while the current one is classified
+#define ALLOCATION_READ_SIZE (4 * 1024 * 1024)
+#define ALLOCATION_MAX_BLOCK_SIZE ALLOCATION_READ_SIZE
+
+// Consecutive blocks of the same kind
+typedef struct AllocationRun {
+  uint64_t offset;
+  uint64_t length;
+  BlockKind kind;
+  // The repeated byte, for zero and constant runs
+  uint8_t fill;
+  // A hole in the backing file, zero without ever being read
+  bool hole;
+} AllocationRun;
+
+typedef struct AllocationSummary {
+  uint64_t zeroBytes;       // Holes included
+  uint64_t constantBytes;
+  uint64_t dataBytes;
+  uint64_t holeBytes;
+  uint64_t runCount;
+} AllocationSummary;
+
+// Classifies every `blockSize` block of `reader`, merging the same kind of
+// blocks into runs. Each run goes to `onRun` once it's complete, in disk
+// order, and returning false from it stops the scan. If `fd` isn't -1, it's
+// the file `reader` reads as it is, and its holes are found with SEEK_DATA and
+// SEEK_HOLE instead of being read. Reads wait for `ioJob`'s turn, if there's
+// one. Throws on read errors.
+AllocationSummary mapAllocation(ImageReader& reader, int fd, uint32_t blockSize, std::function<bool(const AllocationRun&)> onRun, IOScheduler::Job* ioJob = nullptr);
+
+// Same, for whatever openImageReader() can open at `path`. Holes are used
+// when it's a raw image on a filesystem that knows about them. The scan is
+// scheduled as `ioClass` on `bus` by the shared I/O scheduler
+AllocationSummary mapAllocation(const std::string& path, uint32_t blockSize, std::function<bool(const AllocationRun&)> onRun, IOClass ioClass = IO_CLASS_BULK, const std::string& bus = "");
+
+#endif
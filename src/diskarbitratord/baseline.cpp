@@ -0,0 +1,402 @@
+/***************************************************************************
+ *   baseline.cpp  --  This file is part of diskarbitratord.               *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <random>
+#include <set>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "acquisition.hpp"
+#include "baseline.hpp"
+#include "byteorder.hpp"
+#include "image_reader.hpp"
+#include "pipeline.hpp"
+#include "scope_guard.hpp"
+
+#define BASELINE_MAGIC "DAMERKLE"
+#define BASELINE_MAGIC_SIZE 8
+#define BASELINE_VERSION 1
+// Magic, version, leaf size, disk size, creation time and root, followed by
+// the leaves
+#define BASELINE_HEADER_SIZE 64
+#define BASELINE_ROOT_OFFSET 32
+#define BASELINE_LEAF_PREFIX 0x00
+#define BASELINE_NODE_PREFIX 0x01
+
+typedef std::array<uint8_t, SHA256_DIGEST_SIZE> Digest;
+
+typedef struct PendingLeaf {
+  uint64_t index;
+  std::shared_ptr<uint8_t> buffer;
+  std::future<Digest> digest;
+} PendingLeaf;
+
+static Digest leafDigest(const uint8_t* data, size_t len) {
+  const uint8_t prefix = BASELINE_LEAF_PREFIX;
+  SHA256 hash;
+  hash.update(&prefix, sizeof(prefix));
+  hash.update(data, len);
+  Digest digest;
+  hash.finish(digest.data());
+  return digest;
+}
+
+static Digest nodeDigest(const Digest& left, const Digest& right) {
+  const uint8_t prefix = BASELINE_NODE_PREFIX;
+  SHA256 hash;
+  hash.update(&prefix, sizeof(prefix));
+  hash.update(left.data(), left.size());
+  hash.update(right.data(), right.size());
+  Digest digest;
+  hash.finish(digest.data());
+  return digest;
+}
+
+static uint64_t leafCount(uint64_t diskSize, uint32_t leafSize) {
+  return (diskSize + leafSize - 1) / leafSize;
+}
+
+static uint64_t leafLength(uint64_t diskSize, uint32_t leafSize, uint64_t index) {
+  const uint64_t offset = index * leafSize;
+  return offset >= diskSize ? 0 : std::min<uint64_t>(leafSize, diskSize - offset);
+}
+
+static void checkLeafSize(uint32_t leafSize) {
+  // The disk is read with O_DIRECT, which wants aligned offsets
+  if(!leafSize || leafSize % PIPELINE_BUFFER_ALIGNMENT || leafSize > BASELINE_MAX_LEAF_SIZE) {
+    throw std::runtime_error("Invalid leaf size " + std::to_string(leafSize) + ", it has to be a multiple of " +
+                             std::to_string(PIPELINE_BUFFER_ALIGNMENT) + " up to " + std::to_string(BASELINE_MAX_LEAF_SIZE));
+  }
+}
+
+static Digest rootDigest(const Baseline& baseline) {
+  std::vector<Digest> level(baselineLeafCount(baseline));
+  if(level.empty()) {
+    // Same as RFC 6962 for an empty tree
+    Digest digest;
+    SHA256().finish(digest.data());
+    return digest;
+  }
+  for(size_t i = 0; i < level.size(); ++i) {
+    memcpy(level[i].data(), baseline.leaves.data() + i * SHA256_DIGEST_SIZE, SHA256_DIGEST_SIZE);
+  }
+  // Each level is written over the start of the one below
+  while(level.size() > 1) {
+    size_t next = 0;
+    for(size_t i = 0; i + 1 < level.size(); i += 2) {
+      level[next++] = nodeDigest(level[i], level[i + 1]);
+    }
+    if(level.size() % 2) {
+      level[next++] = level.back();
+    }
+    level.resize(next);
+  }
+  return level[0];
+}
+
+// Reads the leaves at `indices` in order and hashes them on `pool`, handing
+// each digest to `onLeaf` in the same order. Returns false if cancelled
+static bool hashLeaves(int fd, uint64_t diskSize, uint32_t leafSize, const std::vector<uint64_t>& indices, ThreadPool& pool, IOScheduler::Job* ioJob,
+                       std::function<void(uint64_t, const Digest&)> onLeaf, std::function<bool(const BaselineProgress&)> onProgress) {
+  std::unique_ptr<ScopedIOPriority> priority;
+  if(ioJob) {
+    priority.reset(new ScopedIOPriority(ioJob->ioClass(), ioJob->weight()));
+  }
+  uint64_t bytesTotal = 0;
+  for(uint64_t index : indices) {
+    bytesTotal += leafLength(diskSize, leafSize, index);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  auto lastProgress = start;
+  uint64_t bytesHashed = 0;
+  const size_t window = pool.size() * BASELINE_READ_AHEAD + 1;
+  std::deque<PendingLeaf> pending;
+  std::vector<std::shared_ptr<uint8_t>> spare;
+
+  // Waits for the oldest leaf, which frees its buffer for the next one. The
+  // hashing jobs hold on to their buffers, so leaving some pending on the way
+  // out (cancelled, or an exception) is fine
+  auto collect = [&]() {
+    PendingLeaf& leaf = pending.front();
+    onLeaf(leaf.index, leaf.digest.get());
+    bytesHashed += leafLength(diskSize, leafSize, leaf.index);
+    spare.push_back(std::move(leaf.buffer));
+    pending.pop_front();
+  };
+
+  for(uint64_t index : indices) {
+    if(pending.size() == window) {
+      collect();
+    }
+    std::shared_ptr<uint8_t> buffer;
+    if(spare.size()) {
+      buffer = std::move(spare.back());
+      spare.pop_back();
+    } else {
+      buffer = allocateAligned(leafSize);
+    }
+
+    const uint64_t offset = index * leafSize;
+    const size_t length = leafLength(diskSize, leafSize, index);
+    // The last leaf of a disk that isn't a multiple of the alignment is read
+    // as a whole block, pread(2) stops at the end anyway
+    const size_t aligned = (length + PIPELINE_BUFFER_ALIGNMENT - 1) / PIPELINE_BUFFER_ALIGNMENT * PIPELINE_BUFFER_ALIGNMENT;
+    if(ioJob) {
+      ioJob->acquire(length);
+    }
+    if(preadFully(fd, buffer.get(), aligned, offset) < length) {
+      throw std::runtime_error("The disk ended before offset " + std::to_string(offset + length));
+    }
+    pending.push_back({index, buffer, pool.submit([buffer, length]() {
+      return leafDigest(buffer.get(), length);
+    })});
+
+    auto now = std::chrono::steady_clock::now();
+    if(now - lastProgress >= std::chrono::milliseconds(ACQUIRE_PROGRESS_INTERVAL_MS)) {
+      lastProgress = now;
+      const double seconds = std::chrono::duration<double>(now - start).count();
+      if(!onProgress({bytesHashed, bytesTotal, seconds > 0 ? bytesHashed / seconds : 0})) {
+        return false;
+      }
+    }
+  }
+  while(pending.size()) {
+    collect();
+  }
+  return true;
+}
+
+uint64_t baselineLeafCount(const Baseline& baseline) {
+  return baseline.leaves.size() / SHA256_DIGEST_SIZE;
+}
+
+BaselineLeaf baselineLeaf(const Baseline& baseline, uint64_t index) {
+  return {index, index * baseline.leafSize, leafLength(baseline.diskSize, baseline.leafSize, index)};
+}
+
+std::string merkleRoot(const Baseline& baseline) {
+  const Digest root = rootDigest(baseline);
+  return hexString(root.data(), root.size());
+}
+
+std::string baselinePath(const std::string& directory, const std::string& mediaUUID) {
+  if(mediaUUID.empty() || mediaUUID.find('/') != std::string::npos || mediaUUID[0] == '.') {
+    throw std::runtime_error("Invalid media UUID \"" + mediaUUID + "\"");
+  }
+  return directory + "/" + mediaUUID + ".merkle";
+}
+
+bool loadBaseline(const std::string& path, Baseline& baseline) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd == -1) {
+    if(errno == ENOENT) {
+      return false;
+    }
+    throw std::runtime_error("Unable to open baseline " + path + ": " + std::string(strerror(errno)));
+  }
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+
+  uint8_t header[BASELINE_HEADER_SIZE];
+  if(preadFully(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, BASELINE_MAGIC, BASELINE_MAGIC_SIZE)) {
+    throw std::runtime_error(path + " isn't a baseline");
+  }
+  if(readLE32(header + 8) != BASELINE_VERSION) {
+    throw std::runtime_error("Unsupported baseline version " + std::to_string(readLE32(header + 8)) + " in " + path);
+  }
+  Baseline loaded;
+  loaded.leafSize = readLE32(header + 12);
+  loaded.diskSize = readLE64(header + 16);
+  loaded.created = readLE64(header + 24);
+  checkLeafSize(loaded.leafSize);
+
+  const uint64_t leaves = leafCount(loaded.diskSize, loaded.leafSize);
+  if(fileOrDeviceSize(fd) != BASELINE_HEADER_SIZE + leaves * SHA256_DIGEST_SIZE) {
+    throw std::runtime_error("Baseline " + path + " is truncated");
+  }
+  loaded.leaves.resize(leaves * SHA256_DIGEST_SIZE);
+  if(preadFully(fd, loaded.leaves.data(), loaded.leaves.size(), BASELINE_HEADER_SIZE) != loaded.leaves.size()) {
+    throw std::runtime_error("Baseline " + path + " is truncated");
+  }
+  const Digest root = rootDigest(loaded);
+  if(memcmp(root.data(), header + BASELINE_ROOT_OFFSET, root.size())) {
+    throw std::runtime_error("Baseline " + path + " is corrupt, its leaves don't match its root");
+  }
+  baseline = std::move(loaded);
+  return true;
+}
+
+void saveBaseline(const std::string& path, const Baseline& baseline) {
+  uint8_t header[BASELINE_HEADER_SIZE] = {};
+  memcpy(header, BASELINE_MAGIC, BASELINE_MAGIC_SIZE);
+  putLE32(header + 8, BASELINE_VERSION);
+  putLE32(header + 12, baseline.leafSize);
+  putLE64(header + 16, baseline.diskSize);
+  putLE64(header + 24, baseline.created);
+  const Digest root = rootDigest(baseline);
+  memcpy(header + BASELINE_ROOT_OFFSET, root.data(), root.size());
+
+  const std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    throw std::runtime_error("Unable to save baseline " + temporary + ": " + std::string(strerror(errno)));
+  }
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+  pwriteFully(fd, header, sizeof(header), 0);
+  pwriteFully(fd, baseline.leaves.data(), baseline.leaves.size(), BASELINE_HEADER_SIZE);
+  if(fsync(fd) != 0 || rename(temporary.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Unable to save baseline " + path + ": " + std::string(strerror(errno)));
+  }
+}
+
+BaselineResult buildBaseline(const std::string& source, const BaselineOptions& options, ThreadPool& pool, std::function<bool(const BaselineProgress&)> onProgress) {
+  checkLeafSize(options.leafSize);
+  std::unique_ptr<IOScheduler::Job> ioJob;
+  std::shared_ptr<IOScheduler> scheduler = sharedIOScheduler();
+  if(scheduler) {
+    ioJob = scheduler->join(ioDeviceKey(source), options.bus, options.ioClass, options.ioWeight);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int fd = openAcquisitionSource(source);
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+
+  BaselineResult result;
+  result.baseline.diskSize = fileOrDeviceSize(fd);
+  result.baseline.leafSize = options.leafSize;
+  result.baseline.created = std::time(nullptr);
+  std::vector<uint64_t> indices(leafCount(result.baseline.diskSize, options.leafSize));
+  for(uint64_t i = 0; i < indices.size(); ++i) {
+    indices[i] = i;
+  }
+  result.baseline.leaves.reserve(indices.size() * SHA256_DIGEST_SIZE);
+  result.complete = hashLeaves(fd, result.baseline.diskSize, options.leafSize, indices, pool, ioJob.get(), [&](uint64_t, const Digest& digest) {
+    result.baseline.leaves.insert(result.baseline.leaves.end(), digest.begin(), digest.end());
+  }, onProgress);
+  if(result.complete) {
+    result.root = merkleRoot(result.baseline);
+  }
+  result.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+std::vector<uint64_t> baselineSelection(const Baseline& baseline, const BaselineOptions& options, uint64_t seed) {
+  const uint64_t count = baselineLeafCount(baseline);
+  std::vector<uint64_t> selected;
+  if((options.extents.empty() && !options.sample) || options.sample >= count) {
+    selected.resize(count);
+    for(uint64_t i = 0; i < count; ++i) {
+      selected[i] = i;
+    }
+    return selected;
+  }
+
+  std::set<uint64_t> leaves;
+  for(const auto& extent : options.extents) {
+    if(!extent.second || extent.first >= baseline.diskSize) {
+      continue;
+    }
+    const uint64_t last = std::min(extent.first + extent.second - 1, baseline.diskSize - 1) / baseline.leafSize;
+    for(uint64_t leaf = extent.first / baseline.leafSize; leaf <= last; ++leaf) {
+      leaves.insert(leaf);
+    }
+  }
+  // Floyd's algorithm, which picks each one with the same odds in as many
+  // draws as there are leaves to pick. The sample may well overlap the
+  // extents
+  if(options.sample) {
+    std::mt19937_64 random(seed ? seed : std::random_device()());
+    std::set<uint64_t> sample;
+    for(uint64_t j = count - options.sample; j < count; ++j) {
+      const uint64_t pick = std::uniform_int_distribution<uint64_t>(0, j)(random);
+      sample.insert(sample.count(pick) ? j : pick);
+    }
+    leaves.insert(sample.begin(), sample.end());
+  }
+  return std::vector<uint64_t>(leaves.begin(), leaves.end());
+}
+
+BaselineVerification verifyBaseline(const std::string& source, const Baseline& baseline, const BaselineOptions& options, ThreadPool& pool, std::function<bool(const BaselineProgress&)> onProgress) {
+  checkLeafSize(baseline.leafSize);
+  std::unique_ptr<IOScheduler::Job> ioJob;
+  std::shared_ptr<IOScheduler> scheduler = sharedIOScheduler();
+  if(scheduler) {
+    ioJob = scheduler->join(ioDeviceKey(source), options.bus, options.ioClass, options.ioWeight);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int fd = openAcquisitionSource(source);
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+
+  BaselineVerification result;
+  result.diskSize = fileOrDeviceSize(fd);
+  result.leavesChecked = 0;
+  result.bytesChecked = 0;
+
+  // Leaves the disk doesn't have all of anymore can't be the same, the rest
+  // are read
+  std::vector<uint64_t> indices;
+  std::vector<uint64_t> truncated;
+  for(uint64_t index : baselineSelection(baseline, options)) {
+    if(leafLength(result.diskSize, baseline.leafSize, index) == leafLength(baseline.diskSize, baseline.leafSize, index)) {
+      indices.push_back(index);
+    } else {
+      truncated.push_back(index);
+    }
+  }
+
+  result.complete = hashLeaves(fd, result.diskSize, baseline.leafSize, indices, pool, ioJob.get(), [&](uint64_t index, const Digest& digest) {
+    const BaselineLeaf leaf = baselineLeaf(baseline, index);
+    result.leavesChecked++;
+    result.bytesChecked += leaf.length;
+    if(memcmp(digest.data(), baseline.leaves.data() + index * SHA256_DIGEST_SIZE, digest.size())) {
+      result.changed.push_back(leaf);
+    }
+  }, onProgress);
+  if(result.complete) {
+    // They're all after the ones read
+    for(uint64_t index : truncated) {
+      result.leavesChecked++;
+      result.changed.push_back(baselineLeaf(baseline, index));
+    }
+  }
+  result.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
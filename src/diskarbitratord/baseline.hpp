@@ -0,0 +1,140 @@
+/***************************************************************************
+ *   baseline.hpp  --  This file is part of diskarbitratord.               *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef BASELINE_HPP_
+#define BASELINE_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hash.hpp"
+#include "io_scheduler.hpp"
+#include "thread_pool.hpp"
+
+// Each leaf of the tree covers this much of the disk unless told otherwise.
+// A 1 TB disk takes 8 MB of digests, and checking a leaf again means reading
+// 4 MB of it
+#define BASELINE_DEFAULT_LEAF_SIZE (4 * 1024 * 1024)
+// Bigger leaves would only make the buffers silly
+#define BASELINE_MAX_LEAF_SIZE (256 * 1024 * 1024)
+// Leaves read and waiting to be hashed, for every hashing thread. Enough for
+// the disk to keep going while they're all busy
+#define BASELINE_READ_AHEAD 2
+
+// What a disk looked like when it was first seen: the SHA-256 of every leaf
+// of a Merkle tree over its contents. Only the leaves are kept, the rest of
+// the tree is cheap to work out again from them
+typedef struct Baseline {
+  uint64_t diskSize = 0;
+  uint32_t leafSize = BASELINE_DEFAULT_LEAF_SIZE;
+  // Unix time it was taken at
+  uint64_t created = 0;
+  // Raw digests, SHA256_DIGEST_SIZE bytes for each leaf, in disk order
+  std::vector<uint8_t> leaves;
+} Baseline;
+
+typedef struct BaselineOptions {
+  // Only for building, verifying uses the baseline's
+  uint32_t leafSize = BASELINE_DEFAULT_LEAF_SIZE;
+  IOClass ioClass = IO_CLASS_BULK;
+  unsigned int ioWeight = IO_DEFAULT_WEIGHT;
+  std::string bus;
+  // Leaves verified: the ones holding any of these byte ranges (offset and
+  // length), plus this many picked at random. Every leaf if neither is set
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+  uint64_t sample = 0;
+} BaselineOptions;
+
+typedef struct BaselineProgress {
+  uint64_t bytesHashed;
+  // Of the leaves being hashed, not the whole disk when verifying some
+  uint64_t bytesTotal;
+  double bytesPerSecond;
+} BaselineProgress;
+
+typedef struct BaselineResult {
+  // False if cancelled, and then the baseline is only half there
+  bool complete;
+  Baseline baseline;
+  std::string root;
+  uint64_t durationMs;
+} BaselineResult;
+
+typedef struct BaselineLeaf {
+  uint64_t index;
+  uint64_t offset;
+  uint64_t length;
+} BaselineLeaf;
+
+typedef struct BaselineVerification {
+  bool complete;
+  // As it is now. Leaves past the end of a shrunk disk, or cut short by it,
+  // are changed without reading them
+  uint64_t diskSize;
+  uint64_t leavesChecked;
+  uint64_t bytesChecked;
+  // In disk order
+  std::vector<BaselineLeaf> changed;
+  uint64_t durationMs;
+} BaselineVerification;
+
+uint64_t baselineLeafCount(const Baseline& baseline);
+
+// Where leaf `index` is on the disk
+BaselineLeaf baselineLeaf(const Baseline& baseline, uint64_t index);
+
+// Root of the tree, in hex. Leaves are hashed with a 0x00 in front and
+// nodes with a 0x01, and a node without a sibling goes up a level as it is,
+// which makes it the same tree as RFC 6962's: no leaf can pass for a node or
+// the other way round
+std::string merkleRoot(const Baseline& baseline);
+
+// Where the baseline of the disk with `mediaUUID` is kept in `directory`.
+// Throws for UUIDs that can't be a file name
+std::string baselinePath(const std::string& directory, const std::string& mediaUUID);
+
+// Returns false if there's nothing at `path`. Throws if it isn't a baseline,
+// or its leaves don't add up to the root saved along with them
+bool loadBaseline(const std::string& path, Baseline& baseline);
+
+// Replaces whatever was at `path` in one go, a crash leaves either the old
+// baseline or the new one
+void saveBaseline(const std::string& path, const Baseline& baseline);
+
+// Reads the whole device at `source` once, hashing its leaves on `pool` while
+// the next ones are read. `onProgress` is called every now and then and
+// cancels if it returns false. Throws on errors
+BaselineResult buildBaseline(const std::string& source, const BaselineOptions& options, ThreadPool& pool, std::function<bool(const BaselineProgress&)> onProgress);
+
+// Hashes the leaves `options` picks again and tells which ones changed since
+// `baseline` was taken. Only those leaves are read, so a sample of a few
+// hundred is done in seconds no matter the size of the disk
+BaselineVerification verifyBaseline(const std::string& source, const Baseline& baseline, const BaselineOptions& options, ThreadPool& pool, std::function<bool(const BaselineProgress&)> onProgress);
+
+// The leaves verifyBaseline() checks for `options`, in order. `seed` picks
+// the sample, 0 for a random one
+std::vector<uint64_t> baselineSelection(const Baseline& baseline, const BaselineOptions& options, uint64_t seed = 0);
+
+#endif
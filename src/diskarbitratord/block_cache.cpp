@@ -0,0 +1,266 @@
+/***************************************************************************
+ *   block_cache.cpp  --  This file is part of diskarbitratord.            *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_cache.hpp"
+
+// O_DIRECT wants buffers aligned to the logical block size, a page covers
+// every device out there
+#define BLOCK_CACHE_BUFFER_ALIGNMENT 4096
+// Blocks are keyed by device id in the top bits and block number in the rest
+#define BLOCK_CACHE_BLOCK_BITS 48
+
+static std::mutex sharedCacheMutex;
+static std::shared_ptr<BlockCache> sharedCache;
+
+void setSharedBlockCache(std::shared_ptr<BlockCache> cache) {
+  const std::lock_guard<std::mutex> lock(sharedCacheMutex);
+  sharedCache = cache;
+}
+
+std::shared_ptr<BlockCache> sharedBlockCache() {
+  const std::lock_guard<std::mutex> lock(sharedCacheMutex);
+  return sharedCache;
+}
+
+BlockCache::Device::~Device() {
+  close(this->fd);
+}
+
+BlockCache::BlockCache(uint64_t capacity, bool directIO) :
+    capacity(capacity), directIO(directIO), hits(0), misses(0), readaheadBlocks(0), readaheadHits(0), deviceBytesRead(0),
+    readaheadPool(BLOCK_CACHE_READAHEAD_THREADS) {
+  const size_t blocksPerShard = std::max<uint64_t>(1, capacity / BLOCK_CACHE_BLOCK_SIZE / BLOCK_CACHE_SHARDS);
+  for(unsigned int i = 0; i < BLOCK_CACHE_SHARDS; ++i) {
+    this->shards.emplace_back(new Shard(blocksPerShard));
+  }
+}
+
+std::unique_ptr<ImageReader> BlockCache::open(const std::string& path) {
+  int flags = O_RDONLY;
+#ifdef O_DIRECT
+  if(this->directIO) {
+    flags |= O_DIRECT;
+  }
+#endif
+  int fd = ::open(path.c_str(), flags);
+  // Some filesystems (tmpfs, for one) don't do O_DIRECT. The page cache it is
+  if(fd == -1 && errno == EINVAL && flags != O_RDONLY) {
+    fd = ::open(path.c_str(), O_RDONLY);
+  }
+  if(fd == -1) {
+    throw std::runtime_error("Unable to open " + path + ": " + std::string(strerror(errno)));
+  }
+#ifdef F_NOCACHE
+  if(this->directIO) {
+    fcntl(fd, F_NOCACHE, 1);
+  }
+#endif
+
+  std::shared_ptr<Device> device = std::make_shared<Device>();
+  device->fd = fd;
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    throw std::runtime_error("Unable to stat " + path + ": " + std::string(strerror(errno)));
+  }
+  device->size = fileOrDeviceSize(fd);
+  // The raw and buffered nodes of a disk are different devices to us, which
+  // is fine, nobody reads both
+  const std::string key = S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) ? "dev:" + std::to_string(st.st_rdev)
+                                                                       : std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+
+  const std::lock_guard<std::mutex> lock(this->devicesMutex);
+  std::shared_ptr<Device> existing = this->devices[key].lock();
+  if(existing != nullptr) {
+    // Ours gets closed on the way out
+    return std::unique_ptr<ImageReader>(new Reader(this->shared_from_this(), existing));
+  }
+  auto id = this->deviceIds.find(key);
+  if(id == this->deviceIds.end()) {
+    id = this->deviceIds.emplace(key, this->deviceIds.size()).first;
+  }
+  device->id = id->second;
+  this->devices[key] = device;
+  return std::unique_ptr<ImageReader>(new Reader(this->shared_from_this(), device));
+}
+
+BlockCacheStats BlockCache::stats() const {
+  BlockCacheStats stats;
+  stats.hits = this->hits;
+  stats.misses = this->misses;
+  stats.readaheadBlocks = this->readaheadBlocks;
+  stats.readaheadHits = this->readaheadHits;
+  stats.deviceBytesRead = this->deviceBytesRead;
+  stats.capacity = this->capacity;
+  stats.directIO = this->directIO;
+  return stats;
+}
+
+BlockCache::BlockData BlockCache::readBlock(const Device& device, uint64_t block) {
+  const uint64_t offset = block * BLOCK_CACHE_BLOCK_SIZE;
+  std::shared_ptr<Block> result = std::make_shared<Block>();
+  void* buffer;
+  if(posix_memalign(&buffer, BLOCK_CACHE_BUFFER_ALIGNMENT, BLOCK_CACHE_BLOCK_SIZE)) {
+    throw std::runtime_error("Unable to allocate a cache block");
+  }
+  result->data = std::shared_ptr<uint8_t>(static_cast<uint8_t*>(buffer), free);
+  result->length = std::min<uint64_t>(BLOCK_CACHE_BLOCK_SIZE, device.size - offset);
+  result->prefetched = false;
+  // Always the whole block, O_DIRECT wants aligned lengths. The device just
+  // ends early for the last one
+  size_t bytesRead = preadFully(device.fd, result->data.get(), BLOCK_CACHE_BLOCK_SIZE, offset);
+  if(bytesRead < result->length) {
+    throw std::runtime_error("Short read at offset " + std::to_string(offset + bytesRead));
+  }
+  this->deviceBytesRead += bytesRead;
+  return result;
+}
+
+std::shared_future<BlockCache::BlockData> BlockCache::fetch(const std::shared_ptr<Device>& device, uint64_t block, bool readahead) {
+  const uint64_t key = (device->id << BLOCK_CACHE_BLOCK_BITS) | block;
+  // Consecutive blocks land on different shards
+  Shard& shard = *this->shards[(block + device->id * 7) % BLOCK_CACHE_SHARDS];
+
+  auto hit = [this, readahead](const BlockData& cached) {
+    if(!readahead) {
+      ++this->hits;
+      if(cached->prefetched.exchange(false)) {
+        ++this->readaheadHits;
+      }
+    }
+    std::promise<BlockData> ready;
+    ready.set_value(cached);
+    return ready.get_future().share();
+  };
+  BlockData cached = shard.cache.get(key);
+  if(cached) {
+    return hit(cached);
+  }
+
+  std::unique_lock<std::mutex> lock(shard.inFlightMutex);
+  // It may have finished loading since we looked
+  cached = shard.cache.get(key);
+  if(cached) {
+    return hit(cached);
+  }
+  auto it = shard.inFlight.find(key);
+  if(it != shard.inFlight.end()) {
+    // Someone else is already reading it, which is as good as a hit
+    if(!readahead) {
+      ++this->hits;
+    }
+    return it->second;
+  }
+
+  auto load = [this, &shard, device, block, key, readahead]() {
+    BlockData data;
+    try {
+      data = this->readBlock(*device, block);
+      data->prefetched = readahead;
+      shard.cache.put(key, data);
+    } catch(...) {
+      const std::lock_guard<std::mutex> lock(shard.inFlightMutex);
+      shard.inFlight.erase(key);
+      throw;
+    }
+    const std::lock_guard<std::mutex> lock(shard.inFlightMutex);
+    shard.inFlight.erase(key);
+    return data;
+  };
+
+  if(readahead) {
+    ++this->readaheadBlocks;
+    std::shared_future<BlockData> result = this->readaheadPool.submit(load).share();
+    shard.inFlight[key] = result;
+    return result;
+  }
+
+  // Whoever needs the block now reads it themselves, rather than waiting in
+  // line behind readahead
+  ++this->misses;
+  std::promise<BlockData> promise;
+  std::shared_future<BlockData> result = promise.get_future().share();
+  shard.inFlight[key] = result;
+  lock.unlock();
+  try {
+    promise.set_value(load());
+  } catch(...) {
+    promise.set_exception(std::current_exception());
+  }
+  return result;
+}
+
+uint64_t BlockCache::Reader::size() const {
+  return this->device->size;
+}
+
+size_t BlockCache::Reader::read(uint64_t offset, void* buffer, size_t len) {
+  const uint64_t deviceSize = this->device->size;
+  if(offset >= deviceSize) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, deviceSize - offset);
+  const uint64_t end = offset + len;
+  const uint64_t firstBlock = offset / BLOCK_CACHE_BLOCK_SIZE;
+  const uint64_t lastBlock = (end - 1) / BLOCK_CACHE_BLOCK_SIZE;
+  const uint64_t blockCount = (deviceSize + BLOCK_CACHE_BLOCK_SIZE - 1) / BLOCK_CACHE_BLOCK_SIZE;
+
+  // Readahead goes out first, so it's on its way while we read what's needed
+  // now. It only ever asks for blocks past what it asked for before
+  uint64_t readaheadFrom = 0;
+  uint64_t readaheadTo = 0;
+  {
+    const std::lock_guard<std::mutex> lock(this->streamMutex);
+    if(offset == this->nextSequentialOffset) {
+      this->readaheadWindow = this->readaheadWindow ? std::min<uint64_t>(this->readaheadWindow * 2, BLOCK_CACHE_MAX_READAHEAD) : BLOCK_CACHE_MIN_READAHEAD;
+      readaheadFrom = std::max(lastBlock + 1, this->readaheadEnd);
+      readaheadTo = std::min(blockCount, lastBlock + 1 + this->readaheadWindow / BLOCK_CACHE_BLOCK_SIZE);
+      this->readaheadEnd = std::max(this->readaheadEnd, readaheadTo);
+    } else {
+      this->readaheadWindow = 0;
+      this->readaheadEnd = 0;
+    }
+    this->nextSequentialOffset = end;
+  }
+  for(uint64_t block = readaheadFrom; block < readaheadTo; ++block) {
+    this->cache->fetch(this->device, block, true);
+  }
+
+  uint8_t* out = static_cast<uint8_t*>(buffer);
+  for(uint64_t block = firstBlock; block <= lastBlock; ++block) {
+    BlockData data = this->cache->fetch(this->device, block, false).get();
+    const uint64_t blockStart = block * BLOCK_CACHE_BLOCK_SIZE;
+    const uint64_t copyStart = std::max(offset, blockStart);
+    const uint64_t copyEnd = std::min(end, blockStart + data->length);
+    memcpy(out + (copyStart - offset), data->data.get() + (copyStart - blockStart), copyEnd - copyStart);
+  }
+  return len;
+}
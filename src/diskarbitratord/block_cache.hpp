@@ -0,0 +1,154 @@
+/***************************************************************************
+ *   block_cache.hpp  --  This file is part of diskarbitratord.            *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef BLOCK_CACHE_HPP_
+#define BLOCK_CACHE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+#include "lru_cache.hpp"
+#include "thread_pool.hpp"
+
+// Block cache shared by everything reading raw devices and images: partition
+// probing, extraction, hashing, NBD exports... Each of them opens its own
+// reader, but blocks are keyed by the device underneath, so the device gets
+// read once no matter how many of them want the same data. Readers that go
+// sequential get readahead, growing the more sequential they stay.
+
+// Unit of caching and of device reads. A multiple of any sector size, so it
+// works with O_DIRECT and raw character devices
+#define BLOCK_CACHE_BLOCK_SIZE (128 * 1024)
+// Separately locked parts of the cache, so concurrent readers don't all fight
+// over a single mutex
+#define BLOCK_CACHE_SHARDS 16
+// Readahead window on the first sequential read, doubled on every sequential
+// read after it up to the maximum
+#define BLOCK_CACHE_MIN_READAHEAD (512 * 1024)
+#define BLOCK_CACHE_MAX_READAHEAD (16 * 1024 * 1024)
+#define BLOCK_CACHE_READAHEAD_THREADS 4
+#define BLOCK_CACHE_DEFAULT_SIZE (256ULL * 1024 * 1024)
+
+typedef struct BlockCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  // Blocks read ahead, and how many of them were read by someone afterwards
+  uint64_t readaheadBlocks;
+  uint64_t readaheadHits;
+  uint64_t deviceBytesRead;
+  uint64_t capacity;
+  bool directIO;
+} BlockCacheStats;
+
+// Always created with std::make_shared, readers keep it alive
+class BlockCache : public std::enable_shared_from_this<BlockCache> {
+  public:
+    // Holds up to `capacity` bytes. With `directIO`, devices are opened with
+    // O_DIRECT (F_NOCACHE on macOS) so that data isn't cached twice, once here
+    // and once in the page cache
+    BlockCache(uint64_t capacity, bool directIO = false);
+
+    // Opens a raw image or device for reading through the cache. Throws if it
+    // can't be opened
+    std::unique_ptr<ImageReader> open(const std::string& path);
+
+    BlockCacheStats stats() const;
+
+  private:
+    typedef struct Block {
+      std::shared_ptr<uint8_t> data;
+      size_t length;
+      // Set until someone other than readahead reads the block
+      mutable std::atomic<bool> prefetched;
+    } Block;
+    typedef std::shared_ptr<const Block> BlockData;
+
+    // An open device, shared by every reader of it
+    typedef struct Device {
+      int fd;
+      uint64_t size;
+      uint64_t id;
+      ~Device();
+    } Device;
+
+    typedef struct Shard {
+      Shard(size_t capacity) : cache(capacity) {}
+      LRUCache<uint64_t, Block> cache;
+      std::mutex inFlightMutex;
+      // Blocks being read right now, so two readers never read the same one
+      std::map<uint64_t, std::shared_future<BlockData>> inFlight;
+    } Shard;
+
+    class Reader : public ImageReader {
+      public:
+        Reader(std::shared_ptr<BlockCache> cache, std::shared_ptr<Device> device) : cache(cache), device(device) {}
+        uint64_t size() const override;
+        size_t read(uint64_t offset, void* buffer, size_t len) override;
+
+      private:
+        std::shared_ptr<BlockCache> cache;
+        std::shared_ptr<Device> device;
+        // Sequential detection and the current readahead window
+        std::mutex streamMutex;
+        uint64_t nextSequentialOffset = 0;
+        uint64_t readaheadWindow = 0;
+        uint64_t readaheadEnd = 0;
+    };
+
+    // Returns the block, reading it first if it isn't cached. Readahead reads
+    // happen on the pool, everything else on the calling thread
+    std::shared_future<BlockData> fetch(const std::shared_ptr<Device>& device, uint64_t block, bool readahead);
+    BlockData readBlock(const Device& device, uint64_t block);
+
+    const uint64_t capacity;
+    const bool directIO;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    // Devices stay open while someone reads them. Their ids outlive them, so a
+    // device opened again later finds its blocks still there
+    std::mutex devicesMutex;
+    std::map<std::string, std::weak_ptr<Device>> devices;
+    std::map<std::string, uint64_t> deviceIds;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> readaheadBlocks;
+    std::atomic<uint64_t> readaheadHits;
+    std::atomic<uint64_t> deviceBytesRead;
+
+    // Last, so it's destroyed (and waited for) before the rest
+    ThreadPool readaheadPool;
+};
+
+// The cache openImageReader() sends raw images and devices through. Null, the
+// default, means they're read directly
+void setSharedBlockCache(std::shared_ptr<BlockCache> cache);
+std::shared_ptr<BlockCache> sharedBlockCache();
+
+#endif
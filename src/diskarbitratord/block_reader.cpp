@@ -0,0 +1,352 @@
+/***************************************************************************
+ *   block_reader.cpp  --  This file is part of diskarbitratord.           *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "block_reader.hpp"
+
+#ifdef BLOCK_READER_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+static std::mutex defaultsMutex;
+static BlockReaderBackend defaultBackend = BLOCK_READER_AUTO;
+static unsigned int defaultDepth = BLOCK_READER_DEFAULT_DEPTH;
+
+void setBlockReaderDefaults(BlockReaderBackend backend, unsigned int depth) {
+  const std::lock_guard<std::mutex> lock(defaultsMutex);
+  defaultBackend = backend;
+  defaultDepth = depth ? depth : BLOCK_READER_DEFAULT_DEPTH;
+}
+
+BlockReaderBackend parseBlockReaderBackend(const std::string& name) {
+  if(name == "auto") {
+    return BLOCK_READER_AUTO;
+  }
+  if(name == "pread") {
+    return BLOCK_READER_PREAD;
+  }
+  if(name == "io_uring") {
+    return BLOCK_READER_IO_URING;
+  }
+  throw std::runtime_error("Unknown I/O backend " + name + ", it has to be auto, pread or io_uring");
+}
+
+PreadBlockReader::PreadBlockReader(int fd, unsigned int depth) :
+    fd(fd), queueDepth(depth), pool(std::min(depth, static_cast<unsigned int>(BLOCK_READER_MAX_THREADS))) {}
+
+void PreadBlockReader::submit(void* buffer, size_t len, uint64_t offset, uint64_t tag) {
+  if(this->pending == this->queueDepth) {
+    throw std::logic_error("Block reader queue is full");
+  }
+  ++this->pending;
+  this->pool.submit([this, buffer, len, offset, tag]() {
+    size_t done = 0;
+    ssize_t result = 0;
+    while(done < len) {
+      ssize_t bytesRead = pread(this->fd, static_cast<uint8_t*>(buffer) + done, len - done, offset + done);
+      if(bytesRead < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        result = -errno;
+        break;
+      }
+      if(bytesRead == 0) {
+        break;
+      }
+      done += bytesRead;
+    }
+    {
+      const std::lock_guard<std::mutex> lock(this->mutex);
+      this->completed.push_back({tag, result < 0 ? result : static_cast<ssize_t>(done)});
+    }
+    this->finished.notify_one();
+  });
+}
+
+void PreadBlockReader::wait(std::vector<BlockCompletion>& completions) {
+  if(!this->pending) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->finished.wait(lock, [this]() {
+    return this->completed.size();
+  });
+  this->pending -= this->completed.size();
+  completions.insert(completions.end(), this->completed.begin(), this->completed.end());
+  this->completed.clear();
+}
+
+#ifdef BLOCK_READER_HAVE_IO_URING
+// There's no liburing to lean on everywhere, the raw system calls aren't much
+// harder to use for what we need
+static int ioUringSetup(unsigned int entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int ring, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+  return syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int ring, unsigned int opcode, const void* arg, unsigned int count) {
+  return syscall(__NR_io_uring_register, ring, opcode, arg, count);
+}
+
+IOUringBlockReader::IOUringBlockReader(int fd, unsigned int depth, const std::vector<std::pair<void*, size_t>>& buffers) :
+    fd(fd), queueDepth(depth), requests(depth), buffers(buffers) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  this->ring = ioUringSetup(depth, &params);
+  if(this->ring < 0) {
+    throw std::runtime_error("Unable to set up io_uring: " + std::string(strerror(errno)));
+  }
+  try {
+    this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    this->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+      this->sqRingSize = this->cqRingSize = std::max(this->sqRingSize, this->cqRingSize);
+    }
+    this->sqRing = mmap(NULL, this->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_SQ_RING);
+    if(this->sqRing == MAP_FAILED) {
+      this->sqRing = nullptr;
+      throw std::runtime_error("Unable to map the io_uring submission queue: " + std::string(strerror(errno)));
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+      this->cqRing = this->sqRing;
+    } else {
+      this->cqRing = mmap(NULL, this->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_CQ_RING);
+      if(this->cqRing == MAP_FAILED) {
+        this->cqRing = nullptr;
+        throw std::runtime_error("Unable to map the io_uring completion queue: " + std::string(strerror(errno)));
+      }
+    }
+    this->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    this->sqes = mmap(NULL, this->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_SQES);
+    if(this->sqes == MAP_FAILED) {
+      this->sqes = nullptr;
+      throw std::runtime_error("Unable to map the io_uring submission entries: " + std::string(strerror(errno)));
+    }
+  } catch(...) {
+    this->unmap();
+    throw;
+  }
+
+  uint8_t* sq = static_cast<uint8_t*>(this->sqRing);
+  this->sqHead = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+  this->sqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+  this->sqMask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+  this->sqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+  uint8_t* cq = static_cast<uint8_t*>(this->cqRing);
+  this->cqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+  this->cqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+  this->cqMask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+  this->cqes = cq + params.cq_off.cqes;
+
+  // Both are only an optimisation, everything works without them (memlock
+  // limits can get in the way of registering buffers)
+  this->fixedFile = ioUringRegister(this->ring, IORING_REGISTER_FILES, &this->fd, 1) == 0;
+  if(this->buffers.size()) {
+    std::vector<struct iovec> iovecs;
+    for(const auto& buffer : this->buffers) {
+      iovecs.push_back({buffer.first, buffer.second});
+    }
+    if(ioUringRegister(this->ring, IORING_REGISTER_BUFFERS, iovecs.data(), iovecs.size()) != 0) {
+      this->buffers.clear();
+    }
+  }
+
+  for(unsigned int slot = depth; slot > 0; --slot) {
+    this->freeSlots.push_back(slot - 1);
+  }
+}
+
+IOUringBlockReader::~IOUringBlockReader() {
+  // The kernel may still be writing into buffers that are about to go away
+  std::vector<BlockCompletion> completions;
+  try {
+    while(this->pending) {
+      this->wait(completions);
+    }
+  } catch(...) {
+  }
+  this->unmap();
+}
+
+void IOUringBlockReader::unmap() {
+  if(this->sqes) {
+    munmap(this->sqes, this->sqesSize);
+  }
+  if(this->cqRing && this->cqRing != this->sqRing) {
+    munmap(this->cqRing, this->cqRingSize);
+  }
+  if(this->sqRing) {
+    munmap(this->sqRing, this->sqRingSize);
+  }
+  close(this->ring);
+}
+
+void IOUringBlockReader::submit(void* buffer, size_t len, uint64_t offset, uint64_t tag) {
+  if(this->freeSlots.empty()) {
+    throw std::logic_error("Block reader queue is full");
+  }
+  const unsigned int slot = this->freeSlots.back();
+  this->freeSlots.pop_back();
+  Request& request = this->requests[slot];
+  request = {static_cast<uint8_t*>(buffer), len, offset, tag, 0, -1};
+  for(size_t i = 0; i < this->buffers.size(); ++i) {
+    uint8_t* start = static_cast<uint8_t*>(this->buffers[i].first);
+    if(request.buffer >= start && request.buffer + len <= start + this->buffers[i].second) {
+      request.bufferIndex = i;
+      break;
+    }
+  }
+  ++this->pending;
+  this->queue(slot);
+}
+
+void IOUringBlockReader::queue(unsigned int slot) {
+  const Request& request = this->requests[slot];
+  // We're the only producer, the kernel only moves the head
+  const unsigned int tail = *this->sqTail;
+  const unsigned int index = tail & *this->sqMask;
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(this->sqes) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = request.bufferIndex >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = this->fixedFile ? 0 : this->fd;
+  sqe->flags = this->fixedFile ? IOSQE_FIXED_FILE : 0;
+  sqe->addr = reinterpret_cast<uint64_t>(request.buffer + request.done);
+  sqe->len = request.len - request.done;
+  sqe->off = request.offset + request.done;
+  sqe->buf_index = request.bufferIndex >= 0 ? request.bufferIndex : 0;
+  sqe->user_data = slot;
+  this->sqArray[index] = index;
+  __atomic_store_n(this->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++this->unsubmitted;
+}
+
+void IOUringBlockReader::enter(unsigned int minComplete) {
+  while(true) {
+    int submitted = ioUringEnter(this->ring, this->unsubmitted, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0);
+    if(submitted >= 0) {
+      this->unsubmitted -= std::min<unsigned int>(submitted, this->unsubmitted);
+      return;
+    }
+    if(errno != EINTR) {
+      throw std::runtime_error("Unable to submit reads to io_uring: " + std::string(strerror(errno)));
+    }
+  }
+}
+
+void IOUringBlockReader::wait(std::vector<BlockCompletion>& completions) {
+  const size_t before = completions.size();
+  while(this->pending && completions.size() == before) {
+    unsigned int head = *this->cqHead;
+    unsigned int tail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+    if(head == tail || this->unsubmitted) {
+      // Sends everything queued up in one go, and only sleeps if there's
+      // nothing to reap yet
+      this->enter(head == tail ? 1 : 0);
+      continue;
+    }
+    for(; head != tail; ++head) {
+      const struct io_uring_cqe* cqe = static_cast<const struct io_uring_cqe*>(this->cqes) + (head & *this->cqMask);
+      const unsigned int slot = cqe->user_data;
+      Request& request = this->requests[slot];
+      if(cqe->res > 0 && request.done + cqe->res < request.len) {
+        request.done += cqe->res;
+        this->queue(slot);
+        continue;
+      }
+      if(cqe->res == -EAGAIN || cqe->res == -EINTR) {
+        this->queue(slot);
+        continue;
+      }
+      completions.push_back({request.tag, cqe->res < 0 ? cqe->res : static_cast<ssize_t>(request.done + cqe->res)});
+      this->freeSlots.push_back(slot);
+      --this->pending;
+    }
+    __atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+  }
+}
+#endif
+
+bool ioUringAvailable() {
+#ifdef BLOCK_READER_HAVE_IO_URING
+  // Old kernels don't have it, and it's often disabled by sysctl or seccomp.
+  // Rings work from 5.1, but IORING_OP_READ (what unregistered buffers are
+  // read with) only came in 5.6, along with the probe telling us so. Before
+  // that every read would fail with EINVAL, so those get pread too
+  static const bool available = []() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = ioUringSetup(1, &params);
+    if(ring < 0) {
+      return false;
+    }
+    std::vector<uint8_t> buffer(sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(buffer.data());
+    auto supported = [probe](unsigned int op) {
+      return op < probe->ops_len && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+    bool usable = ioUringRegister(ring, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+                  supported(IORING_OP_READ) && supported(IORING_OP_READ_FIXED);
+    close(ring);
+    return usable;
+  }();
+  return available;
+#else
+  return false;
+#endif
+}
+
+std::unique_ptr<BlockReader> openBlockReader(int fd, BlockReaderBackend backend, unsigned int depth, const std::vector<std::pair<void*, size_t>>& buffers) {
+  {
+    const std::lock_guard<std::mutex> lock(defaultsMutex);
+    if(backend == BLOCK_READER_AUTO) {
+      backend = defaultBackend;
+    }
+    if(!depth) {
+      depth = defaultDepth;
+    }
+  }
+  depth = std::min<unsigned int>(depth, BLOCK_READER_MAX_DEPTH);
+  if(backend == BLOCK_READER_IO_URING && !ioUringAvailable()) {
+    throw std::runtime_error("io_uring isn't available on this system");
+  }
+#ifdef BLOCK_READER_HAVE_IO_URING
+  if(backend != BLOCK_READER_PREAD && ioUringAvailable()) {
+    return std::unique_ptr<BlockReader>(new IOUringBlockReader(fd, depth, buffers));
+  }
+#endif
+  return std::unique_ptr<BlockReader>(new PreadBlockReader(fd, depth));
+}
@@ -0,0 +1,192 @@
+/***************************************************************************
+ *   block_reader.hpp  --  This file is part of diskarbitratord.           *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#ifndef BLOCK_READER_HPP_
+#define BLOCK_READER_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "thread_pool.hpp"
+
+#define BLOCK_READER_DEFAULT_DEPTH 32
+#define BLOCK_READER_MAX_DEPTH 4096
+// Blocking reads take a thread each, past this many they only get in each
+// other's way
+#define BLOCK_READER_MAX_THREADS 16
+
+enum BlockReaderBackend {
+  // io_uring where the kernel has it, threads doing pread(2) anywhere else
+  BLOCK_READER_AUTO,
+  BLOCK_READER_PREAD,
+  BLOCK_READER_IO_URING,
+};
+
+typedef struct BlockCompletion {
+  uint64_t tag;
+  // Bytes read, which is only less than asked for at the end of the file, or
+  // -errno
+  ssize_t result;
+} BlockCompletion;
+
+// Reads of one file or device kept in flight together, so the disk always
+// has a queue to work through. Nothing is read in any particular order, each
+// read comes back with the tag it was submitted with. Not thread safe, it's
+// meant to be driven from a single thread.
+class BlockReader {
+  public:
+    virtual ~BlockReader() {}
+
+    // Queues a read of `len` bytes at `offset`. Reads may only be actually
+    // started on the next wait(), so a batch of them goes to the kernel at
+    // once. No more than depth() can be in flight
+    virtual void submit(void* buffer, size_t len, uint64_t offset, uint64_t tag) = 0;
+    // Waits for at least one read in flight to finish, and appends every one
+    // that has to `completions`
+    virtual void wait(std::vector<BlockCompletion>& completions) = 0;
+    virtual unsigned int inFlight() const = 0;
+    virtual unsigned int depth() const = 0;
+    virtual const char* name() const = 0;
+};
+
+// A pool of threads doing blocking pread(2)s
+class PreadBlockReader : public BlockReader {
+  public:
+    PreadBlockReader(int fd, unsigned int depth);
+    void submit(void* buffer, size_t len, uint64_t offset, uint64_t tag) override;
+    void wait(std::vector<BlockCompletion>& completions) override;
+    unsigned int inFlight() const override {
+      return this->pending;
+    }
+    unsigned int depth() const override {
+      return this->queueDepth;
+    }
+    const char* name() const override {
+      return "pread";
+    }
+
+  private:
+    int fd;
+    unsigned int queueDepth;
+    unsigned int pending = 0;
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<BlockCompletion> completed;
+    // Last, so it's destroyed (and waited for) before the rest
+    ThreadPool pool;
+};
+
+#ifdef __linux__
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BLOCK_READER_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef BLOCK_READER_HAVE_IO_URING
+// One io_uring, with the file registered so the kernel doesn't have to look
+// it up on every read. Reads into the `buffers` it's created with skip
+// mapping the pages in every time too. Short reads are resubmitted for what's
+// left, so they only come back short at the end of the file.
+class IOUringBlockReader : public BlockReader {
+  public:
+    // Throws if the kernel doesn't do io_uring, or won't let us use it
+    IOUringBlockReader(int fd, unsigned int depth, const std::vector<std::pair<void*, size_t>>& buffers = {});
+    ~IOUringBlockReader();
+    void submit(void* buffer, size_t len, uint64_t offset, uint64_t tag) override;
+    void wait(std::vector<BlockCompletion>& completions) override;
+    unsigned int inFlight() const override {
+      return this->pending;
+    }
+    unsigned int depth() const override {
+      return this->queueDepth;
+    }
+    const char* name() const override {
+      return "io_uring";
+    }
+
+  private:
+    typedef struct Request {
+      uint8_t* buffer;
+      size_t len;
+      uint64_t offset;
+      uint64_t tag;
+      size_t done;
+      int bufferIndex;
+    } Request;
+
+    void queue(unsigned int slot);
+    void enter(unsigned int minComplete);
+    void unmap();
+
+    int fd;
+    int ring;
+    bool fixedFile = false;
+    unsigned int queueDepth;
+    unsigned int pending = 0;
+    // Queued, but not handed to the kernel yet
+    unsigned int unsubmitted = 0;
+    std::vector<Request> requests;
+    std::vector<unsigned int> freeSlots;
+    std::vector<std::pair<void*, size_t>> buffers;
+
+    void* sqRing = nullptr;
+    size_t sqRingSize = 0;
+    void* cqRing = nullptr;
+    size_t cqRingSize = 0;
+    void* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    void* cqes;
+};
+#endif
+
+// Whether this kernel lets us use io_uring at all
+bool ioUringAvailable();
+
+// `buffers` are what the reads will go into, backends that can make use of
+// knowing them in advance do. A backend or depth of 0 means the defaults.
+// Throws if the backend asked for isn't available
+std::unique_ptr<BlockReader> openBlockReader(int fd, BlockReaderBackend backend = BLOCK_READER_AUTO, unsigned int depth = 0, const std::vector<std::pair<void*, size_t>>& buffers = {});
+
+// What openBlockReader() uses when asked for the defaults, set from the
+// daemon's command line
+void setBlockReaderDefaults(BlockReaderBackend backend, unsigned int depth);
+
+BlockReaderBackend parseBlockReaderBackend(const std::string& name);
+
+#endif
@@ -0,0 +1,167 @@
+/***************************************************************************
+ *   block_scan.cpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BLOCK_SCAN_HAVE_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BLOCK_SCAN_HAVE_NEON
+#endif
+
+#include "block_scan.hpp"
+
+// Bytes compared before checking whether anything differed. Data blocks
+// usually differ right away, so there's no point in going much further
+#define BLOCK_SCAN_STRIDE 128
+
+// Eight bytes at a time, for tails and CPUs without vector units
+static bool filledScalar(const uint8_t* data, size_t len, uint8_t value) {
+  const uint64_t pattern = value * 0x0101010101010101ULL;
+  size_t i = 0;
+  for(; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    if(word != pattern) {
+      return false;
+    }
+  }
+  for(; i < len; ++i) {
+    if(data[i] != value) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef BLOCK_SCAN_HAVE_SSE2
+static bool filledSSE2(const uint8_t* data, size_t len, uint8_t value) {
+  const __m128i pattern = _mm_set1_epi8(static_cast<char>(value));
+  size_t i = 0;
+  for(; i + BLOCK_SCAN_STRIDE <= len; i += BLOCK_SCAN_STRIDE) {
+    __m128i diff = _mm_setzero_si128();
+    for(size_t j = 0; j < BLOCK_SCAN_STRIDE; j += 16) {
+      diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + j)), pattern));
+    }
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) {
+      return false;
+    }
+  }
+  return filledScalar(data + i, len - i, value);
+}
+
+__attribute__((target("avx2")))
+static bool filledAVX2(const uint8_t* data, size_t len, uint8_t value) {
+  const __m256i pattern = _mm256_set1_epi8(static_cast<char>(value));
+  size_t i = 0;
+  for(; i + BLOCK_SCAN_STRIDE <= len; i += BLOCK_SCAN_STRIDE) {
+    __m256i diff = _mm256_setzero_si256();
+    for(size_t j = 0; j < BLOCK_SCAN_STRIDE; j += 32) {
+      diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + j)), pattern));
+    }
+    if(!_mm256_testz_si256(diff, diff)) {
+      return false;
+    }
+  }
+  return filledScalar(data + i, len - i, value);
+}
+#endif
+
+#ifdef BLOCK_SCAN_HAVE_NEON
+static bool filledNEON(const uint8_t* data, size_t len, uint8_t value) {
+  const uint8x16_t pattern = vdupq_n_u8(value);
+  size_t i = 0;
+  for(; i + BLOCK_SCAN_STRIDE <= len; i += BLOCK_SCAN_STRIDE) {
+    uint8x16_t diff = vdupq_n_u8(0);
+    for(size_t j = 0; j < BLOCK_SCAN_STRIDE; j += 16) {
+      diff = vorrq_u8(diff, veorq_u8(vld1q_u8(data + i + j), pattern));
+    }
+    if(vmaxvq_u8(diff)) {
+      return false;
+    }
+  }
+  return filledScalar(data + i, len - i, value);
+}
+#endif
+
+typedef bool (*FilledFunction)(const uint8_t*, size_t, uint8_t);
+
+typedef struct BlockScanBackend {
+  FilledFunction filled;
+  const char* name;
+} BlockScanBackend;
+
+static BlockScanBackend selectBackend() {
+#if defined(BLOCK_SCAN_HAVE_NEON)
+  return {filledNEON, "neon"};
+#elif defined(BLOCK_SCAN_HAVE_SSE2)
+  if(__builtin_cpu_supports("avx2")) {
+    return {filledAVX2, "avx2"};
+  }
+  return {filledSSE2, "sse2"};
+#else
+  return {filledScalar, "scalar"};
+#endif
+}
+
+static const BlockScanBackend& backend() {
+  static const BlockScanBackend selected = selectBackend();
+  return selected;
+}
+
+bool blockIsFilled(const uint8_t* data, size_t len, uint8_t value) {
+  return backend().filled(data, len, value);
+}
+
+// libc's memcmp is vectorized already (AVX2 or AVX-512 with glibc, NEON on
+// Apple silicon), and measured faster than the same loop as above with two
+// inputs
+bool blocksEqual(const uint8_t* a, const uint8_t* b, size_t len) {
+  return !memcmp(a, b, len);
+}
+
+BlockKind classifyBlock(const uint8_t* data, size_t len, uint8_t& fill) {
+  fill = data[0];
+  if(!blockIsFilled(data, len, fill)) {
+    fill = 0;
+    return BLOCK_DATA;
+  }
+  return fill ? BLOCK_CONSTANT : BLOCK_ZERO;
+}
+
+const char* blockKindName(BlockKind kind) {
+  switch(kind) {
+    case BLOCK_ZERO:
+      return "zero";
+    case BLOCK_CONSTANT:
+      return "constant";
+    case BLOCK_DATA:
+      break;
+  }
+  return "data";
+}
+
+const char* blockScanImplementation() {
+  return backend().name;
+}
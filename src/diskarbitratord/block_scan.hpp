@@ -0,0 +1,52 @@
+/***************************************************************************
+ *   block_scan.hpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef BLOCK_SCAN_HPP_
+#define BLOCK_SCAN_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+// Tells empty blocks from ones with data in them. Uses AVX2, SSE2 or NEON
+// when the CPU has them, so scanning keeps up with any disk.
+
+enum BlockKind {
+  BLOCK_ZERO,
+  BLOCK_CONSTANT,   // Every byte the same, but not zero (0xFF erased flash...)
+  BLOCK_DATA
+};
+
+// Whether all `len` bytes at `data` are `value`
+bool blockIsFilled(const uint8_t* data, size_t len, uint8_t value);
+
+// Whether the `len` bytes at `a` and `b` are the same
+bool blocksEqual(const uint8_t* a, const uint8_t* b, size_t len);
+
+// `fill` gets the repeated byte for zero and constant blocks, 0 for data. `len` can't be 0
+BlockKind classifyBlock(const uint8_t* data, size_t len, uint8_t& fill);
+
+const char* blockKindName(BlockKind kind);
+
+// Which implementation ended up being used, for the benchmarks
+const char* blockScanImplementation();
+
+#endif
@@ -0,0 +1,69 @@
+/***************************************************************************
+ *   byteorder.hpp  --  This file is part of diskarbitratord.              *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef BYTEORDER_HPP_
+#define BYTEORDER_HPP_
+
+#include <cstdint>
+
+// Helpers for pulling integers out of on-disk structures (and putting them
+// into ours). Apple's formats are big endian, PC ones (MBR, GPT, FAT...)
+// little endian, and we don't want to care about the host's byte order or
+// alignment.
+
+inline uint16_t readBE16(const uint8_t* p) {
+  return (static_cast<uint16_t>(p[0]) << 8) | p[1];
+}
+
+inline uint32_t readBE32(const uint8_t* p) {
+  return (static_cast<uint32_t>(readBE16(p)) << 16) | readBE16(p + 2);
+}
+
+inline uint64_t readBE64(const uint8_t* p) {
+  return (static_cast<uint64_t>(readBE32(p)) << 32) | readBE32(p + 4);
+}
+
+inline uint16_t readLE16(const uint8_t* p) {
+  return (static_cast<uint16_t>(p[1]) << 8) | p[0];
+}
+
+inline uint32_t readLE32(const uint8_t* p) {
+  return (static_cast<uint32_t>(readLE16(p + 2)) << 16) | readLE16(p);
+}
+
+inline uint64_t readLE64(const uint8_t* p) {
+  return (static_cast<uint64_t>(readLE32(p + 4)) << 32) | readLE32(p);
+}
+
+inline void putLE32(uint8_t* p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+inline void putLE64(uint8_t* p, uint64_t v) {
+  putLE32(p, v);
+  putLE32(p + 4, v >> 32);
+}
+
+#endif
@@ -0,0 +1,146 @@
+/***************************************************************************
+ *   checkpoint.cpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "checkpoint.hpp"
+#include "hash.hpp"
+#include "pipeline.hpp"
+#include "scope_guard.hpp"
+
+#define CHECKPOINT_HEADER "# Checkpoint written by diskarbitratord"
+
+bool loadCheckpoint(const std::string& path, Checkpoint& checkpoint) {
+  std::ifstream file(path);
+  if(!file) {
+    if(errno == ENOENT) {
+      return false;
+    }
+    throw std::runtime_error("Unable to open checkpoint " + path + ": " + std::string(strerror(errno)));
+  }
+  Checkpoint loaded;
+  std::string line;
+  if(!std::getline(file, line) || line != CHECKPOINT_HEADER) {
+    throw std::runtime_error(path + " isn't a checkpoint");
+  }
+  bool haveOffset = false;
+  while(std::getline(file, line)) {
+    if(line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string key;
+    std::string first;
+    std::string second;
+    fields >> key >> first >> second;
+    try {
+      if(key == "identity") {
+        loaded.identity = first;
+      } else if(key == "size") {
+        loaded.size = std::stoull(first);
+      } else if(key == "offset") {
+        loaded.offset = std::stoull(first);
+        haveOffset = true;
+      } else if(key == "output") {
+        loaded.outputSize = std::stoull(first);
+      } else if(key == "sparse") {
+        loaded.sparseBytes = std::stoull(first);
+      } else if(key == "state" && second.size()) {
+        loaded.states[first] = second;
+      } else if(key == "segment" && second.size()) {
+        loaded.segments[first].push_back(second);
+      } else {
+        throw std::invalid_argument(line);
+      }
+    } catch(const std::logic_error& e) {
+      throw std::runtime_error("Invalid line in checkpoint " + path + ": " + line);
+    }
+  }
+  if(loaded.identity.empty() || !haveOffset || loaded.offset > loaded.size) {
+    throw std::runtime_error("Incomplete checkpoint " + path);
+  }
+  checkpoint = loaded;
+  return true;
+}
+
+void saveCheckpoint(const std::string& path, const Checkpoint& checkpoint) {
+  std::string contents = CHECKPOINT_HEADER "\n";
+  contents += "identity " + checkpoint.identity + "\n";
+  contents += "size " + std::to_string(checkpoint.size) + "\n";
+  contents += "offset " + std::to_string(checkpoint.offset) + "\n";
+  contents += "output " + std::to_string(checkpoint.outputSize) + "\n";
+  contents += "sparse " + std::to_string(checkpoint.sparseBytes) + "\n";
+  for(const auto& state : checkpoint.states) {
+    contents += "state " + state.first + " " + state.second + "\n";
+  }
+  for(const auto& segments : checkpoint.segments) {
+    for(const auto& digest : segments.second) {
+      contents += "segment " + segments.first + " " + digest + "\n";
+    }
+  }
+
+  const std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    throw std::runtime_error("Unable to save checkpoint " + temporary + ": " + std::string(strerror(errno)));
+  }
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+  pwriteFully(fd, contents.data(), contents.size(), 0);
+  if(fsync(fd) != 0 || rename(temporary.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Unable to save checkpoint " + path + ": " + std::string(strerror(errno)));
+  }
+}
+
+static std::string identityOf(const uint8_t* head, size_t len, uint64_t size, uint32_t sectorSize, const std::string& extra) {
+  SHA256 hash;
+  const std::string fields = std::to_string(size) + ":" + std::to_string(sectorSize) + ":" + extra + ":";
+  hash.update(fields.data(), fields.size());
+  hash.update(head, len);
+  return hash.finish();
+}
+
+std::string diskIdentity(int fd, uint64_t size, const std::string& extra) {
+  // The disk may well be open with O_DIRECT, which wants aligned lengths too
+  std::shared_ptr<uint8_t> head = allocateAligned(CHECKPOINT_IDENTITY_SIZE);
+  const size_t len = preadFully(fd, head.get(), std::min<uint64_t>(CHECKPOINT_IDENTITY_SIZE, size / PIPELINE_BUFFER_ALIGNMENT * PIPELINE_BUFFER_ALIGNMENT), 0);
+  return identityOf(head.get(), len, size, deviceSectorSize(fd), extra);
+}
+
+std::string diskIdentity(ImageReader& reader, const std::string& extra) {
+  std::vector<uint8_t> head(std::min<uint64_t>(CHECKPOINT_IDENTITY_SIZE, reader.size()));
+  if(!readExact(reader, 0, head.data(), head.size())) {
+    throw std::runtime_error("Unable to read the start of the disk");
+  }
+  return identityOf(head.data(), head.size(), reader.size(), 0, extra);
+}
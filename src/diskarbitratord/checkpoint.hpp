@@ -0,0 +1,73 @@
+/***************************************************************************
+ *   checkpoint.hpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+#ifndef CHECKPOINT_HPP_
+#define CHECKPOINT_HPP_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+
+// How often long jobs save a checkpoint. Whatever was done since the last
+// one is done again after a crash
+#define CHECKPOINT_INTERVAL_MS 10000
+// The start of a disk is hashed into its identity. Partition tables and
+// volume headers make it different for every disk out there
+#define CHECKPOINT_IDENTITY_SIZE (1024 * 1024)
+
+// Where an acquisition or hashing job was at, enough to pick up from there
+// in another run
+typedef struct Checkpoint {
+  // From diskIdentity()
+  std::string identity;
+  uint64_t size = 0;
+  // Everything before this is done
+  uint64_t offset = 0;
+  // Of the image being written at that point, 0 if there's none
+  uint64_t outputSize = 0;
+  // Zeroes of it left as holes
+  uint64_t sparseBytes = 0;
+  // Hasher::saveState() of every hash of the job, by a name of the job's
+  // choosing
+  std::map<std::string, std::string> states;
+  // Digests of the segments finished so far, in order, by the same names
+  std::map<std::string, std::vector<std::string>> segments;
+} Checkpoint;
+
+// Returns false if there's nothing at `path`. Throws if it's not a checkpoint
+bool loadCheckpoint(const std::string& path, Checkpoint& checkpoint);
+
+// Replaces whatever is at `path` atomically, so a crash halfway through still
+// leaves the previous checkpoint. Throws on errors
+void saveCheckpoint(const std::string& path, const Checkpoint& checkpoint);
+
+// Tells disks apart, so a checkpoint is only ever resumed on the disk it was
+// taken from. Hashes the size, sector size and first bytes of the disk along
+// with `extra` (the model, say), which has to be the same every time too
+std::string diskIdentity(int fd, uint64_t size, const std::string& extra);
+std::string diskIdentity(ImageReader& reader, const std::string& extra);
+
+#endif
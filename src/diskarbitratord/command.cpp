@@ -0,0 +1,334 @@
+/***************************************************************************
+ *   command.cpp  --  This file is part of diskarbitratord.                *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include "command.hpp"
+#include "scope_guard.hpp"
+
+// Strategically, this is the same size as the pipe buffer in XNU kernel
+#define READ_BUFFER_SIZE 16384
+
+// Used to send stdin data to child
+void streamDataIn(int fd, const std::string* in, bool* err) {
+  size_t totalBytesWritten = 0;
+  ssize_t bytesWritten = 0;
+  while(totalBytesWritten != in->size()) {
+    bytesWritten = write(fd, in->c_str() + totalBytesWritten, in->size() - totalBytesWritten);
+    if(bytesWritten < 0) {
+      if(errno != EINTR) {
+        *err = true;
+        break;
+      }
+      continue;
+    }
+    totalBytesWritten += bytesWritten;
+  }
+  // Child sees EOF on its stdin
+  close(fd);
+}
+
+static int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Used to read stdout/err data from child. If `onLine` is set, every complete
+// line is handed to it as soon as it's read. If `lastActivity` is set, it's
+// bumped every time the child writes something.
+void streamDataOut(int fd, std::string* out, bool* err, const std::function<void(const std::string&)>* onLine, std::atomic<int64_t>* lastActivity) {
+  ssize_t bytesRead = 0;
+  char buffer[READ_BUFFER_SIZE];
+  size_t lineStart = 0;
+
+  while((bytesRead = read(fd, buffer, READ_BUFFER_SIZE)) != 0) {
+    if(bytesRead < 0) {
+      if(errno != EINTR) {
+        *err = true;
+        break;
+      }
+      continue;
+    }
+    out->append(buffer, bytesRead);
+    if(lastActivity) {
+      lastActivity->store(nowNs());
+    }
+    if(onLine && *onLine) {
+      size_t lineEnd;
+      while((lineEnd = out->find('\n', lineStart)) != std::string::npos) {
+        (*onLine)(out->substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 1;
+      }
+    }
+  }
+  if(onLine && *onLine && lineStart < out->size()) {
+    // Last line without a trailing newline
+    (*onLine)(out->substr(lineStart));
+  }
+}
+
+int getChildExitCode(pid_t childPid) {
+  int status;
+  int exitCode = -1;
+  while(waitpid(childPid, &status, 0) == -1) {
+    if(errno != EINTR) {
+      throw std::runtime_error("Error waiting for child process PID: " + std::string(strerror(errno)));
+    }
+  }
+  if (WIFEXITED(status)) {
+    exitCode = WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    // Child exited due to signal. Return which one was it.
+    exitCode = WTERMSIG(status);
+  }
+
+  return exitCode;
+}
+
+// Reaps the child and notifies through the pipe. We used to get notified with
+// a SIGCHLD handler, but that's process-wide: with several children running at
+// once there's no telling which one of them exited.
+void waitForChild(pid_t childPid, int notifyFd, int* exitCode) {
+  try {
+    *exitCode = getChildExitCode(childPid);
+  } catch(const std::runtime_error& e) {
+    LOG(ERROR) << e.what();
+  }
+  write(notifyFd, "", 1);
+}
+
+// Every fd we open here has to be close-on-exec, otherwise children spawned
+// concurrently would inherit each other's pipes, and the readers would never
+// see EOF until all of them exit. This mutex makes sure no spawn happens
+// between pipe(2) and the flag being set.
+static std::mutex spawnMutex;
+
+static void openPipe(int fds[2], const std::string& name) {
+  if(pipe(fds) != 0) {
+    throw std::runtime_error("Unable to open " + name + " pipe: " + std::string(strerror(errno)));
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+static void closePipe(int fds[2]) {
+  for(int i = 0; i < 2; ++i) {
+    if(fds[i] != -1) {
+      close(fds[i]);
+      fds[i] = -1;
+    }
+  }
+}
+
+// Just the typical fork/exec wrap. Since vfork is deprecated in macOS, we're
+// using posix_spawn, since it also avoids duplicating process memory.
+CommandOutput runCommand(const std::string& path, const std::vector<std::string>& args, const std::string& stdinData, unsigned int timeoutSecs) {
+  CommandOptions options;
+  options.timeoutSecs = timeoutSecs;
+  options.inactivityTimeout = false;
+  return runCommand(path, args, stdinData, options);
+}
+
+CommandOutput runCommand(const std::string& path, const std::vector<std::string>& args, const std::string& stdinData, const CommandOptions& options) {
+  CommandOutput co;
+
+  pid_t childPid;
+  
+  int stdoutPipeFds[2] = {-1, -1};
+  int stderrPipeFds[2] = {-1, -1};
+  int stdinPipeFds[2] = {-1, -1};
+  int terminationPipe[2] = {-1, -1};
+
+  ScopeGuard pipeGuard([&stdinPipeFds, &stdoutPipeFds, &stderrPipeFds, &terminationPipe]() {
+    closePipe(stdinPipeFds);
+    closePipe(stdoutPipeFds);
+    closePipe(stderrPipeFds);
+    closePipe(terminationPipe);
+  });
+
+  std::unique_lock<std::mutex> spawnLock(spawnMutex);
+  openPipe(stdoutPipeFds, "stdout");
+  openPipe(stderrPipeFds, "stderr");
+  openPipe(stdinPipeFds, "stdin");
+  // Set up execution timeout
+  openPipe(terminationPipe, "timeout execution");
+
+  posix_spawn_file_actions_t fileActions;
+  if(posix_spawn_file_actions_init(&fileActions) != 0) {
+    throw std::runtime_error("Unable to init spawn file actions:" + std::string(strerror(errno)));
+  }
+  ScopeGuard fileActionsGuard([&fileActions]() {
+    posix_spawn_file_actions_destroy(&fileActions);
+  });
+  // Child process will write/read std streams from the pipes. dup2 clears the
+  // close-on-exec flag on the new descriptors
+  if(posix_spawn_file_actions_adddup2(&fileActions, stdinPipeFds[0], STDIN_FILENO) != 0) {
+    throw std::runtime_error("Unable to dup stdin fd:" + std::string(strerror(errno)));
+  }
+  if(posix_spawn_file_actions_adddup2(&fileActions, stdoutPipeFds[1], STDOUT_FILENO) != 0) {
+    throw std::runtime_error("Unable to dup stdout fd:" + std::string(strerror(errno)));
+  }
+  if(posix_spawn_file_actions_adddup2(&fileActions, stderrPipeFds[1], STDERR_FILENO) != 0) {
+    throw std::runtime_error("Unable to dup stderr fd:" + std::string(strerror(errno)));
+  }
+
+  std::vector<const char*> argv;
+  // From posix_spawn(2), argv[0] must be the path to the executable (it's not
+  // added automatically)
+  argv.push_back(path.c_str());
+
+  for(const auto& arg : args) {
+    argv.push_back(arg.c_str());
+  }
+
+  // Push final NULL string
+  argv.push_back(NULL);
+
+  // The child gets its own process group, so on timeout we can kill anything it
+  // spawned too. Otherwise a grandchild could keep the pipes open and the
+  // reader threads would wait for it
+  posix_spawnattr_t spawnAttr;
+  if(posix_spawnattr_init(&spawnAttr) != 0) {
+    throw std::runtime_error("Unable to init spawn attributes:" + std::string(strerror(errno)));
+  }
+  ScopeGuard spawnAttrGuard([&spawnAttr]() {
+    posix_spawnattr_destroy(&spawnAttr);
+  });
+  posix_spawnattr_setflags(&spawnAttr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&spawnAttr, 0);
+
+  if(posix_spawn(&childPid, path.c_str(), &fileActions, &spawnAttr, (char* const*) argv.data(), NULL) != 0) {
+    throw std::runtime_error("Unable to spawn child process " + path + ": " + std::string(strerror(errno)));
+  }
+  spawnLock.unlock();
+
+  // The child has its own copies now. Closing ours means the readers get EOF
+  // as soon as the child exits
+  close(stdinPipeFds[0]);
+  stdinPipeFds[0] = -1;
+  close(stdoutPipeFds[1]);
+  stdoutPipeFds[1] = -1;
+  close(stderrPipeFds[1]);
+  stderrPipeFds[1] = -1;
+
+  std::string stdoutData;
+  std::string stderrData;
+
+  bool stdinErr = false;
+  bool stdoutErr = false;
+  bool stderrErr = false;
+
+  // The stdin thread owns the write end of the pipe from here on
+  int stdinFd = stdinPipeFds[1];
+  stdinPipeFds[1] = -1;
+
+  const int64_t start = nowNs();
+  const int64_t timeoutNs = static_cast<int64_t>(options.timeoutSecs) * 1000000000;
+  std::atomic<int64_t> lastActivity(start);
+
+  int exitCode = -1;
+  std::thread waiterThread(&waitForChild, childPid, terminationPipe[1], &exitCode);
+  std::thread stdinThread(&streamDataIn, stdinFd, &stdinData, &stdinErr);
+  std::thread stdoutThread(&streamDataOut, stdoutPipeFds[0], &stdoutData, &stdoutErr, &options.onStdoutLine, &lastActivity);
+  std::thread stderrThread(&streamDataOut, stderrPipeFds[0], &stderrData, &stderrErr, nullptr, nullptr);
+
+  char c;
+  int ret;
+
+  // With an inactivity timeout the deadline moves forward every time the child
+  // writes to stdout, so we keep waking up to recompute it until either the
+  // child exits or it goes quiet for long enough.
+  while(true) {
+    int64_t deadline = (options.inactivityTimeout ? lastActivity.load() : start) + timeoutNs;
+    int64_t remaining = deadline - nowNs();
+    if(remaining <= 0) {
+      ret = 0;
+      break;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = remaining / 1000000000;
+    tv.tv_usec = (remaining % 1000000000) / 1000;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(terminationPipe[0], &fds);
+
+    ret = select(terminationPipe[0] + 1, &fds, NULL, NULL, &tv);
+    if(ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if(ret != 0) {
+      break;
+    }
+  }
+
+  if(ret > 0) {
+    // Termination event ocurred
+    read(terminationPipe[0], &c, 1);
+  } else {
+    // Execution timeout reached or select(2) failed. Terminate execution in any case.
+    if(ret < 0) {
+      // select(2) failed. Don't throw here because we need to kill the child process
+      LOG(ERROR) << "Unable to wait for execution timeout: " + std::string(strerror(errno));  
+    } else {
+      LOG(ERROR) << (options.inactivityTimeout ? "Inactivity" : "Execution") << " timeout reached for " + path + " (PID " + std::to_string(childPid) + "). Terminating child process...";
+    }
+
+    // Don't throw either: the threads below must be joined regardless
+    if(kill(-childPid, SIGKILL)) {
+      LOG(ERROR) << "Error sending SIGKILL to child PID " + std::to_string(childPid) + ": " + std::string(strerror(errno));
+    }
+  }
+
+  // Once the child is gone every stream is guaranteed to reach EOF, so all of
+  // these return
+  waiterThread.join();
+  stdinThread.join();
+  stdoutThread.join();
+  stderrThread.join();
+
+  co.retCode = exitCode;
+
+  if(stdinErr || stdoutErr || stderrErr) {
+    throw std::runtime_error("Error streaming data in/out child process");
+  }
+
+  co.stdout = std::move(stdoutData);
+  co.stderr = std::move(stderrData);
+
+  return co;
+}
@@ -0,0 +1,52 @@
+/***************************************************************************
+ *   command.hpp  --  This file is part of diskarbitratord.                *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef COMMAND_HPP_
+#define COMMAND_HPP_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+typedef struct CommandOutput {
+  int retCode;
+  std::string stdout;
+  std::string stderr;
+} CommandOutput;
+
+typedef struct CommandOptions {
+  unsigned int timeoutSecs;
+  // Restart the timeout every time the child writes to stdout, so it only
+  // fires once the child stops making progress
+  bool inactivityTimeout;
+  // Called from a reader thread with every line written to stdout, as soon as
+  // it's available. The full output is still returned at the end.
+  std::function<void(const std::string&)> onStdoutLine;
+} CommandOptions;
+
+// Runs the executable at `path` with `args`, feeding it `stdinData` and
+// collecting everything it writes. The child is killed if it runs for longer
+// than `timeoutSecs`. Safe to call from several threads at once.
+CommandOutput runCommand(const std::string& path, const std::vector<std::string>& args, const std::string& stdinData, unsigned int timeoutSecs);
+CommandOutput runCommand(const std::string& path, const std::vector<std::string>& args, const std::string& stdinData, const CommandOptions& options);
+
+#endif
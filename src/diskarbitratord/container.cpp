@@ -0,0 +1,338 @@
+/***************************************************************************
+ *   container.cpp  --  This file is part of diskarbitratord.              *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#ifdef DISKIMAGE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "block_scan.hpp"
+#include "byteorder.hpp"
+#include "container.hpp"
+#include "crc32.hpp"
+
+// Stored as is, compressing it didn't make it any smaller
+#define CONTAINER_CHUNK_STORED 0x1
+// All zeroes, nothing stored
+#define CONTAINER_CHUNK_ZERO 0x2
+
+#define CONTAINER_SHA256_OFFSET 48
+#define CONTAINER_SHA256_SIZE 64
+
+const char* containerCompressionName(ContainerCompression compression) {
+  switch(compression) {
+    case CONTAINER_COMPRESSION_ZLIB:
+      return "zlib";
+    case CONTAINER_COMPRESSION_ZSTD:
+      return "zstd";
+    case CONTAINER_COMPRESSION_NONE:
+      break;
+  }
+  return "none";
+}
+
+ContainerCompression parseContainerCompression(const std::string& name) {
+  if(name == "none") {
+    return CONTAINER_COMPRESSION_NONE;
+  }
+  if(name == "zlib") {
+    return CONTAINER_COMPRESSION_ZLIB;
+  }
+  if(name == "zstd") {
+#ifdef DISKIMAGE_HAVE_ZSTD
+    return CONTAINER_COMPRESSION_ZSTD;
+#else
+    throw std::runtime_error("Built without zstd support");
+#endif
+  }
+  throw std::runtime_error("Unknown compression " + name);
+}
+
+ContainerWriter::ContainerWriter(int fd, ContainerCompression compression, uint32_t chunkSize, unsigned int threads) : fd(fd), compression(compression), chunkSize(chunkSize), pool(threads) {
+  if(chunkSize == 0 || chunkSize > CONTAINER_MAX_CHUNK_SIZE) {
+    throw std::runtime_error("Invalid chunk size " + std::to_string(chunkSize));
+  }
+#ifndef DISKIMAGE_HAVE_ZSTD
+  if(compression == CONTAINER_COMPRESSION_ZSTD) {
+    throw std::runtime_error("Built without zstd support");
+  }
+#endif
+  uint8_t header[CONTAINER_HEADER_SIZE] = {0};
+  memcpy(header, CONTAINER_MAGIC, CONTAINER_MAGIC_SIZE);
+  putLE32(header + 8, CONTAINER_VERSION);
+  putLE32(header + 12, compression);
+  putLE32(header + 16, chunkSize);
+  pwriteFully(this->fd, header, sizeof(header), 0);
+  this->fileOffset = sizeof(header);
+}
+
+void ContainerWriter::write(const uint8_t* data, size_t len) {
+  while(len) {
+    if(this->current == nullptr) {
+      this->current = std::make_shared<std::vector<uint8_t>>();
+      this->current->reserve(this->chunkSize);
+    }
+    size_t n = std::min<size_t>(len, this->chunkSize - this->current->size());
+    this->current->insert(this->current->end(), data, data + n);
+    this->diskSize += n;
+    data += n;
+    len -= n;
+    if(this->current->size() == this->chunkSize) {
+      this->submitChunk();
+    }
+  }
+}
+
+void ContainerWriter::submitChunk() {
+  std::shared_ptr<std::vector<uint8_t>> data = this->current;
+  ContainerCompression compression = this->compression;
+  this->current.reset();
+  this->pending.push_back(this->pool.submit([data, compression]() {
+    Chunk chunk;
+    chunk.crc = crc32Update(0, data->data(), data->size());
+    chunk.flags = 0;
+    if(blockIsFilled(data->data(), data->size(), 0)) {
+      chunk.flags = CONTAINER_CHUNK_ZERO;
+      return chunk;
+    }
+    if(compression == CONTAINER_COMPRESSION_ZLIB) {
+      uLongf length = compressBound(data->size());
+      chunk.stored.resize(length);
+      if(compress2(chunk.stored.data(), &length, data->data(), data->size(), CONTAINER_ZLIB_LEVEL) != Z_OK) {
+        throw std::runtime_error("Unable to compress chunk");
+      }
+      chunk.stored.resize(length);
+    }
+#ifdef DISKIMAGE_HAVE_ZSTD
+    if(compression == CONTAINER_COMPRESSION_ZSTD) {
+      chunk.stored.resize(ZSTD_compressBound(data->size()));
+      size_t length = ZSTD_compress(chunk.stored.data(), chunk.stored.size(), data->data(), data->size(), CONTAINER_ZSTD_LEVEL);
+      if(ZSTD_isError(length)) {
+        throw std::runtime_error("Unable to compress chunk: " + std::string(ZSTD_getErrorName(length)));
+      }
+      chunk.stored.resize(length);
+    }
+#endif
+    if(compression == CONTAINER_COMPRESSION_NONE || chunk.stored.size() >= data->size()) {
+      chunk.stored = *data;
+      chunk.flags = CONTAINER_CHUNK_STORED;
+    }
+    return chunk;
+  }));
+  // A couple of chunks per worker keeps them all busy without piling up
+  // memory
+  this->flushChunks(2 * this->pool.size());
+}
+
+void ContainerWriter::flushChunks(size_t maxPending) {
+  while(this->pending.size() > maxPending) {
+    Chunk chunk = this->pending.front().get();
+    this->pending.pop_front();
+    uint8_t entry[CONTAINER_INDEX_ENTRY_SIZE] = {0};
+    putLE64(entry, this->fileOffset);
+    putLE32(entry + 8, chunk.stored.size());
+    putLE32(entry + 12, chunk.crc);
+    putLE32(entry + 16, chunk.flags);
+    this->index.insert(this->index.end(), entry, entry + sizeof(entry));
+    if(chunk.stored.size()) {
+      pwriteFully(this->fd, chunk.stored.data(), chunk.stored.size(), this->fileOffset);
+      this->fileOffset += chunk.stored.size();
+    }
+  }
+}
+
+void ContainerWriter::finish(const std::string& sha256) {
+  if(this->current != nullptr && this->current->size()) {
+    this->submitChunk();
+  }
+  this->flushChunks(0);
+
+  const uint64_t indexOffset = this->fileOffset;
+  pwriteFully(this->fd, this->index.data(), this->index.size(), indexOffset);
+  this->fileOffset += this->index.size();
+
+  uint8_t trailer[CONTAINER_TRAILER_SIZE] = {0};
+  memcpy(trailer, CONTAINER_TRAILER_MAGIC, CONTAINER_MAGIC_SIZE);
+  putLE64(trailer + 8, indexOffset);
+  putLE64(trailer + 16, this->index.size() / CONTAINER_INDEX_ENTRY_SIZE);
+  putLE64(trailer + 24, this->diskSize);
+  putLE32(trailer + 32, this->chunkSize);
+  putLE32(trailer + 36, this->compression);
+  putLE32(trailer + 40, crc32Update(0, this->index.data(), this->index.size()));
+  memcpy(trailer + CONTAINER_SHA256_OFFSET, sha256.data(), std::min<size_t>(sha256.size(), CONTAINER_SHA256_SIZE));
+  pwriteFully(this->fd, trailer, sizeof(trailer), this->fileOffset);
+  this->fileOffset += sizeof(trailer);
+}
+
+bool findContainerSize(int fd, uint64_t& size) {
+  const uint64_t fileSize = fileOrDeviceSize(fd);
+  uint8_t trailer[CONTAINER_TRAILER_SIZE];
+  if(fileSize < CONTAINER_HEADER_SIZE + sizeof(trailer) ||
+     preadFully(fd, trailer, sizeof(trailer), fileSize - sizeof(trailer)) != sizeof(trailer) ||
+     memcmp(trailer, CONTAINER_TRAILER_MAGIC, CONTAINER_MAGIC_SIZE)) {
+    return false;
+  }
+  size = readLE64(trailer + 24);
+  return true;
+}
+
+ContainerReader::ContainerReader(const std::string& path, size_t cacheChunks) : cache(cacheChunks) {
+  this->fd = open(path.c_str(), O_RDONLY);
+  if(this->fd == -1) {
+    throw std::runtime_error("Unable to open " + path + ": " + std::string(strerror(errno)));
+  }
+  try {
+    const uint64_t fileSize = fileOrDeviceSize(this->fd);
+    uint8_t header[CONTAINER_HEADER_SIZE];
+    uint8_t trailer[CONTAINER_TRAILER_SIZE];
+    if(fileSize < sizeof(header) + sizeof(trailer) ||
+       preadFully(this->fd, header, sizeof(header), 0) != sizeof(header) ||
+       preadFully(this->fd, trailer, sizeof(trailer), fileSize - sizeof(trailer)) != sizeof(trailer)) {
+      throw std::runtime_error("Truncated container");
+    }
+    if(memcmp(header, CONTAINER_MAGIC, CONTAINER_MAGIC_SIZE) || readLE32(header + 8) != CONTAINER_VERSION) {
+      throw std::runtime_error("Not a container, or a version we don't know");
+    }
+    if(memcmp(trailer, CONTAINER_TRAILER_MAGIC, CONTAINER_MAGIC_SIZE)) {
+      throw std::runtime_error("Container has no index, its acquisition didn't finish");
+    }
+
+    const uint64_t indexOffset = readLE64(trailer + 8);
+    const uint64_t chunkCount = readLE64(trailer + 16);
+    this->diskSize = readLE64(trailer + 24);
+    this->chunkBytes = readLE32(trailer + 32);
+    this->method = static_cast<ContainerCompression>(readLE32(trailer + 36));
+    if(this->chunkBytes == 0 || this->chunkBytes > CONTAINER_MAX_CHUNK_SIZE || this->chunkBytes != readLE32(header + 16) ||
+       this->method > CONTAINER_COMPRESSION_ZSTD || this->method != static_cast<ContainerCompression>(readLE32(header + 12))) {
+      throw std::runtime_error("Corrupt container header");
+    }
+#ifndef DISKIMAGE_HAVE_ZSTD
+    if(this->method == CONTAINER_COMPRESSION_ZSTD) {
+      throw std::runtime_error("Container is zstd compressed, and we were built without zstd support");
+    }
+#endif
+    if(chunkCount != (this->diskSize + this->chunkBytes - 1) / this->chunkBytes ||
+       indexOffset + chunkCount * CONTAINER_INDEX_ENTRY_SIZE != fileSize - sizeof(trailer)) {
+      throw std::runtime_error("Corrupt container trailer");
+    }
+    this->index.resize(chunkCount * CONTAINER_INDEX_ENTRY_SIZE);
+    if(preadFully(this->fd, this->index.data(), this->index.size(), indexOffset) != this->index.size() ||
+       crc32Update(0, this->index.data(), this->index.size()) != readLE32(trailer + 40)) {
+      throw std::runtime_error("Corrupt container index");
+    }
+    const char* sha256 = reinterpret_cast<const char*>(trailer + CONTAINER_SHA256_OFFSET);
+    this->digest.assign(sha256, strnlen(sha256, CONTAINER_SHA256_SIZE));
+  } catch(...) {
+    close(this->fd);
+    throw;
+  }
+}
+
+ContainerReader::~ContainerReader() {
+  close(this->fd);
+}
+
+uint64_t ContainerReader::size() const {
+  return this->diskSize;
+}
+
+ContainerReader::ChunkData ContainerReader::decompress(uint64_t index) {
+  const uint8_t* entry = this->index.data() + index * CONTAINER_INDEX_ENTRY_SIZE;
+  const uint64_t offset = readLE64(entry);
+  const uint32_t storedLength = readLE32(entry + 8);
+  const uint32_t flags = readLE32(entry + 16);
+  const uint64_t length = std::min(this->chunkBytes, this->diskSize - index * this->chunkBytes);
+  std::shared_ptr<std::vector<uint8_t>> out = std::make_shared<std::vector<uint8_t>>(length, 0);
+  if(flags & CONTAINER_CHUNK_ZERO) {
+    return out;
+  }
+  if(storedLength > CONTAINER_MAX_CHUNK_SIZE * 2) {
+    throw std::runtime_error("Corrupt index entry for chunk " + std::to_string(index));
+  }
+
+  std::vector<uint8_t> stored(storedLength);
+  if(preadFully(this->fd, stored.data(), stored.size(), offset) != stored.size()) {
+    throw std::runtime_error("Short read on chunk " + std::to_string(index));
+  }
+  if(flags & CONTAINER_CHUNK_STORED) {
+    if(stored.size() != length) {
+      throw std::runtime_error("Corrupt index entry for chunk " + std::to_string(index));
+    }
+    out->swap(stored);
+  } else if(this->method == CONTAINER_COMPRESSION_ZLIB) {
+    uLongf outLength = out->size();
+    if(uncompress(out->data(), &outLength, stored.data(), stored.size()) != Z_OK || outLength != length) {
+      throw std::runtime_error("Corrupt zlib chunk " + std::to_string(index));
+    }
+#ifdef DISKIMAGE_HAVE_ZSTD
+  } else if(this->method == CONTAINER_COMPRESSION_ZSTD) {
+    size_t outLength = ZSTD_decompress(out->data(), out->size(), stored.data(), stored.size());
+    if(ZSTD_isError(outLength) || outLength != length) {
+      throw std::runtime_error("Corrupt zstd chunk " + std::to_string(index));
+    }
+#endif
+  } else {
+    throw std::runtime_error("Compressed chunk " + std::to_string(index) + " in an uncompressed container");
+  }
+
+  if(crc32Update(0, out->data(), out->size()) != readLE32(entry + 12)) {
+    throw std::runtime_error("CRC32 mismatch in chunk " + std::to_string(index));
+  }
+  return out;
+}
+
+ContainerReader::ChunkData ContainerReader::readChunk(uint64_t index) {
+  if(index >= this->chunkCount()) {
+    throw std::runtime_error("Chunk " + std::to_string(index) + " out of range");
+  }
+  ChunkData data = this->cache.get(index);
+  if(data == nullptr) {
+    data = this->decompress(index);
+    this->cache.put(index, data);
+  }
+  return data;
+}
+
+size_t ContainerReader::read(uint64_t offset, void* buffer, size_t len) {
+  if(offset >= this->diskSize) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, this->diskSize - offset);
+  const uint64_t end = offset + len;
+  uint8_t* out = static_cast<uint8_t*>(buffer);
+  for(uint64_t index = offset / this->chunkBytes; index * this->chunkBytes < end; ++index) {
+    ChunkData data = this->readChunk(index);
+    const uint64_t chunkStart = index * this->chunkBytes;
+    const uint64_t copyStart = std::max(offset, chunkStart);
+    const uint64_t copyEnd = std::min(end, chunkStart + data->size());
+    memcpy(out + (copyStart - offset), data->data() + (copyStart - chunkStart), copyEnd - copyStart);
+  }
+  return len;
+}
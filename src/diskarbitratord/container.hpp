@@ -0,0 +1,172 @@
+/***************************************************************************
+ *   container.hpp  --  This file is part of diskarbitratord.              *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef CONTAINER_HPP_
+#define CONTAINER_HPP_
+
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+#include "lru_cache.hpp"
+#include "thread_pool.hpp"
+
+// Our own evidence container: a compressed raw image that can still be read
+// anywhere. The disk is cut into chunks of the same size, each compressed on
+// its own (so they can be compressed in parallel, and read back one by one)
+// and stored one after the other. An index at the end has where each chunk
+// is and the CRC32 of its contents, and a fixed size trailer after it points
+// to the index. Everything is little endian.
+//
+//   header   magic, version, compression, chunk size
+//   chunks   as many as the disk needs, all-zero ones take no space
+//   index    per chunk: offset, stored length, CRC32, flags
+//   trailer  magic, index offset and CRC32, chunk count, disk size, SHA-256
+
+#define CONTAINER_MAGIC "DAEVCONT"
+#define CONTAINER_TRAILER_MAGIC "DAEVINDX"
+#define CONTAINER_MAGIC_SIZE 8
+#define CONTAINER_VERSION 1
+#define CONTAINER_HEADER_SIZE 32
+#define CONTAINER_INDEX_ENTRY_SIZE 24
+#define CONTAINER_TRAILER_SIZE 128
+
+// Big enough to compress well, small enough that a random read doesn't
+// decompress much it doesn't need
+#define CONTAINER_DEFAULT_CHUNK_SIZE (256 * 1024)
+#define CONTAINER_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+// Default number of decompressed chunks kept around by readers
+#define CONTAINER_DEFAULT_CACHE_CHUNKS 256
+
+// Fast levels, so compression keeps up with the disk being read
+#define CONTAINER_ZLIB_LEVEL 1
+#define CONTAINER_ZSTD_LEVEL 1
+
+enum ContainerCompression {
+  CONTAINER_COMPRESSION_NONE = 0,
+  CONTAINER_COMPRESSION_ZLIB = 1,
+  CONTAINER_COMPRESSION_ZSTD = 2
+};
+
+const char* containerCompressionName(ContainerCompression compression);
+// Throws for unknown names, and for zstd if we were built without it
+ContainerCompression parseContainerCompression(const std::string& name);
+
+// Writes a container to `fd`, which has to be empty. The disk is written in
+// order, and chunks are compressed on a pool as they fill up
+class ContainerWriter {
+  public:
+    // `threads` of 0 is one per core
+    ContainerWriter(int fd, ContainerCompression compression, uint32_t chunkSize = CONTAINER_DEFAULT_CHUNK_SIZE, unsigned int threads = 0);
+
+    // Appends to the disk. Only blocks when the pool falls behind
+    void write(const uint8_t* data, size_t len);
+
+    // Writes whatever is left, the index and the trailer. `sha256` is the hex
+    // digest of the whole disk, if there is one
+    void finish(const std::string& sha256);
+
+    // Bytes written to the file so far
+    uint64_t storedBytes() const {
+      return this->fileOffset;
+    }
+
+  private:
+    typedef struct Chunk {
+      std::vector<uint8_t> stored;
+      uint32_t crc;
+      uint32_t flags;
+    } Chunk;
+
+    void submitChunk();
+    // Writes finished chunks out, in order, until no more than `maxPending`
+    // are left
+    void flushChunks(size_t maxPending);
+
+    int fd;
+    ContainerCompression compression;
+    uint32_t chunkSize;
+    uint64_t diskSize = 0;
+    uint64_t fileOffset = 0;
+    std::shared_ptr<std::vector<uint8_t>> current;
+    std::deque<std::future<Chunk>> pending;
+    std::vector<uint8_t> index;
+    ThreadPool pool;
+};
+
+class ContainerReader : public ImageReader {
+  public:
+    typedef std::shared_ptr<const std::vector<uint8_t>> ChunkData;
+
+    ContainerReader(const std::string& path, size_t cacheChunks = CONTAINER_DEFAULT_CACHE_CHUNKS);
+    ~ContainerReader();
+
+    uint64_t size() const override;
+    size_t read(uint64_t offset, void* buffer, size_t len) override;
+
+    uint64_t chunkSize() const {
+      return this->chunkBytes;
+    }
+    uint64_t chunkCount() const {
+      return this->index.size() / CONTAINER_INDEX_ENTRY_SIZE;
+    }
+    ContainerCompression compression() const {
+      return this->method;
+    }
+    // Hex SHA-256 of the disk as acquired, empty if it wasn't hashed
+    const std::string& sha256() const {
+      return this->digest;
+    }
+
+    // Returns the decompressed chunk, from the cache if possible. Throws if
+    // its CRC32 doesn't match
+    ChunkData readChunk(uint64_t index);
+
+    size_t cacheHits() {
+      return this->cache.hitCount();
+    }
+    size_t cacheMisses() {
+      return this->cache.missCount();
+    }
+
+  private:
+    ChunkData decompress(uint64_t index);
+
+    int fd;
+    ContainerCompression method;
+    uint64_t chunkBytes;
+    uint64_t diskSize;
+    std::string digest;
+    // Raw index entries, as stored
+    std::vector<uint8_t> index;
+    LRUCache<uint64_t, std::vector<uint8_t>> cache;
+};
+
+// Disk size from the trailer of the container open at `fd`. Returns false if
+// there's no trailer, which means its acquisition never finished
+bool findContainerSize(int fd, uint64_t& size);
+
+#endif
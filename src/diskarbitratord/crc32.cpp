@@ -0,0 +1,213 @@
+/***************************************************************************
+ *   crc32.cpp  --  This file is part of diskarbitratord.                  *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstring>
+
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32_HAVE_ARMV8
+#endif
+
+#include "crc32.hpp"
+
+// Below this, setting up the folding costs more than it saves
+#define CRC32_FOLD_MIN_LENGTH 64
+#define CRC32_ZERO_BLOCK_SIZE 4096
+
+static uint32_t crc32Zlib(uint32_t crc, const uint8_t* data, size_t len) {
+  // zlib takes a uInt length
+  while(len) {
+    uInt n = static_cast<uInt>(std::min<size_t>(len, 1U << 30));
+    crc = crc32(crc, data, n);
+    data += n;
+    len -= n;
+  }
+  return crc;
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i crc32Fold128(__m128i x, __m128i next, __m128i k) {
+  __m128i high = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), high), next);
+}
+
+// Folding with carry-less multiplies, as in Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". The constants are for the
+// bit-reflected CRC32 polynomial: x^(32*n) mod P(x) for the folding distances,
+// then P(x) and floor(x^64 / P(x)) for the Barrett reduction. Takes and
+// returns the CRC without the initial and final inversion. `len` must be a
+// multiple of 16, and at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32FoldPCLMUL(uint32_t crc, const uint8_t* data, size_t len) {
+  const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+  const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+  const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+  __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+  __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32));
+  __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  data += 64;
+  len -= 64;
+
+  // Four lanes of 128 bits, folded 512 bits at a time
+  while(len >= 64) {
+    __m128i h1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    __m128i h2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    __m128i h3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    __m128i h4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x00), h1);
+    x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x00), h2);
+    x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x00), h3);
+    x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x00), h4);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)));
+    x4 = _mm_xor_si128(x4, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)));
+    data += 64;
+    len -= 64;
+  }
+
+  // Down to a single lane
+  x1 = crc32Fold128(x1, x2, k3k4);
+  x1 = crc32Fold128(x1, x3, k3k4);
+  x1 = crc32Fold128(x1, x4, k3k4);
+  while(len >= 16) {
+    x1 = crc32Fold128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), k3k4);
+    data += 16;
+    len -= 16;
+  }
+
+  // 128 to 64 bits, then 64 to 32 with a Barrett reduction
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(k3k4, x1, 0x01));
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), x2);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32PCLMUL(uint32_t crc, const uint8_t* data, size_t len) {
+  if(len < CRC32_FOLD_MIN_LENGTH) {
+    return crc32Zlib(crc, data, len);
+  }
+  size_t folded = len & ~static_cast<size_t>(15);
+  crc = ~crc32FoldPCLMUL(~crc, data, folded);
+  return crc32Zlib(crc, data + folded, len - folded);
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+// ARMv8 has CRC32 instructions for this very polynomial, every Apple Silicon
+// Mac has them
+static uint32_t crc32ARMv8(uint32_t crc, const uint8_t* data, size_t len) {
+  crc = ~crc;
+  while(len && (reinterpret_cast<uintptr_t>(data) & 7)) {
+    crc = __crc32b(crc, *data++);
+    --len;
+  }
+  while(len >= 32) {
+    uint64_t words[4];
+    memcpy(words, data, sizeof(words));
+    crc = __crc32d(crc, words[0]);
+    crc = __crc32d(crc, words[1]);
+    crc = __crc32d(crc, words[2]);
+    crc = __crc32d(crc, words[3]);
+    data += 32;
+    len -= 32;
+  }
+  while(len >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32d(crc, word);
+    data += 8;
+    len -= 8;
+  }
+  while(len--) {
+    crc = __crc32b(crc, *data++);
+  }
+  return ~crc;
+}
+#endif
+
+typedef uint32_t (*CRC32Function)(uint32_t, const uint8_t*, size_t);
+
+typedef struct CRC32Backend {
+  CRC32Function update;
+  const char* name;
+} CRC32Backend;
+
+static CRC32Backend selectBackend() {
+#if defined(CRC32_HAVE_ARMV8)
+  return {crc32ARMv8, "armv8-crc"};
+#elif defined(CRC32_HAVE_PCLMUL)
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    return {crc32PCLMUL, "pclmul"};
+  }
+#endif
+  return {crc32Zlib, "zlib"};
+}
+
+static const CRC32Backend& backend() {
+  static const CRC32Backend selected = selectBackend();
+  return selected;
+}
+
+uint32_t crc32Update(uint32_t crc, const void* data, size_t len) {
+  return backend().update(crc, static_cast<const uint8_t*>(data), len);
+}
+
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, uint64_t lenB) {
+  return crc32_combine(crcA, crcB, static_cast<z_off_t>(lenB));
+}
+
+// Zeroes are zeroes, so the CRC of a long run can be built by doubling up a
+// short one
+uint32_t crc32Zeros(uint64_t len) {
+  static const uint8_t zeros[CRC32_ZERO_BLOCK_SIZE] = {0};
+  uint32_t crc = crc32Update(0, zeros, len % CRC32_ZERO_BLOCK_SIZE);
+  uint32_t power = crc32Update(0, zeros, CRC32_ZERO_BLOCK_SIZE);
+  uint64_t powerLength = CRC32_ZERO_BLOCK_SIZE;
+  for(uint64_t blocks = len / CRC32_ZERO_BLOCK_SIZE; blocks; blocks >>= 1) {
+    if(blocks & 1) {
+      crc = crc32Combine(crc, power, powerLength);
+    }
+    power = crc32Combine(power, power, powerLength);
+    powerLength *= 2;
+  }
+  return crc;
+}
+
+const char* crc32Implementation() {
+  return backend().name;
+}
@@ -0,0 +1,45 @@
+/***************************************************************************
+ *   crc32.hpp  --  This file is part of diskarbitratord.                  *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef CRC32_HPP_
+#define CRC32_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32 (the zlib/IEEE one, which is what UDIF uses). Same semantics as
+// zlib's crc32(): start with 0 and feed the previous result back in. Uses the
+// CPU's CRC or carry-less multiply instructions when available, and zlib
+// otherwise.
+uint32_t crc32Update(uint32_t crc, const void* data, size_t len);
+
+// CRC32 of A followed by B, given the CRC32 of each and the length of B. This
+// is what lets chunks be checksummed in parallel.
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, uint64_t lenB);
+
+// CRC32 of `len` zero bytes, without going through them
+uint32_t crc32Zeros(uint64_t len);
+
+// Which implementation crc32Update() ended up with, for the benchmarks
+const char* crc32Implementation();
+
+#endif
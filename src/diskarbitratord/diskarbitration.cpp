@@ -85,6 +85,22 @@ void DiskAppearedCallback(DADiskRef diskRef, void *context) {
   if(!instance->diskExists(disk->disk())) {
     instance->addDisk(disk);
   }
+
+  // Slices get probed along with their whole disk. That takes a few reads per
+  // partition, so it's kept out of the run loop
+  if(disk->description().media_whole()) {
+    instance->startBackgroundThread(disk->disk(), [disk, instance]() {
+      probeDiskVolumes(disk, instance);
+    });
+  }
+
+  // And so do their baselines, when enabled. Internal disks change all the
+  // time and aren't what's being arbitrated anyway
+  if(disk->description().media_whole() && !disk->description().device_internal() && instance->baselineDir.size()) {
+    instance->startBackgroundThread(disk->disk(), [disk, instance]() {
+      recordBaseline(disk, instance);
+    });
+  }
 }
 
 // This function is called from the framework when a disk is detached. Purely
@@ -93,6 +109,9 @@ void DiskDisappearedCallback(DADiskRef diskRef, void *context) {
   DiskAbitratorServiceImpl* instance = reinterpret_cast<DiskAbitratorServiceImpl*>(context);
   std::shared_ptr<diskarbitrator::Disk> disk = genDisk(diskRef, instance);
   LOG(INFO)  << "Disk disappeared: " << disk->disk();
+  // Nothing left to read, and whatever was reading it can't outlive it
+  instance->stopBaselines(disk->disk());
+  instance->joinBackgroundThreads(disk->disk());
   const std::string parentDisk = instance->getParentDisk(disk->disk());
   if(parentDisk.size() && instance->diskExists(parentDisk)) {
     instance->removeChildFromParent(disk->disk(), parentDisk);
@@ -565,6 +584,97 @@ std::shared_ptr<diskarbitrator::Disk> genDisk(DADiskRef& disk, DiskAbitratorServ
   return std::move(diskPtr);
 }
 
+void probeDiskVolumes(std::shared_ptr<diskarbitrator::Disk> disk, DiskAbitratorServiceImpl* instance) {
+  const std::string& mediaUUID = disk->description().media_uuid();
+  if(mediaUUID.size() && instance->volumeCache.get(mediaUUID) != nullptr) {
+    // Seen this one before
+    return;
+  }
+
+  try {
+    const std::string path = resolveDevicePath(disk->disk());
+    // Whoever plugged it in is waiting to see what's on it
+    std::unique_ptr<IOScheduler::Job> ioJob = instance->interactiveIO(path, disk->disk());
+    ScopedIOPriority priority(IO_CLASS_INTERACTIVE);
+    std::unique_ptr<ImageReader> reader = openImageReader(path);
+    DiskProbe probe = probeDisk(*reader, instance->probePool);
+    for(size_t i = 0; i < probe.table.partitions.size(); ++i) {
+      const Partition& partition = probe.table.partitions[i];
+      const FilesystemInfo& info = probe.filesystems[i];
+      LOG(INFO) << "Probed " << disk->disk() << " partition " << partition.index << ": " << filesystemKindName(info.kind)
+                << (info.label.size() ? " \"" + info.label + "\"" : "");
+      if(probe.table.scheme == PARTITION_SCHEME_GPT) {
+        instance->volumeCache.put(partition.uuid, std::make_shared<const FilesystemInfo>(info));
+      } else if(mediaUUID.size()) {
+        instance->volumeCache.put(mediaUUID + ":" + std::to_string(partition.index), std::make_shared<const FilesystemInfo>(info));
+      }
+    }
+    if(probe.wholeDisk.kind != FS_UNKNOWN) {
+      LOG(INFO) << "Probed " << disk->disk() << ": " << filesystemKindName(probe.wholeDisk.kind);
+    }
+    // Also marks the disk as probed, even if the filesystem is unknown
+    if(mediaUUID.size()) {
+      instance->volumeCache.put(mediaUUID, std::make_shared<const FilesystemInfo>(probe.wholeDisk));
+    }
+  } catch(const std::exception& e) {
+    LOG(WARNING) << "Unable to probe filesystems of " << disk->disk() << ": " << e.what();
+  }
+}
+
+void recordBaseline(std::shared_ptr<diskarbitrator::Disk> disk, DiskAbitratorServiceImpl* instance) {
+  const std::string& mediaUUID = disk->description().media_uuid();
+  if(mediaUUID.empty()) {
+    LOG(INFO) << "Not taking a baseline of " << disk->disk() << ", it has no media UUID";
+    return;
+  }
+
+  try {
+    if(access(baselinePath(instance->baselineDir, mediaUUID).c_str(), F_OK) == 0) {
+      // Seen this one before, checking it again is up to whoever asks
+      return;
+    }
+    LOG(INFO) << "Taking a baseline of " << disk->disk();
+    BaselineOptions options;
+    options.ioClass = IO_CLASS_IDLE;
+    const BaselineResult result = instance->takeBaseline(disk->disk(), mediaUUID, options, [](const BaselineProgress& progress) {
+      return true;
+    });
+    if(!result.complete) {
+      LOG(INFO) << "Baseline of " << disk->disk() << " stopped before it was complete";
+    }
+  } catch(const std::exception& e) {
+    LOG(WARNING) << "Unable to take a baseline of " << disk->disk() << ": " << e.what();
+  }
+}
+
+const std::string volumeKind(FilesystemKind kind) {
+  switch(kind) {
+    case FS_HFSPLUS:
+    case FS_HFSX:
+      return "hfs";
+    case FS_APFS:
+      return "apfs";
+    case FS_FAT12:
+    case FS_FAT16:
+    case FS_FAT32:
+      return "msdos";
+    case FS_EXFAT:
+      return "exfat";
+    case FS_NTFS:
+      return "ntfs";
+    case FS_EXT2:
+      return "ext2";
+    case FS_EXT3:
+      return "ext3";
+    case FS_EXT4:
+      return "ext4";
+    case FS_ISO9660:
+      return "cd9660";
+    default:
+      return "";
+  }
+}
+
 const std::string genErrorDescription(int errCode) {
   // Disclaimer: These are descriptions made by me, not by Apple. This is to
   // the best of my understanding what explains what the error is about
@@ -27,6 +27,8 @@
 
 #include "diskarbitrator.grpc.pb.h"
 
+#include "fs_probe.hpp"
+
 // Forward declaration
 class DiskAbitratorServiceImpl;
 
@@ -87,6 +89,18 @@ void checkSuccess(DADiskRef diskRef, DADissenterRef dissenterRef, void *context)
 // their parents
 std::shared_ptr<diskarbitrator::Disk> genDisk(DADiskRef& disk, DiskAbitratorServiceImpl* instance = nullptr);
 
+// Probes the filesystems of a whole disk and its partitions, and stores them in
+// the instance volume cache. Meant to run on its own thread
+void probeDiskVolumes(std::shared_ptr<diskarbitrator::Disk> disk, DiskAbitratorServiceImpl* instance);
+
+// Takes a baseline of a disk seen for the first time, reading it only while
+// nothing else wants it. Meant to run on its own thread too
+void recordBaseline(std::shared_ptr<diskarbitrator::Disk> disk, DiskAbitratorServiceImpl* instance);
+
+// The name DiskArbitration uses as kDADiskDescriptionVolumeKindKey for this
+// filesystem, which is the name of the filesystem bundle
+const std::string volumeKind(FilesystemKind kind);
+
 // Takes a (local/diskarbitration) error code and returns a human readable description
 const std::string genErrorDescription(int errCode);
 
@@ -0,0 +1,341 @@
+/***************************************************************************
+ *   ewf.cpp  --  This file is part of diskarbitratord.                    *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "byteorder.hpp"
+#include "ewf.hpp"
+
+#define EWF_TABLE_HEADER_SIZE 24
+#define EWF_TABLE_OFFSET_MASK 0x7FFFFFFF
+#define EWF_TABLE_COMPRESSED 0x80000000
+#define EWF_CHECKSUM_SIZE 4
+// Chunks bigger than this, compressed, are corrupt entries rather than data
+#define EWF_MAX_STORED_CHUNK(chunkSize) ((chunkSize) * 2 + 1024)
+
+typedef struct SectionDescriptor {
+  std::string type;
+  uint64_t offset;
+  uint64_t next;
+  uint64_t size;
+} SectionDescriptor;
+
+static bool readSectionDescriptor(int fd, uint64_t offset, SectionDescriptor& section) {
+  uint8_t d[EWF_SECTION_DESCRIPTOR_SIZE];
+  if(preadFully(fd, d, sizeof(d), offset) != sizeof(d)) {
+    return false;
+  }
+  if(adler32(1, d, EWF_SECTION_DESCRIPTOR_SIZE - EWF_CHECKSUM_SIZE) != readLE32(d + EWF_SECTION_DESCRIPTOR_SIZE - EWF_CHECKSUM_SIZE)) {
+    throw std::runtime_error("Corrupt EWF section descriptor at offset " + std::to_string(offset));
+  }
+  section.type = std::string(reinterpret_cast<const char*>(d), strnlen(reinterpret_cast<const char*>(d), 16));
+  section.offset = offset;
+  section.next = readLE64(d + 16);
+  section.size = readLE64(d + 24);
+  return true;
+}
+
+static bool hasSignature(int fd) {
+  uint8_t header[EWF_FILE_HEADER_SIZE];
+  return preadFully(fd, header, sizeof(header), 0) == sizeof(header) && !memcmp(header, EWF_SIGNATURE, EWF_SIGNATURE_SIZE);
+}
+
+bool findEWFVolume(int fd, EWFVolume& volume) {
+  if(!hasSignature(fd)) {
+    return false;
+  }
+  SectionDescriptor section;
+  // The volume comes right after the header sections, a few sections in
+  for(uint64_t offset = EWF_FILE_HEADER_SIZE; readSectionDescriptor(fd, offset, section); offset = section.next) {
+    if(section.type == "volume" || section.type == "disk") {
+      uint8_t v[24];
+      if(preadFully(fd, v, sizeof(v), offset + EWF_SECTION_DESCRIPTOR_SIZE) != sizeof(v)) {
+        return false;
+      }
+      volume.chunkCount = readLE32(v + 4);
+      volume.sectorsPerChunk = readLE32(v + 8);
+      volume.bytesPerSector = readLE32(v + 12);
+      volume.sectorCount = readLE64(v + 16);
+      return true;
+    }
+    if(section.type == "sectors" || section.type == "table" || section.type == "done" || section.type == "next" || section.next <= offset) {
+      return false;
+    }
+  }
+  return false;
+}
+
+EWFReader::EWFReader(const std::string& path, unsigned int threads, size_t cacheChunks) : cache(cacheChunks), pool(threads) {
+  try {
+    for(const auto& segment : segmentPaths(path)) {
+      int fd = open(segment.c_str(), O_RDONLY);
+      if(fd == -1) {
+        throw std::runtime_error("Unable to open " + segment + ": " + std::string(strerror(errno)));
+      }
+      this->segments.push_back(fd);
+      this->segmentNames.push_back(segment);
+    }
+
+    if(!findEWFVolume(this->segments[0], this->volume)) {
+      throw std::runtime_error(path + " is not an EWF image, or has no volume section");
+    }
+    this->chunkBytes = static_cast<uint64_t>(this->volume.sectorsPerChunk) * this->volume.bytesPerSector;
+    this->mediaSize = this->volume.sectorCount * this->volume.bytesPerSector;
+    if(this->chunkBytes == 0 || this->chunkBytes > EWF_TABLE_OFFSET_MASK) {
+      throw std::runtime_error(path + " has an invalid chunk size");
+    }
+
+    for(size_t i = 0; i < this->segments.size(); ++i) {
+      this->parseSegment(i);
+    }
+    uint64_t neededChunks = (this->mediaSize + this->chunkBytes - 1) / this->chunkBytes;
+    if(this->entries.size() < neededChunks) {
+      throw std::runtime_error(path + " is incomplete, only " + std::to_string(this->entries.size()) + " of " + std::to_string(neededChunks) +
+                               " chunks found in " + std::to_string(this->segments.size()) + " segments");
+    }
+  } catch(...) {
+    for(int fd : this->segments) {
+      close(fd);
+    }
+    throw;
+  }
+}
+
+EWFReader::~EWFReader() {
+  // The pool is destroyed after this, and its jobs still use the fds. Wait for
+  // them while they're open
+  std::vector<std::shared_future<ChunkData>> pending;
+  {
+    const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+    for(const auto& it : this->inFlight) {
+      pending.push_back(it.second);
+    }
+  }
+  for(auto& f : pending) {
+    f.wait();
+  }
+  for(int fd : this->segments) {
+    close(fd);
+  }
+}
+
+void EWFReader::parseSegment(size_t segment) {
+  const int fd = this->segments[segment];
+  const std::string& name = this->segmentNames[segment];
+  uint8_t header[EWF_FILE_HEADER_SIZE];
+  if(preadFully(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, EWF_SIGNATURE, EWF_SIGNATURE_SIZE)) {
+    throw std::runtime_error(name + " is not an EWF segment");
+  }
+  if(readLE16(header + 9) != segment + 1) {
+    throw std::runtime_error(name + " is segment " + std::to_string(readLE16(header + 9)) + ", expected " + std::to_string(segment + 1));
+  }
+
+  // Where the last sectors section ends, which is where the data of the last
+  // chunk in the next table ends
+  uint64_t sectorsEnd = 0;
+  SectionDescriptor section;
+  for(uint64_t offset = EWF_FILE_HEADER_SIZE; ; offset = section.next) {
+    if(!readSectionDescriptor(fd, offset, section)) {
+      throw std::runtime_error(name + " is truncated at offset " + std::to_string(offset));
+    }
+    if(section.type == "sectors") {
+      sectorsEnd = offset + section.size;
+    } else if(section.type == "table") {
+      uint8_t t[EWF_TABLE_HEADER_SIZE];
+      if(preadFully(fd, t, sizeof(t), offset + EWF_SECTION_DESCRIPTOR_SIZE) != sizeof(t)) {
+        throw std::runtime_error(name + " has a truncated table at offset " + std::to_string(offset));
+      }
+      Table table;
+      table.firstChunk = this->entries.size();
+      table.chunkCount = readLE32(t);
+      // Entries have to fit in the section, or a corrupt count could have us
+      // allocate gigabytes for them
+      if(section.size < EWF_SECTION_DESCRIPTOR_SIZE + EWF_TABLE_HEADER_SIZE ||
+         table.chunkCount > (section.size - EWF_SECTION_DESCRIPTOR_SIZE - EWF_TABLE_HEADER_SIZE) / 4) {
+        throw std::runtime_error(name + " has a corrupt table at offset " + std::to_string(offset));
+      }
+      table.segment = segment;
+      table.baseOffset = readLE64(t + 8);
+      // Images from EnCase 1 to 3 keep the chunks in the table section itself
+      table.endOffset = sectorsEnd ? sectorsEnd : offset + section.size;
+      std::vector<uint8_t> raw(table.chunkCount * 4);
+      if(preadFully(fd, raw.data(), raw.size(), offset + EWF_SECTION_DESCRIPTOR_SIZE + EWF_TABLE_HEADER_SIZE) != raw.size()) {
+        throw std::runtime_error(name + " has a truncated table at offset " + std::to_string(offset));
+      }
+      for(uint64_t i = 0; i < table.chunkCount; ++i) {
+        this->entries.push_back(readLE32(raw.data() + i * 4));
+      }
+      if(table.chunkCount) {
+        this->tables.push_back(table);
+      }
+      sectorsEnd = 0;
+    }
+    // table2 is a backup copy of table, and the rest is metadata
+    if(section.type == "done" || section.type == "next" || section.next == offset) {
+      break;
+    }
+    if(section.next < offset) {
+      throw std::runtime_error(name + " has a section loop at offset " + std::to_string(offset));
+    }
+  }
+}
+
+uint64_t EWFReader::size() const {
+  return this->mediaSize;
+}
+
+EWFReader::ChunkData EWFReader::decompress(uint64_t index) {
+  // Last table starting at or before this chunk
+  auto table = std::upper_bound(this->tables.begin(), this->tables.end(), index, [](uint64_t i, const Table& t) {
+    return i < t.firstChunk;
+  }) - 1;
+  const uint32_t entry = this->entries[index];
+  const uint64_t start = table->baseOffset + (entry & EWF_TABLE_OFFSET_MASK);
+  const uint64_t end = index + 1 < table->firstChunk + table->chunkCount ? table->baseOffset + (this->entries[index + 1] & EWF_TABLE_OFFSET_MASK) : table->endOffset;
+  if(end <= start || end - start > EWF_MAX_STORED_CHUNK(this->chunkBytes)) {
+    throw std::runtime_error("Corrupt table entry for chunk " + std::to_string(index));
+  }
+  std::vector<uint8_t> raw(end - start);
+  if(preadFully(this->segments[table->segment], raw.data(), raw.size(), start) != raw.size()) {
+    throw std::runtime_error("Short read on chunk " + std::to_string(index));
+  }
+
+  const uint64_t length = std::min(this->chunkBytes, this->mediaSize - index * this->chunkBytes);
+  std::shared_ptr<std::vector<uint8_t>> out = std::make_shared<std::vector<uint8_t>>(length, 0);
+  if(entry & EWF_TABLE_COMPRESSED) {
+    // zlib checks the Adler-32 at the end of the stream by itself
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(inflateInit(&stream) != Z_OK) {
+      throw std::runtime_error("Unable to init zlib");
+    }
+    stream.next_in = raw.data();
+    stream.avail_in = raw.size();
+    stream.next_out = out->data();
+    stream.avail_out = out->size();
+    int ret = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if(ret != Z_STREAM_END) {
+      throw std::runtime_error("Corrupt zlib chunk " + std::to_string(index) + " (zlib error " + std::to_string(ret) + ")");
+    }
+    return out;
+  }
+
+  if(raw.size() < length + EWF_CHECKSUM_SIZE) {
+    throw std::runtime_error("Truncated chunk " + std::to_string(index));
+  }
+  const uint64_t stored = std::min<uint64_t>(raw.size() - EWF_CHECKSUM_SIZE, this->chunkBytes);
+  if(adler32(1, raw.data(), stored) != readLE32(raw.data() + stored)) {
+    throw std::runtime_error("Adler-32 mismatch in chunk " + std::to_string(index));
+  }
+  memcpy(out->data(), raw.data(), length);
+  return out;
+}
+
+std::shared_future<EWFReader::ChunkData> EWFReader::scheduleChunk(uint64_t index) {
+  ChunkData cached = this->cache.get(index);
+  if(cached) {
+    std::promise<ChunkData> ready;
+    ready.set_value(cached);
+    return ready.get_future().share();
+  }
+
+  const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+  auto it = this->inFlight.find(index);
+  if(it != this->inFlight.end()) {
+    return it->second;
+  }
+  std::shared_future<ChunkData> result = this->pool.submit([this, index]() {
+    ChunkData data;
+    try {
+      data = this->decompress(index);
+      this->cache.put(index, data);
+    } catch(...) {
+      const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+      this->inFlight.erase(index);
+      throw;
+    }
+    const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+    this->inFlight.erase(index);
+    return data;
+  }).share();
+  this->inFlight[index] = result;
+  return result;
+}
+
+EWFReader::ChunkData EWFReader::decompressChunk(uint64_t index) {
+  if(index >= this->entries.size() || index >= (this->mediaSize + this->chunkBytes - 1) / this->chunkBytes) {
+    throw std::runtime_error("Chunk " + std::to_string(index) + " out of range");
+  }
+  return this->scheduleChunk(index).get();
+}
+
+size_t EWFReader::read(uint64_t offset, void* buffer, size_t len) {
+  if(offset >= this->mediaSize) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, this->mediaSize - offset);
+  const uint64_t end = offset + len;
+  // Chunks are all the same size, so there's nothing to search for
+  const uint64_t firstChunk = offset / this->chunkBytes;
+  const uint64_t lastChunk = (end - 1) / this->chunkBytes;
+
+  std::vector<std::shared_future<ChunkData>> pending;
+  for(uint64_t index = firstChunk; index <= lastChunk; ++index) {
+    pending.push_back(this->scheduleChunk(index));
+  }
+
+  // Chunks are small, so readahead goes by size rather than by worker count
+  uint64_t expected = offset;
+  if(this->nextSequentialOffset.compare_exchange_strong(expected, end)) {
+    uint64_t readahead = std::max<uint64_t>(this->pool.size(), EWF_READAHEAD_SIZE / this->chunkBytes);
+    // Tables can have more entries than the media has chunks, the ones past
+    // its end hold nothing worth reading
+    const uint64_t mediaChunks = (this->mediaSize + this->chunkBytes - 1) / this->chunkBytes;
+    const uint64_t readaheadEnd = std::min(lastChunk + 1 + readahead, mediaChunks);
+    for(uint64_t index = lastChunk + 1; index < readaheadEnd; ++index) {
+      this->scheduleChunk(index);
+    }
+  } else {
+    this->nextSequentialOffset = end;
+  }
+
+  uint8_t* out = static_cast<uint8_t*>(buffer);
+  for(uint64_t index = firstChunk; index <= lastChunk; ++index) {
+    ChunkData data = pending[index - firstChunk].get();
+    uint64_t chunkStart = index * this->chunkBytes;
+    uint64_t copyStart = std::max(offset, chunkStart);
+    uint64_t copyEnd = std::min(end, chunkStart + data->size());
+    if(copyEnd > copyStart) {
+      memcpy(out + (copyStart - offset), data->data() + (copyStart - chunkStart), copyEnd - copyStart);
+    }
+  }
+  return len;
+}
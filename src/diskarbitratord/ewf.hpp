@@ -0,0 +1,136 @@
+/***************************************************************************
+ *   ewf.hpp  --  This file is part of diskarbitratord.                    *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef EWF_HPP_
+#define EWF_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+#include "lru_cache.hpp"
+#include "thread_pool.hpp"
+
+// Native read-only Expert Witness Format (EnCase .E01) support. An EWF image
+// is a set of segment files, each a chain of sections. The volume section has
+// the disk geometry, and every table section lists where the chunks (32KB by
+// default) in the sectors section before it are, and whether they're zlib
+// compressed. Uncompressed chunks carry an Adler-32 after them, compressed
+// ones have it inside the zlib stream. Everything is little endian.
+
+#define EWF_SIGNATURE "EVF\x09\x0D\x0A\xFF\x00"
+#define EWF_SIGNATURE_SIZE 8
+#define EWF_FILE_HEADER_SIZE 13
+#define EWF_SECTION_DESCRIPTOR_SIZE 76
+
+// Default number of decompressed chunks kept around
+#define EWF_DEFAULT_CACHE_CHUNKS 512
+// Sequential reads get this much decompressed ahead of them
+#define EWF_READAHEAD_SIZE (4 * 1024 * 1024)
+
+typedef struct EWFVolume {
+  uint64_t chunkCount;
+  uint32_t sectorsPerChunk;
+  uint32_t bytesPerSector;
+  uint64_t sectorCount;
+} EWFVolume;
+
+// Looks for the volume (or disk) section in the segment file open at `fd`.
+// Only the first segment has one. Returns false if there isn't one
+bool findEWFVolume(int fd, EWFVolume& volume);
+
+class EWFReader : public ImageReader {
+  public:
+    typedef std::shared_ptr<const std::vector<uint8_t>> ChunkData;
+
+    // `path` is the first segment (.E01), the rest are found next to it.
+    // `threads` decompress chunks in parallel (0 is one per core), and up to
+    // `cacheChunks` decompressed chunks are kept for later reads
+    EWFReader(const std::string& path, unsigned int threads = 0, size_t cacheChunks = EWF_DEFAULT_CACHE_CHUNKS);
+    ~EWFReader();
+
+    uint64_t size() const override;
+    size_t read(uint64_t offset, void* buffer, size_t len) override;
+
+    uint64_t chunkSize() const {
+      return this->chunkBytes;
+    }
+    uint64_t chunkCount() const {
+      return this->entries.size();
+    }
+    size_t segmentCount() const {
+      return this->segments.size();
+    }
+
+    // Returns the decompressed chunk, from the cache if possible. Throws if
+    // its Adler-32 doesn't match
+    ChunkData decompressChunk(uint64_t index);
+
+    size_t cacheHits() {
+      return this->cache.hitCount();
+    }
+    size_t cacheMisses() {
+      return this->cache.missCount();
+    }
+
+  private:
+    // A table section, mapping a run of chunks to a segment file
+    typedef struct Table {
+      uint64_t firstChunk;
+      uint64_t chunkCount;
+      size_t segment;
+      uint64_t baseOffset;
+      // Where the data of the last chunk ends
+      uint64_t endOffset;
+    } Table;
+
+    void parseSegment(size_t segment);
+    ChunkData decompress(uint64_t index);
+    // Decompresses the chunk on the pool unless it's cached or already underway
+    std::shared_future<ChunkData> scheduleChunk(uint64_t index);
+
+    std::vector<int> segments;
+    std::vector<std::string> segmentNames;
+    EWFVolume volume;
+    uint64_t chunkBytes;
+    uint64_t mediaSize;
+    // Raw table entries for every chunk: the offset from the table base, and
+    // the top bit set if compressed. 4 bytes a chunk keeps even TB images
+    // cheap to index
+    std::vector<uint32_t> entries;
+    // Sorted by firstChunk, searched to find the table a chunk belongs to
+    std::vector<Table> tables;
+    LRUCache<uint64_t, std::vector<uint8_t>> cache;
+    std::mutex inFlightMutex;
+    std::map<uint64_t, std::shared_future<ChunkData>> inFlight;
+    // Where the next read starts if it's sequential, to trigger readahead
+    std::atomic<uint64_t> nextSequentialOffset{0};
+    ThreadPool pool;
+};
+
+#endif
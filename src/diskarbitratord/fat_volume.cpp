@@ -0,0 +1,465 @@
+/***************************************************************************
+ *   fat_volume.cpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+
+#include "byteorder.hpp"
+#include "fat_volume.hpp"
+#include "scope_guard.hpp"
+#include "unicode.hpp"
+
+#define FAT_DIR_ENTRY_SIZE 32
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_LFN 0x0F
+#define FAT_LFN_LAST 0x40
+#define FAT_ENTRY_DELETED 0xE5
+#define FAT_CASE_LOWER_BASE 0x08
+#define FAT_CASE_LOWER_EXT 0x10
+#define EXFAT_ENTRY_FILE 0x85
+#define EXFAT_ENTRY_STREAM 0xC0
+#define EXFAT_ENTRY_NAME 0xC1
+#define EXFAT_NAME_CHARS_PER_ENTRY 15
+#define EXFAT_FLAG_NO_FAT_CHAIN 0x02
+// Anything bigger than this is a corrupt directory. exFAT allows 256MB, but
+// nobody gets anywhere near
+#define FAT_MAX_DIRECTORY_SIZE (64 * 1024 * 1024)
+
+// Days since epoch for a date in the proleptic Gregorian calendar
+static int64_t daysFromCivil(int64_t y, unsigned int m, unsigned int d) {
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned int yoe = static_cast<unsigned int>(y - era * 400);
+  const unsigned int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+// Both FAT and exFAT store MS-DOS timestamps, 2 second resolution
+static int64_t dosTimeToEpoch(uint16_t date, uint16_t time) {
+  unsigned int month = std::max(1, std::min(12, (date >> 5) & 0x0F));
+  unsigned int day = std::max(1, date & 0x1F);
+  return daysFromCivil(1980 + (date >> 9), month, day) * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+}
+
+// Names end up in protobuf strings, which have to be valid UTF-8. Legacy
+// codepage characters in short names can't be told apart without knowing the
+// codepage, and '/' would make a mess of paths
+static std::string sanitizeName(std::string name) {
+  for(auto& c : name) {
+    if(c == '/' || (c >= 0 && c < 0x20)) {
+      c = '_';
+    }
+  }
+  return name;
+}
+
+static std::string shortName(const uint8_t* d) {
+  std::string base(reinterpret_cast<const char*>(d), 8);
+  std::string ext(reinterpret_cast<const char*>(d + 8), 3);
+  if(static_cast<uint8_t>(base[0]) == 0x05) {
+    base[0] = static_cast<char>(FAT_ENTRY_DELETED);
+  }
+  base.erase(base.find_last_not_of(' ') + 1);
+  ext.erase(ext.find_last_not_of(' ') + 1);
+  // Windows NT keeps all-lowercase 8.3 names as flags instead of a long name
+  if(d[12] & FAT_CASE_LOWER_BASE) {
+    std::transform(base.begin(), base.end(), base.begin(), ::tolower);
+  }
+  if(d[12] & FAT_CASE_LOWER_EXT) {
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  }
+  std::string name = ext.size() ? base + "." + ext : base;
+  for(auto& c : name) {
+    if(static_cast<uint8_t>(c) >= 0x80) {
+      c = '_';
+    }
+  }
+  return name;
+}
+
+static uint8_t shortNameChecksum(const uint8_t* d) {
+  uint8_t sum = 0;
+  for(int i = 0; i < 11; ++i) {
+    sum = ((sum & 1) << 7) + (sum >> 1) + d[i];
+  }
+  return sum;
+}
+
+static bool equalsIgnoreCase(const std::string& a, const std::string& b) {
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+    return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y));
+  });
+}
+
+FATVolume::FATVolume(ImageReader& reader, ThreadPool& pool) : reader(reader), pool(pool) {
+  uint8_t boot[512];
+  if(!readExact(reader, 0, boot, sizeof(boot))) {
+    throw std::runtime_error("Volume too small to hold a FAT filesystem");
+  }
+
+  this->rootDirectory.name = "";
+  this->rootDirectory.directory = true;
+  this->rootDirectory.size = 0;
+  this->rootDirectory.contiguous = false;
+  this->rootDirectory.modified = 0;
+  this->rootDirOffset = 0;
+  this->rootDirSize = 0;
+
+  if(!memcmp(boot + 3, "EXFAT   ", 8)) {
+    uint8_t sectorShift = boot[108];
+    uint8_t clusterShift = boot[109];
+    if(sectorShift < 9 || sectorShift > 12 || sectorShift + clusterShift > 25) {
+      throw std::runtime_error("Invalid exFAT geometry");
+    }
+    uint64_t sectorSize = 1ULL << sectorShift;
+    this->fsKind = FS_EXFAT;
+    this->clusterSize = sectorSize << clusterShift;
+    this->fatOffset = readLE32(boot + 80) * sectorSize;
+    this->fatSize = readLE32(boot + 84) * sectorSize;
+    this->dataOffset = readLE32(boot + 88) * sectorSize;
+    this->clusterCount = readLE32(boot + 92);
+    this->rootDirectory.firstCluster = readLE32(boot + 96);
+  } else {
+    FilesystemInfo info = probeFilesystem(reader);
+    if(info.kind != FS_FAT12 && info.kind != FS_FAT16 && info.kind != FS_FAT32) {
+      throw std::runtime_error("Not a FAT or exFAT volume");
+    }
+    // The probe already sanity checked all of these
+    uint64_t bytesPerSector = readLE16(boot + 11);
+    uint64_t reservedSectors = readLE16(boot + 14);
+    uint64_t fatCount = boot[16];
+    uint64_t rootEntries = readLE16(boot + 17);
+    uint64_t totalSectors = readLE16(boot + 19) ? readLE16(boot + 19) : readLE32(boot + 32);
+    uint64_t fatSectors = readLE16(boot + 22) ? readLE16(boot + 22) : readLE32(boot + 36);
+    uint64_t rootSectors = (rootEntries * FAT_DIR_ENTRY_SIZE + bytesPerSector - 1) / bytesPerSector;
+    this->fsKind = info.kind;
+    this->clusterSize = info.blockSize;
+    this->fatOffset = reservedSectors * bytesPerSector;
+    this->fatSize = fatSectors * bytesPerSector;
+    this->rootDirOffset = (reservedSectors + fatCount * fatSectors) * bytesPerSector;
+    this->rootDirSize = rootSectors * bytesPerSector;
+    this->dataOffset = this->rootDirOffset + this->rootDirSize;
+    this->clusterCount = (totalSectors * bytesPerSector - this->dataOffset) / this->clusterSize;
+    this->rootDirectory.firstCluster = this->fsKind == FS_FAT32 ? readLE32(boot + 44) : 0;
+  }
+
+  // The FAT is allocated for every cluster the boot sector claims, so those
+  // have to fit both in the volume and in the FAT itself
+  const uint64_t volumeSize = reader.size();
+  const uint64_t entryBits = this->fsKind == FS_FAT12 ? 12 : this->fsKind == FS_FAT16 ? 16 : 32;
+  if(this->fatSize > volumeSize || this->fatOffset > volumeSize - this->fatSize || this->dataOffset > volumeSize ||
+     this->clusterCount > (volumeSize - this->dataOffset) / this->clusterSize || this->clusterCount > this->fatSize * 8 / entryBits) {
+    throw std::runtime_error(std::string(this->fsKind == FS_EXFAT ? "exFAT" : "FAT") + " geometry doesn't fit in the volume");
+  }
+}
+
+FilesystemKind FATVolume::kind() const {
+  return this->fsKind;
+}
+
+const FATFile& FATVolume::root() const {
+  return this->rootDirectory;
+}
+
+uint64_t FATVolume::clusterOffset(uint32_t cluster) const {
+  return this->dataOffset + static_cast<uint64_t>(cluster - 2) * this->clusterSize;
+}
+
+void FATVolume::loadFAT() {
+  // Only as much as the clusters that exist, the FAT is usually padded
+  uint64_t entries = static_cast<uint64_t>(this->clusterCount) + 2;
+  uint64_t bytes = this->fsKind == FS_FAT12 ? (entries * 3 + 1) / 2 : entries * (this->fsKind == FS_FAT16 ? 2 : 4);
+  bytes = std::min(bytes, this->fatSize);
+  std::vector<uint8_t> raw(bytes);
+  if(this->reader.read(this->fatOffset, raw.data(), raw.size()) != raw.size()) {
+    throw std::runtime_error("Truncated volume reading the FAT");
+  }
+
+  this->fat.resize(entries, 0);
+  for(uint64_t i = 0; i < entries; ++i) {
+    switch(this->fsKind) {
+      case FS_FAT12: {
+        // 12 bit entries, packed in pairs into 3 bytes
+        uint64_t offset = i * 3 / 2;
+        if(offset + 1 < raw.size()) {
+          uint16_t v = readLE16(raw.data() + offset);
+          this->fat[i] = i & 1 ? v >> 4 : v & 0x0FFF;
+        }
+        break;
+      }
+      case FS_FAT16:
+        if(i * 2 + 1 < raw.size()) {
+          this->fat[i] = readLE16(raw.data() + i * 2);
+        }
+        break;
+      default:
+        if(i * 4 + 3 < raw.size()) {
+          // The top 4 bits of FAT32 entries are reserved
+          this->fat[i] = readLE32(raw.data() + i * 4) & (this->fsKind == FS_FAT32 ? 0x0FFFFFFF : 0xFFFFFFFF);
+        }
+        break;
+    }
+  }
+}
+
+std::vector<FATExtent> FATVolume::extents(const FATFile& file) {
+  std::vector<FATExtent> result;
+  if(file.directory && file.firstCluster == 0 && this->fsKind != FS_EXFAT && this->fsKind != FS_FAT32) {
+    // FAT12/16 root directory
+    result.push_back({this->rootDirOffset, this->rootDirSize});
+    return result;
+  }
+  const uint64_t lastCluster = static_cast<uint64_t>(this->clusterCount) + 2;
+  if(file.firstCluster < 2 || file.firstCluster >= lastCluster) {
+    return result;
+  }
+
+  if(file.contiguous) {
+    uint64_t available = (lastCluster - file.firstCluster) * this->clusterSize;
+    result.push_back({this->clusterOffset(file.firstCluster), std::min(file.size, available)});
+    return result;
+  }
+
+  std::call_once(this->fatLoaded, [this]() {
+    this->loadFAT();
+  });
+  // Directories don't have a size, they just go on until the end of the chain
+  const uint64_t wanted = file.directory ? UINT64_MAX : file.size;
+  uint64_t total = 0;
+  uint32_t cluster = file.firstCluster;
+  // A chain can't be longer than the volume, anything else is a loop
+  for(uint32_t steps = 0; steps < this->clusterCount && total < wanted; ++steps) {
+    uint64_t offset = this->clusterOffset(cluster);
+    uint64_t length = std::min<uint64_t>(this->clusterSize, wanted - total);
+    if(result.size() && result.back().offset + result.back().length == offset) {
+      result.back().length += length;
+    } else {
+      result.push_back({offset, length});
+    }
+    total += length;
+    uint32_t next = this->fat[cluster];
+    // End of chain markers, bad clusters and free ones are all out of range
+    if(next < 2 || next >= lastCluster) {
+      break;
+    }
+    cluster = next;
+  }
+  return result;
+}
+
+void FATVolume::readFile(const FATFile& file, const std::function<bool(const uint8_t*, size_t)>& sink) {
+  std::vector<FATExtent> pieces;
+  for(const auto& extent : this->extents(file)) {
+    for(uint64_t done = 0; done < extent.length; done += FAT_MAX_IO_SIZE) {
+      pieces.push_back({extent.offset + done, std::min<uint64_t>(FAT_MAX_IO_SIZE, extent.length - done)});
+    }
+  }
+  if(pieces.empty()) {
+    return;
+  }
+
+  auto readPiece = [this](const FATExtent& piece, std::vector<uint8_t>* buffer) {
+    buffer->resize(piece.length);
+    if(!readExact(this->reader, piece.offset, buffer->data(), buffer->size())) {
+      throw std::runtime_error("Truncated volume reading file data at offset " + std::to_string(piece.offset));
+    }
+  };
+  // Double buffered, so the device is kept busy while the data goes out. The
+  // read ahead uses the buffers here, so it's waited for however this ends
+  std::vector<uint8_t> buffers[2];
+  std::future<void> pending = this->pool.submit([&readPiece, &pieces, &buffers]() {
+    readPiece(pieces[0], &buffers[0]);
+  });
+  ScopeGuard pendingGuard([&pending]() {
+    if(pending.valid()) {
+      pending.wait();
+    }
+  });
+  for(size_t i = 0; i < pieces.size(); ++i) {
+    pending.get();
+    if(i + 1 < pieces.size()) {
+      pending = this->pool.submit([&readPiece, &pieces, &buffers, i]() {
+        readPiece(pieces[i + 1], &buffers[(i + 1) % 2]);
+      });
+    }
+    if(!sink(buffers[i % 2].data(), buffers[i % 2].size())) {
+      return;
+    }
+  }
+}
+
+std::vector<uint8_t> FATVolume::readDirectory(const FATFile& directory) {
+  if(!directory.directory) {
+    throw std::runtime_error(directory.name + " is not a directory");
+  }
+  std::vector<uint8_t> data;
+  for(const auto& extent : this->extents(directory)) {
+    if(data.size() + extent.length > FAT_MAX_DIRECTORY_SIZE) {
+      throw std::runtime_error("Directory " + directory.name + " is too big, the volume is probably corrupt");
+    }
+    size_t previousSize = data.size();
+    data.resize(previousSize + extent.length);
+    if(!readExact(this->reader, extent.offset, data.data() + previousSize, extent.length)) {
+      throw std::runtime_error("Truncated volume reading directory " + directory.name);
+    }
+  }
+  return data;
+}
+
+std::vector<FATFile> FATVolume::parseFATDirectory(const std::vector<uint8_t>& data) const {
+  std::vector<FATFile> files;
+  // Long names come in reverse order right before their short entry, 13
+  // UTF-16 characters each
+  std::vector<uint8_t> longName;
+  uint8_t longNameChecksum = 0;
+  for(size_t entry = 0; entry + FAT_DIR_ENTRY_SIZE <= data.size(); entry += FAT_DIR_ENTRY_SIZE) {
+    const uint8_t* d = data.data() + entry;
+    if(d[0] == 0) {
+      break;
+    }
+    if(d[0] == FAT_ENTRY_DELETED) {
+      longName.clear();
+      continue;
+    }
+    if(d[11] == FAT_ATTR_LFN) {
+      unsigned int sequence = d[0] & 0x1F;
+      if(sequence == 0) {
+        longName.clear();
+        continue;
+      }
+      if(d[0] & FAT_LFN_LAST) {
+        longName.assign(sequence * 26, 0);
+        longNameChecksum = d[13];
+      }
+      if(sequence * 26 > longName.size()) {
+        longName.clear();
+        continue;
+      }
+      uint8_t* part = longName.data() + (sequence - 1) * 26;
+      memcpy(part, d + 1, 10);
+      memcpy(part + 10, d + 14, 12);
+      memcpy(part + 22, d + 28, 4);
+      continue;
+    }
+    if(d[11] & FAT_ATTR_VOLUME_ID) {
+      longName.clear();
+      continue;
+    }
+
+    FATFile file;
+    file.name = longName.size() && longNameChecksum == shortNameChecksum(d) ? utf16ToUTF8(longName.data(), longName.size(), false) : shortName(d);
+    longName.clear();
+    if(file.name == "." || file.name == "..") {
+      continue;
+    }
+    file.name = sanitizeName(file.name);
+    file.directory = d[11] & FAT_ATTR_DIRECTORY;
+    file.size = file.directory ? 0 : readLE32(d + 28);
+    file.firstCluster = (this->fsKind == FS_FAT32 ? static_cast<uint32_t>(readLE16(d + 20)) << 16 : 0) | readLE16(d + 26);
+    file.contiguous = false;
+    file.modified = dosTimeToEpoch(readLE16(d + 24), readLE16(d + 22));
+    files.push_back(file);
+  }
+  return files;
+}
+
+std::vector<FATFile> FATVolume::parseExFATDirectory(const std::vector<uint8_t>& data) const {
+  std::vector<FATFile> files;
+  for(size_t entry = 0; entry + FAT_DIR_ENTRY_SIZE <= data.size(); entry += FAT_DIR_ENTRY_SIZE) {
+    const uint8_t* d = data.data() + entry;
+    if(d[0] == 0) {
+      break;
+    }
+    if(d[0] != EXFAT_ENTRY_FILE) {
+      continue;
+    }
+    // A file entry, then a stream extension, then the name in pieces
+    unsigned int secondaryCount = d[1];
+    if(secondaryCount < 2 || entry + (secondaryCount + 1) * FAT_DIR_ENTRY_SIZE > data.size()) {
+      continue;
+    }
+    const uint8_t* stream = d + FAT_DIR_ENTRY_SIZE;
+    if(stream[0] != EXFAT_ENTRY_STREAM) {
+      continue;
+    }
+    FATFile file;
+    file.directory = readLE16(d + 4) & FAT_ATTR_DIRECTORY;
+    file.modified = dosTimeToEpoch(readLE16(d + 14), readLE16(d + 12));
+    file.contiguous = stream[1] & EXFAT_FLAG_NO_FAT_CHAIN;
+    file.firstCluster = readLE32(stream + 20);
+    file.size = readLE64(stream + 24);
+    size_t nameBytes = stream[3] * 2;
+    std::vector<uint8_t> name;
+    for(unsigned int i = 2; i <= secondaryCount && name.size() < nameBytes; ++i) {
+      const uint8_t* part = d + i * FAT_DIR_ENTRY_SIZE;
+      if(part[0] != EXFAT_ENTRY_NAME) {
+        break;
+      }
+      name.insert(name.end(), part + 2, part + 2 + EXFAT_NAME_CHARS_PER_ENTRY * 2);
+    }
+    file.name = sanitizeName(utf16ToUTF8(name.data(), std::min(nameBytes, name.size()), false));
+    files.push_back(file);
+    entry += secondaryCount * FAT_DIR_ENTRY_SIZE;
+  }
+  return files;
+}
+
+std::vector<FATFile> FATVolume::listDirectory(const FATFile& directory) {
+  std::vector<uint8_t> data = this->readDirectory(directory);
+  return this->fsKind == FS_EXFAT ? this->parseExFATDirectory(data) : this->parseFATDirectory(data);
+}
+
+FATFile FATVolume::lookup(const std::string& path) {
+  FATFile current = this->rootDirectory;
+  size_t start = 0;
+  while(start < path.size()) {
+    size_t end = path.find('/', start);
+    if(end == std::string::npos) {
+      end = path.size();
+    }
+    const std::string component = path.substr(start, end - start);
+    start = end + 1;
+    if(component.empty() || component == ".") {
+      continue;
+    }
+    if(!current.directory) {
+      throw std::runtime_error("Not a directory: " + current.name);
+    }
+    bool found = false;
+    for(const auto& file : this->listDirectory(current)) {
+      if(equalsIgnoreCase(file.name, component)) {
+        current = file;
+        found = true;
+        break;
+      }
+    }
+    if(!found) {
+      throw std::runtime_error("No such file or directory: " + path);
+    }
+  }
+  return current;
+}
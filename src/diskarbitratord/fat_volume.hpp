@@ -0,0 +1,111 @@
+/***************************************************************************
+ *   fat_volume.hpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef FAT_VOLUME_HPP_
+#define FAT_VOLUME_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fs_probe.hpp"
+#include "image_reader.hpp"
+#include "thread_pool.hpp"
+
+// Largest single read when pulling file data. Runs of consecutive clusters are
+// read in pieces of this size, so a unfragmented file streams at device speed
+#define FAT_MAX_IO_SIZE (4 * 1024 * 1024)
+
+typedef struct FATFile {
+  std::string name;
+  bool directory;
+  uint64_t size;
+  uint32_t firstCluster;
+  // exFAT files can skip the FAT altogether when they're in one piece
+  bool contiguous;
+  // Seconds since epoch. FAT has no timezone, so this is local time of
+  // whatever wrote it, taken as UTC
+  int64_t modified;
+} FATFile;
+
+// A run of consecutive clusters, in bytes from the start of the volume
+typedef struct FATExtent {
+  uint64_t offset;
+  uint64_t length;
+} FATExtent;
+
+// Read-only access to FAT12/16/32 and exFAT volumes, straight from the device
+// or image, so evidence never has to be mounted. Safe to use from several
+// threads at once.
+class FATVolume {
+  public:
+    // Throws if `reader` doesn't hold a FAT or exFAT volume. File data is
+    // read ahead on `pool`. Both have to outlive this
+    FATVolume(ImageReader& reader, ThreadPool& pool);
+
+    FilesystemKind kind() const;
+    const FATFile& root() const;
+
+    std::vector<FATFile> listDirectory(const FATFile& directory);
+
+    // Looks up a / separated path from the root, case insensitively as FAT
+    // does. Throws if it doesn't exist
+    FATFile lookup(const std::string& path);
+
+    // Where the data of `file` is, consecutive clusters already merged
+    std::vector<FATExtent> extents(const FATFile& file);
+
+    // Streams the contents of `file` to `sink`, in pieces of up to
+    // FAT_MAX_IO_SIZE. The next piece is read while `sink` handles the
+    // current one. Stops early if `sink` returns false.
+    void readFile(const FATFile& file, const std::function<bool(const uint8_t*, size_t)>& sink);
+
+  private:
+    void loadFAT();
+    uint64_t clusterOffset(uint32_t cluster) const;
+    std::vector<uint8_t> readDirectory(const FATFile& directory);
+    std::vector<FATFile> parseFATDirectory(const std::vector<uint8_t>& data) const;
+    std::vector<FATFile> parseExFATDirectory(const std::vector<uint8_t>& data) const;
+
+    ImageReader& reader;
+    ThreadPool& pool;
+    FilesystemKind fsKind;
+    uint64_t clusterSize;
+    uint32_t clusterCount;
+    uint64_t fatOffset;
+    uint64_t fatSize;
+    // Where cluster 2 starts
+    uint64_t dataOffset;
+    // FAT12/16 root directories live in a fixed area before the data
+    uint64_t rootDirOffset;
+    uint64_t rootDirSize;
+    FATFile rootDirectory;
+
+    // The whole FAT, decoded, loaded on first use. Even for big FAT32 sticks
+    // it's a few MB, and it saves a read for every cluster we follow
+    std::vector<uint32_t> fat;
+    std::once_flag fatLoaded;
+};
+
+#endif
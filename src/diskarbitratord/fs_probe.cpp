@@ -0,0 +1,494 @@
+/***************************************************************************
+ *   fs_probe.cpp  --  This file is part of diskarbitratord.               *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+
+#include "byteorder.hpp"
+#include "fs_probe.hpp"
+#include "unicode.hpp"
+
+// Every superblock we care about lives in the first 64KB, so that's read in
+// one go. Labels may need one more read
+#define PROBE_HEADER_SIZE (64 * 1024)
+// Largest directory or MFT record we read to find a label
+#define PROBE_MAX_EXTRA_READ (256 * 1024)
+
+#define HFS_HEADER_OFFSET 1024
+#define HFS_ROOT_PARENT_ID 1
+#define EXT_SUPERBLOCK_OFFSET 1024
+#define EXT_MAGIC 0xEF53
+#define ISO9660_PVD_OFFSET 32768
+#define NTFS_VOLUME_RECORD 3
+#define NTFS_ATTR_VOLUME_NAME 0x60
+#define NTFS_ATTR_END 0xFFFFFFFF
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_LFN 0x0F
+#define FAT_DIR_ENTRY_SIZE 32
+#define EXFAT_ENTRY_LABEL 0x83
+// NTFS, exFAT and FAT only look at their boot sector
+#define BOOT_SECTOR_SIZE 512
+
+static FilesystemInfo unknownFilesystem() {
+  FilesystemInfo info;
+  info.kind = FS_UNKNOWN;
+  info.blockSize = 0;
+  return info;
+}
+
+static std::string formatUUID(const uint8_t* u) {
+  char buffer[37];
+  snprintf(buffer, sizeof(buffer), "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+           u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+  return buffer;
+}
+
+// Fixed size, space or NUL padded labels
+static std::string trimLabel(const uint8_t* p, size_t len) {
+  std::string label(reinterpret_cast<const char*>(p), len);
+  label = label.substr(0, label.find('\0'));
+  label.erase(label.find_last_not_of(' ') + 1);
+  return label;
+}
+
+static bool isPowerOfTwo(uint64_t v) {
+  return v && !(v & (v - 1));
+}
+
+// Reads up to `len` bytes at `offset`, capped to PROBE_MAX_EXTRA_READ. Returns
+// an empty buffer if it's out of the disk
+static std::vector<uint8_t> readExtra(ImageReader& reader, uint64_t offset, uint64_t len) {
+  std::vector<uint8_t> buffer(std::min<uint64_t>(len, PROBE_MAX_EXTRA_READ));
+  if(!readExact(reader, offset, buffer.data(), buffer.size())) {
+    buffer.clear();
+  }
+  return buffer;
+}
+
+static bool probeAPFS(const uint8_t* header, size_t len, FilesystemInfo& info) {
+  if(len < 4096) {
+    return false;
+  }
+  if(!memcmp(header + 32, "NXSB", 4)) {
+    // A container. Volume names live in the volumes, deep in the object map
+    info.kind = FS_APFS;
+    info.blockSize = readLE32(header + 36);
+    info.uuid = formatUUID(header + 72);
+    return true;
+  }
+  if(!memcmp(header + 32, "APSB", 4)) {
+    // A volume on its own, which is how macOS exposes them (diskXsY)
+    info.kind = FS_APFS;
+    info.uuid = formatUUID(header + 240);
+    info.label = trimLabel(header + 704, 256);
+    return true;
+  }
+  return false;
+}
+
+// The catalog B-tree is sorted by parent ID first, and the root folder is the
+// only thing with parent ID 1, so its name (the volume name) is the very first
+// key of the first leaf node
+static std::string readHFSVolumeName(ImageReader& reader, const uint8_t* vh, uint32_t blockSize) {
+  const uint8_t* extents = vh + 288;
+  auto catalogOffset = [extents, blockSize](uint64_t offset) -> uint64_t {
+    // Map an offset in the catalog file through its first 8 extents
+    for(int i = 0; i < 8; ++i) {
+      uint64_t start = static_cast<uint64_t>(readBE32(extents + i * 8)) * blockSize;
+      uint64_t length = static_cast<uint64_t>(readBE32(extents + i * 8 + 4)) * blockSize;
+      if(offset < length) {
+        return start + offset;
+      }
+      offset -= length;
+    }
+    return UINT64_MAX;
+  };
+
+  uint8_t headerNode[512];
+  uint64_t headerOffset = catalogOffset(0);
+  if(headerOffset == UINT64_MAX || !readExact(reader, headerOffset, headerNode, sizeof(headerNode))) {
+    return "";
+  }
+  uint32_t firstLeaf = readBE32(headerNode + 24);
+  uint16_t nodeSize = readBE16(headerNode + 32);
+  if(nodeSize < 512 || !isPowerOfTwo(nodeSize)) {
+    return "";
+  }
+  uint64_t leafOffset = catalogOffset(static_cast<uint64_t>(firstLeaf) * nodeSize);
+  if(leafOffset == UINT64_MAX) {
+    return "";
+  }
+  std::vector<uint8_t> leaf = readExtra(reader, leafOffset, nodeSize);
+  if(leaf.size() != nodeSize || readBE16(leaf.data() + 10) == 0) {
+    return "";
+  }
+  // Record offsets are stacked backwards at the end of the node
+  uint16_t record = readBE16(leaf.data() + nodeSize - 2);
+  if(record + 10 > nodeSize || readBE32(leaf.data() + record + 2) != HFS_ROOT_PARENT_ID) {
+    return "";
+  }
+  uint16_t nameLength = readBE16(leaf.data() + record + 6);
+  size_t nameBytes = std::min<size_t>(nameLength * 2, nodeSize - record - 8);
+  return utf16ToUTF8(leaf.data() + record + 8, nameBytes, true);
+}
+
+static bool probeHFS(ImageReader& reader, const uint8_t* header, size_t len, FilesystemInfo& info) {
+  if(len < HFS_HEADER_OFFSET + 512) {
+    return false;
+  }
+  const uint8_t* vh = header + HFS_HEADER_OFFSET;
+  uint16_t signature = readBE16(vh);
+  if(signature != 0x482B && signature != 0x4858) {
+    return false;
+  }
+  uint32_t blockSize = readBE32(vh + 40);
+  if(blockSize < 512 || !isPowerOfTwo(blockSize)) {
+    return false;
+  }
+  info.kind = signature == 0x482B ? FS_HFSPLUS : FS_HFSX;
+  info.blockSize = blockSize;
+  // The 64 bit volume ID in the last two Finder info words. macOS derives the
+  // volume UUID from it
+  char id[17];
+  snprintf(id, sizeof(id), "%016llX", static_cast<unsigned long long>(readBE64(vh + 104)));
+  info.uuid = id;
+  info.label = readHFSVolumeName(reader, vh, blockSize);
+  return true;
+}
+
+static bool probeExt(const uint8_t* header, size_t len, FilesystemInfo& info) {
+  if(len < EXT_SUPERBLOCK_OFFSET + 1024) {
+    return false;
+  }
+  const uint8_t* sb = header + EXT_SUPERBLOCK_OFFSET;
+  if(readLE16(sb + 56) != EXT_MAGIC) {
+    return false;
+  }
+  uint32_t logBlockSize = readLE32(sb + 24);
+  if(logBlockSize > 6) {
+    return false;
+  }
+  uint32_t compat = readLE32(sb + 92);
+  uint32_t incompat = readLE32(sb + 96);
+  uint32_t roCompat = readLE32(sb + 100);
+  // Extents, 64bit, MMP, flex_bg, inline data / huge_file, gdt_csum,
+  // dir_nlink, extra_isize, metadata_csum. Any of these means ext4
+  if((incompat & (0x40 | 0x80 | 0x100 | 0x200 | 0x8000)) || (roCompat & (0x8 | 0x10 | 0x20 | 0x40 | 0x400))) {
+    info.kind = FS_EXT4;
+  } else if(compat & 0x4) {
+    // Has a journal
+    info.kind = FS_EXT3;
+  } else {
+    info.kind = FS_EXT2;
+  }
+  info.blockSize = 1024 << logBlockSize;
+  info.uuid = formatUUID(sb + 104);
+  info.label = trimLabel(sb + 120, 16);
+  return true;
+}
+
+static bool probeISO9660(const uint8_t* header, size_t len, FilesystemInfo& info) {
+  if(len < ISO9660_PVD_OFFSET + 2048) {
+    return false;
+  }
+  const uint8_t* pvd = header + ISO9660_PVD_OFFSET;
+  if(pvd[0] != 1 || memcmp(pvd + 1, "CD001", 5)) {
+    return false;
+  }
+  info.kind = FS_ISO9660;
+  info.label = trimLabel(pvd + 40, 32);
+  info.blockSize = readLE16(pvd + 128);
+  // Creation date, YYYYMMDDHHMMSSCC, turned into YYYY-MM-DD-HH-MM-SS-CC
+  const char* date = reinterpret_cast<const char*>(pvd + 813);
+  std::string uuid;
+  for(int i = 0; i < 16; ++i) {
+    if(i == 4 || (i > 4 && i % 2 == 0)) {
+      uuid += '-';
+    }
+    uuid += date[i];
+  }
+  info.uuid = uuid;
+  return true;
+}
+
+static bool probeNTFS(ImageReader& reader, const uint8_t* header, size_t len, FilesystemInfo& info) {
+  if(len < BOOT_SECTOR_SIZE) {
+    return false;
+  }
+  if(memcmp(header + 3, "NTFS    ", 8)) {
+    return false;
+  }
+  uint32_t bytesPerSector = readLE16(header + 11);
+  uint8_t sectorsPerClusterRaw = header[13];
+  // Above 128 it's a negative shift, for clusters bigger than 64KB
+  uint64_t sectorsPerCluster = sectorsPerClusterRaw <= 128 ? sectorsPerClusterRaw : 1ULL << (256 - sectorsPerClusterRaw);
+  if(bytesPerSector < 256 || !isPowerOfTwo(bytesPerSector) || !isPowerOfTwo(sectorsPerCluster)) {
+    return false;
+  }
+  uint64_t clusterSize = bytesPerSector * sectorsPerCluster;
+  info.kind = FS_NTFS;
+  info.blockSize = clusterSize;
+  char serial[17];
+  snprintf(serial, sizeof(serial), "%016llX", static_cast<unsigned long long>(readLE64(header + 72)));
+  info.uuid = serial;
+
+  // The label is the $VOLUME_NAME attribute of $Volume, MFT record 3
+  int8_t clustersPerRecord = static_cast<int8_t>(header[64]);
+  uint64_t recordSize = clustersPerRecord > 0 ? clustersPerRecord * clusterSize : 1ULL << -clustersPerRecord;
+  if(recordSize < bytesPerSector || recordSize > PROBE_MAX_EXTRA_READ) {
+    return true;
+  }
+  std::vector<uint8_t> record = readExtra(reader, readLE64(header + 48) * clusterSize + NTFS_VOLUME_RECORD * recordSize, recordSize);
+  if(record.size() != recordSize || memcmp(record.data(), "FILE", 4)) {
+    return true;
+  }
+  // Undo the update sequence fixups: the last two bytes of every sector were
+  // swapped for a sequence number on write
+  uint16_t usaOffset = readLE16(record.data() + 4);
+  uint16_t usaCount = readLE16(record.data() + 6);
+  if(usaOffset + usaCount * 2u > recordSize) {
+    return true;
+  }
+  for(uint32_t i = 1; i < usaCount && i * bytesPerSector <= recordSize; ++i) {
+    memcpy(record.data() + i * bytesPerSector - 2, record.data() + usaOffset + i * 2, 2);
+  }
+
+  size_t attribute = readLE16(record.data() + 20);
+  while(attribute + 24 <= recordSize) {
+    uint32_t type = readLE32(record.data() + attribute);
+    uint32_t length = readLE32(record.data() + attribute + 4);
+    if(type == NTFS_ATTR_END || length == 0 || attribute + length > recordSize) {
+      break;
+    }
+    // Resident attributes only, which $VOLUME_NAME always is
+    if(type == NTFS_ATTR_VOLUME_NAME && record[attribute + 8] == 0) {
+      uint32_t valueLength = readLE32(record.data() + attribute + 16);
+      uint16_t valueOffset = readLE16(record.data() + attribute + 20);
+      if(valueOffset + valueLength <= length) {
+        info.label = utf16ToUTF8(record.data() + attribute + valueOffset, valueLength, false);
+      }
+      break;
+    }
+    attribute += length;
+  }
+  return true;
+}
+
+static bool probeExFAT(ImageReader& reader, const uint8_t* header, size_t len, FilesystemInfo& info) {
+  if(len < BOOT_SECTOR_SIZE) {
+    return false;
+  }
+  if(memcmp(header + 3, "EXFAT   ", 8)) {
+    return false;
+  }
+  uint8_t sectorShift = header[108];
+  uint8_t clusterShift = header[109];
+  if(sectorShift < 9 || sectorShift > 12 || sectorShift + clusterShift > 25) {
+    return false;
+  }
+  uint64_t sectorSize = 1ULL << sectorShift;
+  uint64_t clusterSize = sectorSize << clusterShift;
+  info.kind = FS_EXFAT;
+  info.blockSize = clusterSize;
+  char serial[10];
+  uint32_t serialNumber = readLE32(header + 100);
+  snprintf(serial, sizeof(serial), "%04X-%04X", serialNumber >> 16, serialNumber & 0xFFFF);
+  info.uuid = serial;
+
+  // The label is an entry in the root directory. It's always near the start,
+  // so the first cluster is enough
+  uint64_t heapOffset = readLE32(header + 88) * sectorSize;
+  uint32_t rootCluster = readLE32(header + 96);
+  if(rootCluster < 2) {
+    return true;
+  }
+  std::vector<uint8_t> root = readExtra(reader, heapOffset + (rootCluster - 2) * clusterSize, clusterSize);
+  for(size_t entry = 0; entry + FAT_DIR_ENTRY_SIZE <= root.size(); entry += FAT_DIR_ENTRY_SIZE) {
+    uint8_t type = root[entry];
+    if(type == 0) {
+      break;
+    }
+    if(type == EXFAT_ENTRY_LABEL) {
+      info.label = utf16ToUTF8(root.data() + entry + 2, std::min<size_t>(root[entry + 1], 11) * 2, false);
+      break;
+    }
+  }
+  return true;
+}
+
+static std::string findFATLabel(const std::vector<uint8_t>& directory) {
+  for(size_t entry = 0; entry + FAT_DIR_ENTRY_SIZE <= directory.size(); entry += FAT_DIR_ENTRY_SIZE) {
+    const uint8_t* d = directory.data() + entry;
+    if(d[0] == 0) {
+      break;
+    }
+    if(d[0] != 0xE5 && d[11] != FAT_ATTR_LFN && (d[11] & FAT_ATTR_VOLUME_ID)) {
+      return trimLabel(d, 11);
+    }
+  }
+  return "";
+}
+
+static bool probeFAT(ImageReader& reader, const uint8_t* header, size_t len, FilesystemInfo& info) {
+  if(len < BOOT_SECTOR_SIZE) {
+    return false;
+  }
+  if((header[0] != 0xEB && header[0] != 0xE9) || header[510] != 0x55 || header[511] != 0xAA) {
+    return false;
+  }
+  uint32_t bytesPerSector = readLE16(header + 11);
+  uint32_t sectorsPerCluster = header[13];
+  uint32_t reservedSectors = readLE16(header + 14);
+  uint32_t fatCount = header[16];
+  uint32_t rootEntries = readLE16(header + 17);
+  uint32_t totalSectors = readLE16(header + 19) ? readLE16(header + 19) : readLE32(header + 32);
+  uint32_t fatSize = readLE16(header + 22) ? readLE16(header + 22) : readLE32(header + 36);
+  if(bytesPerSector < 512 || bytesPerSector > 4096 || !isPowerOfTwo(bytesPerSector) || !isPowerOfTwo(sectorsPerCluster) ||
+     !reservedSectors || !fatCount || !fatSize || !totalSectors) {
+    return false;
+  }
+
+  uint64_t rootSectors = (rootEntries * FAT_DIR_ENTRY_SIZE + bytesPerSector - 1) / bytesPerSector;
+  uint64_t firstDataSector = reservedSectors + static_cast<uint64_t>(fatCount) * fatSize + rootSectors;
+  if(firstDataSector >= totalSectors) {
+    return false;
+  }
+  // The cluster count is the only thing that really tells FAT types apart
+  uint64_t clusters = (totalSectors - firstDataSector) / sectorsPerCluster;
+  info.kind = clusters < 4085 ? FS_FAT12 : clusters < 65525 ? FS_FAT16 : FS_FAT32;
+  info.blockSize = bytesPerSector * sectorsPerCluster;
+
+  // The extended boot record moves down in FAT32
+  const uint8_t* ebr = header + (info.kind == FS_FAT32 ? 64 : 36);
+  std::string bootLabel;
+  if(ebr[2] == 0x29) {
+    uint32_t serialNumber = readLE32(ebr + 3);
+    char serial[10];
+    snprintf(serial, sizeof(serial), "%04X-%04X", serialNumber >> 16, serialNumber & 0xFFFF);
+    info.uuid = serial;
+    bootLabel = trimLabel(ebr + 7, 11);
+  }
+
+  // Formatters keep the boot sector label, but renames only touch the root
+  // directory entry, so that one wins
+  std::vector<uint8_t> root;
+  if(info.kind == FS_FAT32) {
+    uint32_t rootCluster = readLE32(header + 44);
+    if(rootCluster >= 2) {
+      root = readExtra(reader, (firstDataSector + static_cast<uint64_t>(rootCluster - 2) * sectorsPerCluster) * bytesPerSector, info.blockSize);
+    }
+  } else {
+    root = readExtra(reader, (firstDataSector - rootSectors) * bytesPerSector, rootSectors * bytesPerSector);
+  }
+  info.label = findFATLabel(root);
+  if(info.label.empty() && bootLabel != "NO NAME") {
+    info.label = bootLabel;
+  }
+  return true;
+}
+
+FilesystemInfo probeFilesystem(ImageReader& reader) {
+  FilesystemInfo info = unknownFilesystem();
+  std::vector<uint8_t> header(std::min<uint64_t>(PROBE_HEADER_SIZE, reader.size()));
+  if(header.size() < 512 || reader.read(0, header.data(), header.size()) != header.size()) {
+    return info;
+  }
+  const uint8_t* h = header.data();
+  const size_t len = header.size();
+
+  // Ones with a proper magic number first. FAT goes last, all it has is a
+  // jump instruction and the boot signature, which the others have too
+  if(probeAPFS(h, len, info) || probeHFS(reader, h, len, info) || probeNTFS(reader, h, len, info) ||
+     probeExFAT(reader, h, len, info) || probeExt(h, len, info) || probeISO9660(h, len, info) ||
+     probeFAT(reader, h, len, info)) {
+    return info;
+  }
+  return unknownFilesystem();
+}
+
+DiskProbe probeDisk(ImageReader& reader, ThreadPool& pool) {
+  DiskProbe probe;
+  probe.table = readPartitionTable(reader);
+  probe.wholeDisk = unknownFilesystem();
+  if(probe.table.scheme == PARTITION_SCHEME_NONE) {
+    probe.wholeDisk = probeFilesystem(reader);
+    return probe;
+  }
+
+  std::vector<std::future<FilesystemInfo>> pending;
+  for(const auto& partition : probe.table.partitions) {
+    pending.push_back(pool.submit([&reader, partition]() {
+      SliceImageReader slice(reader, partition.offset, partition.size);
+      return probeFilesystem(slice);
+    }));
+  }
+  // Collect everything before throwing, the jobs use `reader`
+  std::exception_ptr error;
+  for(auto& result : pending) {
+    try {
+      probe.filesystems.push_back(result.get());
+    } catch(...) {
+      probe.filesystems.push_back(unknownFilesystem());
+      if(!error) {
+        error = std::current_exception();
+      }
+    }
+  }
+  if(error) {
+    std::rethrow_exception(error);
+  }
+  return probe;
+}
+
+const std::string filesystemKindName(FilesystemKind kind) {
+  switch(kind) {
+    case FS_HFSPLUS:
+      return "HFS+";
+    case FS_HFSX:
+      return "HFSX";
+    case FS_APFS:
+      return "APFS";
+    case FS_FAT12:
+      return "FAT12";
+    case FS_FAT16:
+      return "FAT16";
+    case FS_FAT32:
+      return "FAT32";
+    case FS_EXFAT:
+      return "exFAT";
+    case FS_NTFS:
+      return "NTFS";
+    case FS_EXT2:
+      return "ext2";
+    case FS_EXT3:
+      return "ext3";
+    case FS_EXT4:
+      return "ext4";
+    case FS_ISO9660:
+      return "ISO 9660";
+    default:
+      return "Unknown";
+  }
+}
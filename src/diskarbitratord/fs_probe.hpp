@@ -0,0 +1,84 @@
+/***************************************************************************
+ *   fs_probe.hpp  --  This file is part of diskarbitratord.               *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef FS_PROBE_HPP_
+#define FS_PROBE_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+#include "partition_table.hpp"
+#include "thread_pool.hpp"
+
+// Filesystem detection straight from the superblocks. Disks we block never get
+// mounted, so DiskArbitration never learns their volume name or kind. This
+// gets them without mounting anything, from a handful of sectors.
+
+enum FilesystemKind {
+  FS_UNKNOWN,
+  FS_HFSPLUS,
+  FS_HFSX,
+  FS_APFS,
+  FS_FAT12,
+  FS_FAT16,
+  FS_FAT32,
+  FS_EXFAT,
+  FS_NTFS,
+  FS_EXT2,
+  FS_EXT3,
+  FS_EXT4,
+  FS_ISO9660
+};
+
+typedef struct FilesystemInfo {
+  FilesystemKind kind;
+  std::string label;
+  // Whatever identifier the filesystem stores: a real UUID for APFS and ext,
+  // a serial number for FAT and NTFS, the volume ID for HFS+ and the creation
+  // date for ISO9660 (as blkid does)
+  std::string uuid;
+  // Allocation block (cluster) size
+  uint32_t blockSize;
+} FilesystemInfo;
+
+// The layout of a disk and what's in each partition
+typedef struct DiskProbe {
+  PartitionTable table;
+  // Same order as table.partitions
+  std::vector<FilesystemInfo> filesystems;
+  // For disks without a partition table
+  FilesystemInfo wholeDisk;
+} DiskProbe;
+
+// Probes the filesystem at the start of `reader`. Unknown filesystems come back
+// as FS_UNKNOWN. Throws on read errors.
+FilesystemInfo probeFilesystem(ImageReader& reader);
+
+// Reads the partition table and probes every partition in parallel on `pool`.
+// Must not be called from a job running on that same pool.
+DiskProbe probeDisk(ImageReader& reader, ThreadPool& pool);
+
+const std::string filesystemKindName(FilesystemKind kind);
+
+#endif
@@ -0,0 +1,640 @@
+/***************************************************************************
+ *   hash.cpp  --  This file is part of diskarbitratord.                   *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HASH_HAVE_SHANI
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+#include <arm_neon.h>
+#define HASH_HAVE_ARMV8
+#endif
+
+#include "byteorder.hpp"
+#include "hash.hpp"
+
+static const uint32_t MD5_K[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned int MD5_SHIFTS[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const uint32_t SHA1_K[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, unsigned int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t rotl(uint32_t x, unsigned int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+// Whole blocks go straight to `blocks`, whatever's left over waits in
+// `buffer` for the next update
+template<size_t BLOCK_SIZE, typename F>
+static void updateBlocks(uint32_t* state, uint8_t* buffer, size_t& buffered, const void* data, size_t len, F blocks) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  if(buffered) {
+    size_t n = std::min(len, BLOCK_SIZE - buffered);
+    memcpy(buffer + buffered, bytes, n);
+    buffered += n;
+    bytes += n;
+    len -= n;
+    if(buffered < BLOCK_SIZE) {
+      return;
+    }
+    blocks(state, buffer, 1);
+    buffered = 0;
+  }
+  if(len >= BLOCK_SIZE) {
+    blocks(state, bytes, len / BLOCK_SIZE);
+    bytes += len / BLOCK_SIZE * BLOCK_SIZE;
+    len %= BLOCK_SIZE;
+  }
+  memcpy(buffer, bytes, len);
+  buffered = len;
+}
+
+// A 1 bit, zeroes, and the length in bits at the very end. They all pad the
+// same way, MD5 just has the length the other way round. Returns how much of
+// `padding` to hash
+static size_t makePadding(uint8_t padding[128], uint64_t length, size_t buffered, bool bigEndian) {
+  memset(padding, 0, 128);
+  padding[0] = 0x80;
+  const uint64_t bits = length * 8;
+  size_t paddingLength = (buffered < 56 ? 56 : 120) - buffered;
+  for(int i = 0; i < 8; ++i) {
+    padding[paddingLength + i] = bits >> (bigEndian ? 56 - 8 * i : 8 * i);
+  }
+  return paddingLength + 8;
+}
+
+static void md5Blocks(uint32_t state[4], const uint8_t* data, size_t blocks) {
+  while(blocks--) {
+    uint32_t m[16];
+    for(int i = 0; i < 16; ++i) {
+      m[i] = readLE32(data + i * 4);
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    // Unrolled, the round functions and message indexes are all constants
+#pragma GCC unroll 64
+    for(int i = 0; i < 64; ++i) {
+      uint32_t f;
+      int g;
+      if(i < 16) {
+        f = d ^ (b & (c ^ d));
+        g = i;
+      } else if(i < 32) {
+        f = c ^ (d & (b ^ c));
+        g = (5 * i + 1) % 16;
+      } else if(i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      f += a + MD5_K[i] + m[g];
+      a = d;
+      d = c;
+      c = b;
+      b += rotl(f, MD5_SHIFTS[i]);
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    data += MD5_BLOCK_SIZE;
+  }
+}
+
+static void sha1BlocksScalar(uint32_t state[5], const uint8_t* data, size_t blocks) {
+  while(blocks--) {
+    uint32_t w[80];
+    for(int i = 0; i < 16; ++i) {
+      w[i] = readBE32(data + i * 4);
+    }
+    for(int i = 16; i < 80; ++i) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for(int i = 0; i < 80; ++i) {
+      uint32_t f;
+      if(i < 20) {
+        f = d ^ (b & (c ^ d));
+      } else if(i < 40 || i >= 60) {
+        f = b ^ c ^ d;
+      } else {
+        f = (b & c) | (d & (b | c));
+      }
+      uint32_t t = rotl(a, 5) + f + e + SHA1_K[i / 20] + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    data += SHA1_BLOCK_SIZE;
+  }
+}
+
+static void sha256BlocksScalar(uint32_t state[8], const uint8_t* data, size_t blocks) {
+  while(blocks--) {
+    uint32_t w[64];
+    for(int i = 0; i < 16; ++i) {
+      w[i] = readBE32(data + i * 4);
+    }
+    for(int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for(int i = 0; i < 64; ++i) {
+      uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+    data += SHA256_BLOCK_SIZE;
+  }
+}
+
+#ifdef HASH_HAVE_SHANI
+// Intel SHA extensions. sha1rnds4 does 4 rounds with E added to the message
+// beforehand, and sha1nexte works out the E for the next 4 from what A was.
+// The message schedule is spread over the 3 groups before it's needed.
+__attribute__((target("sha,sse4.1")))
+static void sha1BlocksSHANI(uint32_t state[5], const uint8_t* data, size_t blocks) {
+  const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+  __m128i e = _mm_set_epi32(state[4], 0, 0, 0);
+
+  while(blocks--) {
+    const __m128i savedABCD = abcd;
+    const __m128i savedE = e;
+    __m128i w[4];
+    for(int i = 0; i < 4; ++i) {
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16)), byteSwap);
+    }
+    __m128i previousA = abcd;
+#pragma GCC unroll 20
+    for(int group = 0; group < 20; ++group) {
+      const __m128i current = w[group % 4];
+      const __m128i message = group ? _mm_sha1nexte_epu32(previousA, current) : _mm_add_epi32(e, current);
+      previousA = abcd;
+      // The round function has to be an immediate
+      switch(group / 5) {
+        case 0:
+          abcd = _mm_sha1rnds4_epu32(abcd, message, 0);
+          break;
+        case 1:
+          abcd = _mm_sha1rnds4_epu32(abcd, message, 1);
+          break;
+        case 2:
+          abcd = _mm_sha1rnds4_epu32(abcd, message, 2);
+          break;
+        default:
+          abcd = _mm_sha1rnds4_epu32(abcd, message, 3);
+          break;
+      }
+      if(group >= 3 && group <= 18) {
+        w[(group + 1) % 4] = _mm_sha1msg2_epu32(w[(group + 1) % 4], current);
+      }
+      if(group >= 2 && group <= 17) {
+        w[(group + 2) % 4] = _mm_xor_si128(w[(group + 2) % 4], current);
+      }
+      if(group >= 1 && group <= 16) {
+        w[(group + 3) % 4] = _mm_sha1msg1_epu32(w[(group + 3) % 4], current);
+      }
+    }
+    e = _mm_sha1nexte_epu32(previousA, savedE);
+    abcd = _mm_add_epi32(abcd, savedABCD);
+    data += SHA1_BLOCK_SIZE;
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e, 3);
+}
+
+// Intel SHA extensions. The state is kept as ABEF and CDGH, which is what
+// sha256rnds2 wants, and each group of 4 rounds also advances the message
+// schedule for the groups to come.
+__attribute__((target("sha,sse4.1")))
+static void sha256BlocksSHANI(uint32_t state[8], const uint8_t* data, size_t blocks) {
+  const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  while(blocks--) {
+    const __m128i savedABEF = state0;
+    const __m128i savedCDGH = state1;
+    __m128i w[4];
+    for(int i = 0; i < 4; ++i) {
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16)), byteSwap);
+    }
+    // Unrolled, the message words stay in registers instead of an array
+#pragma GCC unroll 16
+    for(int group = 0; group < 16; ++group) {
+      const __m128i current = w[group % 4];
+      __m128i message = _mm_add_epi32(current, _mm_loadu_si128(reinterpret_cast<const __m128i*>(SHA256_K + group * 4)));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+      if(group >= 3 && group <= 14) {
+        __m128i& next = w[(group + 1) % 4];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(current, w[(group + 3) % 4], 4));
+        next = _mm_sha256msg2_epu32(next, current);
+      }
+      message = _mm_shuffle_epi32(message, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+      if(group >= 1 && group <= 12) {
+        __m128i& previous = w[(group + 3) % 4];
+        previous = _mm_sha256msg1_epu32(previous, current);
+      }
+    }
+    state0 = _mm_add_epi32(state0, savedABEF);
+    state1 = _mm_add_epi32(state1, savedCDGH);
+    data += SHA256_BLOCK_SIZE;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+}
+#endif
+
+#ifdef HASH_HAVE_ARMV8
+// ARMv8 crypto extensions, on every Apple Silicon Mac. Each instruction does
+// 4 rounds, and sha1h works out the E for the next 4
+static void sha1BlocksARMv8(uint32_t state[5], const uint8_t* data, size_t blocks) {
+  uint32x4_t abcd = vld1q_u32(state);
+  uint32_t e = state[4];
+
+  while(blocks--) {
+    const uint32x4_t savedABCD = abcd;
+    const uint32_t savedE = e;
+    uint32x4_t w[4];
+    for(int i = 0; i < 4; ++i) {
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+    }
+#pragma GCC unroll 20
+    for(int group = 0; group < 20; ++group) {
+      const uint32x4_t message = vaddq_u32(w[group % 4], vdupq_n_u32(SHA1_K[group / 5]));
+      if(group < 16) {
+        w[group % 4] = vsha1su1q_u32(vsha1su0q_u32(w[group % 4], w[(group + 1) % 4], w[(group + 2) % 4]), w[(group + 3) % 4]);
+      }
+      const uint32_t nextE = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if(group < 5) {
+        abcd = vsha1cq_u32(abcd, e, message);
+      } else if(group < 10 || group >= 15) {
+        abcd = vsha1pq_u32(abcd, e, message);
+      } else {
+        abcd = vsha1mq_u32(abcd, e, message);
+      }
+      e = nextE;
+    }
+    abcd = vaddq_u32(abcd, savedABCD);
+    e += savedE;
+    data += SHA1_BLOCK_SIZE;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e;
+}
+
+static void sha256BlocksARMv8(uint32_t state[8], const uint8_t* data, size_t blocks) {
+  uint32x4_t state0 = vld1q_u32(state);
+  uint32x4_t state1 = vld1q_u32(state + 4);
+
+  while(blocks--) {
+    const uint32x4_t savedABCD = state0;
+    const uint32x4_t savedEFGH = state1;
+    uint32x4_t w[4];
+    for(int i = 0; i < 4; ++i) {
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+    }
+#pragma GCC unroll 16
+    for(int group = 0; group < 16; ++group) {
+      const uint32x4_t message = vaddq_u32(w[group % 4], vld1q_u32(SHA256_K + group * 4));
+      if(group < 12) {
+        w[group % 4] = vsha256su1q_u32(vsha256su0q_u32(w[group % 4], w[(group + 1) % 4]), w[(group + 2) % 4], w[(group + 3) % 4]);
+      }
+      const uint32x4_t abcd = state0;
+      state0 = vsha256hq_u32(state0, state1, message);
+      state1 = vsha256h2q_u32(state1, abcd, message);
+    }
+    state0 = vaddq_u32(state0, savedABCD);
+    state1 = vaddq_u32(state1, savedEFGH);
+    data += SHA256_BLOCK_SIZE;
+  }
+
+  vst1q_u32(state, state0);
+  vst1q_u32(state + 4, state1);
+}
+#endif
+
+typedef void (*BlocksFunction)(uint32_t*, const uint8_t*, size_t);
+
+typedef struct HashBackend {
+  BlocksFunction blocks;
+  const char* name;
+} HashBackend;
+
+static bool haveSHANI() {
+#if defined(HASH_HAVE_SHANI)
+  return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#else
+  return false;
+#endif
+}
+
+static HashBackend selectSHA1Backend() {
+#if defined(HASH_HAVE_ARMV8)
+  return {sha1BlocksARMv8, "armv8-sha1"};
+#elif defined(HASH_HAVE_SHANI)
+  if(haveSHANI()) {
+    return {sha1BlocksSHANI, "sha-ni"};
+  }
+#endif
+  return {sha1BlocksScalar, "scalar"};
+}
+
+static HashBackend selectSHA256Backend() {
+#if defined(HASH_HAVE_ARMV8)
+  return {sha256BlocksARMv8, "armv8-sha2"};
+#elif defined(HASH_HAVE_SHANI)
+  if(haveSHANI()) {
+    return {sha256BlocksSHANI, "sha-ni"};
+  }
+#endif
+  return {sha256BlocksScalar, "scalar"};
+}
+
+static const HashBackend& sha1Backend() {
+  static const HashBackend selected = selectSHA1Backend();
+  return selected;
+}
+
+static const HashBackend& sha256Backend() {
+  static const HashBackend selected = selectSHA256Backend();
+  return selected;
+}
+
+// name:state words:length:buffered bytes, all but the length in hex
+static std::string packState(const char* name, const uint32_t* state, size_t words, uint64_t length, const uint8_t* buffer, size_t buffered) {
+  std::string packed = std::string(name) + ":";
+  for(size_t i = 0; i < words; ++i) {
+    uint8_t word[4] = {static_cast<uint8_t>(state[i] >> 24), static_cast<uint8_t>(state[i] >> 16), static_cast<uint8_t>(state[i] >> 8), static_cast<uint8_t>(state[i])};
+    packed += hexString(word, sizeof(word));
+  }
+  return packed + ":" + std::to_string(length) + ":" + hexString(buffer, buffered);
+}
+
+static uint8_t hexDigit(char c) {
+  if(c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if(c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  throw std::invalid_argument("Not a hex digit");
+}
+
+static void unpackState(const std::string& packed, const char* name, uint32_t* state, size_t words, uint64_t& length, uint8_t* buffer, size_t& buffered, size_t blockSize) {
+  try {
+    const std::string prefix = std::string(name) + ":";
+    const size_t lengthStart = prefix.size() + words * 8 + 1;
+    if(packed.compare(0, prefix.size(), prefix) != 0 || packed.size() < lengthStart || packed[lengthStart - 1] != ':') {
+      throw std::invalid_argument(packed);
+    }
+    const size_t bufferStart = packed.find(':', lengthStart);
+    if(bufferStart == std::string::npos || (packed.size() - bufferStart - 1) % 2 || (packed.size() - bufferStart - 1) / 2 >= blockSize) {
+      throw std::invalid_argument(packed);
+    }
+    uint32_t unpacked[8];
+    for(size_t i = 0; i < words; ++i) {
+      unpacked[i] = 0;
+      for(size_t j = 0; j < 8; ++j) {
+        unpacked[i] = unpacked[i] << 4 | hexDigit(packed[prefix.size() + i * 8 + j]);
+      }
+    }
+    size_t end;
+    const uint64_t unpackedLength = std::stoull(packed.substr(lengthStart, bufferStart - lengthStart), &end);
+    if(end != bufferStart - lengthStart) {
+      throw std::invalid_argument(packed);
+    }
+    const size_t unpackedBuffered = (packed.size() - bufferStart - 1) / 2;
+    if(unpackedLength % blockSize != unpackedBuffered) {
+      throw std::invalid_argument(packed);
+    }
+    for(size_t i = 0; i < unpackedBuffered; ++i) {
+      buffer[i] = hexDigit(packed[bufferStart + 1 + i * 2]) << 4 | hexDigit(packed[bufferStart + 2 + i * 2]);
+    }
+    memcpy(state, unpacked, words * sizeof(uint32_t));
+    length = unpackedLength;
+    buffered = unpackedBuffered;
+  } catch(const std::logic_error& e) {
+    throw std::runtime_error(std::string("Invalid ") + name + " state");
+  }
+}
+
+MD5::MD5() {
+  static const uint32_t initial[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  memcpy(this->state, initial, sizeof(this->state));
+}
+
+void MD5::update(const void* data, size_t len) {
+  this->length += len;
+  updateBlocks<MD5_BLOCK_SIZE>(this->state, this->buffer, this->buffered, data, len, md5Blocks);
+}
+
+std::string MD5::finish() {
+  uint8_t padding[MD5_BLOCK_SIZE * 2];
+  this->update(padding, makePadding(padding, this->length, this->buffered, false));
+
+  uint8_t digest[MD5_DIGEST_SIZE];
+  for(int i = 0; i < 4; ++i) {
+    for(int j = 0; j < 4; ++j) {
+      digest[i * 4 + j] = this->state[i] >> (8 * j);
+    }
+  }
+  return hexString(digest, sizeof(digest));
+}
+
+std::string MD5::saveState() const {
+  return packState(this->name(), this->state, 4, this->length, this->buffer, this->buffered);
+}
+
+void MD5::restoreState(const std::string& state) {
+  unpackState(state, this->name(), this->state, 4, this->length, this->buffer, this->buffered, MD5_BLOCK_SIZE);
+}
+
+SHA1::SHA1() {
+  static const uint32_t initial[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  memcpy(this->state, initial, sizeof(this->state));
+}
+
+void SHA1::update(const void* data, size_t len) {
+  this->length += len;
+  updateBlocks<SHA1_BLOCK_SIZE>(this->state, this->buffer, this->buffered, data, len, sha1Backend().blocks);
+}
+
+std::string SHA1::finish() {
+  uint8_t padding[SHA1_BLOCK_SIZE * 2];
+  this->update(padding, makePadding(padding, this->length, this->buffered, true));
+
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  for(int i = 0; i < 5; ++i) {
+    for(int j = 0; j < 4; ++j) {
+      digest[i * 4 + j] = this->state[i] >> (24 - 8 * j);
+    }
+  }
+  return hexString(digest, sizeof(digest));
+}
+
+std::string SHA1::saveState() const {
+  return packState(this->name(), this->state, 5, this->length, this->buffer, this->buffered);
+}
+
+void SHA1::restoreState(const std::string& state) {
+  unpackState(state, this->name(), this->state, 5, this->length, this->buffer, this->buffered, SHA1_BLOCK_SIZE);
+}
+
+SHA256::SHA256() {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(this->state, initial, sizeof(this->state));
+}
+
+void SHA256::update(const void* data, size_t len) {
+  this->length += len;
+  updateBlocks<SHA256_BLOCK_SIZE>(this->state, this->buffer, this->buffered, data, len, sha256Backend().blocks);
+}
+
+std::string SHA256::finish() {
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  this->finish(digest);
+  return hexString(digest, sizeof(digest));
+}
+
+void SHA256::finish(uint8_t digest[SHA256_DIGEST_SIZE]) {
+  uint8_t padding[SHA256_BLOCK_SIZE * 2];
+  this->update(padding, makePadding(padding, this->length, this->buffered, true));
+
+  for(int i = 0; i < 8; ++i) {
+    for(int j = 0; j < 4; ++j) {
+      digest[i * 4 + j] = this->state[i] >> (24 - 8 * j);
+    }
+  }
+}
+
+std::string SHA256::saveState() const {
+  return packState(this->name(), this->state, 8, this->length, this->buffer, this->buffered);
+}
+
+void SHA256::restoreState(const std::string& state) {
+  unpackState(state, this->name(), this->state, 8, this->length, this->buffer, this->buffered, SHA256_BLOCK_SIZE);
+}
+
+std::unique_ptr<Hasher> makeHasher(const std::string& name) {
+  if(name == "md5") {
+    return std::unique_ptr<Hasher>(new MD5());
+  }
+  if(name == "sha1") {
+    return std::unique_ptr<Hasher>(new SHA1());
+  }
+  if(name == "sha256") {
+    return std::unique_ptr<Hasher>(new SHA256());
+  }
+  throw std::runtime_error("Unknown hash algorithm " + name);
+}
+
+std::string hexString(const uint8_t* data, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex(len * 2, '0');
+  for(size_t i = 0; i < len; ++i) {
+    hex[i * 2] = digits[data[i] >> 4];
+    hex[i * 2 + 1] = digits[data[i] & 0xF];
+  }
+  return hex;
+}
+
+const char* sha1Implementation() {
+  return sha1Backend().name;
+}
+
+const char* sha256Implementation() {
+  return sha256Backend().name;
+}
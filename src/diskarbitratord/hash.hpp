@@ -0,0 +1,129 @@
+/***************************************************************************
+ *   hash.hpp  --  This file is part of diskarbitratord.                   *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef HASH_HPP_
+#define HASH_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#define MD5_BLOCK_SIZE 64
+#define MD5_DIGEST_SIZE 16
+#define SHA1_BLOCK_SIZE 64
+#define SHA1_DIGEST_SIZE 20
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+// Cryptographic hashes for evidence. Native, so the image code keeps building
+// without OpenSSL or CommonCrypto, and fast enough to keep up with the disks
+// being hashed.
+class Hasher {
+  public:
+    virtual ~Hasher() {}
+
+    virtual void update(const void* data, size_t len) = 0;
+
+    // Lowercase hex digest of everything so far. Can't be updated afterwards
+    virtual std::string finish() = 0;
+
+    // "sha256"...
+    virtual const char* name() const = 0;
+
+    // Everything needed to carry on hashing later, maybe in another process,
+    // as printable text. restoreState() throws if it isn't from a hasher of
+    // the same kind
+    virtual std::string saveState() const = 0;
+    virtual void restoreState(const std::string& state) = 0;
+};
+
+// Still what most chain of custody forms ask for. There's no instruction for
+// it, and its rounds depend on each other too much for SIMD to help
+class MD5 : public Hasher {
+  public:
+    MD5();
+    void update(const void* data, size_t len) override;
+    std::string finish() override;
+    const char* name() const override {
+      return "md5";
+    }
+    std::string saveState() const override;
+    void restoreState(const std::string& state) override;
+
+  private:
+    uint32_t state[4];
+    uint64_t length = 0;
+    uint8_t buffer[MD5_BLOCK_SIZE];
+    size_t buffered = 0;
+};
+
+// Uses the SHA extensions of x86 and ARMv8 when the CPU has them
+class SHA1 : public Hasher {
+  public:
+    SHA1();
+    void update(const void* data, size_t len) override;
+    std::string finish() override;
+    const char* name() const override {
+      return "sha1";
+    }
+    std::string saveState() const override;
+    void restoreState(const std::string& state) override;
+
+  private:
+    uint32_t state[5];
+    uint64_t length = 0;
+    uint8_t buffer[SHA1_BLOCK_SIZE];
+    size_t buffered = 0;
+};
+
+// Uses the SHA extensions of x86 and ARMv8 when the CPU has them
+class SHA256 : public Hasher {
+  public:
+    SHA256();
+    void update(const void* data, size_t len) override;
+    std::string finish() override;
+    // Same, but the digest as it is instead of in hex
+    void finish(uint8_t digest[SHA256_DIGEST_SIZE]);
+    const char* name() const override {
+      return "sha256";
+    }
+    std::string saveState() const override;
+    void restoreState(const std::string& state) override;
+
+  private:
+    uint32_t state[8];
+    uint64_t length = 0;
+    uint8_t buffer[SHA256_BLOCK_SIZE];
+    size_t buffered = 0;
+};
+
+// "md5", "sha1" or "sha256". Throws for anything else
+std::unique_ptr<Hasher> makeHasher(const std::string& name);
+
+std::string hexString(const uint8_t* data, size_t len);
+
+// Which implementation SHA1 and SHA256 ended up with, for the benchmarks
+const char* sha1Implementation();
+const char* sha256Implementation();
+
+#endif
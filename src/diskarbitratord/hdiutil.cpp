@@ -18,32 +18,44 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
 #include <mutex>
 #include <thread>
 
-#include <spawn.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include <glog/logging.h>
 
+#include "command.hpp"
 #include "hdiutil.hpp"
+#include "image_sniffer.hpp"
 #include "plist.hpp"
-#include "scope_guard.hpp"
 
-#define HDIUTIL_PATH "/usr/bin/hdiutil"
-// Strategically, this is the same size as the pipe buffer in XNU kernel
-#define READ_BUFFER_SIZE 16384
 #define EXECUTION_TIMEOUT_SECS 10
-
-typedef struct CommandOutput {
-  int retCode;
-  std::string stdout;
-  std::string stderr;
-} CommandOutput;
-
-static int terminationPipe[2];
-
-void terminationHandler(int signal) {
-  write(terminationPipe[1], "", 1);
+// Attaches report progress, so instead of a fixed timeout they get killed once
+// hdiutil hasn't said anything for this long
+#define ATTACH_INACTIVITY_TIMEOUT_SECS 30
+
+static std::string hdiutilPath = DEFAULT_HDIUTIL_PATH;
+
+// Paths we query on hdiutil's plist outputs. Built once, the CF keys are reused
+// on every call.
+static const PlistPath encryptedPath = PlistPath().key("encrypted");
+static const PlistPath slaPath = PlistPath().key("Properties").key("Software License Agreement");
+static const PlistPath devEntriesPath = PlistPath().key("system-entities").each().key("dev-entry");
+
+// Resolves a path expected to match exactly one value
+static PlistNode& queryOne(Plist& pl, const PlistPath& path) {
+  PlistQueryResult result = pl.query(path);
+  if(!result.ok) {
+    throw std::runtime_error("Unexpected hdiutil output: " + result.error);
+  }
+  return *result.nodes[0];
 }
 
 // Let's talk about hdiutil for a minute.
@@ -62,233 +74,59 @@ void terminationHandler(int signal) {
 // Hence, with a heavy heart, here's a series of functions that wrap hdiutil 
 // for attaching disks
 
-// Used to send stdin data to child
-void streamDataIn(int fd, const std::string* in, std::mutex* mutex, bool* err) {
-  const std::lock_guard<std::mutex> lock(*mutex);
-  size_t totalBytesWritten = 0;
-  ssize_t bytesWritten = 0;
-  while(totalBytesWritten != in->size()) {
-    bytesWritten = write(fd, in->c_str() + totalBytesWritten, in->size() - totalBytesWritten);
-    if(bytesWritten < 0) {
-      if(errno != EINTR) {
-        *err = true;
-        break;
-      }
-    }
-    totalBytesWritten += bytesWritten;
-  }
-  close(fd);
-}
-
-// Used to read stdout/err data from child
-void streamDataOut(int fd, std::string* out, std::mutex* mutex, bool* err) {
-  const std::lock_guard<std::mutex> lock(*mutex);
-  ssize_t bytesRead = 0;
-  char buffer[READ_BUFFER_SIZE];
-
-  while((bytesRead = read(fd, buffer, READ_BUFFER_SIZE)) != 0) {
-    if(bytesRead < 0) {
-      if(errno != EINTR) {
-        *err = true;
-        break;
-      }
-    }
-    *out += std::string(buffer, READ_BUFFER_SIZE);
+// Runs hdiutil with the given verb. The image path, if any, goes last
+static CommandOutput runHdiutil(const std::string& command, const std::string& image, std::vector<std::string> extraArgs, const std::string& stdinData, const CommandOptions& options) {
+  std::vector<std::string> args;
+  args.push_back(command);
+  args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+  if(image.size()) {
+    args.push_back(image);
   }
-  close(fd);
+  return runCommand(hdiutilPath, args, stdinData, options);
 }
 
-int getChildExitCode(pid_t childPid) {
-  int status;
-  int exitCode = -1;
-  while(waitpid(childPid, &status, 0) == -1) {
-    if(errno != EINTR) {
-      throw std::runtime_error("Error waiting for child process PID: " + std::string(strerror(errno)));
-    }
-  }
-  if (WIFEXITED(status)) {
-    exitCode = WEXITSTATUS(status);
-  } else if (WIFSIGNALED(status)) {
-    // Child exited due to signal. Return which one was it.
-    exitCode = WTERMSIG(status);
-  }
-
-  return exitCode;
+static CommandOutput runHdiutil(const std::string& command, const std::string& image, std::vector<std::string> extraArgs, const std::string& stdinData) {
+  CommandOptions options;
+  options.timeoutSecs = EXECUTION_TIMEOUT_SECS;
+  options.inactivityTimeout = false;
+  return runHdiutil(command, image, extraArgs, stdinData, options);
 }
 
-
-// Just the typical fork/exec wrap. Since vfork is deprecated in macOS, we're
-// using posix_spawn, since it also avoids duplicating process memory.
-CommandOutput runHdiutil(const std::string& command, const std::string& image, std::vector<std::string> extraArgs, const std::string& stdinData) {
-  CommandOutput co;
-
-  pid_t childPid;
-  
-  int stdoutPipeFds[2];
-  int stderrPipeFds[2];
-  int stdinPipeFds[2];
-  if(pipe(stdoutPipeFds) != 0) {
-    throw std::runtime_error("Unable to open stdout pipe: " + std::string(strerror(errno)));
-  }
-  if(pipe(stderrPipeFds) != 0) {
-    throw std::runtime_error("Unable to open stderr pipe: " + std::string(strerror(errno)));
+// With -puppetstrings, hdiutil writes its progress to stdout as lines like
+// "PERCENT:42.000000" or "MESSAGE:Attaching...", before the plist output.
+// Returns false for lines that aren't progress.
+static bool parsePuppetString(const std::string& line, AttachProgress& progress) {
+  size_t colon = line.find(':');
+  if(colon == std::string::npos) {
+    return false;
   }
-  if(pipe(stdinPipeFds) != 0) {
-    throw std::runtime_error("Unable to open stdin pipe: " + std::string(strerror(errno)));
-  }
-
-  ScopeGuard pipeGuard([stdinPipeFds, stdoutPipeFds, stderrPipeFds]() {
-    close(stdinPipeFds[0]);
-    close(stdinPipeFds[1]);
-
-    close(stdoutPipeFds[0]);
-    close(stdoutPipeFds[1]);
-
-    close(stderrPipeFds[0]);
-    close(stderrPipeFds[1]);
-  });
-
-  posix_spawn_file_actions_t fileActions;
-  if(posix_spawn_file_actions_init(&fileActions) != 0) {
-    throw std::runtime_error("Unable to init spawn file actions:" + std::string(strerror(errno)));
-  }
-  // Child process will write/read std streams from the pipes
-  if(posix_spawn_file_actions_adddup2(&fileActions, stdinPipeFds[0], STDIN_FILENO) != 0) {
-    throw std::runtime_error("Unable to dup stdin fd:" + std::string(strerror(errno)));
-  }
-  if(posix_spawn_file_actions_adddup2(&fileActions, stdoutPipeFds[1], STDOUT_FILENO) != 0) {
-    throw std::runtime_error("Unable to dup stdout fd:" + std::string(strerror(errno)));
-  }
-  if(posix_spawn_file_actions_adddup2(&fileActions, stderrPipeFds[1], STDERR_FILENO) != 0) {
-    throw std::runtime_error("Unable to dup stderr fd:" + std::string(strerror(errno)));
-  }
-
-  std::string stdoutData;
-  std::string stderrData;
-
-  bool stdinErr = false;
-  bool stdoutErr = false;
-  bool stderrErr = false;
-
-  std::mutex stdinMutex;
-  std::mutex stdoutMutex;
-  std::mutex stderrMutex;
-
-  std::thread stdinThread(&streamDataIn, stdinPipeFds[1], &stdinData, &stdinMutex, &stdinErr);
-  std::thread stdoutThread(&streamDataOut, stdoutPipeFds[0], &stdoutData, &stdoutMutex, &stdoutErr);
-  std::thread stderrThread(&streamDataOut, stderrPipeFds[0], &stderrData, &stderrMutex, &stderrErr);
-
-  // Running these in joinable state is not a good idea. We'd need to use a
-  // scope guard to ensure they are joined before the thread is destroyed, and
-  // unfortunately the order of destructor calls is the reverse of declaration.
-  // So this guard would run before the pipe file descriptors are closed, which
-  // would lead to the threads never joining in some sceanarios. Given that 
-  // these threads are *guaranteed* to finish if the file descriptors are 
-  // closed, I'm comfortable enough running them in detached state.
-  stdinThread.detach();
-  stdoutThread.detach();
-  stderrThread.detach();
-
-  std::vector<const char*> argv;
-  // From posix_spawn(2), argv[0] must be the path to the executable (it's not
-  // added automatically)
-  argv.push_back(HDIUTIL_PATH);
-
-  // Add the command
-  argv.push_back(command.c_str());
-
-  // Add extra args
-  for(const auto& arg : extraArgs) {
-    argv.push_back(arg.c_str());
-  }
-
-  // Add the image path, if specified
-  if(image.size()) {
-    argv.push_back(image.c_str());
-  }
-
-  // Push final NULL string
-  argv.push_back(NULL);
-
-  // Set up execution timeout
-  if (pipe(terminationPipe) == -1) {
-    throw std::runtime_error("Error setting up timeout execution pipe: " + std::string(strerror(errno)));  
-  }
-  ScopeGuard terminationPipeGuard([]() {
-    close(terminationPipe[0]);
-    close(terminationPipe[1]);
-  });
-
-  static struct sigaction action;
-  memset(&action, 0, sizeof(action));
-  action.sa_handler = terminationHandler;
-  action.sa_flags = SA_RESETHAND;
-  sigaction(SIGCHLD, &action, NULL);
-
-  if(posix_spawn(&childPid, HDIUTIL_PATH, &fileActions, NULL, (char* const*) argv.data(), NULL) != 0) {
-    throw std::runtime_error("Unable to spawn child hdiutil process: " + std::string(strerror(errno)));
-  }
-
-  char c;
-
-  struct timeval tv;
-  tv.tv_sec = EXECUTION_TIMEOUT_SECS;
-  tv.tv_usec = 0;
-
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(terminationPipe[0], &fds);
-
-  int ret = select(terminationPipe[0] + 1, &fds, NULL, NULL, &tv);
-  if(ret > 0) {
-    // Termination event ocurred
-    read(terminationPipe[0], &c, 1);
-  } else {
-    // Execution timeout reached or select(2) failed. Terminate execution in any case.
-    if(ret < 0) {
-      // select(2) failed. Don't throw here because we need to kill the child process
-      LOG(ERROR) << "Unable to wait for execution timeout: " + std::string(strerror(errno));  
-    } else {
-      LOG(ERROR) << "Execution timeout reached for hdiutil (PID " + std::to_string(childPid) + "). Terminating child process...";
-    }
-    // Reset signal handler
-    memset(&action, 0, sizeof(action));
-    action.sa_handler = SIG_DFL;
-    sigaction(SIGCHLD, &action, NULL);
-
-    if(kill(childPid, SIGKILL)) {
-      throw std::runtime_error("Error sending SIGKILL to child PID " + std::to_string(childPid) + ": " + std::string(strerror(errno)));
+  const std::string tag = line.substr(0, colon);
+  const std::string value = line.substr(colon + 1);
+  if(tag == "PERCENT") {
+    try {
+      progress.percent = std::stod(value);
+    } catch(const std::exception& e) {
+      return false;
     }
+    return true;
+  } else if(tag == "MESSAGE" || tag == "TITLE" || tag == "DETAILS") {
+    progress.message = value;
+    return true;
   }
+  return false;
+}
 
-  // Get exit code or reap child process in any case
-  co.retCode = getChildExitCode(childPid);
-  
-  // Stronger guarantee that the threads have exhausted all input/output
-
-  close(stdinPipeFds[0]);
-  close(stdinPipeFds[1]);
-
-  close(stdoutPipeFds[0]);
-  close(stdoutPipeFds[1]);
-
-  close(stderrPipeFds[0]);
-  close(stderrPipeFds[1]);
-
-  const std::lock_guard<std::mutex> stdinLock(stdinMutex);
-  const std::lock_guard<std::mutex> stdoutLock(stdoutMutex);
-  const std::lock_guard<std::mutex> stderrLock(stderrMutex);
-
-  posix_spawn_file_actions_destroy(&fileActions);
-
-  if(stdinErr || stdoutErr || stderrErr) {
-    throw std::runtime_error("Error streaming data in/out child process");
+// Puppet strings come first, so the plist starts at the XML declaration
+static std::string stripPuppetStrings(const std::string& output) {
+  size_t plistStart = output.find("<?xml");
+  if(plistStart == std::string::npos) {
+    return output;
   }
+  return output.substr(plistStart);
+}
 
-  co.stdout = stdoutData;
-  co.stderr = stderrData;
-
-  return co;
+void setHdiutilPath(const std::string& path) {
+  hdiutilPath = path;
 }
 
 // Returns true if the image requires a passphrase.
@@ -298,8 +136,8 @@ bool isImageEncrypted(const std::string& path) {
     throw std::runtime_error("hdiutil returned: " + std::to_string(output.retCode) + ". Error: " + output.stderr);
   }
 	
-  std::unique_ptr<Plist> pl = std::unique_ptr<Plist>(new Plist(output.stdout));
-  bool value = (*pl)["encrypted"].get<bool>();
+  Plist pl(output.stdout);
+  bool value = queryOne(pl, encryptedPath).get<bool>();
   return value;
 }
 
@@ -310,19 +148,26 @@ bool imageHasSLA(const std::string& path, const std::string& password) {
     throw std::runtime_error("hdiutil returned: " + std::to_string(output.retCode) + ". Error: " + output.stderr);
   }
 	
-  std::unique_ptr<Plist> pl = std::unique_ptr<Plist>(new Plist(output.stdout));
-  bool value = (*pl)["Properties"]["Software License Agreement"].get<bool>();
+  Plist pl(output.stdout);
+  bool value = queryOne(pl, slaPath).get<bool>();
   return value;
 }
 
-std::vector<std::string> attachDisk(const std::string& path, diskarbitrator::MountMode mode, const std::string& password) {
+// The actual hdiutil pipeline for attaching an image. Use attachDisk instead,
+// which makes sure the same image isn't attached twice at the same time.
+static std::vector<std::string> runAttachPipeline(const std::string& path, diskarbitrator::MountMode mode, const std::string& password, AttachProgressCallback onProgress) {
   std::vector<std::string> args;
   std::string stdinData;
 
   args.push_back("-plist");
   args.push_back("-noverify");
+  args.push_back("-puppetstrings");
 
-  if(isImageEncrypted(path) && password == "") {
+  // Most images can be figured out from a few bytes, only ask hdiutil about
+  // what the sniffer couldn't tell
+  ImageInfo info = sniffImage(path);
+  bool encrypted = info.encryptionKnown ? info.encrypted : isImageEncrypted(path);
+  if(encrypted && password == "") {
     throw std::runtime_error("Image is encrypted and a password was not provided");
   }
 
@@ -331,7 +176,7 @@ std::vector<std::string> attachDisk(const std::string& path, diskarbitrator::Mou
     args.push_back("-stdinpass");
   }
 	
-  if(imageHasSLA(path, password)) {
+  if(info.slaKnown ? info.hasSLA : imageHasSLA(path, password)) {
     // hdiutil prompts the user with a (Y/n) dialog if the image has a SLA
     stdinData += "Y\n";
   }
@@ -342,18 +187,141 @@ std::vector<std::string> attachDisk(const std::string& path, diskarbitrator::Mou
     args.push_back("-readonly");
   }
 
-  CommandOutput output = runHdiutil("attach", path, args, stdinData);
+  CommandOptions options;
+  options.timeoutSecs = ATTACH_INACTIVITY_TIMEOUT_SECS;
+  options.inactivityTimeout = true;
+  // PERCENT and MESSAGE come in separate lines, keep the last of each so every
+  // update carries both
+  AttachProgress progress;
+  progress.percent = -1;
+  options.onStdoutLine = [&progress, &onProgress](const std::string& line) {
+    if(parsePuppetString(line, progress) && onProgress) {
+      onProgress(progress);
+    }
+  };
+
+  CommandOutput output = runHdiutil("attach", path, args, stdinData, options);
   if(output.retCode) {
     throw std::runtime_error("hdiutil returned: " + std::to_string(output.retCode) + ". Error: " + output.stderr);
   }
 
   std::vector<std::string> disks;
-	std::unique_ptr<Plist> pl = std::unique_ptr<Plist>(new Plist(output.stdout));
-  
-  for(unsigned int i = 0; i < (*pl)["system-entities"].size(); ++i) {
-    const std::string devEntry = (*pl)["system-entities"][i]["dev-entry"].get<std::string>();
-    disks.push_back(devEntry);
+  Plist pl(stripPuppetStrings(output.stdout));
+
+  PlistQueryResult devEntries = pl.query(devEntriesPath);
+  if(!devEntries.ok) {
+    throw std::runtime_error("Unexpected hdiutil attach output: " + devEntries.error);
+  }
+  for(const auto& node : devEntries.nodes) {
+    disks.push_back(node->get<std::string>());
   }
 
   return std::move(disks);
-}
\ No newline at end of file
+}
+
+// Single-flight for attaches. When a request comes in for an image that's
+// already being attached, it waits for the running hdiutil pipeline and gets
+// the same result instead of starting another one (which could end up with
+// the image attached twice). Images are identified by device and inode, so
+// different paths to the same file are coalesced too.
+static std::mutex inFlightMutex;
+static std::map<std::string, std::shared_future<std::vector<std::string>>> inFlightAttaches;
+static std::atomic<uint64_t> coalescedAttaches(0);
+
+uint64_t coalescedAttachCount() {
+  return coalescedAttaches.load();
+}
+
+std::vector<std::string> attachDisk(const std::string& path, diskarbitrator::MountMode mode, const std::string& password, AttachProgressCallback onProgress) {
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0) {
+    throw std::runtime_error("Unable to access image " + path + ": " + std::string(strerror(errno)));
+  }
+  char canonicalPath[PATH_MAX];
+  if(realpath(path.c_str(), canonicalPath) == NULL) {
+    throw std::runtime_error("Unable to resolve image path " + path + ": " + std::string(strerror(errno)));
+  }
+
+  // Requests with a different mode or password would get a different outcome,
+  // so they aren't the same operation
+  const std::string key = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" + std::to_string(mode) + ":" + password;
+
+  std::unique_lock<std::mutex> lock(inFlightMutex);
+  auto it = inFlightAttaches.find(key);
+  if(it != inFlightAttaches.end()) {
+    std::shared_future<std::vector<std::string>> inFlight = it->second;
+    lock.unlock();
+    LOG(INFO) << "Attach for image " << canonicalPath << " already in flight, waiting for it (" << ++coalescedAttaches << " coalesced so far)";
+    if(onProgress) {
+      // Progress goes to whoever started the attach, just let this one know
+      AttachProgress progress;
+      progress.percent = -1;
+      progress.message = "Waiting for an attach of the same image already in progress";
+      onProgress(progress);
+    }
+    return inFlight.get();
+  }
+  std::promise<std::vector<std::string>> promise;
+  inFlightAttaches[key] = promise.get_future().share();
+  lock.unlock();
+
+  std::vector<std::string> disks;
+  try {
+    disks = runAttachPipeline(canonicalPath, mode, password, onProgress);
+  } catch(...) {
+    lock.lock();
+    inFlightAttaches.erase(key);
+    lock.unlock();
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+
+  lock.lock();
+  inFlightAttaches.erase(key);
+  lock.unlock();
+  promise.set_value(disks);
+
+  return disks;
+}
+
+// Attaches every image in `paths`, running up to `parallelism` hdiutil
+// pipelines at the same time. Each worker picks the next image not taken yet,
+// so a slow image doesn't hold back the rest of the batch. `onResult` is called
+// once per image as soon as it finishes, never from two threads at once.
+void attachDisks(const std::vector<std::string>& paths, diskarbitrator::MountMode mode, unsigned int parallelism, std::function<void(const AttachResult&)> onResult) {
+  if(parallelism == 0) {
+    parallelism = DEFAULT_ATTACH_PARALLELISM;
+  }
+  parallelism = std::min<unsigned int>(parallelism, MAX_ATTACH_PARALLELISM);
+  parallelism = std::min<unsigned int>(parallelism, paths.size());
+
+  std::atomic<size_t> nextImage(0);
+  std::mutex resultMutex;
+
+  auto worker = [&]() {
+    size_t i;
+    while((i = nextImage++) < paths.size()) {
+      AttachResult result;
+      result.image = paths[i];
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      try {
+        result.disks = attachDisk(paths[i], mode);
+      } catch(const std::exception& e) {
+        result.error = e.what();
+      }
+      result.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+      const std::lock_guard<std::mutex> lock(resultMutex);
+      onResult(result);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for(unsigned int i = 0; i < parallelism; ++i) {
+    workers.emplace_back(worker);
+  }
+  for(auto& t : workers) {
+    t.join();
+  }
+}
@@ -21,9 +21,45 @@
 #ifndef HDIUTIL_HPP_
 #define HDIUTIL_HPP_
 
+#include <functional>
+
 #include "diskarbitrator.grpc.pb.h"
 
+#define DEFAULT_HDIUTIL_PATH "/usr/bin/hdiutil"
+
+// Concurrent hdiutil pipelines for attachDisks when the caller doesn't say
+#define DEFAULT_ATTACH_PARALLELISM 4
+#define MAX_ATTACH_PARALLELISM 16
+
+typedef struct AttachResult {
+  std::string image;
+  std::vector<std::string> disks;
+  // Empty if the attach succeeded
+  std::string error;
+  uint64_t durationMs;
+} AttachResult;
+
+typedef struct AttachProgress {
+  // -1 while hdiutil can't tell how far along it is
+  double percent;
+  std::string message;
+} AttachProgress;
+
+typedef std::function<void(const AttachProgress&)> AttachProgressCallback;
+
+// Overrides the hdiutil binary used. Call before serving any request
+void setHdiutilPath(const std::string& path);
+
 // Attaches a disk image, returns the BSD disk names from the attach operation.
-std::vector<std::string> attachDisk(const std::string& path, diskarbitrator::MountMode mode, const std::string& password = "");
+// Concurrent calls for the same image share a single hdiutil run. If set,
+// `onProgress` is called from another thread as hdiutil reports progress.
+std::vector<std::string> attachDisk(const std::string& path, diskarbitrator::MountMode mode, const std::string& password = "", AttachProgressCallback onProgress = nullptr);
+
+// Number of attach requests that were served by an attach already in flight
+uint64_t coalescedAttachCount();
+
+// Attaches several disk images concurrently. Failing images don't stop the
+// batch, their error is reported in the result instead.
+void attachDisks(const std::vector<std::string>& paths, diskarbitrator::MountMode mode, unsigned int parallelism, std::function<void(const AttachResult&)> onResult);
 
 #endif
\ No newline at end of file
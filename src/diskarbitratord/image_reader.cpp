@@ -0,0 +1,348 @@
+/***************************************************************************
+ *   image_reader.cpp  --  This file is part of diskarbitratord.           *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <sys/disk.h>
+#elif defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include "block_cache.hpp"
+#include "container.hpp"
+#include "ewf.hpp"
+#include "image_reader.hpp"
+#include "image_sniffer.hpp"
+#include "udif.hpp"
+
+bool readExact(ImageReader& reader, uint64_t offset, void* buffer, size_t len) {
+  return offset <= reader.size() && len <= reader.size() - offset && reader.read(offset, buffer, len) == len;
+}
+
+std::string resolveDevicePath(const std::string& disk) {
+  if(disk.find('/') != std::string::npos) {
+    return disk;
+  }
+#ifdef __APPLE__
+  return "/dev/r" + disk;
+#else
+  return "/dev/" + disk;
+#endif
+}
+
+size_t preadFully(int fd, void* buffer, size_t len, uint64_t offset) {
+  size_t total = 0;
+  while(total < len) {
+    ssize_t bytesRead = pread(fd, static_cast<uint8_t*>(buffer) + total, len - total, offset + total);
+    if(bytesRead < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Read error at offset " + std::to_string(offset + total) + ": " + std::string(strerror(errno)));
+    }
+    if(bytesRead == 0) {
+      break;
+    }
+    total += bytesRead;
+  }
+  return total;
+}
+
+void pwriteFully(int fd, const void* buffer, size_t len, uint64_t offset) {
+  size_t total = 0;
+  while(total < len) {
+    ssize_t written = pwrite(fd, static_cast<const uint8_t*>(buffer) + total, len - total, offset + total);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Write error at offset " + std::to_string(offset + total) + ": " + std::string(strerror(errno)));
+    }
+    total += written;
+  }
+}
+
+uint64_t fileOrDeviceSize(int fd) {
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    throw std::runtime_error("Unable to stat: " + std::string(strerror(errno)));
+  }
+  if(!S_ISBLK(st.st_mode) && !S_ISCHR(st.st_mode)) {
+    return st.st_size;
+  }
+
+  // Devices report a size of 0, ask the driver instead
+#ifdef __APPLE__
+  uint64_t blockCount;
+  uint32_t blockSize;
+  if(ioctl(fd, DKIOCGETBLOCKCOUNT, &blockCount) != 0 || ioctl(fd, DKIOCGETBLOCKSIZE, &blockSize) != 0) {
+    throw std::runtime_error("Unable to get device size: " + std::string(strerror(errno)));
+  }
+  return blockCount * blockSize;
+#elif defined(__linux__)
+  uint64_t deviceSize;
+  if(ioctl(fd, BLKGETSIZE64, &deviceSize) != 0) {
+    throw std::runtime_error("Unable to get device size: " + std::string(strerror(errno)));
+  }
+  return deviceSize;
+#else
+  off_t end = lseek(fd, 0, SEEK_END);
+  if(end < 0) {
+    throw std::runtime_error("Unable to get device size: " + std::string(strerror(errno)));
+  }
+  return end;
+#endif
+}
+
+uint32_t deviceSectorSize(int fd) {
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (!S_ISBLK(st.st_mode) && !S_ISCHR(st.st_mode))) {
+    return 512;
+  }
+#ifdef __APPLE__
+  uint32_t blockSize;
+  if(ioctl(fd, DKIOCGETBLOCKSIZE, &blockSize) == 0 && blockSize) {
+    return blockSize;
+  }
+#elif defined(__linux__)
+  int blockSize;
+  if(ioctl(fd, BLKSSZGET, &blockSize) == 0 && blockSize > 0) {
+    return blockSize;
+  }
+#endif
+  return 512;
+}
+
+// Raw (character) devices only take whole sectors. Block devices and files
+// take anything
+static uint32_t readAlignment(int fd) {
+  struct stat st;
+  if(fstat(fd, &st) != 0 || !S_ISCHR(st.st_mode)) {
+    return 1;
+  }
+  return deviceSectorSize(fd);
+}
+
+FileImageReader::FileImageReader(const std::string& path) {
+  this->fd = open(path.c_str(), O_RDONLY);
+  if(this->fd == -1) {
+    throw std::runtime_error("Unable to open " + path + ": " + std::string(strerror(errno)));
+  }
+  try {
+    this->fileSize = fileOrDeviceSize(this->fd);
+    this->alignment = readAlignment(this->fd);
+  } catch(...) {
+    close(this->fd);
+    throw;
+  }
+}
+
+FileImageReader::~FileImageReader() {
+  close(this->fd);
+}
+
+uint64_t FileImageReader::size() const {
+  return this->fileSize;
+}
+
+size_t FileImageReader::read(uint64_t offset, void* buffer, size_t len) {
+  if(offset >= this->fileSize) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, this->fileSize - offset);
+  if(offset % this->alignment == 0 && len % this->alignment == 0) {
+    return preadFully(this->fd, buffer, len, offset);
+  }
+
+  // Go through a bounce buffer covering whole sectors. Metadata reads are
+  // the only unaligned ones, and those are small
+  uint64_t start = offset - offset % this->alignment;
+  uint64_t end = std::min<uint64_t>((offset + len + this->alignment - 1) / this->alignment * this->alignment, this->fileSize);
+  std::vector<uint8_t> bounce(end - start);
+  size_t bytesRead = preadFully(this->fd, bounce.data(), bounce.size(), start);
+  if(bytesRead <= offset - start) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, bytesRead - (offset - start));
+  memcpy(buffer, bounce.data() + (offset - start), len);
+  return len;
+}
+
+// Next segment name, or an empty string after the last possible one
+static std::string nextSegmentPath(const std::string& path) {
+  size_t dot = path.rfind('.');
+  if(dot == std::string::npos || dot + 1 == path.size() || path.find('/', dot) != std::string::npos) {
+    return "";
+  }
+  std::string ext = path.substr(dot + 1);
+  bool numeric = std::all_of(ext.begin(), ext.end(), ::isdigit);
+  bool encase = ext.size() == 3 && isalpha(static_cast<unsigned char>(ext[0])) && isalnum(static_cast<unsigned char>(ext[1])) && isalnum(static_cast<unsigned char>(ext[2]));
+  if(!numeric && !encase) {
+    return "";
+  }
+
+  if(encase && ext.substr(1) == "99") {
+    // E99 is followed by EAA
+    char a = isupper(static_cast<unsigned char>(ext[0])) ? 'A' : 'a';
+    return path.substr(0, dot + 1) + ext[0] + a + a;
+  }
+  // Count up from the right, carrying over. Digits and letters each wrap
+  // within their own range
+  for(size_t i = ext.size(); i-- > 0;) {
+    char& c = ext[i];
+    if(isdigit(static_cast<unsigned char>(c))) {
+      if(c != '9') {
+        ++c;
+        return path.substr(0, dot + 1) + ext;
+      }
+      c = '0';
+    } else {
+      if(c != 'z' && c != 'Z') {
+        ++c;
+        return path.substr(0, dot + 1) + ext;
+      }
+      c -= 25;
+    }
+  }
+  return "";
+}
+
+std::vector<std::string> segmentPaths(const std::string& first) {
+  std::vector<std::string> paths = {first};
+  struct stat st;
+  for(std::string next = nextSegmentPath(first); next.size() && stat(next.c_str(), &st) == 0; next = nextSegmentPath(next)) {
+    paths.push_back(next);
+  }
+  return paths;
+}
+
+SplitRawReader::SplitRawReader(const std::string& path) {
+  uint64_t total = 0;
+  try {
+    for(const auto& segment : segmentPaths(path)) {
+      int fd = open(segment.c_str(), O_RDONLY);
+      if(fd == -1) {
+        throw std::runtime_error("Unable to open " + segment + ": " + std::string(strerror(errno)));
+      }
+      this->fds.push_back(fd);
+      this->starts.push_back(total);
+      total += fileOrDeviceSize(fd);
+    }
+  } catch(...) {
+    for(int fd : this->fds) {
+      close(fd);
+    }
+    throw;
+  }
+  this->starts.push_back(total);
+}
+
+SplitRawReader::~SplitRawReader() {
+  for(int fd : this->fds) {
+    close(fd);
+  }
+}
+
+uint64_t SplitRawReader::size() const {
+  return this->starts.back();
+}
+
+size_t SplitRawReader::read(uint64_t offset, void* buffer, size_t len) {
+  if(offset >= this->size()) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, this->size() - offset);
+  // Last segment starting at or before `offset`
+  size_t segment = std::upper_bound(this->starts.begin(), this->starts.end() - 1, offset) - this->starts.begin() - 1;
+  size_t total = 0;
+  while(total < len && segment < this->fds.size()) {
+    uint64_t segmentOffset = offset + total - this->starts[segment];
+    size_t chunk = std::min<uint64_t>(len - total, this->starts[segment + 1] - this->starts[segment] - segmentOffset);
+    size_t bytesRead = preadFully(this->fds[segment], static_cast<uint8_t*>(buffer) + total, chunk, segmentOffset);
+    total += bytesRead;
+    if(bytesRead < chunk) {
+      // The segment shrank under us
+      break;
+    }
+    ++segment;
+  }
+  return total;
+}
+
+SliceImageReader::SliceImageReader(ImageReader& parent, uint64_t offset, uint64_t length) : parent(parent), offset(offset), length(length) {
+  // Partition tables can point past the end of a truncated image
+  if(offset >= parent.size()) {
+    this->length = 0;
+  } else if(length > parent.size() - offset) {
+    this->length = parent.size() - offset;
+  }
+}
+
+uint64_t SliceImageReader::size() const {
+  return this->length;
+}
+
+size_t SliceImageReader::read(uint64_t offset, void* buffer, size_t len) {
+  if(offset >= this->length) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, this->length - offset);
+  return this->parent.read(this->offset + offset, buffer, len);
+}
+
+std::unique_ptr<ImageReader> openImageReader(const std::string& path) {
+  ImageInfo info = sniffImage(path);
+  switch(info.format) {
+    case IMAGE_FORMAT_UDIF:
+      return std::unique_ptr<ImageReader>(new UDIFReader(path));
+    case IMAGE_FORMAT_EWF:
+      return std::unique_ptr<ImageReader>(new EWFReader(path));
+    case IMAGE_FORMAT_SPLIT_RAW:
+      return std::unique_ptr<ImageReader>(new SplitRawReader(path));
+    case IMAGE_FORMAT_CONTAINER:
+      return std::unique_ptr<ImageReader>(new ContainerReader(path));
+    case IMAGE_FORMAT_ENCRYPTED:
+    case IMAGE_FORMAT_SPARSEIMAGE:
+    case IMAGE_FORMAT_SPARSEBUNDLE:
+      throw std::runtime_error(imageFormatName(info.format) + " images can't be read natively, attach them instead");
+    default: {
+      // Raw images, devices, or anything we don't recognise. Worst case
+      // scenario, whoever reads it finds garbage
+      std::shared_ptr<BlockCache> cache = sharedBlockCache();
+      if(cache) {
+        return cache->open(path);
+      }
+      return std::unique_ptr<ImageReader>(new FileImageReader(path));
+    }
+  }
+}
@@ -0,0 +1,133 @@
+/***************************************************************************
+ *   image_reader.hpp  --  This file is part of diskarbitratord.           *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef IMAGE_READER_HPP_
+#define IMAGE_READER_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Random access to the virtual disk inside an image (or a plain device), no
+// matter how it's stored. This is what lets us inspect evidence without having
+// hdiutil attach it first.
+class ImageReader {
+  public:
+    virtual ~ImageReader() {}
+
+    // Size of the virtual disk in bytes
+    virtual uint64_t size() const = 0;
+
+    // Reads up to `len` bytes at `offset` of the virtual disk. Only returns less
+    // than `len` at the end of the disk. Throws on I/O or format errors. Safe to
+    // call from several threads at once.
+    virtual size_t read(uint64_t offset, void* buffer, size_t len) = 0;
+};
+
+// Raw images and block devices, read as they are
+class FileImageReader : public ImageReader {
+  public:
+    FileImageReader(const std::string& path);
+    ~FileImageReader();
+    uint64_t size() const override;
+    size_t read(uint64_t offset, void* buffer, size_t len) override;
+
+    // Descriptor the disk can be read from as it is, for sendfile(2) and the
+    // like. -1 when reads have to go through the bounce buffer
+    int descriptor() const {
+      return this->alignment > 1 ? -1 : this->fd;
+    }
+
+  private:
+    int fd;
+    uint64_t fileSize;
+    // Reads not multiple of this in offset and length need a bounce buffer
+    uint32_t alignment;
+};
+
+// Split raw sets (image.001, image.002...), read as one disk. Segments can be
+// of any size, the one holding an offset is found by binary search
+class SplitRawReader : public ImageReader {
+  public:
+    // `path` is the first segment, the rest are found next to it
+    SplitRawReader(const std::string& path);
+    ~SplitRawReader();
+    uint64_t size() const override;
+    size_t read(uint64_t offset, void* buffer, size_t len) override;
+
+    size_t segmentCount() const {
+      return this->fds.size();
+    }
+
+  private:
+    std::vector<int> fds;
+    // Where each segment starts in the disk, plus the total size at the end
+    std::vector<uint64_t> starts;
+};
+
+// A byte range of another reader, such as a partition. The parent has to
+// outlive it
+class SliceImageReader : public ImageReader {
+  public:
+    SliceImageReader(ImageReader& parent, uint64_t offset, uint64_t length);
+    uint64_t size() const override;
+    size_t read(uint64_t offset, void* buffer, size_t len) override;
+
+  private:
+    ImageReader& parent;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Opens the right reader for whatever is at `path`. Throws for formats that
+// can't be read natively (encrypted images, sparse images and bundles). Raw
+// images and devices go through the shared block cache, if there's one.
+std::unique_ptr<ImageReader> openImageReader(const std::string& path);
+
+// Every file of a segmented image set that exists, starting with `first`.
+// Numeric extensions count up (image.001, image.002...) and EnCase ones go
+// from E01 to E99 and then EAA, EAB... ZZZ
+std::vector<std::string> segmentPaths(const std::string& first);
+
+// Reads exactly `len` bytes at `offset`. Returns false if the disk ends
+// before that
+bool readExact(ImageReader& reader, uint64_t offset, void* buffer, size_t len);
+
+// Paths are returned as they are, BSD names (disk2s1) become their raw device
+// node, which skips the buffer cache and reads much faster
+std::string resolveDevicePath(const std::string& disk);
+
+// pread(2) that doesn't give up on short reads. Returns less than `len` only
+// at EOF.
+size_t preadFully(int fd, void* buffer, size_t len, uint64_t offset);
+
+// pwrite(2) that doesn't give up on short writes. Throws on errors
+void pwriteFully(int fd, const void* buffer, size_t len, uint64_t offset);
+
+// Size of a regular file or block device
+uint64_t fileOrDeviceSize(int fd);
+
+// Logical sector size of a device, 512 for anything else
+uint32_t deviceSectorSize(int fd);
+
+#endif
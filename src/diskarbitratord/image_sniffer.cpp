@@ -0,0 +1,327 @@
+/***************************************************************************
+ *   image_sniffer.cpp  --  This file is part of diskarbitratord.          *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "container.hpp"
+#include "ewf.hpp"
+#include "image_reader.hpp"
+#include "image_sniffer.hpp"
+#include "scope_guard.hpp"
+#include "udif.hpp"
+
+#define SECTOR_SIZE 512
+#define ENCRYPTED_V2_MAGIC "encrcdsa"
+#define ENCRYPTED_V1_MAGIC "cdsaencr"
+#define SPARSEIMAGE_MAGIC "sprs"
+#define GPT_MAGIC "EFI PART"
+#define ISO9660_MAGIC "CD001"
+#define ISO9660_MAGIC_OFFSET 32769
+// The XML plist in a UDIF image is read in chunks of this size
+#define XML_CHUNK_SIZE 65536
+
+// Reads exactly `len` bytes at `offset`. Returns false on a short read, which
+// for sniffing just means the image is too small to have that structure.
+static bool readAt(int fd, uint64_t offset, void* buffer, size_t len) {
+  size_t total = 0;
+  while(total < len) {
+    ssize_t bytesRead = pread(fd, static_cast<uint8_t*>(buffer) + total, len - total, offset + total);
+    if(bytesRead < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Unable to read image: " + std::string(strerror(errno)));
+    }
+    if(bytesRead == 0) {
+      return false;
+    }
+    total += bytesRead;
+  }
+  return true;
+}
+
+// image.001, or image.000 for the tools that count from zero, followed by an
+// image.002 or image.001. A lone .001 is just a file with a funny name.
+static bool isFirstSplitSegment(const std::string& path) {
+  size_t dot = path.rfind('.');
+  if(dot == std::string::npos || dot + 1 == path.size() || path.find('/', dot) != std::string::npos) {
+    return false;
+  }
+  const std::string ext = path.substr(dot + 1);
+  if(!std::all_of(ext.begin(), ext.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+    return false;
+  }
+  // Compared as a string, a long enough extension doesn't fit any integer
+  const std::string number = ext.substr(std::min(ext.find_first_not_of('0'), ext.size()));
+  if(number.size() && number != "1") {
+    return false;
+  }
+  return segmentPaths(path).size() > 1;
+}
+
+static ImageInfo unknownImage() {
+  ImageInfo info;
+  info.format = IMAGE_FORMAT_UNKNOWN;
+  info.encrypted = false;
+  info.encryptionKnown = false;
+  info.hasSLA = false;
+  info.slaKnown = false;
+  info.size = 0;
+  info.sizeKnown = false;
+  return info;
+}
+
+// A SLA lives in the LPic resource. Plist dictionaries are written with their
+// keys sorted, and "LPic" sorts before "blkx" (which every UDIF image has), so
+// we can stop reading as soon as we see either of them.
+static void sniffUDIFSLA(int fd, uint64_t xmlOffset, uint64_t xmlLength, ImageInfo& info) {
+  static const std::string slaKey = "<key>LPic</key>";
+  static const std::string blkxKey = "<key>blkx</key>";
+
+  std::string xml;
+  uint64_t position = 0;
+  while(position < xmlLength) {
+    size_t chunk = static_cast<size_t>(std::min<uint64_t>(XML_CHUNK_SIZE, xmlLength - position));
+    size_t previousSize = xml.size();
+    xml.resize(previousSize + chunk);
+    if(!readAt(fd, xmlOffset + position, &xml[previousSize], chunk)) {
+      return;
+    }
+    position += chunk;
+
+    // Only look at what's new, plus enough overlap for a key split in two
+    size_t searchFrom = previousSize > slaKey.size() ? previousSize - slaKey.size() : 0;
+    if(xml.find(slaKey, searchFrom) != std::string::npos) {
+      info.hasSLA = true;
+      info.slaKnown = true;
+      return;
+    }
+    if(xml.find(blkxKey, searchFrom) != std::string::npos) {
+      info.hasSLA = false;
+      info.slaKnown = true;
+      return;
+    }
+  }
+}
+
+// Sparse bundles are directories. Their Info.plist is tiny and always written
+// by hdiutil the same way, so a string search is enough to get the size.
+// Encrypted bundles have a "token" file with the encryption header.
+static ImageInfo sniffSparseBundle(const std::string& path) {
+  ImageInfo info = unknownImage();
+
+  int fd = open((path + "/Info.plist").c_str(), O_RDONLY);
+  if(fd == -1) {
+    return info;
+  }
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+
+  char buffer[4096];
+  ssize_t bytesRead = pread(fd, buffer, sizeof(buffer), 0);
+  if(bytesRead <= 0) {
+    return info;
+  }
+  const std::string plist(buffer, bytesRead);
+  if(plist.find("diskimage-bundle-type") == std::string::npos) {
+    return info;
+  }
+  info.format = IMAGE_FORMAT_SPARSEBUNDLE;
+  // Only UDIF images can carry a SLA
+  info.hasSLA = false;
+  info.slaKnown = true;
+
+  size_t key = plist.find("<key>size</key>");
+  if(key != std::string::npos) {
+    size_t value = plist.find("<integer>", key);
+    if(value != std::string::npos) {
+      try {
+        info.size = std::stoull(plist.substr(value + strlen("<integer>")));
+        info.sizeKnown = true;
+      } catch(const std::exception& e) {
+        // Leave it unknown
+      }
+    }
+  }
+
+  info.encrypted = false;
+  info.encryptionKnown = true;
+  int tokenFd = open((path + "/token").c_str(), O_RDONLY);
+  if(tokenFd != -1) {
+    char magic[8];
+    info.encrypted = pread(tokenFd, magic, sizeof(magic), 0) == sizeof(magic) && !memcmp(magic, ENCRYPTED_V2_MAGIC, sizeof(magic));
+    close(tokenFd);
+  }
+
+  return info;
+}
+
+ImageInfo sniffImage(const std::string& path) {
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0) {
+    throw std::runtime_error("Unable to access image " + path + ": " + std::string(strerror(errno)));
+  }
+  if(S_ISDIR(st.st_mode)) {
+    return sniffSparseBundle(path);
+  }
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd == -1) {
+    throw std::runtime_error("Unable to open image " + path + ": " + std::string(strerror(errno)));
+  }
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+
+  ImageInfo info = unknownImage();
+  // Block devices have a st_size of 0
+  const uint64_t fileSize = fileOrDeviceSize(fd);
+
+  // Containers of mostly empty disks can be smaller than this, whatever isn't
+  // there reads as zeroes
+  uint8_t header[SECTOR_SIZE * 2] = {};
+  if(preadFully(fd, header, sizeof(header), 0) < CONTAINER_MAGIC_SIZE) {
+    return info;
+  }
+
+  // Encrypted images wrap everything else, nothing more can be told without
+  // the passphrase
+  uint8_t trailer[UDIF_TRAILER_SIZE];
+  bool hasTrailer = fileSize >= UDIF_TRAILER_SIZE && readAt(fd, fileSize - UDIF_TRAILER_SIZE, trailer, sizeof(trailer));
+  if(!memcmp(header, ENCRYPTED_V2_MAGIC, strlen(ENCRYPTED_V2_MAGIC)) ||
+     (hasTrailer && !memcmp(trailer + UDIF_TRAILER_SIZE - strlen(ENCRYPTED_V1_MAGIC), ENCRYPTED_V1_MAGIC, strlen(ENCRYPTED_V1_MAGIC)))) {
+    info.format = IMAGE_FORMAT_ENCRYPTED;
+    info.encrypted = true;
+    info.encryptionKnown = true;
+    return info;
+  }
+
+  KolyTrailer koly;
+  if(hasTrailer && parseKolyTrailer(trailer, koly)) {
+    info.format = IMAGE_FORMAT_UDIF;
+    info.encrypted = false;
+    info.encryptionKnown = true;
+    info.size = koly.sectorCount * UDIF_SECTOR_SIZE;
+    info.sizeKnown = true;
+    if(koly.xmlLength && koly.xmlOffset + koly.xmlLength <= fileSize) {
+      sniffUDIFSLA(fd, koly.xmlOffset, koly.xmlLength, info);
+    }
+    return info;
+  }
+
+  // None of the formats below can be encrypted or carry a SLA
+  info.encrypted = false;
+  info.encryptionKnown = true;
+  info.hasSLA = false;
+  info.slaKnown = true;
+
+  if(!memcmp(header, SPARSEIMAGE_MAGIC, strlen(SPARSEIMAGE_MAGIC))) {
+    info.format = IMAGE_FORMAT_SPARSEIMAGE;
+    return info;
+  }
+
+  EWFVolume volume;
+  if(!memcmp(header, EWF_SIGNATURE, EWF_SIGNATURE_SIZE)) {
+    info.format = IMAGE_FORMAT_EWF;
+    if(findEWFVolume(fd, volume)) {
+      info.size = volume.sectorCount * volume.bytesPerSector;
+      info.sizeKnown = true;
+    }
+    return info;
+  }
+
+  if(!memcmp(header, CONTAINER_MAGIC, CONTAINER_MAGIC_SIZE)) {
+    info.format = IMAGE_FORMAT_CONTAINER;
+    info.sizeKnown = findContainerSize(fd, info.size);
+    return info;
+  }
+
+  // Split raw images are only recognised from their first segment, there's
+  // nothing in the data itself telling them apart from a short raw image
+  if(isFirstSplitSegment(path)) {
+    info.format = IMAGE_FORMAT_SPLIT_RAW;
+    info.size = 0;
+    for(const auto& segment : segmentPaths(path)) {
+      struct stat segmentStat;
+      if(stat(segment.c_str(), &segmentStat) != 0) {
+        throw std::runtime_error("Unable to access image segment " + segment + ": " + std::string(strerror(errno)));
+      }
+      info.size += segmentStat.st_size;
+    }
+    info.sizeKnown = true;
+    return info;
+  }
+
+  info.size = fileSize;
+  info.sizeKnown = true;
+  if(!memcmp(header + SECTOR_SIZE, GPT_MAGIC, strlen(GPT_MAGIC))) {
+    info.format = IMAGE_FORMAT_RAW_GPT;
+    return info;
+  }
+  if(header[510] == 0x55 && header[511] == 0xAA) {
+    info.format = IMAGE_FORMAT_RAW_MBR;
+    return info;
+  }
+  char isoMagic[5];
+  if(readAt(fd, ISO9660_MAGIC_OFFSET, isoMagic, sizeof(isoMagic)) && !memcmp(isoMagic, ISO9660_MAGIC, sizeof(isoMagic))) {
+    info.format = IMAGE_FORMAT_ISO9660;
+    return info;
+  }
+
+  return unknownImage();
+}
+
+const std::string imageFormatName(ImageFormat format) {
+  switch(format) {
+    case IMAGE_FORMAT_UDIF:
+      return "UDIF";
+    case IMAGE_FORMAT_ENCRYPTED:
+      return "Encrypted";
+    case IMAGE_FORMAT_SPARSEIMAGE:
+      return "Sparse image";
+    case IMAGE_FORMAT_SPARSEBUNDLE:
+      return "Sparse bundle";
+    case IMAGE_FORMAT_RAW_MBR:
+      return "Raw (MBR)";
+    case IMAGE_FORMAT_RAW_GPT:
+      return "Raw (GPT)";
+    case IMAGE_FORMAT_ISO9660:
+      return "ISO 9660";
+    case IMAGE_FORMAT_EWF:
+      return "EWF";
+    case IMAGE_FORMAT_SPLIT_RAW:
+      return "Split raw";
+    case IMAGE_FORMAT_CONTAINER:
+      return "Evidence container";
+    case IMAGE_FORMAT_UNKNOWN:
+      break;
+  }
+  return "Unknown";
+}
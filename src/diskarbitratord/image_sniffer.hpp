@@ -0,0 +1,66 @@
+/***************************************************************************
+ *   image_sniffer.hpp  --  This file is part of diskarbitratord.          *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef IMAGE_SNIFFER_HPP_
+#define IMAGE_SNIFFER_HPP_
+
+#include <cstdint>
+#include <string>
+
+// Native disk image sniffer. Answers the questions we used to spawn hdiutil
+// for (is it encrypted? does it have a SLA?) by reading a few header and
+// trailer bytes. Doesn't depend on any macOS framework.
+
+enum ImageFormat {
+  IMAGE_FORMAT_UNKNOWN,
+  IMAGE_FORMAT_UDIF,          // Regular .dmg, with a koly trailer
+  IMAGE_FORMAT_ENCRYPTED,     // encrcdsa/cdsaencr wrapper around any other format
+  IMAGE_FORMAT_SPARSEIMAGE,
+  IMAGE_FORMAT_SPARSEBUNDLE,
+  IMAGE_FORMAT_RAW_MBR,
+  IMAGE_FORMAT_RAW_GPT,
+  IMAGE_FORMAT_ISO9660,
+  IMAGE_FORMAT_EWF,           // EnCase .E01, possibly split in .E02, .E03...
+  IMAGE_FORMAT_SPLIT_RAW,     // Raw image split in .001, .002...
+  IMAGE_FORMAT_CONTAINER      // Our own compressed evidence container
+};
+
+// Every answer comes with a flag saying whether the sniffer could tell. When
+// it can't, the caller should ask hdiutil instead.
+typedef struct ImageInfo {
+  ImageFormat format;
+  bool encrypted;
+  bool encryptionKnown;
+  bool hasSLA;
+  bool slaKnown;
+  // Size of the virtual disk in bytes, not of the image file
+  uint64_t size;
+  bool sizeKnown;
+} ImageInfo;
+
+// Throws if the image can't be opened or read. An unrecognised image is not an
+// error, it just comes back as IMAGE_FORMAT_UNKNOWN with nothing known.
+ImageInfo sniffImage(const std::string& path);
+
+const std::string imageFormatName(ImageFormat format);
+
+#endif
@@ -0,0 +1,286 @@
+/***************************************************************************
+ *   io_scheduler.cpp  --  This file is part of diskarbitratord.           *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <sys/resource.h>
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "io_scheduler.hpp"
+
+#ifdef __linux__
+// glibc has no wrappers for these, nor the constants
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_VALUE(ioClass, level) (((ioClass) << IOPRIO_CLASS_SHIFT) | (level))
+#endif
+
+static std::mutex sharedSchedulerMutex;
+static std::shared_ptr<IOScheduler> sharedScheduler;
+
+void setSharedIOScheduler(std::shared_ptr<IOScheduler> scheduler) {
+  const std::lock_guard<std::mutex> lock(sharedSchedulerMutex);
+  sharedScheduler = scheduler;
+}
+
+std::shared_ptr<IOScheduler> sharedIOScheduler() {
+  const std::lock_guard<std::mutex> lock(sharedSchedulerMutex);
+  return sharedScheduler;
+}
+
+std::string ioDeviceKey(const std::string& path) {
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0) {
+    throw std::runtime_error("Unable to access " + path + ": " + std::string(strerror(errno)));
+  }
+  if(S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+    return "device:" + std::to_string(st.st_rdev);
+  }
+  return "filesystem:" + std::to_string(st.st_dev);
+}
+
+IOScheduler::Job::~Job() {
+  this->scheduler.leave(this->state);
+}
+
+void IOScheduler::Job::acquire(uint64_t bytes) {
+  this->scheduler.acquire(this->state, bytes);
+}
+
+uint64_t IOScheduler::Job::bytes() const {
+  const std::lock_guard<std::mutex> lock(this->scheduler.mutex);
+  return this->state.bytes;
+}
+
+std::unique_ptr<IOScheduler::Job> IOScheduler::join(const std::string& device, const std::string& bus, IOClass ioClass, unsigned int weight) {
+  std::unique_ptr<Job> job(new Job(*this));
+  const Clock::time_point now = Clock::now();
+  job->state = {device, bus, ioClass, std::max(1U, std::min<unsigned int>(weight, IO_MAX_WEIGHT)), 0, false, 0, now, now - std::chrono::hours(1)};
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    this->jobs.insert(&job->state);
+  }
+  // Bulk jobs may have to make way for this one
+  this->changed.notify_all();
+  return job;
+}
+
+void IOScheduler::leave(JobState& job) {
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    this->jobs.erase(&job);
+  }
+  this->changed.notify_all();
+}
+
+void IOScheduler::setLimit(std::map<std::string, Bucket>& buckets, const std::string& key, uint64_t bytesPerSecond, bool ownLimit) {
+  Bucket& bucket = buckets[key];
+  bucket.rate = bytesPerSecond;
+  bucket.tokens = bytesPerSecond * IO_SCHEDULER_BURST_MS / 1000.0;
+  bucket.ownLimit = ownLimit;
+  bucket.updated = Clock::now();
+}
+
+void IOScheduler::setDeviceLimit(const std::string& device, uint64_t bytesPerSecond) {
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    this->setLimit(this->devices, device, bytesPerSecond, true);
+  }
+  this->changed.notify_all();
+}
+
+void IOScheduler::setBusLimit(const std::string& bus, uint64_t bytesPerSecond) {
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    this->setLimit(this->buses, bus, bytesPerSecond, true);
+  }
+  this->changed.notify_all();
+}
+
+void IOScheduler::setDefaultLimits(uint64_t deviceBytesPerSecond, uint64_t busBytesPerSecond) {
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    this->defaultDeviceRate = deviceBytesPerSecond;
+    this->defaultBusRate = busBytesPerSecond;
+    for(auto& it : this->devices) {
+      if(!it.second.ownLimit) {
+        this->setLimit(this->devices, it.first, deviceBytesPerSecond, false);
+      }
+    }
+    for(auto& it : this->buses) {
+      if(!it.second.ownLimit) {
+        this->setLimit(this->buses, it.first, busBytesPerSecond, false);
+      }
+    }
+  }
+  this->changed.notify_all();
+}
+
+// Refilled as it's looked at, null if there's no limit
+IOScheduler::Bucket* IOScheduler::bucket(std::map<std::string, Bucket>& buckets, const std::string& key, uint64_t defaultRate) {
+  if(key.empty()) {
+    return nullptr;
+  }
+  auto it = buckets.find(key);
+  if(it == buckets.end()) {
+    this->setLimit(buckets, key, defaultRate, false);
+    it = buckets.find(key);
+  }
+  Bucket& bucket = it->second;
+  if(!bucket.rate) {
+    return nullptr;
+  }
+  const Clock::time_point now = Clock::now();
+  bucket.tokens = std::min(bucket.rate * IO_SCHEDULER_BURST_MS / 1000.0, bucket.tokens + bucket.rate * std::chrono::duration<double>(now - bucket.updated).count());
+  bucket.updated = now;
+  return &bucket;
+}
+
+bool IOScheduler::active(const JobState& job, Clock::time_point now) const {
+  return job.waiting || now - job.lastRequest < std::chrono::milliseconds(IO_SCHEDULER_ACTIVE_MS);
+}
+
+void IOScheduler::acquire(JobState& job, uint64_t bytes) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  auto shares = [&job](const JobState& other) {
+    return &other != &job && (other.device == job.device || (job.bus.size() && other.bus == job.bus));
+  };
+
+  if(job.ioClass != IO_CLASS_INTERACTIVE) {
+    Clock::time_point now = Clock::now();
+    // Coming back after a break doesn't earn any credit, or the job would
+    // have everyone else waiting until it caught up
+    if(!this->active(job, now)) {
+      for(const JobState* other : this->jobs) {
+        if(shares(*other) && other->ioClass == job.ioClass && this->active(*other, now)) {
+          job.virtualTime = std::max(job.virtualTime, other->virtualTime);
+        }
+      }
+    }
+    job.waiting = true;
+    while(true) {
+      now = Clock::now();
+      Clock::time_point wake = now + std::chrono::milliseconds(IO_SCHEDULER_ACTIVE_MS);
+      bool blocked = false;
+      for(const JobState* other : this->jobs) {
+        if(!shares(*other)) {
+          continue;
+        }
+        if(other->ioClass == IO_CLASS_INTERACTIVE) {
+          const Clock::time_point until = other->joined + std::chrono::milliseconds(IO_SCHEDULER_INTERACTIVE_MAX_MS);
+          if(now < until) {
+            blocked = true;
+            wake = std::min(wake, until);
+          }
+        } else if(job.ioClass == IO_CLASS_IDLE && other->ioClass == IO_CLASS_BULK) {
+          const Clock::time_point until = other->lastRequest + std::chrono::milliseconds(IO_SCHEDULER_IDLE_MS);
+          if(other->waiting || now < until) {
+            blocked = true;
+            wake = other->waiting ? wake : std::min(wake, until);
+          }
+        } else if(other->ioClass == job.ioClass && this->active(*other, now) && job.virtualTime > other->virtualTime + IO_SCHEDULER_QUANTUM) {
+          blocked = true;
+        }
+      }
+      for(Bucket* bucket : {this->bucket(this->devices, job.device, this->defaultDeviceRate), this->bucket(this->buses, job.bus, this->defaultBusRate)}) {
+        if(bucket && bucket->tokens < 0) {
+          blocked = true;
+          wake = std::min(wake, now + std::chrono::microseconds(static_cast<uint64_t>(-bucket->tokens / bucket->rate * 1000000) + 1));
+        }
+      }
+      if(!blocked) {
+        break;
+      }
+      this->changed.wait_until(lock, wake);
+    }
+    job.waiting = false;
+  }
+
+  // Interactive jobs never wait, but they still count against the limits, so
+  // they slow down everyone else instead. Anyone can run the buckets into
+  // debt, or reads bigger than a burst would never go through
+  for(Bucket* bucket : {this->bucket(this->devices, job.device, this->defaultDeviceRate), this->bucket(this->buses, job.bus, this->defaultBusRate)}) {
+    if(bucket) {
+      bucket->tokens -= bytes;
+    }
+  }
+  job.virtualTime += static_cast<double>(bytes) * IO_DEFAULT_WEIGHT / job.weight;
+  job.bytes += bytes;
+  job.lastRequest = Clock::now();
+  lock.unlock();
+  this->changed.notify_all();
+}
+
+ScopedIOPriority::ScopedIOPriority(IOClass ioClass, unsigned int weight) {
+#ifdef __APPLE__
+  this->previous = getiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD);
+  int policy = IOPOL_STANDARD;
+  if(ioClass == IO_CLASS_INTERACTIVE) {
+    policy = IOPOL_IMPORTANT;
+  } else if(ioClass == IO_CLASS_IDLE) {
+    policy = IOPOL_THROTTLE;
+  } else if(weight < IO_DEFAULT_WEIGHT) {
+    policy = IOPOL_UTILITY;
+  }
+  this->changed = this->previous != -1 && setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, policy) == 0;
+#elif defined(__linux__)
+  // Best effort levels go from 0 (most urgent) to 7, 4 being the default.
+  // Every doubling of the weight is one level up
+  int value = IOPRIO_VALUE(IOPRIO_CLASS_BE, 0);
+  if(ioClass == IO_CLASS_IDLE) {
+    value = IOPRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+  } else if(ioClass == IO_CLASS_BULK) {
+    const int level = 4 - static_cast<int>(std::lround(std::log2(static_cast<double>(std::max(1U, weight)) / IO_DEFAULT_WEIGHT)));
+    value = IOPRIO_VALUE(IOPRIO_CLASS_BE, std::max(0, std::min(7, level)));
+  }
+  this->previous = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  this->changed = this->previous != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) == 0;
+#else
+  this->previous = 0;
+#endif
+}
+
+ScopedIOPriority::~ScopedIOPriority() {
+  if(!this->changed) {
+    return;
+  }
+#ifdef __APPLE__
+  setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, this->previous);
+#elif defined(__linux__)
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, this->previous);
+#endif
+}
@@ -0,0 +1,167 @@
+/***************************************************************************
+ *   io_scheduler.hpp  --  This file is part of diskarbitratord.           *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#ifndef IO_SCHEDULER_HPP_
+#define IO_SCHEDULER_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#define IO_DEFAULT_WEIGHT 100
+#define IO_MAX_WEIGHT 1000
+// Bulk jobs sharing a device or bus can get this many bytes (at the default
+// weight) ahead of the one furthest behind before they have to wait for it
+#define IO_SCHEDULER_QUANTUM (8 * 1024 * 1024)
+// Jobs that haven't asked for anything in this long don't hold anyone back
+#define IO_SCHEDULER_ACTIVE_MS 100
+// Idle jobs only get the device once everyone else has left it alone for
+// this long
+#define IO_SCHEDULER_IDLE_MS 200
+// Bulk jobs make way for an interactive one for at most this long, in case it
+// turns out not to be that interactive after all
+#define IO_SCHEDULER_INTERACTIVE_MAX_MS 2000
+// Rate limits let this much go by in one burst
+#define IO_SCHEDULER_BURST_MS 250
+
+enum IOClass {
+  // Things someone is waiting on, like inspecting a disk or probing one that
+  // just appeared. Never waits, and bulk jobs on the same device or bus hold
+  // off while it runs
+  IO_CLASS_INTERACTIVE,
+  // Acquisitions, hashing and scans. They share the bandwidth by weight
+  IO_CLASS_BULK,
+  // Only runs when nothing else is using the device
+  IO_CLASS_IDLE,
+};
+
+// Decides who gets to read from which disk when several jobs want the same
+// one, or disks on the same bus. Jobs ask before every read, and wait until
+// their share of the bandwidth allows it.
+//
+// Fairness between bulk jobs is by virtual time: each job's clock advances by
+// what it reads divided by its weight, and no job can get more than
+// IO_SCHEDULER_QUANTUM ahead of the slowest one it's sharing with. Devices
+// and buses can also be rate limited with a token bucket each.
+class IOScheduler {
+  private:
+    typedef std::chrono::steady_clock Clock;
+    typedef struct JobState {
+      std::string device;
+      std::string bus;
+      IOClass ioClass;
+      unsigned int weight;
+      double virtualTime;
+      bool waiting;
+      uint64_t bytes;
+      Clock::time_point joined;
+      Clock::time_point lastRequest;
+    } JobState;
+
+  public:
+    // A job's place in the scheduler, which it leaves when destroyed. The
+    // scheduler has to outlive it
+    class Job {
+      public:
+        ~Job();
+        // Blocks until the job can read `bytes` more. Safe to call from
+        // several threads
+        void acquire(uint64_t bytes);
+        uint64_t bytes() const;
+
+        IOClass ioClass() const {
+          return this->state.ioClass;
+        }
+        unsigned int weight() const {
+          return this->state.weight;
+        }
+
+      private:
+        friend class IOScheduler;
+        Job(IOScheduler& scheduler) : scheduler(scheduler) {}
+        IOScheduler& scheduler;
+        JobState state;
+    };
+
+    // `device` is what ioDeviceKey() says, `bus` can be empty if unknown
+    std::unique_ptr<Job> join(const std::string& device, const std::string& bus, IOClass ioClass, unsigned int weight = IO_DEFAULT_WEIGHT);
+
+    // In bytes per second, 0 for no limit
+    void setDeviceLimit(const std::string& device, uint64_t bytesPerSecond);
+    void setBusLimit(const std::string& bus, uint64_t bytesPerSecond);
+    // For devices and buses without a limit of their own
+    void setDefaultLimits(uint64_t deviceBytesPerSecond, uint64_t busBytesPerSecond);
+
+  private:
+    typedef struct Bucket {
+      double rate;
+      double tokens;
+      bool ownLimit;
+      Clock::time_point updated;
+    } Bucket;
+
+    void acquire(JobState& job, uint64_t bytes);
+    void leave(JobState& job);
+    Bucket* bucket(std::map<std::string, Bucket>& buckets, const std::string& key, uint64_t defaultRate);
+    void setLimit(std::map<std::string, Bucket>& buckets, const std::string& key, uint64_t bytesPerSecond, bool ownLimit);
+    bool active(const JobState& job, Clock::time_point now) const;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::set<JobState*> jobs;
+    std::map<std::string, Bucket> devices;
+    std::map<std::string, Bucket> buses;
+    uint64_t defaultDeviceRate = 0;
+    uint64_t defaultBusRate = 0;
+};
+
+// What `path` is read from: the device itself for devices, the one holding
+// the filesystem for files. Jobs with the same key compete for the same disk.
+// Throws if `path` doesn't exist
+std::string ioDeviceKey(const std::string& path);
+
+// Tells the kernel how urgent the calling thread's I/O is until destroyed,
+// with ioprio_set(2) on Linux and setiopolicy_np(3) on macOS. Threads from
+// someone else's pool get their old priority back afterwards
+class ScopedIOPriority {
+  public:
+    ScopedIOPriority(IOClass ioClass, unsigned int weight = IO_DEFAULT_WEIGHT);
+    ~ScopedIOPriority();
+
+  private:
+    int previous;
+    bool changed = false;
+};
+
+// The scheduler everything reading disks goes through. Null, the default,
+// means nothing is scheduled
+void setSharedIOScheduler(std::shared_ptr<IOScheduler> scheduler);
+std::shared_ptr<IOScheduler> sharedIOScheduler();
+
+#endif
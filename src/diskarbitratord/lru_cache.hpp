@@ -0,0 +1,94 @@
+/***************************************************************************
+ *   lru_cache.hpp  --  This file is part of diskarbitratord.              *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef LRU_CACHE_HPP_
+#define LRU_CACHE_HPP_
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Thread-safe cache holding up to `capacity` entries, evicting the least
+// recently used one. Values are handed out as shared_ptr, so an evicted entry
+// stays alive for whoever is still using it.
+template<typename K, typename V>
+class LRUCache {
+  public:
+    LRUCache(size_t capacity) : capacity(capacity) {}
+
+    // Returns nullptr on a miss
+    std::shared_ptr<const V> get(const K& key) {
+      const std::lock_guard<std::mutex> lock(this->mutex);
+      auto it = this->index.find(key);
+      if(it == this->index.end()) {
+        ++this->misses;
+        return nullptr;
+      }
+      ++this->hits;
+      this->entries.splice(this->entries.begin(), this->entries, it->second);
+      return it->second->second;
+    }
+
+    void put(const K& key, std::shared_ptr<const V> value) {
+      if(this->capacity == 0) {
+        return;
+      }
+      const std::lock_guard<std::mutex> lock(this->mutex);
+      auto it = this->index.find(key);
+      if(it != this->index.end()) {
+        it->second->second = value;
+        this->entries.splice(this->entries.begin(), this->entries, it->second);
+        return;
+      }
+      this->entries.emplace_front(key, value);
+      this->index[key] = this->entries.begin();
+      if(this->entries.size() > this->capacity) {
+        this->index.erase(this->entries.back().first);
+        this->entries.pop_back();
+      }
+    }
+
+    size_t hitCount() {
+      const std::lock_guard<std::mutex> lock(this->mutex);
+      return this->hits;
+    }
+
+    size_t missCount() {
+      const std::lock_guard<std::mutex> lock(this->mutex);
+      return this->misses;
+    }
+
+  private:
+    typedef std::list<std::pair<K, std::shared_ptr<const V>>> EntryList;
+
+    const size_t capacity;
+    EntryList entries;
+    std::unordered_map<K, typename EntryList::iterator> index;
+    std::mutex mutex;
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+#endif
@@ -46,6 +46,15 @@ int main(int argc, char** argv) {
   cxxopts::Options options("diskarbitratord", "Disk Arbitrator daemon");
   options.add_options() 
       ("s,socket", "diskarbitratord service socket path", cxxopts::value<std::string>()->default_value(DEFAULT_SOCKET_PATH))
+      ("block-cache", "Size in MB of the block cache shared by everything reading raw disks, 0 to disable", cxxopts::value<uint64_t>()->default_value(std::to_string(BLOCK_CACHE_DEFAULT_SIZE >> 20)))
+      ("direct-io", "Read raw disks around the system's page cache")
+      ("io-backend", "How disks being acquired are read: auto, pread or io_uring (Linux only)", cxxopts::value<std::string>()->default_value("auto"))
+      ("queue-depth", "Reads kept in flight for each disk being acquired", cxxopts::value<unsigned int>()->default_value(std::to_string(BLOCK_READER_DEFAULT_DEPTH)))
+      ("device-limit", "Most MB/s read from any one disk by acquisitions and scans together, 0 for no limit", cxxopts::value<uint64_t>()->default_value("0"))
+      ("bus-limit", "Most MB/s read from the disks on any one bus together, 0 for no limit", cxxopts::value<uint64_t>()->default_value("0"))
+      ("nbd-socket", "Serve read-only NBD exports on this socket path", cxxopts::value<std::string>()->default_value(""))
+      ("baseline-dir", "Take a Merkle tree baseline of every external disk the first time it appears, and keep them here", cxxopts::value<std::string>()->default_value(""))
+      ("hdiutil", "hdiutil binary used for attaching images", cxxopts::value<std::string>()->default_value(DEFAULT_HDIUTIL_PATH))
       ("h,help", "Print usage")
   ;
   cxxopts::ParseResult result = options.parse(argc, argv);
@@ -54,9 +63,26 @@ int main(int argc, char** argv) {
     exit(0);
   }
   std::string socketPath = result["socket"].as<std::string>();
+  setHdiutilPath(result["hdiutil"].as<std::string>());
+  if(result["block-cache"].as<uint64_t>()) {
+    setSharedBlockCache(std::make_shared<BlockCache>(result["block-cache"].as<uint64_t>() << 20, result.count("direct-io")));
+  }
+  std::shared_ptr<IOScheduler> ioScheduler = std::make_shared<IOScheduler>();
+  ioScheduler->setDefaultLimits(result["device-limit"].as<uint64_t>() << 20, result["bus-limit"].as<uint64_t>() << 20);
+  setSharedIOScheduler(ioScheduler);
+  try {
+    BlockReaderBackend backend = parseBlockReaderBackend(result["io-backend"].as<std::string>());
+    if(backend == BLOCK_READER_IO_URING && !ioUringAvailable()) {
+      throw std::runtime_error("io_uring isn't available on this system");
+    }
+    setBlockReaderDefaults(backend, result["queue-depth"].as<unsigned int>());
+  } catch(const std::runtime_error& e) {
+    LOG(ERROR) << e.what();
+    exit(1);
+  }
 
   // Main server method. Returns when it's shut down.
-  RunServer(socketPath);
+  RunServer(socketPath, result["nbd-socket"].as<std::string>(), result["baseline-dir"].as<std::string>());
 
   LOG(INFO) << "Exiting...";
   return 0;
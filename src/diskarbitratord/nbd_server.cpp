@@ -0,0 +1,584 @@
+/***************************************************************************
+ *   nbd_server.cpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "byteorder.hpp"
+#include "nbd_server.hpp"
+
+#define NBD_MAX_OPTION_SIZE 65536
+#define NBD_REQUEST_SIZE 28
+#define NBD_SIMPLE_REPLY_SIZE 16
+#define NBD_STRUCTURED_REPLY_SIZE 20
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// Tells the kernel more is coming, so a reply header and its data go out in
+// the same packet when sendfile(2) follows
+#ifdef MSG_MORE
+#define SEND_MORE_FLAGS (SEND_FLAGS | MSG_MORE)
+#else
+#define SEND_MORE_FLAGS SEND_FLAGS
+#endif
+
+static void putBE16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void putBE32(uint8_t* p, uint32_t v) {
+  putBE16(p, v >> 16);
+  putBE16(p + 2, v);
+}
+
+static void putBE64(uint8_t* p, uint64_t v) {
+  putBE32(p, v >> 32);
+  putBE32(p + 4, v);
+}
+
+static bool sendAll(int fd, const void* data, size_t len, int flags = SEND_FLAGS) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while(len) {
+    ssize_t sent = send(fd, p, len, flags);
+    if(sent < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+static bool recvAll(int fd, void* data, size_t len) {
+  uint8_t* p = static_cast<uint8_t*>(data);
+  while(len) {
+    ssize_t received = recv(fd, p, len, 0);
+    if(received < 0 && errno == EINTR) {
+      continue;
+    }
+    if(received <= 0) {
+      return false;
+    }
+    p += received;
+    len -= received;
+  }
+  return true;
+}
+
+// Throws away the payload of a request we're refusing
+static bool discardAll(int fd, uint64_t len) {
+  uint8_t buffer[65536];
+  while(len) {
+    size_t chunk = std::min<uint64_t>(len, sizeof(buffer));
+    if(!recvAll(fd, buffer, chunk)) {
+      return false;
+    }
+    len -= chunk;
+  }
+  return true;
+}
+
+// Sends up to `len` bytes of `fd` at `offset` without copying them through
+// userspace. Returns how much was sent
+static size_t sendFileRange(int socket, int fd, uint64_t offset, size_t len) {
+  size_t total = 0;
+#ifdef __linux__
+  off_t position = offset;
+  while(total < len) {
+    ssize_t sent = sendfile(socket, fd, &position, len - total);
+    if(sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if(sent <= 0) {
+      break;
+    }
+    total += sent;
+  }
+#endif
+  return total;
+}
+
+static bool sendOptionReply(int fd, uint32_t option, uint32_t type, const std::string& data = "") {
+  uint8_t header[20];
+  putBE64(header, NBD_REPLY_MAGIC);
+  putBE32(header + 8, option);
+  putBE32(header + 12, type);
+  putBE32(header + 16, data.size());
+  return sendAll(fd, header, sizeof(header)) && sendAll(fd, data.data(), data.size());
+}
+
+static void putReplyHeader(uint8_t* header, bool structured, uint64_t cookie, uint16_t type, uint32_t length) {
+  if(structured) {
+    putBE32(header, NBD_STRUCTURED_REPLY_MAGIC);
+    putBE16(header + 4, NBD_REPLY_FLAG_DONE);
+    putBE16(header + 6, type);
+    putBE64(header + 8, cookie);
+    putBE32(header + 16, length);
+  } else {
+    putBE32(header, NBD_SIMPLE_REPLY_MAGIC);
+    putBE32(header + 4, 0);
+    putBE64(header + 8, cookie);
+  }
+}
+
+// Success without data, for everything but reads
+static bool sendDone(int fd, bool structured, uint64_t cookie) {
+  uint8_t header[NBD_STRUCTURED_REPLY_SIZE];
+  putReplyHeader(header, structured, cookie, 0, 0);
+  return sendAll(fd, header, structured ? NBD_STRUCTURED_REPLY_SIZE : NBD_SIMPLE_REPLY_SIZE);
+}
+
+// Structured replies can say what went wrong, simple ones only have errno
+static bool sendError(int fd, bool structured, uint64_t cookie, uint32_t error, const std::string& message) {
+  uint8_t header[NBD_STRUCTURED_REPLY_SIZE + 6];
+  if(!structured) {
+    putBE32(header, NBD_SIMPLE_REPLY_MAGIC);
+    putBE32(header + 4, error);
+    putBE64(header + 8, cookie);
+    return sendAll(fd, header, NBD_SIMPLE_REPLY_SIZE);
+  }
+  const std::string text = message.substr(0, 4096);
+  putReplyHeader(header, true, cookie, NBD_REPLY_TYPE_ERROR, 6 + text.size());
+  putBE32(header + NBD_STRUCTURED_REPLY_SIZE, error);
+  putBE16(header + NBD_STRUCTURED_REPLY_SIZE + 4, text.size());
+  return sendAll(fd, header, sizeof(header)) && sendAll(fd, text.data(), text.size());
+}
+
+// Header of a successful read, the data goes right after it
+static size_t putReadHeader(uint8_t* header, bool structured, uint64_t cookie, uint64_t offset, uint32_t length) {
+  putReplyHeader(header, structured, cookie, NBD_REPLY_TYPE_OFFSET_DATA, 8 + length);
+  if(!structured) {
+    return NBD_SIMPLE_REPLY_SIZE;
+  }
+  putBE64(header + NBD_STRUCTURED_REPLY_SIZE, offset);
+  return NBD_STRUCTURED_REPLY_SIZE + 8;
+}
+
+NBDServer::NBDServer(const std::string& socketPath, unsigned int threads) : socketPath(socketPath), stopping(false), pool(threads) {
+  // sendfile(2) has no MSG_NOSIGNAL, and a client hanging up halfway through
+  // a read shouldn't take the whole process down
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(socketPath.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("NBD socket path " + socketPath + " is too long");
+  }
+  strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+  if(pipe(this->wakeFds) == -1) {
+    throw std::runtime_error("Unable to create pipe: " + std::string(strerror(errno)));
+  }
+  this->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(this->listenFd == -1) {
+    close(this->wakeFds[0]);
+    close(this->wakeFds[1]);
+    throw std::runtime_error("Unable to open NBD socket: " + std::string(strerror(errno)));
+  }
+  unlink(socketPath.c_str());
+  if(bind(this->listenFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1 || listen(this->listenFd, SOMAXCONN) == -1) {
+    std::string error = strerror(errno);
+    close(this->listenFd);
+    close(this->wakeFds[0]);
+    close(this->wakeFds[1]);
+    throw std::runtime_error("Unable to listen on " + socketPath + ": " + error);
+  }
+  this->acceptThread = std::thread(&NBDServer::acceptLoop, this);
+}
+
+NBDServer::~NBDServer() {
+  this->stopping = true;
+  // Wakes up the accept loop
+  char wake = 0;
+  while(write(this->wakeFds[1], &wake, 1) == -1 && errno == EINTR) {}
+  this->acceptThread.join();
+
+  // Connections are stuck reading their next request, make them fail
+  const std::lock_guard<std::mutex> lock(this->connectionsMutex);
+  for(auto& connection : this->connections) {
+    shutdown(connection.fd, SHUT_RDWR);
+  }
+  for(auto& connection : this->connections) {
+    connection.thread.join();
+    close(connection.fd);
+  }
+  close(this->listenFd);
+  close(this->wakeFds[0]);
+  close(this->wakeFds[1]);
+  unlink(this->socketPath.c_str());
+}
+
+uint64_t NBDServer::addExport(const std::string& name, const std::string& path) {
+  std::shared_ptr<Export> newExport = std::make_shared<Export>();
+  newExport->path = path;
+  newExport->reader = openImageReader(path);
+  newExport->zeroCopyFd = -1;
+#ifdef __linux__
+  FileImageReader* raw = dynamic_cast<FileImageReader*>(newExport->reader.get());
+  if(raw) {
+    newExport->zeroCopyFd = raw->descriptor();
+  }
+#endif
+  newExport->zeroCopy = newExport->zeroCopyFd != -1;
+
+  const std::lock_guard<std::mutex> lock(this->exportsMutex);
+  if(this->exports.find(name) != this->exports.end()) {
+    throw std::runtime_error("There's already an export named " + name);
+  }
+  this->exports[name] = newExport;
+  return newExport->reader->size();
+}
+
+void NBDServer::removeExport(const std::string& name) {
+  const std::lock_guard<std::mutex> lock(this->exportsMutex);
+  if(!this->exports.erase(name)) {
+    throw std::runtime_error("There's no export named " + name);
+  }
+}
+
+std::vector<std::string> NBDServer::exportNames() {
+  const std::lock_guard<std::mutex> lock(this->exportsMutex);
+  std::vector<std::string> names;
+  for(const auto& it : this->exports) {
+    names.push_back(it.first);
+  }
+  return names;
+}
+
+std::shared_ptr<NBDServer::Export> NBDServer::findExport(const std::string& name) {
+  const std::lock_guard<std::mutex> lock(this->exportsMutex);
+  auto it = this->exports.find(name);
+  if(it != this->exports.end()) {
+    return it->second;
+  }
+  // The default export, for clients that don't bother with names
+  if(name.empty() && this->exports.size() == 1) {
+    return this->exports.begin()->second;
+  }
+  return nullptr;
+}
+
+void NBDServer::acceptLoop() {
+  struct pollfd fds[2];
+  fds[0].fd = this->listenFd;
+  fds[0].events = POLLIN;
+  fds[1].fd = this->wakeFds[0];
+  fds[1].events = POLLIN;
+  while(!this->stopping) {
+    if(poll(fds, 2, -1) == -1 || !(fds[0].revents & POLLIN)) {
+      continue;
+    }
+    int fd = accept(this->listenFd, NULL, NULL);
+    if(fd == -1) {
+      continue;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    const std::lock_guard<std::mutex> lock(this->connectionsMutex);
+    // Clean up after the clients that are gone
+    for(auto it = this->connections.begin(); it != this->connections.end();) {
+      if(it->finished) {
+        it->thread.join();
+        close(it->fd);
+        it = this->connections.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    this->connections.emplace_back();
+    Connection& connection = this->connections.back();
+    connection.fd = fd;
+    connection.finished = false;
+    connection.thread = std::thread(&NBDServer::serve, this, std::ref(connection));
+  }
+}
+
+std::shared_ptr<NBDServer::Export> NBDServer::negotiate(int fd, bool& structured) {
+  uint8_t hello[18];
+  putBE64(hello, NBD_MAGIC);
+  putBE64(hello + 8, NBD_OPTION_MAGIC);
+  putBE16(hello + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  uint8_t clientFlags[4];
+  if(!sendAll(fd, hello, sizeof(hello)) || !recvAll(fd, clientFlags, sizeof(clientFlags))) {
+    return nullptr;
+  }
+  // Old style clients can't be told about errors, not worth supporting
+  if(!(readBE32(clientFlags) & NBD_FLAG_FIXED_NEWSTYLE)) {
+    return nullptr;
+  }
+  const bool noZeroes = readBE32(clientFlags) & NBD_FLAG_NO_ZEROES;
+
+  while(true) {
+    uint8_t header[16];
+    if(!recvAll(fd, header, sizeof(header)) || readBE64(header) != NBD_OPTION_MAGIC) {
+      return nullptr;
+    }
+    const uint32_t option = readBE32(header + 8);
+    const uint32_t length = readBE32(header + 12);
+    if(length > NBD_MAX_OPTION_SIZE) {
+      if(!discardAll(fd, length) || !sendOptionReply(fd, option, NBD_REP_ERR_INVALID)) {
+        return nullptr;
+      }
+      continue;
+    }
+    std::string data(length, '\0');
+    if(!recvAll(fd, &data[0], length)) {
+      return nullptr;
+    }
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    const uint16_t transmissionFlags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_CACHE |
+                                       NBD_FLAG_CAN_MULTI_CONN | (structured ? NBD_FLAG_SEND_DF : 0);
+
+    bool ok = true;
+    switch(option) {
+      case NBD_OPT_EXPORT_NAME: {
+        // No way to send an error here, the spec says to just hang up
+        std::shared_ptr<Export> found = this->findExport(data);
+        if(found == nullptr) {
+          return nullptr;
+        }
+        uint8_t reply[10 + 124];
+        memset(reply, 0, sizeof(reply));
+        putBE64(reply, found->reader->size());
+        putBE16(reply + 8, transmissionFlags);
+        return sendAll(fd, reply, noZeroes ? 10 : sizeof(reply)) ? found : nullptr;
+      }
+      case NBD_OPT_ABORT:
+        sendOptionReply(fd, option, NBD_REP_ACK);
+        return nullptr;
+      case NBD_OPT_LIST:
+        if(length) {
+          ok = sendOptionReply(fd, option, NBD_REP_ERR_INVALID);
+          break;
+        }
+        for(const auto& name : this->exportNames()) {
+          std::string entry(4, '\0');
+          putBE32(reinterpret_cast<uint8_t*>(&entry[0]), name.size());
+          ok = ok && sendOptionReply(fd, option, NBD_REP_SERVER, entry + name);
+        }
+        ok = ok && sendOptionReply(fd, option, NBD_REP_ACK);
+        break;
+      case NBD_OPT_STRUCTURED_REPLY:
+        if(length) {
+          ok = sendOptionReply(fd, option, NBD_REP_ERR_INVALID);
+          break;
+        }
+        structured = true;
+        ok = sendOptionReply(fd, option, NBD_REP_ACK);
+        break;
+      case NBD_OPT_INFO:
+      case NBD_OPT_GO: {
+        uint32_t nameLength = length >= 4 ? readBE32(p) : 0;
+        if(length < 6 || nameLength > length - 6 || (length - 6 - nameLength) != 2u * readBE16(p + 4 + nameLength)) {
+          ok = sendOptionReply(fd, option, NBD_REP_ERR_INVALID);
+          break;
+        }
+        std::shared_ptr<Export> found = this->findExport(data.substr(4, nameLength));
+        if(found == nullptr) {
+          ok = sendOptionReply(fd, option, NBD_REP_ERR_UNKNOWN, "No export named " + data.substr(4, nameLength));
+          break;
+        }
+        std::string info(12, '\0');
+        uint8_t* i = reinterpret_cast<uint8_t*>(&info[0]);
+        putBE16(i, NBD_INFO_EXPORT);
+        putBE64(i + 2, found->reader->size());
+        putBE16(i + 10, transmissionFlags);
+        ok = sendOptionReply(fd, option, NBD_REP_INFO, info);
+        for(uint16_t r = 0; ok && r < readBE16(p + 4 + nameLength); ++r) {
+          if(readBE16(p + 6 + nameLength + r * 2) == NBD_INFO_BLOCK_SIZE) {
+            std::string sizes(14, '\0');
+            uint8_t* s = reinterpret_cast<uint8_t*>(&sizes[0]);
+            putBE16(s, NBD_INFO_BLOCK_SIZE);
+            putBE32(s + 2, 1);
+            putBE32(s + 6, NBD_PREFERRED_BLOCK_SIZE);
+            putBE32(s + 10, NBD_MAX_REQUEST_SIZE);
+            ok = sendOptionReply(fd, option, NBD_REP_INFO, sizes);
+          }
+        }
+        ok = ok && sendOptionReply(fd, option, NBD_REP_ACK);
+        if(ok && option == NBD_OPT_GO) {
+          return found;
+        }
+        break;
+      }
+      default:
+        ok = sendOptionReply(fd, option, NBD_REP_ERR_UNSUP);
+        break;
+    }
+    if(!ok) {
+      return nullptr;
+    }
+  }
+}
+
+void NBDServer::serve(Connection& connection) {
+  const int fd = connection.fd;
+  bool structured = false;
+  std::shared_ptr<Export> served = this->negotiate(fd, structured);
+
+  std::mutex writeMutex;
+  std::vector<std::future<void>> inFlight;
+  // Whatever fails to send leaves the stream in an unknown state, so the
+  // connection is dropped. Shutting the socket down also stops the request
+  // loop below
+  auto reply = [fd, &writeMutex](std::function<bool()> send) {
+    const std::lock_guard<std::mutex> lock(writeMutex);
+    if(!send()) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  };
+
+  while(served != nullptr) {
+    uint8_t request[NBD_REQUEST_SIZE];
+    if(!recvAll(fd, request, sizeof(request)) || readBE32(request) != NBD_REQUEST_MAGIC) {
+      break;
+    }
+    const uint16_t type = readBE16(request + 6);
+    const uint64_t cookie = readBE64(request + 8);
+    const uint64_t offset = readBE64(request + 16);
+    const uint32_t length = readBE32(request + 24);
+    const uint64_t size = served->reader->size();
+
+    if(type == NBD_CMD_DISC) {
+      break;
+    }
+    if(type == NBD_CMD_WRITE) {
+      // The data still has to be read off the socket before saying no
+      if(!discardAll(fd, length)) {
+        break;
+      }
+    }
+    if(type == NBD_CMD_WRITE || type == NBD_CMD_TRIM || type == NBD_CMD_WRITE_ZEROES) {
+      reply([=]() {
+        return sendError(fd, structured, cookie, NBD_EPERM, "Export is read-only");
+      });
+      continue;
+    }
+    if(type == NBD_CMD_FLUSH) {
+      reply([=]() {
+        return sendDone(fd, structured, cookie);
+      });
+      continue;
+    }
+    if(type != NBD_CMD_READ && type != NBD_CMD_CACHE) {
+      reply([=]() {
+        return sendError(fd, structured, cookie, NBD_EINVAL, "Unknown command " + std::to_string(type));
+      });
+      continue;
+    }
+    if(length > NBD_MAX_REQUEST_SIZE || offset > size || length > size - offset) {
+      reply([=]() {
+        return sendError(fd, structured, cookie, length > NBD_MAX_REQUEST_SIZE ? NBD_EOVERFLOW : NBD_EINVAL, "Request out of range");
+      });
+      continue;
+    }
+
+    // Don't let a client queue up unbounded memory
+    while(inFlight.size() >= NBD_MAX_IN_FLIGHT) {
+      inFlight.front().wait();
+      inFlight.erase(std::remove_if(inFlight.begin(), inFlight.end(), [](const std::future<void>& f) {
+        return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+      }), inFlight.end());
+    }
+
+    inFlight.push_back(this->pool.submit([=, &reply]() {
+      std::vector<uint8_t> buffer;
+      if(type == NBD_CMD_READ && served->zeroCopy) {
+        reply([&]() {
+          uint8_t header[NBD_STRUCTURED_REPLY_SIZE + 8];
+          size_t headerSize = putReadHeader(header, structured, cookie, offset, length);
+          if(!sendAll(fd, header, headerSize, SEND_MORE_FLAGS)) {
+            return false;
+          }
+          errno = 0;
+          size_t sent = sendFileRange(fd, served->zeroCopyFd, offset, length);
+          if(sent == length) {
+            return true;
+          }
+          // Not every file can be spliced into a socket. The rest of this read
+          // and every read after it get copied instead
+          if(errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return false;
+          }
+          served->zeroCopy = false;
+          buffer.resize(length - sent);
+          return preadFully(served->zeroCopyFd, buffer.data(), buffer.size(), offset + sent) == buffer.size() &&
+                 sendAll(fd, buffer.data(), buffer.size());
+        });
+        return;
+      }
+
+      buffer.resize(length);
+      std::string error;
+      try {
+        if(!readExact(*served->reader, offset, buffer.data(), length)) {
+          error = "Short read at offset " + std::to_string(offset);
+        }
+      } catch(const std::runtime_error& e) {
+        error = e.what();
+      }
+      reply([&]() {
+        if(error.size()) {
+          return sendError(fd, structured, cookie, NBD_EIO, error);
+        }
+        if(type == NBD_CMD_CACHE) {
+          // The read was just to warm up the reader's chunk cache
+          return sendDone(fd, structured, cookie);
+        }
+        uint8_t header[NBD_STRUCTURED_REPLY_SIZE + 8];
+        size_t headerSize = putReadHeader(header, structured, cookie, offset, length);
+        return sendAll(fd, header, headerSize) && sendAll(fd, buffer.data(), buffer.size());
+      });
+    }));
+  }
+
+  for(auto& f : inFlight) {
+    f.wait();
+  }
+  connection.finished = true;
+}
@@ -0,0 +1,165 @@
+/***************************************************************************
+ *   nbd_server.hpp  --  This file is part of diskarbitratord.             *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef NBD_SERVER_HPP_
+#define NBD_SERVER_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image_reader.hpp"
+#include "thread_pool.hpp"
+
+// Read-only Network Block Device server, so that other tools can read evidence
+// (qemu-nbd, nbdkit clients, nbdfuse, the kernel's nbd driver on Linux...)
+// without ever getting a writable handle on it. Speaks the fixed newstyle
+// handshake over a Unix socket, with structured replies when the client asks
+// for them. Reads are served in parallel and replied to as they finish, in
+// whatever order that is. Everything on the wire is big endian.
+
+#define NBD_MAGIC 0x4E42444D41474943ULL          // NBDMAGIC
+#define NBD_OPTION_MAGIC 0x49484156454F5054ULL   // IHAVEOPT
+#define NBD_REPLY_MAGIC 0x0003E889045565A9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668E33EF
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_POLICY 0x80000002
+#define NBD_REP_ERR_INVALID 0x80000003
+#define NBD_REP_ERR_UNKNOWN 0x80000006
+
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_DF (1 << 7)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+#define NBD_FLAG_SEND_CACHE (1 << 10)
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+#define NBD_CMD_CACHE 5
+#define NBD_CMD_WRITE_ZEROES 6
+
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_ERROR 0x8001
+
+#define NBD_EPERM 1
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+#define NBD_EOVERFLOW 75
+#define NBD_ENOTSUP 95
+
+// Reads bigger than this are refused, and so are option payloads
+#define NBD_MAX_REQUEST_SIZE (32 * 1024 * 1024)
+#define NBD_PREFERRED_BLOCK_SIZE (128 * 1024)
+// Reads in flight per connection before we stop taking more requests
+#define NBD_MAX_IN_FLIGHT 64
+
+class NBDServer {
+  public:
+    // Listens on `socketPath` straight away, replacing whatever socket was
+    // there. `threads` serve reads for every connection (0 is one per core).
+    // Throws if the socket can't be set up
+    NBDServer(const std::string& socketPath, unsigned int threads = 0);
+    // Drops every connection and waits for them to finish
+    ~NBDServer();
+
+    // Makes whatever openImageReader() can read at `path` available as `name`.
+    // Throws if it can't be opened or the name is taken. Returns the size of
+    // the export
+    uint64_t addExport(const std::string& name, const std::string& path);
+    // Connections already using it keep it until they disconnect. Throws if
+    // there's no such export
+    void removeExport(const std::string& name);
+    std::vector<std::string> exportNames();
+
+    const std::string& path() const {
+      return this->socketPath;
+    }
+
+  private:
+    typedef struct Export {
+      std::string path;
+      std::unique_ptr<ImageReader> reader;
+      // Raw images are sent with sendfile(2) from here, -1 otherwise
+      int zeroCopyFd;
+      std::atomic<bool> zeroCopy;
+    } Export;
+
+    typedef struct Connection {
+      int fd;
+      std::thread thread;
+      std::atomic<bool> finished;
+    } Connection;
+
+    void acceptLoop();
+    void serve(Connection& connection);
+    // Option haggling. Returns the export to serve, or nullptr if the client
+    // went away or aborted
+    std::shared_ptr<Export> negotiate(int fd, bool& structured);
+    std::shared_ptr<Export> findExport(const std::string& name);
+
+    std::string socketPath;
+    int listenFd;
+    // Written to when stopping, so the accept loop notices
+    int wakeFds[2];
+    std::thread acceptThread;
+    std::atomic<bool> stopping;
+
+    std::mutex exportsMutex;
+    std::map<std::string, std::shared_ptr<Export>> exports;
+
+    std::mutex connectionsMutex;
+    std::list<Connection> connections;
+
+    ThreadPool pool;
+};
+
+#endif
@@ -0,0 +1,358 @@
+/***************************************************************************
+ *   partition_table.cpp  --  This file is part of diskarbitratord.        *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+#include "byteorder.hpp"
+#include "crc32.hpp"
+#include "partition_table.hpp"
+#include "unicode.hpp"
+
+#define MBR_SIZE 512
+#define MBR_SIGNATURE_OFFSET 510
+#define MBR_ENTRIES_OFFSET 446
+#define MBR_ENTRY_SIZE 16
+#define MBR_ENTRY_COUNT 4
+#define MBR_TYPE_PROTECTIVE 0xEE
+// Logical partitions can't form a chain longer than this on any sane disk.
+// Stops us looping forever on a corrupt (or malicious) EBR chain
+#define MBR_MAX_LOGICAL_PARTITIONS 128
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_MIN_SIZE 92
+#define GPT_ENTRY_MIN_SIZE 128
+#define GPT_NAME_OFFSET 56
+#define GPT_NAME_LENGTH 72
+// The spec asks for at least 16KB of entries. Anything much bigger than this is
+// corruption
+#define GPT_MAX_ENTRIES_SIZE (1024 * 1024)
+
+typedef struct GPTHeader {
+  uint64_t currentLBA;
+  uint64_t backupLBA;
+  uint64_t firstUsableLBA;
+  uint64_t lastUsableLBA;
+  uint8_t diskGUID[16];
+  uint64_t entriesLBA;
+  uint32_t entryCount;
+  uint32_t entrySize;
+  uint32_t entriesCRC;
+} GPTHeader;
+
+static const std::map<std::string, std::string> gptTypeNames = {
+  {"00000000-0000-0000-0000-000000000000", "Unused"},
+  {"C12A7328-F81F-11D2-BA4B-00A0C93EC93B", "EFI System"},
+  {"21686148-6449-6E6F-744E-656564454649", "BIOS Boot"},
+  {"48465300-0000-11AA-AA11-00306543ECAC", "Apple HFS+"},
+  {"7C3457EF-0000-11AA-AA11-00306543ECAC", "Apple APFS"},
+  {"426F6F74-0000-11AA-AA11-00306543ECAC", "Apple Boot"},
+  {"52414944-0000-11AA-AA11-00306543ECAC", "Apple RAID"},
+  {"53746F72-6167-11AA-AA11-00306543ECAC", "Apple Core Storage"},
+  {"55465300-0000-11AA-AA11-00306543ECAC", "Apple UFS"},
+  {"EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Microsoft Basic Data"},
+  {"E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft Reserved"},
+  {"DE94BBA4-06D1-4D40-A16A-BFD50179D6AC", "Windows Recovery"},
+  {"5808C8AA-7E8F-42E0-85D2-E1E90434CFB3", "Windows LDM Metadata"},
+  {"AF9B60A0-1431-4F62-BC68-3311714A69AD", "Windows LDM Data"},
+  {"0FC63DAF-8483-4772-8E79-3D69D8477DE4", "Linux Filesystem"},
+  {"0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", "Linux Swap"},
+  {"E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM"},
+  {"A19D880F-05FC-4D3B-A006-743F0F84911E", "Linux RAID"},
+  {"933AC7E1-2EB4-4F13-B844-0E14E2AEF915", "Linux Home"},
+  {"516E7CB4-6ECF-11D6-8FF8-00022D09712B", "FreeBSD Data"},
+  {"83BD6B9D-7F41-11DC-BE0B-001560B84F0F", "FreeBSD Boot"},
+};
+
+static const std::map<uint8_t, std::string> mbrTypeNames = {
+  {0x01, "FAT12"},
+  {0x04, "FAT16 <32M"},
+  {0x05, "Extended"},
+  {0x06, "FAT16"},
+  {0x07, "NTFS/exFAT"},
+  {0x0B, "FAT32"},
+  {0x0C, "FAT32 LBA"},
+  {0x0E, "FAT16 LBA"},
+  {0x0F, "Extended LBA"},
+  {0x27, "Windows Recovery"},
+  {0x82, "Linux Swap"},
+  {0x83, "Linux"},
+  {0x85, "Linux Extended"},
+  {0x8E, "Linux LVM"},
+  {0xA5, "FreeBSD"},
+  {0xA8, "Apple UFS"},
+  {0xAB, "Apple Boot"},
+  {0xAF, "Apple HFS+"},
+  {0xEE, "GPT Protective"},
+  {0xEF, "EFI System"},
+};
+
+static bool isExtendedType(uint8_t type) {
+  return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+// GUIDs are stored with the first three fields little endian
+static std::string formatGUID(const uint8_t* g) {
+  char buffer[37];
+  snprintf(buffer, sizeof(buffer), "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+           readLE32(g), readLE16(g + 4), readLE16(g + 6), g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+  return buffer;
+}
+
+static bool isZeroGUID(const uint8_t* g) {
+  for(int i = 0; i < 16; ++i) {
+    if(g[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses and checks the GPT header at `lba`. Returns false if there's no valid
+// header there
+static bool readGPTHeader(ImageReader& reader, uint32_t sectorSize, uint64_t lba, GPTHeader& header) {
+  std::vector<uint8_t> sector(sectorSize);
+  if(!readExact(reader, lba * sectorSize, sector.data(), sector.size())) {
+    return false;
+  }
+  const uint8_t* p = sector.data();
+  if(memcmp(p, GPT_SIGNATURE, strlen(GPT_SIGNATURE))) {
+    return false;
+  }
+  uint32_t headerSize = readLE32(p + 12);
+  if(headerSize < GPT_HEADER_MIN_SIZE || headerSize > sectorSize) {
+    return false;
+  }
+  // The CRC is taken with its own field zeroed
+  uint32_t headerCRC = readLE32(p + 16);
+  memset(sector.data() + 16, 0, sizeof(uint32_t));
+  if(crc32Update(0, p, headerSize) != headerCRC) {
+    return false;
+  }
+
+  header.currentLBA = readLE64(p + 24);
+  header.backupLBA = readLE64(p + 32);
+  header.firstUsableLBA = readLE64(p + 40);
+  header.lastUsableLBA = readLE64(p + 48);
+  memcpy(header.diskGUID, p + 56, sizeof(header.diskGUID));
+  header.entriesLBA = readLE64(p + 72);
+  header.entryCount = readLE32(p + 80);
+  header.entrySize = readLE32(p + 84);
+  header.entriesCRC = readLE32(p + 88);
+  return header.currentLBA == lba && header.entrySize >= GPT_ENTRY_MIN_SIZE && header.entrySize % 8 == 0 &&
+         static_cast<uint64_t>(header.entryCount) * header.entrySize <= GPT_MAX_ENTRIES_SIZE;
+}
+
+// Reads the entry array of a header and checks its CRC
+static bool readGPTEntries(ImageReader& reader, uint32_t sectorSize, const GPTHeader& header, std::vector<uint8_t>& entries) {
+  entries.resize(static_cast<size_t>(header.entryCount) * header.entrySize);
+  if(!readExact(reader, header.entriesLBA * sectorSize, entries.data(), entries.size())) {
+    return false;
+  }
+  return crc32Update(0, entries.data(), entries.size()) == header.entriesCRC;
+}
+
+static bool readGPT(ImageReader& reader, uint32_t sectorSize, PartitionTable& table) {
+  if(reader.size() < 3 * sectorSize) {
+    return false;
+  }
+  const uint64_t lastLBA = reader.size() / sectorSize - 1;
+  GPTHeader primary;
+  GPTHeader backup;
+  std::vector<uint8_t> primaryEntries;
+  std::vector<uint8_t> backupEntries;
+
+  bool primaryHeader = readGPTHeader(reader, sectorSize, 1, primary);
+  table.primaryValid = primaryHeader && readGPTEntries(reader, sectorSize, primary, primaryEntries);
+  // The backup lives where the primary says, or at the very end if the
+  // primary is gone. Disks imaged onto bigger media have it before the end
+  uint64_t backupLBA = primaryHeader ? primary.backupLBA : lastLBA;
+  bool backupHeader = readGPTHeader(reader, sectorSize, backupLBA, backup);
+  if(!backupHeader && backupLBA != lastLBA) {
+    backupHeader = readGPTHeader(reader, sectorSize, lastLBA, backup);
+  }
+  table.backupValid = backupHeader && readGPTEntries(reader, sectorSize, backup, backupEntries);
+
+  if(!primaryHeader && !backupHeader) {
+    return false;
+  }
+
+  table.scheme = PARTITION_SCHEME_GPT;
+  table.sectorSize = sectorSize;
+  if(!table.primaryValid) {
+    table.warnings.push_back(primaryHeader ? "Primary GPT entries fail their CRC check" : "Primary GPT header is missing or corrupt");
+  }
+  if(!table.backupValid) {
+    table.warnings.push_back(backupHeader ? "Backup GPT entries fail their CRC check" : "Backup GPT header is missing or corrupt");
+  }
+  if(table.primaryValid && table.backupValid && primaryEntries != backupEntries) {
+    table.warnings.push_back("Primary and backup GPT entries differ, using the primary ones");
+  }
+  if(!table.primaryValid && !table.backupValid) {
+    table.warnings.push_back("No GPT entry array passes its CRC check, entries may be wrong");
+  }
+
+  // Prefer whatever is fully valid, and the primary over the backup
+  const GPTHeader& header = table.primaryValid || (primaryHeader && !table.backupValid) ? primary : backup;
+  const std::vector<uint8_t>& entries = table.primaryValid || (primaryHeader && !table.backupValid) ? primaryEntries : backupEntries;
+  table.diskGUID = formatGUID(header.diskGUID);
+
+  for(uint32_t i = 0; i < header.entryCount && (i + 1) * header.entrySize <= entries.size(); ++i) {
+    const uint8_t* entry = entries.data() + i * header.entrySize;
+    if(isZeroGUID(entry)) {
+      continue;
+    }
+    uint64_t firstLBA = readLE64(entry + 32);
+    uint64_t lastEntryLBA = readLE64(entry + 40);
+    Partition partition;
+    partition.index = i + 1;
+    partition.offset = firstLBA * sectorSize;
+    partition.size = lastEntryLBA >= firstLBA ? (lastEntryLBA - firstLBA + 1) * sectorSize : 0;
+    partition.type = formatGUID(entry);
+    auto typeName = gptTypeNames.find(partition.type);
+    partition.typeName = typeName != gptTypeNames.end() ? typeName->second : "";
+    partition.uuid = formatGUID(entry + 16);
+    partition.attributes = readLE64(entry + 48);
+    partition.name = utf16ToUTF8(entry + GPT_NAME_OFFSET, std::min<size_t>(GPT_NAME_LENGTH, header.entrySize - GPT_NAME_OFFSET), false);
+    partition.bootable = false;
+    if(lastEntryLBA < firstLBA || firstLBA < header.firstUsableLBA || lastEntryLBA > header.lastUsableLBA) {
+      table.warnings.push_back("Partition " + std::to_string(partition.index) + " lies outside the usable area");
+    }
+    table.partitions.push_back(partition);
+  }
+  return true;
+}
+
+static Partition mbrPartition(const uint8_t* entry, uint32_t index, uint64_t baseLBA) {
+  Partition partition;
+  uint8_t type = entry[4];
+  char typeString[8];
+  snprintf(typeString, sizeof(typeString), "0x%02X", type);
+  partition.index = index;
+  partition.offset = (baseLBA + readLE32(entry + 8)) * MBR_SIZE;
+  partition.size = static_cast<uint64_t>(readLE32(entry + 12)) * MBR_SIZE;
+  partition.type = typeString;
+  auto typeName = mbrTypeNames.find(type);
+  partition.typeName = typeName != mbrTypeNames.end() ? typeName->second : "";
+  partition.attributes = 0;
+  partition.bootable = entry[0] == 0x80;
+  return partition;
+}
+
+// Logical partitions are a linked list of EBRs, each holding one partition
+// (relative to the EBR) and a link to the next EBR (relative to the extended
+// partition)
+static void readLogicalPartitions(ImageReader& reader, uint64_t extendedLBA, PartitionTable& table) {
+  uint8_t ebr[MBR_SIZE];
+  uint64_t ebrLBA = extendedLBA;
+  for(uint32_t index = 5; index < 5 + MBR_MAX_LOGICAL_PARTITIONS; ++index) {
+    if(!readExact(reader, ebrLBA * MBR_SIZE, ebr, sizeof(ebr)) || ebr[MBR_SIGNATURE_OFFSET] != 0x55 || ebr[MBR_SIGNATURE_OFFSET + 1] != 0xAA) {
+      table.warnings.push_back("Broken EBR chain at sector " + std::to_string(ebrLBA));
+      return;
+    }
+    const uint8_t* entry = ebr + MBR_ENTRIES_OFFSET;
+    if(entry[4]) {
+      table.partitions.push_back(mbrPartition(entry, index, ebrLBA));
+    }
+    const uint8_t* link = entry + MBR_ENTRY_SIZE;
+    if(!isExtendedType(link[4]) || readLE32(link + 8) == 0) {
+      return;
+    }
+    ebrLBA = extendedLBA + readLE32(link + 8);
+  }
+  table.warnings.push_back("EBR chain too long, stopped after " + std::to_string(MBR_MAX_LOGICAL_PARTITIONS) + " logical partitions");
+}
+
+PartitionTable readPartitionTable(ImageReader& reader) {
+  PartitionTable table;
+  table.scheme = PARTITION_SCHEME_NONE;
+  table.sectorSize = MBR_SIZE;
+  table.primaryValid = false;
+  table.backupValid = false;
+
+  uint8_t mbr[MBR_SIZE];
+  bool hasMBR = readExact(reader, 0, mbr, sizeof(mbr)) && mbr[MBR_SIGNATURE_OFFSET] == 0x55 && mbr[MBR_SIGNATURE_OFFSET + 1] == 0xAA;
+  bool protective = false;
+  if(hasMBR) {
+    for(int i = 0; i < MBR_ENTRY_COUNT; ++i) {
+      protective = protective || mbr[MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE + 4] == MBR_TYPE_PROTECTIVE;
+    }
+  }
+
+  // GPT goes first, a protective MBR is just there to keep old tools away.
+  // Without one (hybrid MBRs aside) it's still worth a look, some tools forget
+  // to write it
+  for(const uint32_t sectorSize : {512U, 4096U}) {
+    if(readGPT(reader, sectorSize, table)) {
+      if(!protective) {
+        table.warnings.push_back("GPT found without a protective MBR");
+      }
+      return table;
+    }
+  }
+  if(protective) {
+    table.warnings.push_back("Protective MBR found, but no GPT header");
+  }
+  if(!hasMBR) {
+    return table;
+  }
+
+  // A FAT boot sector has the same signature, tell them apart by the
+  // partition entries making sense: status is either 0x00 or 0x80
+  for(int i = 0; i < MBR_ENTRY_COUNT; ++i) {
+    uint8_t status = mbr[MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE];
+    if(status != 0x00 && status != 0x80) {
+      return table;
+    }
+  }
+
+  table.scheme = PARTITION_SCHEME_MBR;
+  for(int i = 0; i < MBR_ENTRY_COUNT; ++i) {
+    const uint8_t* entry = mbr + MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE;
+    if(!entry[4]) {
+      continue;
+    }
+    Partition partition = mbrPartition(entry, i + 1, 0);
+    if(partition.offset + partition.size > reader.size()) {
+      table.warnings.push_back("Partition " + std::to_string(partition.index) + " extends past the end of the disk");
+    }
+    table.partitions.push_back(partition);
+    if(isExtendedType(entry[4])) {
+      readLogicalPartitions(reader, readLE32(entry + 8), table);
+    }
+  }
+  return table;
+}
+
+const std::string partitionSchemeName(PartitionScheme scheme) {
+  switch(scheme) {
+    case PARTITION_SCHEME_MBR:
+      return "MBR";
+    case PARTITION_SCHEME_GPT:
+      return "GPT";
+    default:
+      return "None";
+  }
+}
@@ -0,0 +1,80 @@
+/***************************************************************************
+ *   partition_table.hpp  --  This file is part of diskarbitratord.        *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef PARTITION_TABLE_HPP_
+#define PARTITION_TABLE_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+
+// Native MBR/GPT parser, so a disk's layout can be seen without waiting for
+// DiskArbitration to probe it (or when we're blocking it from doing so).
+
+enum PartitionScheme {
+  PARTITION_SCHEME_NONE,
+  PARTITION_SCHEME_MBR,
+  PARTITION_SCHEME_GPT
+};
+
+typedef struct Partition {
+  // 1 based, numbered the way macOS does (diskXsN). MBR logical partitions
+  // start at 5
+  uint32_t index;
+  // In bytes
+  uint64_t offset;
+  uint64_t size;
+  // Type GUID for GPT, "0xNN" for MBR
+  std::string type;
+  // Empty for types we don't know about
+  std::string typeName;
+  // GPT only
+  std::string uuid;
+  std::string name;
+  uint64_t attributes;
+  // MBR only
+  bool bootable;
+} Partition;
+
+typedef struct PartitionTable {
+  PartitionScheme scheme;
+  uint32_t sectorSize;
+  // GPT only
+  std::string diskGUID;
+  bool primaryValid;
+  bool backupValid;
+  // Damage that didn't stop us from reading the table, such as a bad primary
+  // GPT recovered from the backup
+  std::vector<std::string> warnings;
+  std::vector<Partition> partitions;
+} PartitionTable;
+
+// Reads only the sectors holding the tables. GPT is looked for with 512 and
+// 4096 byte sectors. A disk without a table is not an error, it comes back as
+// PARTITION_SCHEME_NONE. Throws on read errors.
+PartitionTable readPartitionTable(ImageReader& reader);
+
+const std::string partitionSchemeName(PartitionScheme scheme);
+
+#endif
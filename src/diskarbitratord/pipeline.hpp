@@ -0,0 +1,102 @@
+/***************************************************************************
+ *   pipeline.hpp  --  This file is part of diskarbitratord.               *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+// O_DIRECT wants buffers aligned to the logical block size, a page covers
+// every device out there
+#define PIPELINE_BUFFER_ALIGNMENT 4096
+
+// Queue between the stages of a pipeline. Once closed, pop() hands out what's
+// left and then returns false, and push() refuses anything new, so every
+// stage winds down no matter which one gave up first.
+template<typename T>
+class Channel {
+  public:
+    bool push(T item) {
+      {
+        const std::lock_guard<std::mutex> lock(this->mutex);
+        if(this->closed) {
+          return false;
+        }
+        this->items.push_back(std::move(item));
+      }
+      this->available.notify_one();
+      return true;
+    }
+
+    bool pop(T& item) {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->available.wait(lock, [this]() {
+        return this->items.size() || this->closed;
+      });
+      if(this->items.empty()) {
+        return false;
+      }
+      item = std::move(this->items.front());
+      this->items.pop_front();
+      return true;
+    }
+
+    // Doesn't wait, false if there's nothing there right now
+    bool tryPop(T& item) {
+      const std::lock_guard<std::mutex> lock(this->mutex);
+      if(this->items.empty()) {
+        return false;
+      }
+      item = std::move(this->items.front());
+      this->items.pop_front();
+      return true;
+    }
+
+    void close() {
+      {
+        const std::lock_guard<std::mutex> lock(this->mutex);
+        this->closed = true;
+      }
+      this->available.notify_all();
+    }
+
+  private:
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool closed = false;
+};
+
+inline std::shared_ptr<uint8_t> allocateAligned(size_t size) {
+  void* buffer;
+  if(posix_memalign(&buffer, PIPELINE_BUFFER_ALIGNMENT, size)) {
+    throw std::runtime_error("Unable to allocate a buffer of " + std::to_string(size) + " bytes");
+  }
+  return std::shared_ptr<uint8_t>(static_cast<uint8_t*>(buffer), free);
+}
+
+#endif
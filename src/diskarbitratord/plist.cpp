@@ -67,10 +67,8 @@ PlistNode& Plist::operator[](const std::string& key) {
   }
   CFTypeRef value = CFDictionaryGetValue((CFDictionaryRef)this->plist, keyCFStr);
   
-  PlistNode* n = new PlistNode(value, key);
-  this->generatedNodes.push_back(std::unique_ptr<PlistNode>(n));
-
-  return *n;
+  this->arena.emplace_back(value, key, &this->arena);
+  return this->arena.back();
 }
 
 // Access a value's key if it's a CFDictionary. Throws an exception if the key
@@ -94,10 +92,8 @@ PlistNode& PlistNode::operator[](const std::string& key) {
   }
   CFTypeRef nestedValue = CFDictionaryGetValue((CFDictionaryRef)this->value, keyCFStr);
   
-  PlistNode* n = new PlistNode(nestedValue, key);
-  this->generatedNodes.push_back(std::unique_ptr<PlistNode>(n));
-
-  return *n;
+  this->arena->emplace_back(nestedValue, key, this->arena);
+  return this->arena->back();
 }
 
 // Access the value in index i if the node's value is a CFArray. Throws an 
@@ -119,10 +115,104 @@ PlistNode& PlistNode::operator[](long long int i) {
 
   CFTypeRef nestedValue = CFArrayGetValueAtIndex((CFArrayRef)this->value, i);
   
-  PlistNode* n = new PlistNode(nestedValue, this->keyName);
-  this->generatedNodes.push_back(std::unique_ptr<PlistNode>(n));
+  this->arena->emplace_back(nestedValue, this->keyName, this->arena);
+  return this->arena->back();
+}
+
+PlistPath& PlistPath::key(const std::string& name) {
+  CFStringRef keyCFStr = CFStringCreateWithCString(NULL, name.c_str(), kCFStringEncodingUTF8);
+  if(keyCFStr == NULL) {
+    throw std::runtime_error("Unable to create CF string with key");
+  }
+
+  Component c;
+  c.type = COMPONENT_KEY;
+  c.name = name;
+  c.cfKey = std::shared_ptr<const void>(keyCFStr, [](const void* k) {
+    CFRelease(k);
+  });
+  c.index = 0;
+  this->components.push_back(std::move(c));
+  return *this;
+}
 
-  return *n;
+PlistPath& PlistPath::index(long long int i) {
+  Component c;
+  c.type = COMPONENT_INDEX;
+  c.name = "[" + std::to_string(i) + "]";
+  c.index = i;
+  this->components.push_back(std::move(c));
+  return *this;
+}
+
+PlistPath& PlistPath::each() {
+  Component c;
+  c.type = COMPONENT_EACH;
+  c.name = "[*]";
+  c.index = 0;
+  this->components.push_back(std::move(c));
+  return *this;
+}
+
+// Walks the path one component at a time, keeping the set of values matched so
+// far. Nodes are only generated for the values at the end of the path, so
+// intermediate dictionaries and arrays cost nothing but a CF lookup.
+PlistQueryResult Plist::query(const PlistPath& path) {
+  PlistQueryResult result;
+  result.ok = false;
+
+  std::vector<CFTypeRef> current = {this->plist};
+  std::vector<CFTypeRef> next;
+  std::string walked = "";
+
+  for(const auto& c : path.components) {
+    next.clear();
+    for(const auto& value : current) {
+      CFTypeID type = CFGetTypeID(value);
+      if(c.type == PlistPath::COMPONENT_KEY) {
+        if(type != CFDictionaryGetTypeID()) {
+          result.error = "Key " + walked + " is not a dictionary. Can't access nested key " + c.name;
+          return result;
+        }
+        CFTypeRef nestedValue = NULL;
+        if(!CFDictionaryGetValueIfPresent((CFDictionaryRef)value, c.cfKey.get(), &nestedValue)) {
+          result.error = "Key " + walked + "/" + c.name + " not found";
+          return result;
+        }
+        next.push_back(nestedValue);
+      } else {
+        if(type != CFArrayGetTypeID()) {
+          result.error = "Key " + walked + " is not a list. Can't access elements";
+          return result;
+        }
+        CFIndex len = CFArrayGetCount((CFArrayRef)value);
+        if(c.type == PlistPath::COMPONENT_EACH) {
+          for(CFIndex i = 0; i < len; ++i) {
+            next.push_back(CFArrayGetValueAtIndex((CFArrayRef)value, i));
+          }
+        } else {
+          long long int i = c.index;
+          if(i < 0) {
+            i += len;
+          }
+          if(i < 0 || i >= len) {
+            result.error = "Index out of bounds in " + walked + ": " + std::to_string(c.index);
+            return result;
+          }
+          next.push_back(CFArrayGetValueAtIndex((CFArrayRef)value, i));
+        }
+      }
+    }
+    walked += (c.type == PlistPath::COMPONENT_KEY ? "/" : "") + c.name;
+    current.swap(next);
+  }
+
+  for(const auto& value : current) {
+    this->arena.emplace_back(value, walked, &this->arena);
+    result.nodes.push_back(&this->arena.back());
+  }
+  result.ok = true;
+  return result;
 }
 
 size_t PlistNode::size() {
@@ -21,6 +21,8 @@
 #ifndef PLIST_HPP_
 #define PLIST_HPP_
 
+#include <deque>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -40,7 +42,7 @@
 // want, while being correct and easy to use.
 class PlistNode {
   public:
-    PlistNode(CFTypeRef& v, const std::string& key) : value(v), keyName(key) {};
+    PlistNode(CFTypeRef v, const std::string& key, std::deque<PlistNode>* arena) : value(v), keyName(key), arena(arena) {};
     PlistNode& operator[](const std::string& key);
     PlistNode& operator[](long long int i);
     size_t size();
@@ -51,11 +53,55 @@ class PlistNode {
     }
 
   private:
-    std::vector<std::unique_ptr<PlistNode>> generatedNodes;
     CFTypeRef value;
     const std::string keyName;
+    // Owned by the Plist this node was generated from
+    std::deque<PlistNode>* arena;
 };
 
+// A precompiled path expression. The CF keys are created once when the path
+// is built, so the same path can be resolved against any number of plists
+// without allocating anything but the resulting nodes. Paths are built with
+// chained calls, for example, to get every dev-entry from an attach output:
+// const PlistPath devEntries = PlistPath().key("system-entities").each().key("dev-entry");
+class PlistPath {
+  public:
+    // Descend into a dictionary key
+    PlistPath& key(const std::string& name);
+    // Descend into a single array element. Negative indexes count from the back
+    PlistPath& index(long long int i);
+    // Descend into every element of an array
+    PlistPath& each();
+
+  private:
+    friend class Plist;
+
+    enum ComponentType {
+      COMPONENT_KEY,
+      COMPONENT_INDEX,
+      COMPONENT_EACH
+    };
+
+    typedef struct Component {
+      ComponentType type;
+      std::string name;
+      // Shared so copying a path doesn't need to retain every key again
+      std::shared_ptr<const void> cfKey;
+      long long int index;
+    } Component;
+
+    std::vector<Component> components;
+};
+
+// Result of resolving a PlistPath. Instead of throwing on a missing key, type
+// mismatch or out of bounds index, `ok` is false and `error` says where the
+// path stopped matching.
+typedef struct PlistQueryResult {
+  bool ok;
+  std::string error;
+  std::vector<PlistNode*> nodes;
+} PlistQueryResult;
+
 // The plist wrapper. Accessing one of its elements returns a PlistNode object.
 // An example for using this would be:
 // const T value = plist["keyName"]["nestedKeyName"][4].get<T>();
@@ -68,10 +114,14 @@ class Plist {
     Plist(const std::string& data);
     ~Plist();
     PlistNode& operator[](const std::string& key);
+    // Resolves the whole path in a single traversal
+    PlistQueryResult query(const PlistPath& path);
 
   private:
     CFPropertyListRef plist;
-    std::vector<std::unique_ptr<PlistNode>> generatedNodes;
+    // Every node handed out by this plist lives here. A deque never moves its
+    // elements, so references stay valid for as long as the plist does.
+    std::deque<PlistNode> arena;
 };
 
 #endif
@@ -0,0 +1,483 @@
+/***************************************************************************
+ *   rescue.cpp  --  This file is part of diskarbitratord.                 *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#include <algorithm>
+#include <cinttypes>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_scan.hpp"
+#include "hash.hpp"
+#include "image_reader.hpp"
+#include "pipeline.hpp"
+#include "rescue.hpp"
+#include "scope_guard.hpp"
+
+RescueMap::RescueMap(uint64_t size) : diskSize(size) {
+  if(size) {
+    this->runs[0] = {size, RESCUE_UNTRIED};
+    this->totals[RESCUE_UNTRIED] = size;
+  }
+}
+
+void RescueMap::split(uint64_t offset) {
+  if(offset >= this->diskSize) {
+    return;
+  }
+  auto it = std::prev(this->runs.upper_bound(offset));
+  if(it->first == offset) {
+    return;
+  }
+  const uint64_t end = it->first + it->second.length;
+  it->second.length = offset - it->first;
+  this->runs[offset] = {end - offset, it->second.status};
+}
+
+void RescueMap::merge(std::map<uint64_t, RescueRegion>::iterator it) {
+  auto next = std::next(it);
+  if(next != this->runs.end() && next->second.status == it->second.status) {
+    it->second.length += next->second.length;
+    this->runs.erase(next);
+  }
+  if(it != this->runs.begin()) {
+    auto previous = std::prev(it);
+    if(previous->second.status == it->second.status) {
+      previous->second.length += it->second.length;
+      this->runs.erase(it);
+    }
+  }
+}
+
+void RescueMap::set(uint64_t offset, uint64_t length, RescueStatus status) {
+  length = std::min(length, this->diskSize - std::min(offset, this->diskSize));
+  if(!length) {
+    return;
+  }
+  this->split(offset);
+  this->split(offset + length);
+  auto it = this->runs.find(offset);
+  while(it != this->runs.end() && it->first < offset + length) {
+    this->totals[it->second.status] -= it->second.length;
+    it = this->runs.erase(it);
+  }
+  it = this->runs.emplace(offset, RescueRegion{length, status}).first;
+  this->totals[status] += length;
+  this->merge(it);
+}
+
+bool RescueMap::next(uint64_t offset, RescueStatus status, uint64_t& start, uint64_t& length) const {
+  if(offset >= this->diskSize) {
+    return false;
+  }
+  for(auto it = std::prev(this->runs.upper_bound(offset)); it != this->runs.end(); ++it) {
+    if(it->second.status != status) {
+      continue;
+    }
+    start = std::max(it->first, offset);
+    length = it->first + it->second.length - start;
+    return true;
+  }
+  return false;
+}
+
+uint64_t RescueMap::bytes(RescueStatus status) const {
+  auto it = this->totals.find(status);
+  return it == this->totals.end() ? 0 : it->second;
+}
+
+static bool isRescueStatus(char c) {
+  return c == RESCUE_UNTRIED || c == RESCUE_FAILED || c == RESCUE_BAD || c == RESCUE_GOOD;
+}
+
+// The format is GNU ddrescue's: comments, a line with the current position,
+// phase and pass, and then one line per run with its offset, size and status
+void RescueMap::load(const std::string& path) {
+  std::ifstream file(path);
+  if(!file) {
+    throw std::runtime_error("Unable to open rescue map " + path + ": " + std::string(strerror(errno)));
+  }
+  RescueMap loaded(this->diskSize);
+  loaded.runs.clear();
+  loaded.totals.clear();
+  bool haveState = false;
+  uint64_t end = 0;
+  std::string line;
+  while(std::getline(file, line)) {
+    if(line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string first;
+    std::string second;
+    std::string third;
+    fields >> first >> second >> third;
+    try {
+      if(!haveState) {
+        // ddrescue's non-scraped ('/') and other phases mean nothing to us
+        // beyond not being finished
+        loaded.position = std::stoull(first, nullptr, 0);
+        loaded.finished = second == "+";
+        loaded.pass = third.size() ? std::stoul(third) : 1;
+        loaded.pass = loaded.pass ? loaded.pass - 1 : 0;
+        haveState = true;
+        continue;
+      }
+      const uint64_t offset = std::stoull(first, nullptr, 0);
+      const uint64_t length = std::stoull(second, nullptr, 0);
+      char status = third.size() == 1 ? third[0] : 0;
+      if(status == '/') {
+        status = RESCUE_FAILED;
+      }
+      if(offset != end || !length || !isRescueStatus(status)) {
+        throw std::invalid_argument(line);
+      }
+      // Whoever wrote it may not have merged runs
+      if(offset && loaded.runs.rbegin()->second.status == status) {
+        loaded.runs.rbegin()->second.length += length;
+      } else {
+        loaded.runs[offset] = {length, static_cast<RescueStatus>(status)};
+      }
+      loaded.totals[static_cast<RescueStatus>(status)] += length;
+      end += length;
+    } catch(const std::logic_error& e) {
+      throw std::runtime_error("Invalid line in rescue map " + path + ": " + line);
+    }
+  }
+  if(!haveState || end != this->diskSize) {
+    throw std::runtime_error("Rescue map " + path + " isn't for a disk of " + std::to_string(this->diskSize) + " bytes");
+  }
+  *this = loaded;
+}
+
+void RescueMap::save(const std::string& path) const {
+  std::string contents = "# Rescue map written by diskarbitratord, in GNU ddrescue's mapfile format\n";
+  contents += "# current_pos  current_status  current_pass\n";
+  char line[64];
+  char phase = RESCUE_GOOD;
+  if(!this->finished) {
+    phase = this->bytes(RESCUE_UNTRIED) ? RESCUE_UNTRIED : this->bytes(RESCUE_FAILED) ? RESCUE_FAILED : RESCUE_BAD;
+  }
+  snprintf(line, sizeof(line), "0x%08" PRIX64 "     %c               %u\n", this->position, phase, this->pass + 1);
+  contents += line;
+  contents += "#      pos        size  status\n";
+  for(const auto& run : this->runs) {
+    snprintf(line, sizeof(line), "0x%08" PRIX64 "  0x%08" PRIX64 "  %c\n", run.first, run.second.length, run.second.status);
+    contents += line;
+  }
+
+  const std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    throw std::runtime_error("Unable to save rescue map " + temporary + ": " + std::string(strerror(errno)));
+  }
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+  pwriteFully(fd, contents.data(), contents.size(), 0);
+  if(fsync(fd) != 0 || rename(temporary.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Unable to save rescue map " + path + ": " + std::string(strerror(errno)));
+  }
+}
+
+DeviceRescueSource::DeviceRescueSource(const std::string& path) : path(path) {
+  this->fd = openAcquisitionSource(path);
+  try {
+    this->diskSize = fileOrDeviceSize(this->fd);
+    this->sector = deviceSectorSize(this->fd);
+  } catch(...) {
+    close(this->fd);
+    throw;
+  }
+}
+
+DeviceRescueSource::~DeviceRescueSource() {
+  close(this->fd);
+}
+
+uint64_t DeviceRescueSource::size() const {
+  return this->diskSize;
+}
+
+uint32_t DeviceRescueSource::sectorSize() const {
+  return this->sector;
+}
+
+bool DeviceRescueSource::read(void* buffer, size_t len, uint64_t offset) {
+  // O_DIRECT wants whole sectors, even for the last bit of a disk that
+  // doesn't end on one
+  const size_t aligned = (len + this->sector - 1) / this->sector * this->sector;
+  size_t total = 0;
+  while(total < len) {
+    ssize_t bytesRead = pread(this->fd, static_cast<uint8_t*>(buffer) + total, aligned - total, offset + total);
+    if(bytesRead < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      // Those are our fault, not the disk's
+      if(errno == EINVAL || errno == EBADF || errno == EFAULT) {
+        throw std::runtime_error("Unable to read " + this->path + ": " + std::string(strerror(errno)));
+      }
+      return false;
+    }
+    if(bytesRead == 0) {
+      return false;
+    }
+    total += bytesRead;
+  }
+  return true;
+}
+
+FaultyRescueSource::FaultyRescueSource(RescueSource& parent, uint32_t delayUs) : parent(parent), delayUs(delayUs) {}
+
+void FaultyRescueSource::addBadRange(uint64_t offset, uint64_t length, unsigned int failures) {
+  this->badRanges.push_back({offset, length, failures});
+}
+
+uint64_t FaultyRescueSource::size() const {
+  return this->parent.size();
+}
+
+uint32_t FaultyRescueSource::sectorSize() const {
+  return this->parent.sectorSize();
+}
+
+bool FaultyRescueSource::read(void* buffer, size_t len, uint64_t offset) {
+  ++this->reads;
+  bool failed = false;
+  for(auto& range : this->badRanges) {
+    if(offset < range.offset + range.length && range.offset < offset + len && range.failures) {
+      --range.failures;
+      failed = true;
+    }
+  }
+  if(failed) {
+    ++this->failedReads;
+    std::this_thread::sleep_for(std::chrono::microseconds(this->delayUs));
+    return false;
+  }
+  this->bytesRead += len;
+  return this->parent.read(buffer, len, offset);
+}
+
+typedef struct RescuePass {
+  RescueStatus status;
+  uint32_t blockSize;
+  bool skip;
+} RescuePass;
+
+static std::vector<RescuePass> rescuePasses(uint32_t sectorSize, unsigned int retries) {
+  std::vector<RescuePass> passes = {
+    {RESCUE_UNTRIED, RESCUE_COPY_SIZE, true},
+    {RESCUE_UNTRIED, RESCUE_COPY_SIZE, false},
+  };
+  for(uint32_t blockSize = RESCUE_COPY_SIZE / RESCUE_TRIM_FACTOR; blockSize > sectorSize; blockSize /= RESCUE_TRIM_FACTOR) {
+    passes.push_back({RESCUE_FAILED, blockSize, false});
+  }
+  passes.push_back({RESCUE_FAILED, sectorSize, false});
+  for(unsigned int i = 0; i < retries; ++i) {
+    passes.push_back({RESCUE_BAD, sectorSize, false});
+  }
+  return passes;
+}
+
+// The image starts out as one big hole, and every part of it is only written
+// once, so zeroes never need writing. Returns how many were skipped
+static uint64_t writeRescued(int fd, const uint8_t* data, size_t len, uint64_t offset, bool sparse) {
+  if(!sparse) {
+    pwriteFully(fd, data, len, offset);
+    return 0;
+  }
+  uint64_t skipped = 0;
+  size_t position = 0;
+  while(position < len) {
+    const bool zero = blockIsFilled(data + position, std::min<size_t>(ACQUIRE_SPARSE_BLOCK_SIZE, len - position), 0);
+    size_t end = position + ACQUIRE_SPARSE_BLOCK_SIZE;
+    while(end < len && blockIsFilled(data + end, std::min<size_t>(ACQUIRE_SPARSE_BLOCK_SIZE, len - end), 0) == zero) {
+      end += ACQUIRE_SPARSE_BLOCK_SIZE;
+    }
+    end = std::min(end, len);
+    if(zero) {
+      skipped += end - position;
+    } else {
+      pwriteFully(fd, data + position, end - position, offset + position);
+    }
+    position = end;
+  }
+  return skipped;
+}
+
+static std::string hashImage(int fd, uint64_t size) {
+  std::shared_ptr<uint8_t> buffer = allocateAligned(ACQUIRE_BUFFER_SIZE);
+  SHA256 hash;
+  for(uint64_t offset = 0; offset < size;) {
+    const size_t len = std::min<uint64_t>(ACQUIRE_BUFFER_SIZE, size - offset);
+    if(preadFully(fd, buffer.get(), len, offset) != len) {
+      throw std::runtime_error("Short read hashing the image at offset " + std::to_string(offset));
+    }
+    hash.update(buffer.get(), len);
+    offset += len;
+  }
+  return hash.finish();
+}
+
+AcquireResult rescueDisk(RescueSource& source, const std::string& destination, const AcquireOptions& options, std::function<bool(const AcquireProgress&)> onProgress, IOScheduler::Job* ioJob) {
+  if(options.container) {
+    throw std::runtime_error("Rescues can only be written into raw images");
+  }
+  auto start = std::chrono::steady_clock::now();
+  const uint64_t size = source.size();
+  RescueMap map(size);
+
+  // Only an image with a map can be written into, its map says which parts
+  // of it are still missing. Anything else could be evidence
+  struct stat st;
+  const bool resuming = stat(options.rescueMap.c_str(), &st) == 0;
+  int fd;
+  if(resuming) {
+    map.load(options.rescueMap);
+    fd = open(destination.c_str(), O_RDWR);
+  } else {
+    fd = open(destination.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  }
+  if(fd == -1) {
+    throw std::runtime_error("Unable to open " + destination + ": " + std::string(strerror(errno)));
+  }
+  ScopeGuard fdGuard([fd]() {
+    close(fd);
+  });
+  if(ftruncate(fd, size) != 0) {
+    throw std::runtime_error("Unable to set the image size: " + std::string(strerror(errno)));
+  }
+  auto saveMap = [&]() {
+    if(fdatasync(fd) != 0) {
+      throw std::runtime_error("Unable to flush " + destination + ": " + std::string(strerror(errno)));
+    }
+    map.save(options.rescueMap);
+  };
+  if(!resuming) {
+    saveMap();
+  }
+
+  AcquireResult result = {};
+  AcquireProgress progress = {};
+  progress.bytesTotal = size;
+  const uint64_t goodAtStart = map.bytes(RESCUE_GOOD);
+  auto lastProgress = start;
+  auto lastSave = start;
+  auto reportProgress = [&]() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - start).count();
+    progress.bytesWritten = map.bytes(RESCUE_GOOD);
+    progress.bytesRead = size - map.bytes(RESCUE_UNTRIED);
+    progress.bytesBad = map.bytes(RESCUE_FAILED) + map.bytes(RESCUE_BAD);
+    progress.bytesPerSecond = seconds > 0 ? (progress.bytesWritten - goodAtStart) / seconds : 0;
+    progress.pass = map.pass + 1;
+    lastProgress = now;
+    return onProgress(progress);
+  };
+
+  const std::vector<RescuePass> passes = rescuePasses(source.sectorSize(), options.retries);
+  std::shared_ptr<uint8_t> buffer = allocateAligned(RESCUE_COPY_SIZE);
+  std::unique_ptr<ScopedIOPriority> priority;
+  if(ioJob) {
+    priority.reset(new ScopedIOPriority(ioJob->ioClass(), ioJob->weight()));
+  }
+  bool stopped = false;
+  try {
+    for(; !map.finished && map.pass < passes.size(); ++map.pass, map.position = 0) {
+      const RescuePass& pass = passes[map.pass];
+      const RescueStatus failStatus = pass.blockSize <= source.sectorSize() ? RESCUE_BAD : RESCUE_FAILED;
+      uint64_t skip = 0;
+      uint64_t offset;
+      uint64_t length;
+      while(!stopped && map.next(map.position, pass.status, offset, length)) {
+        // Reads stay aligned to their own size, the way the disk likes them
+        const uint64_t end = std::min(offset + length, (offset / pass.blockSize + 1) * pass.blockSize);
+        const size_t len = end - offset;
+        map.position = end;
+        if(ioJob) {
+          ioJob->acquire(len);
+        }
+        if(source.read(buffer.get(), len, offset)) {
+          result.sparseBytes += writeRescued(fd, buffer.get(), len, offset, options.sparse);
+          map.set(offset, len, RESCUE_GOOD);
+          skip = 0;
+        } else {
+          ++result.readErrors;
+          map.set(offset, len, failStatus);
+          if(pass.skip) {
+            skip = skip ? std::min<uint64_t>(skip * 2, RESCUE_MAX_SKIP) : RESCUE_MIN_SKIP;
+            map.position = std::min(end + skip, size);
+          }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if(now - lastProgress >= std::chrono::milliseconds(ACQUIRE_PROGRESS_INTERVAL_MS) && !reportProgress()) {
+          stopped = true;
+        }
+        if(now - lastSave >= std::chrono::milliseconds(RESCUE_MAP_SAVE_INTERVAL_MS)) {
+          saveMap();
+          lastSave = now;
+        }
+      }
+      if(stopped) {
+        break;
+      }
+    }
+    map.finished = !stopped;
+    saveMap();
+  } catch(...) {
+    // Keep whatever was rescued up to here
+    try {
+      saveMap();
+    } catch(...) {
+    }
+    throw;
+  }
+
+  result.bytes = map.bytes(RESCUE_GOOD);
+  result.badBytes = map.bytes(RESCUE_FAILED) + map.bytes(RESCUE_BAD);
+  result.complete = map.finished;
+  if(result.complete) {
+    result.sha256 = hashImage(fd, size);
+    // Resumed rescues don't know what earlier runs left as holes, the
+    // filesystem does
+    if(fstat(fd, &st) == 0) {
+      result.storedBytes = st.st_blocks * 512;
+    }
+    reportProgress();
+  }
+  result.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
@@ -0,0 +1,182 @@
+/***************************************************************************
+ *   rescue.hpp  --  This file is part of diskarbitratord.                 *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+
+#ifndef RESCUE_HPP_
+#define RESCUE_HPP_
+
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "acquisition.hpp"
+#include "io_scheduler.hpp"
+
+// The first passes read this much at a time, so healthy parts of the disk go
+// as fast as they would in a normal acquisition
+#define RESCUE_COPY_SIZE (1024 * 1024)
+// Failed reads are retried with blocks this many times smaller, down to a
+// single sector
+#define RESCUE_TRIM_FACTOR 16
+// After a failed read the first pass jumps ahead this much, twice as far on
+// every error in a row. Bad regions tend to come in clusters, and a drive can
+// spend seconds on every read in them
+#define RESCUE_MIN_SKIP (64 * 1024)
+#define RESCUE_MAX_SKIP (1024ULL * 1024 * 1024)
+// How often the map is saved. Anything rescued since the last save is just
+// read again if the daemon dies
+#define RESCUE_MAP_SAVE_INTERVAL_MS 5000
+
+// Same letters as GNU ddrescue mapfiles use, so its tools can read our maps
+// and the other way around
+enum RescueStatus {
+  RESCUE_UNTRIED = '?',
+  // Failed with a read bigger than a sector, there may be good data in there
+  RESCUE_FAILED = '*',
+  RESCUE_BAD = '-',
+  RESCUE_GOOD = '+',
+};
+
+typedef struct RescueRegion {
+  uint64_t length;
+  RescueStatus status;
+} RescueRegion;
+
+// What's known about every byte of the disk, as runs of the same status
+// keyed by offset. Neighbouring runs never share a status
+class RescueMap {
+  public:
+    // All untried
+    RescueMap(uint64_t size);
+
+    void set(uint64_t offset, uint64_t length, RescueStatus status);
+    // First run with `status` at or after `offset`, cut to start there.
+    // Returns false if there's none
+    bool next(uint64_t offset, RescueStatus status, uint64_t& start, uint64_t& length) const;
+    uint64_t bytes(RescueStatus status) const;
+
+    uint64_t size() const {
+      return this->diskSize;
+    }
+
+    const std::map<uint64_t, RescueRegion>& regions() const {
+      return this->runs;
+    }
+
+    // Replaces everything with what's in the mapfile at `path`. Throws if it
+    // can't be parsed or is for a disk of another size
+    void load(const std::string& path);
+    // Atomically, the old map stays in place until the new one is complete
+    void save(const std::string& path) const;
+
+    // Where the rescue was when the map was saved, so it resumes right there
+    unsigned int pass = 0;
+    uint64_t position = 0;
+    bool finished = false;
+
+  private:
+    // Makes sure a run starts at `offset`
+    void split(uint64_t offset);
+    void merge(std::map<uint64_t, RescueRegion>::iterator it);
+
+    uint64_t diskSize;
+    std::map<uint64_t, RescueRegion> runs;
+    std::map<RescueStatus, uint64_t> totals;
+};
+
+// Where rescues read from
+class RescueSource {
+  public:
+    virtual ~RescueSource() {}
+    virtual uint64_t size() const = 0;
+    virtual uint32_t sectorSize() const = 0;
+    // Reads exactly `len` bytes at `offset`, which never go past the end of
+    // the disk. `buffer` is aligned and has room for `len` rounded up to
+    // whole sectors. Returns false if any of it couldn't be read
+    virtual bool read(void* buffer, size_t len, uint64_t offset) = 0;
+};
+
+// A device or raw image, read without going through the buffer cache
+class DeviceRescueSource : public RescueSource {
+  public:
+    DeviceRescueSource(const std::string& path);
+    ~DeviceRescueSource();
+    uint64_t size() const override;
+    uint32_t sectorSize() const override;
+    bool read(void* buffer, size_t len, uint64_t offset) override;
+
+  private:
+    std::string path;
+    int fd;
+    uint64_t diskSize;
+    uint32_t sector;
+};
+
+// Stands in for a failing disk, for trying rescues out on healthy ones (or
+// files). Reads touching a bad range fail, and each failure takes `delayUs`
+// like a drive retrying internally would. Ranges with a limited number of
+// failures start reading fine after that many, the way weak sectors
+// sometimes do.
+class FaultyRescueSource : public RescueSource {
+  public:
+    FaultyRescueSource(RescueSource& parent, uint32_t delayUs = 0);
+    void addBadRange(uint64_t offset, uint64_t length, unsigned int failures = UINT_MAX);
+    uint64_t size() const override;
+    uint32_t sectorSize() const override;
+    bool read(void* buffer, size_t len, uint64_t offset) override;
+
+    uint64_t reads = 0;
+    uint64_t failedReads = 0;
+    uint64_t bytesRead = 0;
+
+  private:
+    typedef struct BadRange {
+      uint64_t offset;
+      uint64_t length;
+      unsigned int failures;
+    } BadRange;
+
+    RescueSource& parent;
+    uint32_t delayUs;
+    std::vector<BadRange> badRanges;
+};
+
+// Images a failing disk the way GNU ddrescue does. The first pass reads big
+// blocks and jumps ahead on errors, leaving what it jumped over for a second
+// pass that doesn't. Whatever failed is then read again in smaller and
+// smaller blocks down to single sectors, and the sectors that still fail get
+// `options.retries` more attempts. Unreadable sectors are left as zeroes (or
+// rather holes) in the image.
+//
+// The map at `options.rescueMap` says which parts of the disk are good, bad
+// or not tried yet. If it exists the rescue resumes from it into the existing
+// `destination`, otherwise both are created. The image is flushed before
+// every map save, so the map never claims more than the image has. The hash
+// is only computed once every pass is done. Reads wait for `ioJob`'s turn,
+// if there's one.
+AcquireResult rescueDisk(RescueSource& source, const std::string& destination, const AcquireOptions& options, std::function<bool(const AcquireProgress&)> onProgress, IOScheduler::Job* ioJob = nullptr);
+
+#endif
@@ -18,6 +18,8 @@
  *                                                                         *
  ***************************************************************************/
 
+#include <algorithm>
+
 #include <libgen.h>
 #include <sys/syslimits.h>
 #include <sys/socket.h>
@@ -85,9 +87,33 @@ int openSocket(const std::string& socketPath) {
   return sockfd;
 }
 
-void RunServer(const std::string& socketPath) {
+void RunServer(const std::string& socketPath, const std::string& nbdSocketPath, const std::string& baselineDir) {
   // Service implementation, this has all the handlers for the gRPC calls
-  DiskAbitratorServiceImpl service = DiskAbitratorServiceImpl();
+  DiskAbitratorServiceImpl service;
+
+  if(nbdSocketPath.size()) {
+    std::string dirpath = std::string(dirname(const_cast<char*>(nbdSocketPath.c_str())));
+    if(mkpath(dirpath.c_str(), 0755)) {
+      LOG(ERROR) << "Unable to create NBD socket directory " << dirpath;
+      return;
+    }
+    try {
+      service.nbd.reset(new NBDServer(nbdSocketPath));
+    } catch(const std::runtime_error& e) {
+      LOG(ERROR) << e.what();
+      return;
+    }
+    LOG(INFO) << "NBD server listening on " << nbdSocketPath;
+  }
+
+  if(baselineDir.size()) {
+    if(mkpath(baselineDir, 0700)) {
+      LOG(ERROR) << "Unable to create baseline directory " << baselineDir;
+      return;
+    }
+    service.baselineDir = baselineDir;
+    LOG(INFO) << "Keeping disk baselines in " << baselineDir;
+  }
 
   // Before we start the server, we can start processing DiskArbitration
   // framework callbacks for the disks currently in the system.
@@ -194,6 +220,7 @@ void DiskAbitratorServiceImpl::stopIntercept() {
 }
 
 void DiskAbitratorServiceImpl::addDisk(std::shared_ptr<diskarbitrator::Disk>& disk) {
+  const std::lock_guard<std::mutex> lock(this->disksMutex);
   if(this->disks.find(disk->disk()) != this->disks.end()) {
     LOG(WARNING) << "Attempted to add a disk with key: " << disk << " which already exists";
     return;
@@ -202,6 +229,7 @@ void DiskAbitratorServiceImpl::addDisk(std::shared_ptr<diskarbitrator::Disk>& di
 }
 
 void DiskAbitratorServiceImpl::removeDisk(const std::string& disk) {
+  const std::lock_guard<std::mutex> lock(this->disksMutex);
   if(this->disks.find(disk) == this->disks.end()) {
     LOG(WARNING) << "Attempted to delete a disk with key: " << disk << " which does not exist";
     return;
@@ -210,10 +238,12 @@ void DiskAbitratorServiceImpl::removeDisk(const std::string& disk) {
 }
 
 bool DiskAbitratorServiceImpl::diskExists(const std::string& disk) {
+  const std::lock_guard<std::mutex> lock(this->disksMutex);
   return this->disks.find(disk) != this->disks.end();
 }
 
 void DiskAbitratorServiceImpl::addChildToParent(const std::string& disk, const std::string& parentDisk) {
+  const std::lock_guard<std::mutex> lock(this->disksMutex);
   if(this->disks.find(parentDisk) == this->disks.end()) {
     throw std::runtime_error("Attempted to add child disk " + disk + " to parent " + parentDisk + ", but the parent disk does not exist");
   }
@@ -229,6 +259,7 @@ void DiskAbitratorServiceImpl::addChildToParent(const std::string& disk, const s
 }
 
 void DiskAbitratorServiceImpl::removeChildFromParent(const std::string& disk, const std::string& parentDisk) {
+  const std::lock_guard<std::mutex> lock(this->disksMutex);
   if(this->disks.find(parentDisk) == this->disks.end()) {
     throw std::runtime_error("Attempted to remove child disk " + disk + " to parent " + parentDisk + ", but the parent disk does not exist");
   }
@@ -249,6 +280,7 @@ void DiskAbitratorServiceImpl::removeChildFromParent(const std::string& disk, co
 }
 
 const std::string DiskAbitratorServiceImpl::getParentDisk(const std::string& disk) {
+  const std::lock_guard<std::mutex> lock(this->disksMutex);
   if(this->disks.find(disk) == this->disks.end()) {
     throw std::runtime_error("Attempted to fetch parent disk from disk " + disk + ", but it does not exist");
   }
@@ -257,9 +289,134 @@ const std::string DiskAbitratorServiceImpl::getParentDisk(const std::string& dis
 }
 
 void DiskAbitratorServiceImpl::updateDiskDescription(const std::string& disk, const diskarbitrator::DiskDescription& description) {
+  const std::lock_guard<std::mutex> lock(this->disksMutex);
   if(this->disks.find(disk) == this->disks.end()) {
     throw std::runtime_error("Attempted to change disk description from disk " + disk + ", but it does not exist");
   }
   std::shared_ptr<diskarbitrator::Disk> d = this->disks[disk];
   *(d->mutable_description()) = description;
 }
+
+void DiskAbitratorServiceImpl::fillProbedVolume(const diskarbitrator::Disk& disk, diskarbitrator::DiskDescription& description) {
+  if(description.has_volume_kind() && description.volume_kind().size()) {
+    return;
+  }
+  std::shared_ptr<const FilesystemInfo> info;
+  if(description.media_uuid().size()) {
+    info = this->volumeCache.get(description.media_uuid());
+  }
+  auto parent = this->disks.find(disk.parent_disk());
+  if(info == nullptr && disk.parent_disk().size() && parent != this->disks.end()) {
+    // MBR slices are numbered after their partition, diskNsM
+    const std::string& parentUUID = parent->second->description().media_uuid();
+    size_t slice = disk.disk().rfind('s');
+    if(parentUUID.size() && slice != std::string::npos && slice >= disk.parent_disk().size()) {
+      info = this->volumeCache.get(parentUUID + ":" + disk.disk().substr(slice + 1));
+    }
+  }
+  if(info == nullptr || info->kind == FS_UNKNOWN) {
+    return;
+  }
+  description.set_volume_kind(volumeKind(info->kind));
+  if(!description.has_volume_name() && info->label.size()) {
+    description.set_volume_name(info->label);
+  }
+  if(!description.has_volume_uuid() && info->uuid.size()) {
+    description.set_volume_uuid(info->uuid);
+  }
+}
+
+BaselineResult DiskAbitratorServiceImpl::takeBaseline(const std::string& disk, const std::string& mediaUUID, BaselineOptions options, std::function<bool(const BaselineProgress&)> onProgress) {
+  const std::string path = baselinePath(this->baselineDir, mediaUUID);
+  {
+    const std::lock_guard<std::mutex> lock(this->baselineMutex);
+    if(this->baselinesStopping) {
+      throw std::runtime_error("The daemon is stopping");
+    }
+    if(!this->baselinesRunning.insert(std::make_pair(mediaUUID, disk)).second) {
+      throw std::runtime_error("A baseline of " + disk + " is already being taken");
+    }
+  }
+  ScopeGuard runningGuard([this, &mediaUUID]() {
+    const std::lock_guard<std::mutex> lock(this->baselineMutex);
+    this->baselinesRunning.erase(mediaUUID);
+    this->baselinesStopped.erase(mediaUUID);
+  });
+
+  options.bus = this->busOf(disk);
+  BaselineResult result = buildBaseline(resolveDevicePath(disk), options, this->baselinePool, [this, &mediaUUID, &onProgress](const BaselineProgress& progress) {
+    {
+      const std::lock_guard<std::mutex> lock(this->baselineMutex);
+      if(this->baselinesStopping || this->baselinesStopped.count(mediaUUID)) {
+        return false;
+      }
+    }
+    return onProgress(progress);
+  });
+  if(result.complete) {
+    saveBaseline(path, result.baseline);
+    LOG(INFO) << "Baseline of " << disk << " saved in " << path << ", root " << result.root;
+  }
+  return result;
+}
+
+void DiskAbitratorServiceImpl::startBackgroundThread(const std::string& disk, std::function<void()> work) {
+  const std::lock_guard<std::mutex> lock(this->backgroundMutex);
+  if(this->backgroundStopping) {
+    return;
+  }
+  for(const std::thread::id& id : this->backgroundThreadsFinished) {
+    auto it = this->backgroundThreads.find(id);
+    if(it != this->backgroundThreads.end()) {
+      it->second.second.join();
+      this->backgroundThreads.erase(it);
+    }
+  }
+  this->backgroundThreadsFinished.clear();
+
+  // The thread can't say it's finished before it's in backgroundThreads, that
+  // takes the lock held here
+  std::thread thread([this, work]() {
+    ScopeGuard finishedGuard([this]() {
+      const std::lock_guard<std::mutex> lock(this->backgroundMutex);
+      this->backgroundThreadsFinished.push_back(std::this_thread::get_id());
+    });
+    work();
+  });
+  const std::thread::id id = thread.get_id();
+  this->backgroundThreads[id] = std::make_pair(disk, std::move(thread));
+}
+
+void DiskAbitratorServiceImpl::joinBackgroundThreads(const std::string& disk) {
+  std::vector<std::thread> threads;
+  {
+    const std::lock_guard<std::mutex> lock(this->backgroundMutex);
+    for(auto it = this->backgroundThreads.begin(); it != this->backgroundThreads.end();) {
+      if(disk.size() && it->second.first != disk) {
+        ++it;
+        continue;
+      }
+      // Its id may be given to a new thread once joined, so it can't stay
+      // around as finished either
+      auto finished = std::find(this->backgroundThreadsFinished.begin(), this->backgroundThreadsFinished.end(), it->first);
+      if(finished != this->backgroundThreadsFinished.end()) {
+        this->backgroundThreadsFinished.erase(finished);
+      }
+      threads.push_back(std::move(it->second.second));
+      it = this->backgroundThreads.erase(it);
+    }
+  }
+  // Without the lock, they take it on their way out
+  for(auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void DiskAbitratorServiceImpl::stopBaselines(const std::string& disk) {
+  const std::lock_guard<std::mutex> lock(this->baselineMutex);
+  for(const auto& running : this->baselinesRunning) {
+    if(running.second == disk) {
+      this->baselinesStopped.insert(running.first);
+    }
+  }
+}
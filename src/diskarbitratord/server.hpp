@@ -21,9 +21,17 @@
 #ifndef SERVER_HPP_
 #define SERVER_HPP_
 
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <vector>
+
+#include <unistd.h>
 
 #include <DiskArbitration/DiskArbitration.h>
 
@@ -34,8 +42,47 @@
 
 #include "diskarbitrator.grpc.pb.h"
 
+#include "acquisition.hpp"
+#include "allocation_map.hpp"
+#include "baseline.hpp"
+#include "block_cache.hpp"
+#include "block_reader.hpp"
+#include "container.hpp"
 #include "diskarbitration.hpp"
+#include "ewf.hpp"
+#include "fat_volume.hpp"
+#include "fs_probe.hpp"
 #include "hdiutil.hpp"
+#include "image_reader.hpp"
+#include "image_sniffer.hpp"
+#include "io_scheduler.hpp"
+#include "lru_cache.hpp"
+#include "nbd_server.hpp"
+#include "partition_table.hpp"
+#include "scope_guard.hpp"
+#include "thread_pool.hpp"
+#include "udif.hpp"
+
+// ReadImage streams the disk in messages of this size
+#define READ_IMAGE_CHUNK_SIZE (1024 * 1024)
+// VerifyImage sends progress every time it advances this much, in percent
+#define VERIFY_PROGRESS_STEP 1.0
+// Partitions of a new disk are probed this many at a time
+#define PROBE_THREADS 4
+// Probed filesystems remembered, by media UUID
+#define VOLUME_CACHE_SIZE 1024
+// Deeper than any path FAT can hold, ExtractFiles gives up past this
+#define EXTRACT_MAX_DEPTH 256
+// Threads reading ahead for ExtractFiles, shared by every call
+#define EXTRACT_THREADS 4
+// MapAllocation sends this many runs per message
+#define ALLOCATION_RUNS_PER_MESSAGE 1024
+// HashDisk sends this many segment hashes per message
+#define HASH_SEGMENTS_PER_MESSAGE 1024
+// DiffDisks sends this many extents per message at most
+#define DIFF_EXTENTS_PER_MESSAGE 1024
+// VerifyBaseline sends this many changed leaves per message
+#define BASELINE_LEAVES_PER_MESSAGE 1024
 
 class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Service {
   private:
@@ -43,8 +90,137 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
     void startIntercept();
     void stopIntercept();
     std::map<std::string, std::shared_ptr<diskarbitrator::Disk>> disks;
+    // DiskArbitration callbacks change disks while handlers and background
+    // threads read them
+    std::mutex disksMutex;
     DASessionRef approvalSession;
 
+    // Sends `file` and everything under it. Returns false once the client is
+    // gone. `visited` holds the first clusters of the directories already
+    // sent, so a corrupt volume can't loop forever
+    static bool extractTree(FATVolume& volume, const std::string& path, const FATFile& file, std::set<uint32_t>& visited, unsigned int depth, grpc::ServerContext* context, grpc::ServerWriter<diskarbitrator::ExtractFilesOutput>* writer) {
+      if(context->IsCancelled()) {
+        return false;
+      }
+      diskarbitrator::ExtractFilesOutput output;
+      if(path.size()) {
+        diskarbitrator::ExtractedFile* header = output.mutable_file();
+        header->set_path(path);
+        header->set_directory(file.directory);
+        header->set_size(file.size);
+        header->set_modified(file.modified);
+        if(!writer->Write(output)) {
+          return false;
+        }
+      }
+
+      if(file.directory) {
+        if(depth >= EXTRACT_MAX_DEPTH || !visited.insert(file.firstCluster).second) {
+          throw std::runtime_error("Directory " + path + " is nested too deep or loops back on itself, the volume is probably corrupt");
+        }
+        for(const auto& child : volume.listDirectory(file)) {
+          if(!extractTree(volume, path.size() ? path + "/" + child.name : child.name, child, visited, depth + 1, context, writer)) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      bool ok = true;
+      volume.readFile(file, [&output, &ok, context, writer](const uint8_t* data, size_t len) {
+        // Reads are much bigger than what a gRPC message should carry
+        for(size_t sent = 0; sent < len && ok; sent += READ_IMAGE_CHUNK_SIZE) {
+          output.set_data(data + sent, std::min<size_t>(READ_IMAGE_CHUNK_SIZE, len - sent));
+          ok = !context->IsCancelled() && writer->Write(output);
+        }
+        return ok;
+      });
+      return ok;
+    }
+
+    static void setVolumeInfo(const FilesystemInfo& info, diskarbitrator::VolumeInfo* volume) {
+      volume->set_kind(filesystemKindName(info.kind));
+      if(info.label.size()) {
+        volume->set_label(info.label);
+      }
+      if(info.uuid.size()) {
+        volume->set_uuid(info.uuid);
+      }
+      volume->set_block_size(info.blockSize);
+    }
+
+    // The bus `disk` hangs from, as DiskArbitration described it, empty if it
+    // isn't a disk we know about. Slices don't always have one of their own,
+    // their whole disk does
+    std::string busOf(const std::string& disk) {
+      const std::lock_guard<std::mutex> lock(this->disksMutex);
+      auto it = this->disks.find(bsdName(disk));
+      if(it == this->disks.end()) {
+        return "";
+      }
+      if(it->second->description().bus_path().size()) {
+        return it->second->description().bus_path();
+      }
+      auto parent = this->disks.find(it->second->parent_disk());
+      return parent != this->disks.end() ? parent->second->description().bus_path() : "";
+    }
+
+    // What checkpoints tell `disk` apart by, along with its contents. Same
+    // deal as the bus for slices
+    std::string identityOf(const std::string& disk) {
+      const std::lock_guard<std::mutex> lock(this->disksMutex);
+      auto it = this->disks.find(bsdName(disk));
+      if(it == this->disks.end()) {
+        return "";
+      }
+      const diskarbitrator::DiskDescription* description = &it->second->description();
+      auto parent = this->disks.find(it->second->parent_disk());
+      if(!description->device_model().size() && parent != this->disks.end()) {
+        description = &parent->second->description();
+      }
+      return description->device_vendor() + "/" + description->device_model() + "/" + description->device_revision();
+    }
+
+    // /dev/disk2s1 and /dev/rdisk2s1 are disk2s1
+    static std::string bsdName(const std::string& disk) {
+      std::string name = disk;
+      if(name.compare(0, strlen("/dev/"), "/dev/") == 0) {
+        name = name.substr(strlen("/dev/"));
+        if(name.compare(0, strlen("rdisk"), "rdisk") == 0) {
+          name = name.substr(1);
+        }
+      }
+      return name;
+    }
+
+    // Baselines are kept by it, so they follow the disk around whatever BSD
+    // name it gets. Empty if the disk isn't known or has none
+    std::string mediaUUIDOf(const std::string& disk) {
+      const std::lock_guard<std::mutex> lock(this->disksMutex);
+      auto it = this->disks.find(bsdName(disk));
+      return it != this->disks.end() ? it->second->description().media_uuid() : "";
+    }
+
+    // Copies `disk` into `out`, so it can be used while the callbacks carry
+    // on. False if it isn't a disk we know about
+    bool copyDisk(const std::string& disk, diskarbitrator::Disk& out) {
+      const std::lock_guard<std::mutex> lock(this->disksMutex);
+      auto it = this->disks.find(disk);
+      if(it == this->disks.end()) {
+        return false;
+      }
+      out = *(it->second);
+      return true;
+    }
+
+    static void setBaselineSummary(const Baseline& baseline, const std::string& root, diskarbitrator::BaselineSummary* summary) {
+      summary->set_root(root);
+      summary->set_disk_size(baseline.diskSize);
+      summary->set_leaf_size(baseline.leafSize);
+      summary->set_leaf_count(baselineLeafCount(baseline));
+      summary->set_created(baseline.created);
+    }
+
   public:
     DiskAbitratorServiceImpl() {};
     ~DiskAbitratorServiceImpl() {
@@ -59,6 +235,34 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
       } else {
         LOG(INFO) << "Arbitration session stopped" << std::endl;
       }
+
+      // No more disks show up now, so stop the baselines still being taken
+      // and wait for every probe and baseline before what they use goes away
+      {
+        const std::lock_guard<std::mutex> lock(this->baselineMutex);
+        this->baselinesStopping = true;
+      }
+      {
+        const std::lock_guard<std::mutex> lock(this->backgroundMutex);
+        this->backgroundStopping = true;
+      }
+      this->joinBackgroundThreads("");
+    }
+
+    // Tells the scheduler someone is waiting on `path`, so bulk jobs on the
+    // same disk or bus hold off until the job is destroyed. Null if nothing
+    // is scheduled, or `path` isn't there (the caller will find out soon
+    // enough)
+    std::unique_ptr<IOScheduler::Job> interactiveIO(const std::string& path, const std::string& disk) {
+      std::shared_ptr<IOScheduler> scheduler = sharedIOScheduler();
+      if(!scheduler) {
+        return nullptr;
+      }
+      try {
+        return scheduler->join(ioDeviceKey(path), this->busOf(disk), IO_CLASS_INTERACTIVE);
+      } catch(const std::runtime_error& e) {
+        return nullptr;
+      }
     }
 
     // Here come all the RPC handling routines
@@ -74,11 +278,11 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
                 << " path " << (request->has_path() ? request->path() : "(default)") 
                 << (request->arguments().size() ? (" args (" + args + ")" ) : "");
       try {
-        if(this->disks.find(request->disk()) == this->disks.end()) {
+        diskarbitrator::Disk disk;
+        if(!this->copyDisk(request->disk(), disk)) {
           return grpc::Status(grpc::NOT_FOUND, "Requested disk was not found");
         }
         this->ourMounts[request->disk()] = true;
-        diskarbitrator::Disk disk = *(this->disks[request->disk()]);
         std::vector<std::string> args;
         for(const auto& arg : request->arguments()) {
           args.push_back(arg);
@@ -100,10 +304,10 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
     grpc::Status UnmountDisk(grpc::ServerContext* context, const diskarbitrator::UnmountDiskInput* request, google::protobuf::Empty* reply) override {
       LOG(INFO) << "Requested disk unmount for disk " << request->disk();
       try {
-        if(this->disks.find(request->disk()) == this->disks.end()) {
+        diskarbitrator::Disk disk;
+        if(!this->copyDisk(request->disk(), disk)) {
           return grpc::Status(grpc::NOT_FOUND, "Requested disk was not found");
         }
-        diskarbitrator::Disk disk = *(this->disks[request->disk()]);
         unmountDisk(session, disk);
       } catch(const std::runtime_error& e) {
         return grpc::Status(grpc::ABORTED, e.what());
@@ -114,10 +318,10 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
     grpc::Status EjectDisk(grpc::ServerContext* context, const diskarbitrator::EjectDiskInput* request, google::protobuf::Empty* reply) override {
       LOG(INFO) << "Requested disk eject for " << request->disk();
       try {
-        if(this->disks.find(request->disk()) == this->disks.end()) {
+        diskarbitrator::Disk disk;
+        if(!this->copyDisk(request->disk(), disk)) {
           return grpc::Status(grpc::NOT_FOUND, "Requested disk was not found");
         }
-        diskarbitrator::Disk disk = *(this->disks[request->disk()]);
         ejectDisk(this->session, disk);
       } catch(const std::runtime_error& e) {
         LOG(ERROR) << "Eject FAILED: " << e.what();
@@ -140,20 +344,647 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
       return grpc::Status::OK;
     }
 
+    grpc::Status AttachDiskWithProgress(grpc::ServerContext* context, const diskarbitrator::AttachDiskInput* request, grpc::ServerWriter<diskarbitrator::AttachDiskProgressOutput>* writer) override {
+      LOG(INFO) << "Requested disk attach with progress for image " << request->disk() << " with mode " << diskarbitrator::MountMode_Name(request->mode());
+      try {
+        std::vector<std::string> disks = attachDisk(request->disk(), request->mode(), "", [writer](const AttachProgress& progress) {
+          diskarbitrator::AttachDiskProgressOutput output;
+          output.mutable_progress()->set_percent(progress.percent);
+          output.mutable_progress()->set_message(progress.message);
+          writer->Write(output);
+        });
+        diskarbitrator::AttachDiskProgressOutput output;
+        for (const auto& it : disks) {
+          std::string* newDisk = output.mutable_result()->add_disks();
+          *newDisk = it;
+        }
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }  
+      return grpc::Status::OK;
+    }
+
+    grpc::Status AttachDisks(grpc::ServerContext* context, const diskarbitrator::AttachDisksInput* request, grpc::ServerWriter<diskarbitrator::AttachDisksOutput>* writer) override {
+      LOG(INFO) << "Requested attach for " << request->disks_size() << " images with mode " << diskarbitrator::MountMode_Name(request->mode()) << " and parallelism " << request->parallelism();
+      std::vector<std::string> images(request->disks().begin(), request->disks().end());
+      attachDisks(images, request->mode(), request->parallelism(), [writer](const AttachResult& result) {
+        diskarbitrator::AttachDisksOutput output;
+        output.set_image(result.image);
+        for(const auto& it : result.disks) {
+          std::string* newDisk = output.add_disks();
+          *newDisk = it;
+        }
+        if(result.error.size()) {
+          LOG(ERROR) << "Attach FAILED for image " << result.image << ": " << result.error;
+          output.set_error(result.error);
+        }
+        output.set_duration_ms(result.durationMs);
+        writer->Write(output);
+      });
+      return grpc::Status::OK;
+    }
+
+    grpc::Status InspectImage(grpc::ServerContext* context, const diskarbitrator::InspectImageInput* request, diskarbitrator::ImageDescription* reply) override {
+      LOG(INFO) << "Requested inspection of image " << request->image();
+      std::unique_ptr<IOScheduler::Job> ioJob = this->interactiveIO(request->image(), request->image());
+      ScopedIOPriority priority(IO_CLASS_INTERACTIVE);
+      try {
+        ImageInfo info = sniffImage(request->image());
+        reply->set_format(imageFormatName(info.format));
+        if(info.encryptionKnown) {
+          reply->set_encrypted(info.encrypted);
+        }
+        if(info.slaKnown) {
+          reply->set_has_sla(info.hasSLA);
+        }
+        if(info.sizeKnown) {
+          reply->set_size(info.size);
+        }
+        if(info.format == IMAGE_FORMAT_UDIF) {
+          // Only the tables are needed, so no workers
+          UDIFReader reader(request->image(), 1, 0);
+          for(const auto& table : reader.tables()) {
+            diskarbitrator::ImagePartition* partition = reply->add_partitions();
+            partition->set_name(table.name);
+            partition->set_first_sector(table.firstSector);
+            partition->set_sector_count(table.sectorCount);
+          }
+          reply->set_chunk_count(reader.chunks().size());
+        } else if(info.format == IMAGE_FORMAT_EWF) {
+          EWFReader reader(request->image(), 1, 0);
+          reply->set_chunk_count(reader.chunkCount());
+        } else if(info.format == IMAGE_FORMAT_CONTAINER && info.sizeKnown) {
+          ContainerReader reader(request->image(), 0);
+          reply->set_chunk_count(reader.chunkCount());
+        }
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status ReadImage(grpc::ServerContext* context, const diskarbitrator::ReadImageInput* request, grpc::ServerWriter<diskarbitrator::ReadImageOutput>* writer) override {
+      LOG(INFO) << "Requested read of image " << request->image() << " at offset " << request->offset() << " length " << request->length();
+      try {
+        std::unique_ptr<ImageReader> reader = openImageReader(request->image());
+        uint64_t end = reader->size();
+        if(request->length() && request->offset() + request->length() < end) {
+          end = request->offset() + request->length();
+        }
+        diskarbitrator::ReadImageOutput output;
+        std::string* data = output.mutable_data();
+        for(uint64_t offset = request->offset(); offset < end && !context->IsCancelled(); offset += data->size()) {
+          data->resize(std::min<uint64_t>(READ_IMAGE_CHUNK_SIZE, end - offset));
+          data->resize(reader->read(offset, &(*data)[0], data->size()));
+          if(data->empty()) {
+            break;
+          }
+          output.set_offset(offset);
+          if(!writer->Write(output)) {
+            break;
+          }
+        }
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status VerifyImage(grpc::ServerContext* context, const diskarbitrator::VerifyImageInput* request, grpc::ServerWriter<diskarbitrator::VerifyImageOutput>* writer) override {
+      LOG(INFO) << "Requested verification of image " << request->image();
+      try {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        UDIFReader reader(request->image());
+        double lastPercent = -VERIFY_PROGRESS_STEP;
+        std::vector<UDIFChecksumResult> results = reader.verify([writer, &lastPercent](uint64_t bytesDone, uint64_t bytesTotal) {
+          // One message per chunk would be way too chatty on big images
+          double percent = bytesTotal ? 100.0 * bytesDone / bytesTotal : 100.0;
+          if(percent - lastPercent < VERIFY_PROGRESS_STEP && bytesDone != bytesTotal) {
+            return;
+          }
+          lastPercent = percent;
+          diskarbitrator::VerifyImageOutput output;
+          output.mutable_progress()->set_bytes_done(bytesDone);
+          output.mutable_progress()->set_bytes_total(bytesTotal);
+          writer->Write(output);
+        });
+
+        diskarbitrator::VerifyImageOutput output;
+        diskarbitrator::VerifyImageResult* result = output.mutable_result();
+        bool valid = true;
+        for(const auto& it : results) {
+          diskarbitrator::ImageChecksum* checksum = result->add_checksums();
+          checksum->set_name(it.name);
+          checksum->set_checked(it.checked);
+          checksum->set_expected(it.expected);
+          checksum->set_actual(it.actual);
+          if(it.checked && it.expected != it.actual) {
+            LOG(ERROR) << "Checksum mismatch in " << it.name << " of image " << request->image();
+            valid = false;
+          }
+        }
+        result->set_valid(valid);
+        result->set_duration_ms(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status InspectPartitions(grpc::ServerContext* context, const diskarbitrator::InspectPartitionsInput* request, diskarbitrator::PartitionTableDescription* reply) override {
+      LOG(INFO) << "Requested partition table of " << request->disk();
+      const std::string path = resolveDevicePath(request->disk());
+      std::unique_ptr<IOScheduler::Job> ioJob = this->interactiveIO(path, request->disk());
+      ScopedIOPriority priority(IO_CLASS_INTERACTIVE);
+      try {
+        std::unique_ptr<ImageReader> reader = openImageReader(path);
+        DiskProbe probe = probeDisk(*reader, this->probePool);
+        const PartitionTable& table = probe.table;
+        reply->set_scheme(partitionSchemeName(table.scheme));
+        reply->set_sector_size(table.sectorSize);
+        if(table.scheme == PARTITION_SCHEME_GPT) {
+          reply->set_disk_guid(table.diskGUID);
+        }
+        if(probe.wholeDisk.kind != FS_UNKNOWN) {
+          setVolumeInfo(probe.wholeDisk, reply->mutable_volume());
+        }
+        for(size_t i = 0; i < table.partitions.size(); ++i) {
+          const Partition& it = table.partitions[i];
+          diskarbitrator::PartitionEntry* partition = reply->add_partitions();
+          partition->set_index(it.index);
+          partition->set_offset(it.offset);
+          partition->set_size(it.size);
+          partition->set_type(it.type);
+          if(it.typeName.size()) {
+            partition->set_type_name(it.typeName);
+          }
+          if(table.scheme == PARTITION_SCHEME_GPT) {
+            partition->set_uuid(it.uuid);
+            partition->set_name(it.name);
+          } else {
+            partition->set_bootable(it.bootable);
+          }
+          if(probe.filesystems[i].kind != FS_UNKNOWN) {
+            setVolumeInfo(probe.filesystems[i], partition->mutable_volume());
+          }
+        }
+        for(const auto& warning : table.warnings) {
+          LOG(WARNING) << request->disk() << ": " << warning;
+          std::string* newWarning = reply->add_warnings();
+          *newWarning = warning;
+        }
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status ExtractFiles(grpc::ServerContext* context, const diskarbitrator::ExtractFilesInput* request, grpc::ServerWriter<diskarbitrator::ExtractFilesOutput>* writer) override {
+      LOG(INFO) << "Requested extraction of " << (request->paths_size() ? std::to_string(request->paths_size()) + " paths" : "everything") << " from " << request->disk()
+                << (request->has_partition() ? " partition " + std::to_string(request->partition()) : "");
+      try {
+        std::unique_ptr<ImageReader> disk = openImageReader(resolveDevicePath(request->disk()));
+        std::unique_ptr<ImageReader> partition;
+        ImageReader* volumeReader = disk.get();
+        if(request->has_partition()) {
+          PartitionTable table = readPartitionTable(*disk);
+          for(const auto& it : table.partitions) {
+            if(it.index == request->partition()) {
+              partition.reset(new SliceImageReader(*disk, it.offset, it.size));
+            }
+          }
+          if(partition == nullptr) {
+            return grpc::Status(grpc::NOT_FOUND, "Requested partition was not found");
+          }
+          volumeReader = partition.get();
+        }
+
+        FATVolume volume(*volumeReader, this->extractPool);
+        std::vector<std::string> paths(request->paths().begin(), request->paths().end());
+        if(paths.empty()) {
+          paths.push_back("/");
+        }
+        for(const auto& path : paths) {
+          FATFile file = volume.lookup(path);
+          // Paths are sent relative to the root, with no leading slash
+          std::string relativePath = path.substr(std::min(path.find_first_not_of('/'), path.size()));
+          while(relativePath.size() && relativePath.back() == '/') {
+            relativePath.pop_back();
+          }
+          if(relativePath.empty() && !file.directory) {
+            relativePath = file.name;
+          }
+          std::set<uint32_t> visited;
+          if(!extractTree(volume, relativePath, file, visited, 0, context, writer)) {
+            LOG(WARNING) << "Extraction from " << request->disk() << " cancelled";
+            break;
+          }
+        }
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status ExportDisk(grpc::ServerContext* context, const diskarbitrator::ExportDiskInput* request, diskarbitrator::ExportDiskOutput* reply) override {
+      const std::string name = request->name().size() ? request->name() : request->disk();
+      LOG(INFO) << "Requested NBD export of " << request->disk() << " as " << name;
+      if(this->nbd == nullptr) {
+        return grpc::Status(grpc::FAILED_PRECONDITION, "The NBD server is not enabled, start the daemon with --nbd-socket");
+      }
+      try {
+        reply->set_size(this->nbd->addExport(name, resolveDevicePath(request->disk())));
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      reply->set_name(name);
+      reply->set_socket(this->nbd->path());
+      return grpc::Status::OK;
+    }
+
+    grpc::Status UnexportDisk(grpc::ServerContext* context, const diskarbitrator::UnexportDiskInput* request, google::protobuf::Empty* reply) override {
+      LOG(INFO) << "Requested removal of NBD export " << request->name();
+      if(this->nbd == nullptr) {
+        return grpc::Status(grpc::FAILED_PRECONDITION, "The NBD server is not enabled, start the daemon with --nbd-socket");
+      }
+      try {
+        this->nbd->removeExport(request->name());
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::NOT_FOUND, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status CacheStats(grpc::ServerContext* context, const google::protobuf::Empty* request, diskarbitrator::CacheStatsOutput* reply) override {
+      LOG(INFO) << "Requested block cache stats";
+      // Not the block cache's, but just as much about not doing things twice
+      reply->set_coalesced_attaches(coalescedAttachCount());
+      std::shared_ptr<BlockCache> cache = sharedBlockCache();
+      reply->set_enabled(cache != nullptr);
+      if(cache) {
+        BlockCacheStats stats = cache->stats();
+        reply->set_hits(stats.hits);
+        reply->set_misses(stats.misses);
+        reply->set_readahead_blocks(stats.readaheadBlocks);
+        reply->set_readahead_hits(stats.readaheadHits);
+        reply->set_device_bytes_read(stats.deviceBytesRead);
+        reply->set_capacity(stats.capacity);
+        reply->set_direct_io(stats.directIO);
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status MapAllocation(grpc::ServerContext* context, const diskarbitrator::MapAllocationInput* request, grpc::ServerWriter<diskarbitrator::MapAllocationOutput>* writer) override {
+      LOG(INFO) << "Requested allocation map of " << request->disk();
+      const uint32_t blockSize = request->block_size() ? request->block_size() : ALLOCATION_DEFAULT_BLOCK_SIZE;
+      auto start = std::chrono::steady_clock::now();
+      try {
+        diskarbitrator::MapAllocationOutput output;
+        bool ok = true;
+        AllocationSummary summary = mapAllocation(resolveDevicePath(request->disk()), blockSize, [&](const AllocationRun& run) {
+          diskarbitrator::AllocationRun* entry = output.add_runs();
+          entry->set_offset(run.offset);
+          entry->set_length(run.length);
+          entry->set_kind(static_cast<diskarbitrator::BlockKind>(run.kind));
+          entry->set_fill(run.fill);
+          entry->set_hole(run.hole);
+          if(output.runs_size() == ALLOCATION_RUNS_PER_MESSAGE) {
+            ok = !context->IsCancelled() && writer->Write(output);
+            output.clear_runs();
+          }
+          return ok;
+        }, request->idle() ? IO_CLASS_IDLE : IO_CLASS_BULK, this->busOf(request->disk()));
+        if(!ok) {
+          LOG(WARNING) << "Allocation map of " << request->disk() << " cancelled";
+          return grpc::Status::CANCELLED;
+        }
+        diskarbitrator::AllocationSummary* result = output.mutable_summary();
+        result->set_zero_bytes(summary.zeroBytes);
+        result->set_constant_bytes(summary.constantBytes);
+        result->set_data_bytes(summary.dataBytes);
+        result->set_hole_bytes(summary.holeBytes);
+        result->set_run_count(summary.runCount);
+        result->set_duration_ms(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status AcquireDisk(grpc::ServerContext* context, const diskarbitrator::AcquireDiskInput* request, grpc::ServerWriter<diskarbitrator::AcquireDiskOutput>* writer) override {
+      LOG(INFO) << "Requested acquisition of " << request->disk() << " into " << request->output();
+      AcquireOptions options;
+      options.sparse = !request->dense();
+      options.rescueMap = request->rescue_map();
+      if(request->retries()) {
+        options.retries = request->retries();
+      }
+      if(request->io_weight()) {
+        options.ioWeight = std::min<uint32_t>(request->io_weight(), IO_MAX_WEIGHT);
+      }
+      options.ioClass = request->idle() ? IO_CLASS_IDLE : IO_CLASS_BULK;
+      options.bus = this->busOf(request->disk());
+      options.checkpoint = request->checkpoint();
+      options.identity = this->identityOf(request->disk());
+      try {
+        if(request->compression().size()) {
+          options.container = true;
+          options.compression = parseContainerCompression(request->compression());
+        }
+        AcquireResult result = acquireDisk(resolveDevicePath(request->disk()), request->output(), options, [&](const AcquireProgress& progress) {
+          diskarbitrator::AcquireDiskOutput output;
+          output.mutable_progress()->set_bytes_read(progress.bytesRead);
+          output.mutable_progress()->set_bytes_written(progress.bytesWritten);
+          output.mutable_progress()->set_bytes_total(progress.bytesTotal);
+          output.mutable_progress()->set_bytes_per_second(progress.bytesPerSecond);
+          output.mutable_progress()->set_bytes_bad(progress.bytesBad);
+          output.mutable_progress()->set_pass(progress.pass);
+          return !context->IsCancelled() && writer->Write(output);
+        });
+        if(!result.complete) {
+          LOG(WARNING) << "Acquisition of " << request->disk() << " cancelled after " << result.bytes << " bytes";
+          if(options.rescueMap.size()) {
+            LOG(INFO) << "Rescue map saved in " << options.rescueMap << ", it can be resumed from there";
+          }
+          if(options.checkpoint.size()) {
+            LOG(INFO) << "Checkpoint saved in " << options.checkpoint << ", it can be resumed from there";
+          }
+          return grpc::Status::CANCELLED;
+        }
+        if(result.resumedFrom) {
+          LOG(INFO) << "Acquisition of " << request->disk() << " resumed at " << result.resumedFrom << " bytes";
+        }
+        LOG(INFO) << "Acquired " << request->disk() << " into " << request->output() << ", SHA-256 " << result.sha256;
+        if(result.badBytes) {
+          LOG(WARNING) << result.badBytes << " bytes of " << request->disk() << " couldn't be read after " << result.readErrors << " read errors";
+        }
+        diskarbitrator::AcquireDiskOutput output;
+        output.mutable_result()->set_bytes(result.bytes);
+        output.mutable_result()->set_sha256(result.sha256);
+        output.mutable_result()->set_duration_ms(result.durationMs);
+        output.mutable_result()->set_sparse_bytes(result.sparseBytes);
+        output.mutable_result()->set_stored_bytes(result.storedBytes);
+        output.mutable_result()->set_bad_bytes(result.badBytes);
+        output.mutable_result()->set_read_errors(result.readErrors);
+        output.mutable_result()->set_resumed_from(result.resumedFrom);
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status HashDisk(grpc::ServerContext* context, const diskarbitrator::HashDiskInput* request, grpc::ServerWriter<diskarbitrator::HashDiskOutput>* writer) override {
+      LOG(INFO) << "Requested hashes of " << request->disk();
+      HashOptions options;
+      if(request->algorithms_size()) {
+        options.algorithms.assign(request->algorithms().begin(), request->algorithms().end());
+      }
+      options.segmentSize = request->segment_size();
+      options.imageFiles = request->image_files();
+      if(request->io_weight()) {
+        options.ioWeight = std::min<uint32_t>(request->io_weight(), IO_MAX_WEIGHT);
+      }
+      options.ioClass = request->idle() ? IO_CLASS_IDLE : IO_CLASS_BULK;
+      options.bus = this->busOf(request->disk());
+      options.checkpoint = request->checkpoint();
+      options.identity = this->identityOf(request->disk());
+      try {
+        HashResult result = hashDisk(resolveDevicePath(request->disk()), options, [&](const HashProgress& progress) {
+          diskarbitrator::HashDiskOutput output;
+          output.mutable_progress()->set_bytes_hashed(progress.bytesHashed);
+          output.mutable_progress()->set_bytes_total(progress.bytesTotal);
+          output.mutable_progress()->set_bytes_per_second(progress.bytesPerSecond);
+          return !context->IsCancelled() && writer->Write(output);
+        });
+        if(!result.complete) {
+          LOG(WARNING) << "Hashing of " << request->disk() << " cancelled after " << result.bytes << " bytes";
+          if(options.checkpoint.size()) {
+            LOG(INFO) << "Checkpoint saved in " << options.checkpoint << ", it can be resumed from there";
+          }
+          return grpc::Status::CANCELLED;
+        }
+        diskarbitrator::HashDiskOutput output;
+        for(const auto& segment : result.segments) {
+          diskarbitrator::HashSegment* entry = output.add_segments();
+          entry->set_offset(segment.offset);
+          entry->set_length(segment.length);
+          for(const auto& digest : segment.digests) {
+            diskarbitrator::Digest* value = entry->add_digests();
+            value->set_algorithm(digest.first);
+            value->set_digest(digest.second);
+          }
+          if(output.segments_size() == HASH_SEGMENTS_PER_MESSAGE) {
+            if(context->IsCancelled() || !writer->Write(output)) {
+              return grpc::Status::CANCELLED;
+            }
+            output.clear_segments();
+          }
+        }
+        for(const auto& digest : result.digests) {
+          LOG(INFO) << "Hashed " << request->disk() << ", " << digest.first << " " << digest.second;
+          diskarbitrator::Digest* value = output.mutable_result()->add_digests();
+          value->set_algorithm(digest.first);
+          value->set_digest(digest.second);
+        }
+        output.mutable_result()->set_bytes(result.bytes);
+        output.mutable_result()->set_duration_ms(result.durationMs);
+        output.mutable_result()->set_resumed_from(result.resumedFrom);
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status DiffDisks(grpc::ServerContext* context, const diskarbitrator::DiffDisksInput* request, grpc::ServerWriter<diskarbitrator::DiffDisksOutput>* writer) override {
+      LOG(INFO) << "Requested comparison of " << request->first() << " and " << request->second();
+      DiffOptions options;
+      if(request->block_size()) {
+        options.blockSize = request->block_size();
+      }
+      options.imageFiles = request->image_files();
+      if(request->io_weight()) {
+        options.ioWeight = std::min<uint32_t>(request->io_weight(), IO_MAX_WEIGHT);
+      }
+      options.ioClass = request->idle() ? IO_CLASS_IDLE : IO_CLASS_BULK;
+      options.firstBus = this->busOf(request->first());
+      options.secondBus = this->busOf(request->second());
+      try {
+        // Extents go out with the next progress update, or on their own once
+        // there are enough of them
+        diskarbitrator::DiffDisksOutput output;
+        DiffResult result = diffDisks(resolveDevicePath(request->first()), resolveDevicePath(request->second()), options, [&](const DiffProgress& progress) {
+          output.mutable_progress()->set_bytes_compared(progress.bytesCompared);
+          output.mutable_progress()->set_bytes_total(progress.bytesTotal);
+          output.mutable_progress()->set_bytes_per_second(progress.bytesPerSecond);
+          bool ok = !context->IsCancelled() && writer->Write(output);
+          output.Clear();
+          return ok;
+        }, [&](const DiffExtent& extent) {
+          diskarbitrator::DiffExtent* entry = output.add_extents();
+          entry->set_offset(extent.offset);
+          entry->set_length(extent.length);
+          if(output.extents_size() < DIFF_EXTENTS_PER_MESSAGE) {
+            return true;
+          }
+          bool ok = !context->IsCancelled() && writer->Write(output);
+          output.Clear();
+          return ok;
+        });
+        if(!result.complete) {
+          LOG(WARNING) << "Comparison of " << request->first() << " and " << request->second() << " cancelled after " << result.bytesCompared << " bytes";
+          return grpc::Status::CANCELLED;
+        }
+        LOG(INFO) << "Compared " << request->first() << " and " << request->second() << ", " << result.differentBytes << " bytes differ in " << result.extentCount << " extents";
+        diskarbitrator::DiffSummary* summary = output.mutable_summary();
+        summary->set_identical(!result.differentBytes);
+        summary->set_first_size(result.firstSize);
+        summary->set_second_size(result.secondSize);
+        summary->set_bytes_compared(result.bytesCompared);
+        summary->set_different_bytes(result.differentBytes);
+        summary->set_extent_count(result.extentCount);
+        summary->set_duration_ms(result.durationMs);
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status BuildBaseline(grpc::ServerContext* context, const diskarbitrator::BuildBaselineInput* request, grpc::ServerWriter<diskarbitrator::BuildBaselineOutput>* writer) override {
+      LOG(INFO) << "Requested a baseline of " << request->disk();
+      if(this->baselineDir.empty()) {
+        return grpc::Status(grpc::FAILED_PRECONDITION, "Baselines aren't enabled, the daemon has to be started with --baseline-dir");
+      }
+      const std::string mediaUUID = this->mediaUUIDOf(request->disk());
+      if(mediaUUID.empty()) {
+        return grpc::Status(grpc::FAILED_PRECONDITION, "The disk has no media UUID to keep its baseline by");
+      }
+      BaselineOptions options;
+      if(request->leaf_size()) {
+        options.leafSize = request->leaf_size();
+      }
+      if(request->io_weight()) {
+        options.ioWeight = std::min<uint32_t>(request->io_weight(), IO_MAX_WEIGHT);
+      }
+      options.ioClass = request->idle() ? IO_CLASS_IDLE : IO_CLASS_BULK;
+      try {
+        if(!request->replace() && access(baselinePath(this->baselineDir, mediaUUID).c_str(), F_OK) == 0) {
+          return grpc::Status(grpc::ALREADY_EXISTS, "The disk already has a baseline");
+        }
+        BaselineResult result = this->takeBaseline(request->disk(), mediaUUID, options, [&](const BaselineProgress& progress) {
+          diskarbitrator::BuildBaselineOutput output;
+          output.mutable_progress()->set_bytes_hashed(progress.bytesHashed);
+          output.mutable_progress()->set_bytes_total(progress.bytesTotal);
+          output.mutable_progress()->set_bytes_per_second(progress.bytesPerSecond);
+          return !context->IsCancelled() && writer->Write(output);
+        });
+        if(!result.complete) {
+          LOG(WARNING) << "Baseline of " << request->disk() << " cancelled";
+          return grpc::Status::CANCELLED;
+        }
+        diskarbitrator::BuildBaselineOutput output;
+        setBaselineSummary(result.baseline, result.root, output.mutable_summary());
+        output.mutable_summary()->set_duration_ms(result.durationMs);
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
+    grpc::Status VerifyBaseline(grpc::ServerContext* context, const diskarbitrator::VerifyBaselineInput* request, grpc::ServerWriter<diskarbitrator::VerifyBaselineOutput>* writer) override {
+      LOG(INFO) << "Requested verification of " << request->disk() << " against its baseline";
+      if(this->baselineDir.empty()) {
+        return grpc::Status(grpc::FAILED_PRECONDITION, "Baselines aren't enabled, the daemon has to be started with --baseline-dir");
+      }
+      const std::string mediaUUID = this->mediaUUIDOf(request->disk());
+      if(mediaUUID.empty()) {
+        return grpc::Status(grpc::FAILED_PRECONDITION, "The disk has no media UUID to keep its baseline by");
+      }
+      BaselineOptions options;
+      for(const auto& extent : request->extents()) {
+        options.extents.push_back(std::make_pair(extent.offset(), extent.length()));
+      }
+      options.sample = request->sample();
+      if(request->io_weight()) {
+        options.ioWeight = std::min<uint32_t>(request->io_weight(), IO_MAX_WEIGHT);
+      }
+      options.ioClass = request->idle() ? IO_CLASS_IDLE : IO_CLASS_BULK;
+      options.bus = this->busOf(request->disk());
+      try {
+        Baseline baseline;
+        if(!loadBaseline(baselinePath(this->baselineDir, mediaUUID), baseline)) {
+          return grpc::Status(grpc::NOT_FOUND, "The disk has no baseline");
+        }
+        // Whoever wrote the root down elsewhere can tell if the baseline
+        // itself was tampered with
+        const std::string root = merkleRoot(baseline);
+        if(request->root().size() && request->root() != root) {
+          return grpc::Status(grpc::FAILED_PRECONDITION, "The baseline of the disk has root " + root + ", not " + request->root());
+        }
+        BaselineVerification result = verifyBaseline(resolveDevicePath(request->disk()), baseline, options, this->baselinePool, [&](const BaselineProgress& progress) {
+          diskarbitrator::VerifyBaselineOutput output;
+          output.mutable_progress()->set_bytes_hashed(progress.bytesHashed);
+          output.mutable_progress()->set_bytes_total(progress.bytesTotal);
+          output.mutable_progress()->set_bytes_per_second(progress.bytesPerSecond);
+          return !context->IsCancelled() && writer->Write(output);
+        });
+        if(!result.complete) {
+          LOG(WARNING) << "Verification of " << request->disk() << " against its baseline cancelled";
+          return grpc::Status::CANCELLED;
+        }
+        LOG(INFO) << "Verified " << result.leavesChecked << " leaves of " << request->disk() << " against its baseline, " << result.changed.size() << " changed";
+        diskarbitrator::VerifyBaselineOutput output;
+        for(const auto& leaf : result.changed) {
+          diskarbitrator::ChangedLeaf* entry = output.add_changed();
+          entry->set_index(leaf.index);
+          entry->set_offset(leaf.offset);
+          entry->set_length(leaf.length);
+          if(output.changed_size() == BASELINE_LEAVES_PER_MESSAGE) {
+            if(context->IsCancelled() || !writer->Write(output)) {
+              return grpc::Status::CANCELLED;
+            }
+            output.clear_changed();
+          }
+        }
+        diskarbitrator::VerifyBaselineSummary* summary = output.mutable_summary();
+        summary->set_intact(result.changed.empty() && result.diskSize == baseline.diskSize);
+        setBaselineSummary(baseline, root, summary->mutable_baseline());
+        summary->set_disk_size(result.diskSize);
+        summary->set_leaves_checked(result.leavesChecked);
+        summary->set_bytes_checked(result.bytesChecked);
+        summary->set_changed_count(result.changed.size());
+        summary->set_duration_ms(result.durationMs);
+        writer->Write(output);
+      } catch(const std::runtime_error& e) {
+        return grpc::Status(grpc::ABORTED, e.what());
+      }
+      return grpc::Status::OK;
+    }
+
     grpc::Status DiskInfo(grpc::ServerContext* context, const diskarbitrator::DiskInfoInput* request, diskarbitrator::DiskDescription* reply) override {
       LOG(INFO) << "Requested disk info for disk " << request->disk();
+      const std::lock_guard<std::mutex> lock(this->disksMutex);
       if(this->disks.find(request->disk()) == this->disks.end()) {
         return grpc::Status(grpc::NOT_FOUND, "The specified disk was not found in the system");
       }
       *reply = this->disks[request->disk()]->description();
+      this->fillProbedVolume(*(this->disks[request->disk()]), *reply);
       return grpc::Status::OK;
     }
 
     grpc::Status ListDisks(grpc::ServerContext* context, const google::protobuf::Empty* request, diskarbitrator::ListDisksOutput* reply) override {
       LOG(INFO) << "Requested disk list";
+      const std::lock_guard<std::mutex> lock(this->disksMutex);
       for (const auto& it : this->disks) {
         diskarbitrator::Disk* newDisk = reply->add_disks();
         *newDisk = *(it.second);
+        this->fillProbedVolume(*(it.second), *(newDisk->mutable_description()));
       }
       return grpc::Status::OK;
     }
@@ -185,6 +1016,39 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
     diskarbitrator::ArbitrationMode arbitrationMode = diskarbitrator::ArbitrationMode::ARBITRATOR_NONE;
     std::map<std::string, bool> ourMounts;
 
+    // Filesystems found by probing, so there's something to show for disks
+    // that never get mounted. GPT partitions are keyed by their media UUID,
+    // MBR ones by the whole disk media UUID and partition number
+    LRUCache<std::string, FilesystemInfo> volumeCache{VOLUME_CACHE_SIZE};
+    ThreadPool probePool{PROBE_THREADS};
+
+    // Reads ahead for ExtractFiles, one piece at a time per call
+    ThreadPool extractPool{EXTRACT_THREADS};
+
+    // Read-only NBD exports, when enabled with --nbd-socket
+    std::unique_ptr<NBDServer> nbd;
+
+    // Merkle trees of what disks looked like when they first showed up, by
+    // media UUID, when enabled with --baseline-dir. Leaves are hashed on
+    // every core
+    std::string baselineDir;
+    std::mutex baselineMutex;
+    // BSD names of the ones being taken right now, by media UUID, and the
+    // media UUIDs of those told to stop
+    std::map<std::string, std::string> baselinesRunning;
+    std::set<std::string> baselinesStopped;
+    // Set on the way out, every baseline stops and no new ones start
+    bool baselinesStopping = false;
+    ThreadPool baselinePool;
+
+    // Threads probing and taking baselines of disks as they show up, with
+    // the BSD name of the disk. Finished ones are joined when the next one
+    // starts, the rest when their disk goes away or the daemon stops
+    std::mutex backgroundMutex;
+    std::map<std::thread::id, std::pair<std::string, std::thread>> backgroundThreads;
+    std::vector<std::thread::id> backgroundThreadsFinished;
+    bool backgroundStopping = false;
+
     // We need to make this one public. The user should call this method after
     // instantiating the service. The reason for this is to avoid any callback
     // functions being called before the object has been constructed
@@ -198,9 +1062,24 @@ class DiskAbitratorServiceImpl final : public diskarbitrator::DiskArbitrator::Se
     void removeChildFromParent(const std::string& disk, const std::string& parentDisk);
     const std::string getParentDisk(const std::string& disk);
     void updateDiskDescription(const std::string& disk, const diskarbitrator::DiskDescription& description);
+    // Fills the volume name, kind and UUID from the probe results when
+    // DiskArbitration doesn't know them. Needs disksMutex held
+    void fillProbedVolume(const diskarbitrator::Disk& disk, diskarbitrator::DiskDescription& description);
+    // Reads the whole of `disk` into a baseline, saved in baselineDir by
+    // `mediaUUID` once complete. Throws if one of the same disk is already
+    // being taken. Stops early if the disk goes away or the daemon stops
+    BaselineResult takeBaseline(const std::string& disk, const std::string& mediaUUID, BaselineOptions options, std::function<bool(const BaselineProgress&)> onProgress);
+    // Runs `work` on `disk` on its own thread, unless the daemon is on its way
+    // out
+    void startBackgroundThread(const std::string& disk, std::function<void()> work);
+    // Waits for the threads working on `disk`, or all of them if it's empty
+    void joinBackgroundThreads(const std::string& disk);
+    // Stops the baselines being taken of `disk`, it's gone
+    void stopBaselines(const std::string& disk);
 };
 
-// Starts the server. What else?
-void RunServer(const std::string& socketPath);
+// Starts the server. What else? The NBD server only runs if `nbdSocketPath`
+// isn't empty, and disks only get baselines if `baselineDir` isn't
+void RunServer(const std::string& socketPath, const std::string& nbdSocketPath, const std::string& baselineDir);
 
 #endif
\ No newline at end of file
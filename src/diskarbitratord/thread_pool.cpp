@@ -0,0 +1,65 @@
+/***************************************************************************
+ *   thread_pool.cpp  --  This file is part of diskarbitratord.            *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(unsigned int threads) {
+  if(threads == 0) {
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  for(unsigned int i = 0; i < threads; ++i) {
+    this->workers.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->jobAvailable.notify_all();
+  for(auto& worker : this->workers) {
+    worker.join();
+  }
+}
+
+// Workers only leave once the queue is drained, so no future is left without
+// a value
+void ThreadPool::work() {
+  while(true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->jobAvailable.wait(lock, [this]() {
+        return this->stopping || !this->jobs.empty();
+      });
+      if(this->jobs.empty()) {
+        return;
+      }
+      job = std::move(this->jobs.front());
+      this->jobs.pop();
+    }
+    job();
+  }
+}
@@ -0,0 +1,74 @@
+/***************************************************************************
+ *   thread_pool.hpp  --  This file is part of diskarbitratord.            *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of worker threads. Jobs are run in submission order, and the
+// result (or exception) comes back through a future. Destroying the pool waits
+// for every job already submitted.
+class ThreadPool {
+  public:
+    // 0 threads means one per core
+    ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    template<typename F>
+    std::future<typename std::result_of<F()>::type> submit(F job) {
+      typedef typename std::result_of<F()>::type R;
+      // std::function needs to be copyable, std::packaged_task isn't
+      std::shared_ptr<std::packaged_task<R()>> task = std::make_shared<std::packaged_task<R()>>(std::move(job));
+      std::future<R> result = task->get_future();
+      {
+        const std::lock_guard<std::mutex> lock(this->mutex);
+        this->jobs.push([task]() {
+          (*task)();
+        });
+      }
+      this->jobAvailable.notify_one();
+      return result;
+    }
+
+    unsigned int size() const {
+      return this->workers.size();
+    }
+
+  private:
+    void work();
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    bool stopping = false;
+};
+
+#endif
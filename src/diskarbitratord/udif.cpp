@@ -0,0 +1,544 @@
+/***************************************************************************
+ *   udif.cpp  --  This file is part of diskarbitratord.                   *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <bzlib.h>
+#include <zlib.h>
+
+#include "byteorder.hpp"
+#include "crc32.hpp"
+#include "udif.hpp"
+
+#define KOLY_MAGIC "koly"
+#define MISH_MAGIC "mish"
+// Offsets in the mish (blkx table) header
+#define MISH_HEADER_SIZE 204
+#define MISH_CHUNK_SIZE 40
+// hdiutil writes chunks of 2048 sectors, so anything holding data past 64MB
+// is corrupt, and would be allocated whole when decompressed. Stored data
+// may be a bit bigger than what it decompresses to, but not by this much
+#define UDIF_MAX_CHUNK_SECTORS (128 * 1024)
+#define UDIF_MAX_STORED_CHUNK(length) ((length) * 2 + 1024)
+
+bool parseKolyTrailer(const uint8_t* buffer, KolyTrailer& trailer) {
+  if(memcmp(buffer, KOLY_MAGIC, strlen(KOLY_MAGIC))) {
+    return false;
+  }
+  trailer.version = readBE32(buffer + 4);
+  trailer.dataForkOffset = readBE64(buffer + 24);
+  trailer.dataForkLength = readBE64(buffer + 32);
+  trailer.dataChecksumType = readBE32(buffer + 80);
+  trailer.dataChecksumBits = readBE32(buffer + 84);
+  memcpy(trailer.dataChecksum, buffer + 88, sizeof(trailer.dataChecksum));
+  trailer.xmlOffset = readBE64(buffer + 216);
+  trailer.xmlLength = readBE64(buffer + 224);
+  trailer.masterChecksumType = readBE32(buffer + 352);
+  trailer.masterChecksumBits = readBE32(buffer + 356);
+  memcpy(trailer.masterChecksum, buffer + 360, sizeof(trailer.masterChecksum));
+  trailer.sectorCount = readBE64(buffer + 492);
+  return true;
+}
+
+static std::vector<uint8_t> base64Decode(const std::string& in) {
+  static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::vector<uint8_t> out;
+  out.reserve(in.size() * 3 / 4);
+  uint32_t accumulator = 0;
+  int bits = 0;
+  for(const auto& c : in) {
+    if(c == '=') {
+      break;
+    }
+    size_t value = alphabet.find(c);
+    if(value == std::string::npos) {
+      // Plists wrap base64 data with newlines and tabs
+      continue;
+    }
+    accumulator = (accumulator << 6) | value;
+    bits += 6;
+    if(bits >= 8) {
+      bits -= 8;
+      out.push_back((accumulator >> bits) & 0xFF);
+    }
+  }
+  return out;
+}
+
+static std::string xmlUnescape(std::string s) {
+  static const std::vector<std::pair<std::string, std::string>> entities = {
+    {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {"&amp;", "&"}
+  };
+  for(const auto& entity : entities) {
+    size_t pos = 0;
+    while((pos = s.find(entity.first, pos)) != std::string::npos) {
+      s.replace(pos, entity.first.size(), entity.second);
+      pos += entity.second.size();
+    }
+  }
+  return s;
+}
+
+// Returns what's between `open` and `close` after `key` in [from, to), or an
+// empty string
+static std::string xmlValueAfterKey(const std::string& xml, size_t from, size_t to, const std::string& key, const std::string& open, const std::string& close) {
+  size_t keyPos = xml.find("<key>" + key + "</key>", from);
+  if(keyPos == std::string::npos || keyPos >= to) {
+    return "";
+  }
+  size_t start = xml.find(open, keyPos);
+  if(start == std::string::npos || start >= to) {
+    return "";
+  }
+  start += open.size();
+  size_t end = xml.find(close, start);
+  if(end == std::string::npos || end > to) {
+    return "";
+  }
+  return xml.substr(start, end - start);
+}
+
+// Apple Data Compression, used by old UDCO images. It's a simple LZ77 variant
+// with three kinds of runs, told apart by the top bits of the first byte.
+static void adcDecompress(const std::vector<uint8_t>& in, std::vector<uint8_t>& out) {
+  size_t i = 0;
+  size_t o = 0;
+  while(i < in.size() && o < out.size()) {
+    uint8_t b = in[i];
+    size_t len;
+    size_t distance;
+    if(b & 0x80) {
+      // Literal run
+      len = (b & 0x7F) + 1;
+      if(i + 1 + len > in.size() || o + len > out.size()) {
+        throw std::runtime_error("Corrupt ADC chunk");
+      }
+      memcpy(out.data() + o, in.data() + i + 1, len);
+      i += len + 1;
+      o += len;
+      continue;
+    } else if(b & 0x40) {
+      if(i + 2 >= in.size()) {
+        throw std::runtime_error("Corrupt ADC chunk");
+      }
+      len = (b & 0x3F) + 4;
+      distance = (static_cast<size_t>(in[i + 1]) << 8) | in[i + 2];
+      i += 3;
+    } else {
+      if(i + 1 >= in.size()) {
+        throw std::runtime_error("Corrupt ADC chunk");
+      }
+      len = ((b & 0x3F) >> 2) + 3;
+      distance = (static_cast<size_t>(b & 0x03) << 8) | in[i + 1];
+      i += 2;
+    }
+    if(distance + 1 > o || o + len > out.size()) {
+      throw std::runtime_error("Corrupt ADC chunk");
+    }
+    // Runs can overlap their own output, so copy byte by byte
+    for(size_t n = 0; n < len; ++n, ++o) {
+      out[o] = out[o - distance - 1];
+    }
+  }
+}
+
+UDIFReader::UDIFReader(const std::string& path, unsigned int threads, size_t cacheChunks) : cache(cacheChunks), pool(threads) {
+  this->fd = open(path.c_str(), O_RDONLY);
+  if(this->fd == -1) {
+    throw std::runtime_error("Unable to open " + path + ": " + std::string(strerror(errno)));
+  }
+
+  try {
+    uint64_t fileSize = fileOrDeviceSize(this->fd);
+    uint8_t trailer[UDIF_TRAILER_SIZE];
+    if(fileSize < UDIF_TRAILER_SIZE || preadFully(this->fd, trailer, sizeof(trailer), fileSize - UDIF_TRAILER_SIZE) != sizeof(trailer) || !parseKolyTrailer(trailer, this->koly)) {
+      throw std::runtime_error(path + " is not a UDIF image");
+    }
+    if(this->koly.xmlLength == 0) {
+      // Images from before 10.2 keep the tables in a resource fork instead
+      throw std::runtime_error(path + " has no XML plist, resource fork only images are not supported");
+    }
+    if(this->koly.xmlLength > fileSize || this->koly.xmlOffset > fileSize - this->koly.xmlLength) {
+      throw std::runtime_error(path + " is truncated, its plist lies past the end of the file");
+    }
+
+    std::string xml(this->koly.xmlLength, '\0');
+    if(preadFully(this->fd, &xml[0], xml.size(), this->koly.xmlOffset) != xml.size()) {
+      throw std::runtime_error("Unable to read plist from " + path);
+    }
+    this->parseBlkxTables(xml);
+
+    for(const auto& chunk : this->chunkMap) {
+      if(chunk.type != UDIF_CHUNK_ZERO && chunk.type != UDIF_CHUNK_IGNORE && (chunk.compressedLength > fileSize || chunk.compressedOffset > fileSize - chunk.compressedLength)) {
+        throw std::runtime_error(path + " is truncated, chunk data lies past the end of the file");
+      }
+    }
+  } catch(...) {
+    close(this->fd);
+    throw;
+  }
+}
+
+UDIFReader::~UDIFReader() {
+  // The pool is destroyed after this, and its jobs still use the fd. Wait for
+  // them while it's open
+  std::vector<std::shared_future<ChunkData>> pending;
+  {
+    const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+    for(const auto& it : this->inFlight) {
+      pending.push_back(it.second);
+    }
+  }
+  for(auto& f : pending) {
+    f.wait();
+  }
+  close(this->fd);
+}
+
+// The blkx array holds one dict per table, with the mish data base64 encoded
+// in "Data". The XML is always written by hdiutil, so plain string searches
+// are enough and spare us an XML parser.
+void UDIFReader::parseBlkxTables(const std::string& xml) {
+  size_t blkx = xml.find("<key>blkx</key>");
+  if(blkx == std::string::npos) {
+    throw std::runtime_error("UDIF plist has no blkx entry");
+  }
+  size_t arrayStart = xml.find("<array>", blkx);
+  size_t arrayEnd = xml.find("</array>", blkx);
+  if(arrayStart == std::string::npos || arrayEnd == std::string::npos) {
+    throw std::runtime_error("UDIF plist blkx entry is not an array");
+  }
+
+  size_t pos = arrayStart;
+  while(true) {
+    size_t dictStart = xml.find("<dict>", pos);
+    if(dictStart == std::string::npos || dictStart > arrayEnd) {
+      break;
+    }
+    size_t dictEnd = xml.find("</dict>", dictStart);
+    if(dictEnd == std::string::npos) {
+      throw std::runtime_error("Unterminated blkx entry in UDIF plist");
+    }
+    std::string data = xmlValueAfterKey(xml, dictStart, dictEnd, "Data", "<data>", "</data>");
+    std::string name = xmlUnescape(xmlValueAfterKey(xml, dictStart, dictEnd, "Name", "<string>", "</string>"));
+    this->parseBlkxTable(base64Decode(data), name);
+    pos = dictEnd;
+  }
+
+  std::sort(this->chunkMap.begin(), this->chunkMap.end(), [](const UDIFChunk& a, const UDIFChunk& b) {
+    return a.offset < b.offset;
+  });
+}
+
+void UDIFReader::parseBlkxTable(const std::vector<uint8_t>& data, const std::string& name) {
+  if(data.size() < MISH_HEADER_SIZE || memcmp(data.data(), MISH_MAGIC, strlen(MISH_MAGIC))) {
+    throw std::runtime_error("Invalid blkx table " + name);
+  }
+  UDIFTable table;
+  table.name = name;
+  table.firstSector = readBE64(data.data() + 8);
+  table.sectorCount = readBE64(data.data() + 16);
+  uint64_t dataOffset = readBE64(data.data() + 24);
+  table.checksumType = readBE32(data.data() + 64);
+  table.checksumBits = readBE32(data.data() + 68);
+  memcpy(table.checksum, data.data() + 72, sizeof(table.checksum));
+  uint32_t chunkCount = readBE32(data.data() + 200);
+  if(data.size() < MISH_HEADER_SIZE + static_cast<size_t>(chunkCount) * MISH_CHUNK_SIZE) {
+    throw std::runtime_error("Truncated blkx table " + name);
+  }
+
+  size_t tableIndex = this->blkxTables.size();
+  this->blkxTables.push_back(table);
+
+  for(uint32_t i = 0; i < chunkCount; ++i) {
+    const uint8_t* entry = data.data() + MISH_HEADER_SIZE + i * MISH_CHUNK_SIZE;
+    UDIFChunk chunk;
+    chunk.type = static_cast<UDIFChunkType>(readBE32(entry));
+    if(chunk.type == UDIF_CHUNK_COMMENT || chunk.type == UDIF_CHUNK_TERMINATOR) {
+      continue;
+    }
+    const uint64_t sectors = readBE64(entry + 16);
+    chunk.offset = (table.firstSector + readBE64(entry + 8)) * UDIF_SECTOR_SIZE;
+    chunk.compressedOffset = this->koly.dataForkOffset + dataOffset + readBE64(entry + 24);
+    chunk.compressedLength = readBE64(entry + 32);
+    // Zero fill chunks are never allocated, but still can't be bigger than
+    // the disk
+    const bool stored = chunk.type != UDIF_CHUNK_ZERO && chunk.type != UDIF_CHUNK_IGNORE;
+    if(sectors > this->koly.sectorCount || (stored && (sectors > UDIF_MAX_CHUNK_SECTORS || chunk.compressedLength > UDIF_MAX_STORED_CHUNK(sectors * UDIF_SECTOR_SIZE)))) {
+      throw std::runtime_error("Corrupt chunk " + std::to_string(i) + " in blkx table " + name);
+    }
+    chunk.length = sectors * UDIF_SECTOR_SIZE;
+    chunk.table = tableIndex;
+    if(chunk.length) {
+      this->chunkMap.push_back(chunk);
+    }
+  }
+}
+
+uint64_t UDIFReader::size() const {
+  return this->koly.sectorCount * UDIF_SECTOR_SIZE;
+}
+
+std::vector<uint8_t> UDIFReader::readRawChunk(size_t index) {
+  const UDIFChunk& chunk = this->chunkMap.at(index);
+  std::vector<uint8_t> raw(chunk.compressedLength);
+  if(preadFully(this->fd, raw.data(), raw.size(), chunk.compressedOffset) != raw.size()) {
+    throw std::runtime_error("Short read on chunk " + std::to_string(index));
+  }
+  return raw;
+}
+
+UDIFReader::ChunkData UDIFReader::decompress(size_t index) {
+  const UDIFChunk& chunk = this->chunkMap.at(index);
+  std::shared_ptr<std::vector<uint8_t>> out = std::make_shared<std::vector<uint8_t>>(chunk.length, 0);
+  if(chunk.type == UDIF_CHUNK_ZERO || chunk.type == UDIF_CHUNK_IGNORE) {
+    return out;
+  }
+
+  std::vector<uint8_t> raw = this->readRawChunk(index);
+  switch(chunk.type) {
+    case UDIF_CHUNK_RAW: {
+      memcpy(out->data(), raw.data(), std::min(raw.size(), out->size()));
+      break;
+    }
+    case UDIF_CHUNK_ZLIB: {
+      z_stream stream;
+      memset(&stream, 0, sizeof(stream));
+      if(inflateInit(&stream) != Z_OK) {
+        throw std::runtime_error("Unable to init zlib");
+      }
+      stream.next_in = raw.data();
+      stream.avail_in = raw.size();
+      stream.next_out = out->data();
+      stream.avail_out = out->size();
+      int ret = inflate(&stream, Z_FINISH);
+      inflateEnd(&stream);
+      if(ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && stream.avail_out == 0)) {
+        throw std::runtime_error("Corrupt zlib chunk " + std::to_string(index) + " (zlib error " + std::to_string(ret) + ")");
+      }
+      break;
+    }
+    case UDIF_CHUNK_BZIP2: {
+      unsigned int outLength = out->size();
+      int ret = BZ2_bzBuffToBuffDecompress(reinterpret_cast<char*>(out->data()), &outLength, reinterpret_cast<char*>(raw.data()), raw.size(), 0, 0);
+      if(ret != BZ_OK && ret != BZ_OUTBUFF_FULL) {
+        throw std::runtime_error("Corrupt bzip2 chunk " + std::to_string(index) + " (bzip2 error " + std::to_string(ret) + ")");
+      }
+      break;
+    }
+    case UDIF_CHUNK_ADC: {
+      adcDecompress(raw, *out);
+      break;
+    }
+    default:
+      // LZFSE and LZMA only come with macOS' own libraries
+      char type[16];
+      snprintf(type, sizeof(type), "0x%08x", chunk.type);
+      throw std::runtime_error("Unsupported UDIF chunk type " + std::string(type));
+  }
+  return out;
+}
+
+std::shared_future<UDIFReader::ChunkData> UDIFReader::scheduleChunk(size_t index) {
+  ChunkData cached = this->cache.get(index);
+  if(cached) {
+    std::promise<ChunkData> ready;
+    ready.set_value(cached);
+    return ready.get_future().share();
+  }
+
+  const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+  auto it = this->inFlight.find(index);
+  if(it != this->inFlight.end()) {
+    return it->second;
+  }
+  // The job removes itself from inFlight once done, which can't happen before
+  // it's inserted because that needs this same lock
+  std::shared_future<ChunkData> result = this->pool.submit([this, index]() {
+    ChunkData data;
+    try {
+      data = this->decompress(index);
+      this->cache.put(index, data);
+    } catch(...) {
+      const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+      this->inFlight.erase(index);
+      throw;
+    }
+    const std::lock_guard<std::mutex> lock(this->inFlightMutex);
+    this->inFlight.erase(index);
+    return data;
+  }).share();
+  this->inFlight[index] = result;
+  return result;
+}
+
+UDIFReader::ChunkData UDIFReader::decompressChunk(size_t index) {
+  return this->scheduleChunk(index).get();
+}
+
+size_t UDIFReader::read(uint64_t offset, void* buffer, size_t len) {
+  if(offset >= this->size()) {
+    return 0;
+  }
+  len = std::min<uint64_t>(len, this->size() - offset);
+  const uint64_t end = offset + len;
+
+  // First chunk that ends past `offset`
+  auto first = std::upper_bound(this->chunkMap.begin(), this->chunkMap.end(), offset, [](uint64_t o, const UDIFChunk& c) {
+    return o < c.offset + c.length;
+  });
+
+  // Queue every chunk in range before waiting for any of them, so they're all
+  // decompressed in parallel
+  std::vector<std::pair<size_t, std::shared_future<ChunkData>>> pending;
+  for(auto it = first; it != this->chunkMap.end() && it->offset < end; ++it) {
+    if(it->type == UDIF_CHUNK_ZERO || it->type == UDIF_CHUNK_IGNORE) {
+      continue;
+    }
+    size_t index = it - this->chunkMap.begin();
+    pending.emplace_back(index, this->scheduleChunk(index));
+  }
+
+  // Streaming readers go through the disk in order with reads smaller than a
+  // chunk, which would decompress one chunk at a time. When this read follows
+  // the previous one, get the next few chunks going as well
+  uint64_t expected = offset;
+  if(this->nextSequentialOffset.compare_exchange_strong(expected, end)) {
+    auto next = std::lower_bound(this->chunkMap.begin(), this->chunkMap.end(), end, [](const UDIFChunk& c, uint64_t o) {
+      return c.offset < o;
+    });
+    for(unsigned int scheduled = 0; next != this->chunkMap.end() && scheduled < this->pool.size(); ++next) {
+      if(next->type != UDIF_CHUNK_ZERO && next->type != UDIF_CHUNK_IGNORE) {
+        this->scheduleChunk(next - this->chunkMap.begin());
+        ++scheduled;
+      }
+    }
+  } else {
+    this->nextSequentialOffset = end;
+  }
+
+  uint8_t* out = static_cast<uint8_t*>(buffer);
+  // Zero chunks and anything not covered by a chunk read as zeroes
+  memset(out, 0, len);
+  for(auto& p : pending) {
+    const UDIFChunk& chunk = this->chunkMap[p.first];
+    ChunkData data = p.second.get();
+    uint64_t copyStart = std::max(offset, chunk.offset);
+    uint64_t copyEnd = std::min(end, chunk.offset + chunk.length);
+    memcpy(out + (copyStart - offset), data->data() + (copyStart - chunk.offset), copyEnd - copyStart);
+  }
+
+  return len;
+}
+
+std::vector<UDIFChecksumResult> UDIFReader::verify(VerifyProgressCallback onProgress) {
+  uint64_t bytesTotal = this->koly.dataForkLength;
+  for(const auto& chunk : this->chunkMap) {
+    bytesTotal += chunk.length;
+  }
+
+  // Queue everything up front so every worker is busy from the start
+  std::vector<std::pair<uint64_t, std::future<uint32_t>>> segments;
+  for(uint64_t position = 0; position < this->koly.dataForkLength; position += UDIF_VERIFY_SEGMENT_SIZE) {
+    uint64_t offset = this->koly.dataForkOffset + position;
+    size_t length = std::min<uint64_t>(UDIF_VERIFY_SEGMENT_SIZE, this->koly.dataForkLength - position);
+    segments.emplace_back(length, this->pool.submit([this, offset, length]() {
+      std::vector<uint8_t> buffer(length);
+      if(preadFully(this->fd, buffer.data(), length, offset) != length) {
+        throw std::runtime_error("Short read on data fork at offset " + std::to_string(offset));
+      }
+      return crc32Update(0, buffer.data(), length);
+    }));
+  }
+  std::vector<std::pair<uint64_t, std::future<uint32_t>>> chunkCRCs;
+  for(size_t i = 0; i < this->chunkMap.size(); ++i) {
+    uint64_t length = this->chunkMap[i].length;
+    chunkCRCs.emplace_back(length, this->pool.submit([this, i, length]() {
+      const UDIFChunk& chunk = this->chunkMap[i];
+      if(chunk.type == UDIF_CHUNK_ZERO || chunk.type == UDIF_CHUNK_IGNORE) {
+        return crc32Zeros(length);
+      }
+      ChunkData data = this->decompress(i);
+      return crc32Update(0, data->data(), data->size());
+    }));
+  }
+
+  // Every job uses this reader, so all of them have to finish before any
+  // error is thrown
+  uint64_t bytesDone = 0;
+  std::exception_ptr error;
+  auto collect = [&](std::pair<uint64_t, std::future<uint32_t>>& job) {
+    uint32_t crc = 0;
+    try {
+      crc = job.second.get();
+    } catch(...) {
+      if(!error) {
+        error = std::current_exception();
+      }
+    }
+    bytesDone += job.first;
+    if(onProgress) {
+      onProgress(bytesDone, bytesTotal);
+    }
+    return crc;
+  };
+
+  uint32_t dataForkCRC = 0;
+  for(auto& segment : segments) {
+    uint64_t length = segment.first;
+    dataForkCRC = crc32Combine(dataForkCRC, collect(segment), length);
+  }
+  // Chunks are sorted by offset and tables don't overlap, so each table's
+  // chunks come up in order
+  std::vector<uint32_t> tableCRCs(this->blkxTables.size(), 0);
+  for(size_t i = 0; i < chunkCRCs.size(); ++i) {
+    uint64_t length = chunkCRCs[i].first;
+    uint32_t& tableCRC = tableCRCs[this->chunkMap[i].table];
+    tableCRC = crc32Combine(tableCRC, collect(chunkCRCs[i]), length);
+  }
+  if(error) {
+    std::rethrow_exception(error);
+  }
+
+  std::vector<UDIFChecksumResult> results;
+  results.push_back({"data fork", this->koly.dataChecksumType == UDIF_CHECKSUM_CRC32, readBE32(this->koly.dataChecksum), dataForkCRC});
+  // The master checksum is the CRC32 of every table CRC32, as stored
+  std::vector<uint8_t> tableChecksums;
+  for(size_t i = 0; i < this->blkxTables.size(); ++i) {
+    const UDIFTable& table = this->blkxTables[i];
+    bool isCRC32 = table.checksumType == UDIF_CHECKSUM_CRC32;
+    results.push_back({table.name, isCRC32, readBE32(table.checksum), tableCRCs[i]});
+    if(isCRC32) {
+      tableChecksums.insert(tableChecksums.end(), table.checksum, table.checksum + sizeof(uint32_t));
+    }
+  }
+  results.push_back({"master", this->koly.masterChecksumType == UDIF_CHECKSUM_CRC32, readBE32(this->koly.masterChecksum), crc32Update(0, tableChecksums.data(), tableChecksums.size())});
+  return results;
+}
@@ -0,0 +1,184 @@
+/***************************************************************************
+ *   udif.hpp  --  This file is part of diskarbitratord.                   *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef UDIF_HPP_
+#define UDIF_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+#include "lru_cache.hpp"
+#include "thread_pool.hpp"
+
+// Native read-only UDIF (.dmg) support. A UDIF image is the data fork (the
+// disk, split in chunks that may be compressed), an XML plist whose blkx
+// entries map chunks to disk sectors, and a 512 byte "koly" trailer at the
+// very end pointing at both. Everything in it is big endian.
+
+#define UDIF_SECTOR_SIZE 512
+#define UDIF_TRAILER_SIZE 512
+
+// Default number of decompressed chunks kept around. Chunks are usually 1MB
+#define UDIF_DEFAULT_CACHE_CHUNKS 64
+
+#define UDIF_CHECKSUM_CRC32 2
+// The data fork is checksummed in pieces of this size, in parallel
+#define UDIF_VERIFY_SEGMENT_SIZE (8 * 1024 * 1024)
+
+enum UDIFChunkType : uint32_t {
+  UDIF_CHUNK_ZERO = 0x00000000,
+  UDIF_CHUNK_RAW = 0x00000001,
+  UDIF_CHUNK_IGNORE = 0x00000002,
+  UDIF_CHUNK_ADC = 0x80000004,
+  UDIF_CHUNK_ZLIB = 0x80000005,
+  UDIF_CHUNK_BZIP2 = 0x80000006,
+  UDIF_CHUNK_LZFSE = 0x80000007,
+  UDIF_CHUNK_LZMA = 0x80000008,
+  UDIF_CHUNK_COMMENT = 0x7ffffffe,
+  UDIF_CHUNK_TERMINATOR = 0xffffffff
+};
+
+// The fields we use from the koly trailer
+typedef struct KolyTrailer {
+  uint32_t version;
+  uint64_t dataForkOffset;
+  uint64_t dataForkLength;
+  uint64_t xmlOffset;
+  uint64_t xmlLength;
+  uint32_t dataChecksumType;
+  uint32_t dataChecksumBits;
+  // Checksums are stored in a 128 byte field, CRC32 only uses the first 4
+  uint8_t dataChecksum[128];
+  uint32_t masterChecksumType;
+  uint32_t masterChecksumBits;
+  uint8_t masterChecksum[128];
+  uint64_t sectorCount;
+} KolyTrailer;
+
+// One run of sectors from a blkx table, resolved to absolute positions
+typedef struct UDIFChunk {
+  UDIFChunkType type;
+  // Position of the chunk in the virtual disk, in bytes
+  uint64_t offset;
+  uint64_t length;
+  // Position of the chunk data in the image file
+  uint64_t compressedOffset;
+  uint64_t compressedLength;
+  // blkx table (partition) this chunk belongs to
+  size_t table;
+} UDIFChunk;
+
+// A blkx table. There's usually one per partition of the disk
+typedef struct UDIFTable {
+  std::string name;
+  uint64_t firstSector;
+  uint64_t sectorCount;
+  uint32_t checksumType;
+  uint32_t checksumBits;
+  uint8_t checksum[128];
+} UDIFTable;
+
+typedef struct UDIFChecksumResult {
+  // "data fork", "master", or the blkx table name
+  std::string name;
+  // Only CRC32 checksums can be verified, anything else is reported unchecked
+  bool checked;
+  uint32_t expected;
+  uint32_t actual;
+} UDIFChecksumResult;
+
+typedef std::function<void(uint64_t bytesDone, uint64_t bytesTotal)> VerifyProgressCallback;
+
+// Returns false if `buffer` doesn't hold a koly trailer
+bool parseKolyTrailer(const uint8_t* buffer, KolyTrailer& trailer);
+
+class UDIFReader : public ImageReader {
+  public:
+    typedef std::shared_ptr<const std::vector<uint8_t>> ChunkData;
+
+    // `threads` decompress chunks in parallel (0 is one per core), and up to
+    // `cacheChunks` decompressed chunks are kept for later reads
+    UDIFReader(const std::string& path, unsigned int threads = 0, size_t cacheChunks = UDIF_DEFAULT_CACHE_CHUNKS);
+    ~UDIFReader();
+
+    uint64_t size() const override;
+    size_t read(uint64_t offset, void* buffer, size_t len) override;
+
+    const KolyTrailer& trailer() const {
+      return this->koly;
+    }
+    const std::vector<UDIFTable>& tables() const {
+      return this->blkxTables;
+    }
+    const std::vector<UDIFChunk>& chunks() const {
+      return this->chunkMap;
+    }
+
+    // Reads the chunk data as stored in the image, still compressed
+    std::vector<uint8_t> readRawChunk(size_t index);
+    // Returns the decompressed chunk, from the cache if possible
+    ChunkData decompressChunk(size_t index);
+
+    // Checks the data fork checksum, every blkx table checksum (taken over the
+    // decompressed data) and the master checksum. Every chunk goes through
+    // the pool, skipping the cache. Progress is reported from the calling
+    // thread.
+    std::vector<UDIFChecksumResult> verify(VerifyProgressCallback onProgress = nullptr);
+
+    size_t cacheHits() {
+      return this->cache.hitCount();
+    }
+    size_t cacheMisses() {
+      return this->cache.missCount();
+    }
+
+  private:
+    ChunkData decompress(size_t index);
+    // Decompresses the chunk on the pool unless it's cached or already underway
+    std::shared_future<ChunkData> scheduleChunk(size_t index);
+    void parseBlkxTables(const std::string& xml);
+    void parseBlkxTable(const std::vector<uint8_t>& data, const std::string& name);
+
+    int fd;
+    KolyTrailer koly;
+    std::vector<UDIFTable> blkxTables;
+    // Sorted by offset, every chunk that holds data (no comments/terminators)
+    std::vector<UDIFChunk> chunkMap;
+    LRUCache<size_t, std::vector<uint8_t>> cache;
+    // Chunks being decompressed right now, so concurrent reads of the same chunk
+    // wait for it instead of doing the work twice
+    std::mutex inFlightMutex;
+    std::map<size_t, std::shared_future<ChunkData>> inFlight;
+    // Where the next read starts if it's sequential, to trigger readahead
+    std::atomic<uint64_t> nextSequentialOffset{0};
+    ThreadPool pool;
+};
+
+#endif
@@ -0,0 +1,67 @@
+/***************************************************************************
+ *   unicode.hpp  --  This file is part of diskarbitratord.                *
+ *                                                                         *
+ *   Copyright (C) 2023 Imanol-Mikel Barba Sabariego                       *
+ *                                                                         *
+ *   diskarbitratord is free software: you can redistribute it and/or      *
+ *   modify it under the terms of the GNU General Public License as        *
+ *   published by the Free Software Foundation, either version 3 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   diskarbitratord is distributed in the hope that it will be useful,    *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty           *
+ *   of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *   See the GNU General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see http://www.gnu.org/licenses/.   *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#ifndef UNICODE_HPP_
+#define UNICODE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "byteorder.hpp"
+
+// UTF-16 to UTF-8, for names stored on disk. Stops at the first NUL, and
+// unpaired surrogates are passed through as they are
+inline std::string utf16ToUTF8(const uint8_t* p, size_t len, bool bigEndian) {
+  std::string out;
+  for(size_t i = 0; i + 1 < len; i += 2) {
+    uint32_t c = bigEndian ? readBE16(p + i) : readLE16(p + i);
+    if(c == 0) {
+      break;
+    }
+    if(c >= 0xD800 && c <= 0xDBFF && i + 3 < len) {
+      uint32_t low = bigEndian ? readBE16(p + i + 2) : readLE16(p + i + 2);
+      if(low >= 0xDC00 && low <= 0xDFFF) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        i += 2;
+      }
+    }
+    if(c < 0x80) {
+      out += static_cast<char>(c);
+    } else if(c < 0x800) {
+      out += static_cast<char>(0xC0 | (c >> 6));
+      out += static_cast<char>(0x80 | (c & 0x3F));
+    } else if(c < 0x10000) {
+      out += static_cast<char>(0xE0 | (c >> 12));
+      out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+      out += static_cast<char>(0xF0 | (c >> 18));
+      out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+      out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+  }
+  return out;
+}
+
+#endif